@@ -0,0 +1,166 @@
+/*==========================================================================*\
+ *
+ * capturebench.c - Frame capture benchmark for flasher.
+ * flasher (C) 2006 Alex Graveley
+ *
+ * Captures a pixmap filled with a test pattern repeatedly, at each size
+ * given, in each output format, with and without MIT-SHM, and reports
+ * frames per second.  Raw and Y4M frames go to /dev/null; PNGs to a
+ * temporary directory.
+ *
+\*==========================================================================*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include <X11/Xlib.h>
+#include <X11/Xutil.h>
+
+#include "capture.h"
+
+
+static double
+Now(void)
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec * 1000.0 + tv.tv_usec / 1000.0;
+}
+
+
+/* A pixmap with gradients and some noise, so PNG has work to do. */
+static Pixmap
+CreatePattern(Display *display, int width, int height)
+{
+	int screen = DefaultScreen(display);
+	Visual *visual = DefaultVisual(display, screen);
+	int depth = DefaultDepth(display, screen);
+
+	XImage *image = XCreateImage(display, visual, depth, ZPixmap, 0, NULL,
+				     width, height, 32, 0);
+	image->data = malloc(image->bytes_per_line * height);
+
+	srand(1);
+	for (int y = 0; y < height; y++) {
+		for (int x = 0; x < width; x++) {
+			int r = x * 255 / width;
+			int g = y * 255 / height;
+			int b = (rand() & 0x3f) + ((x / 32 + y / 32) & 1) * 128;
+			XPutPixel(image, x, y, (r << 16) | (g << 8) | b);
+		}
+	}
+
+	Pixmap pixmap = XCreatePixmap(display, DefaultRootWindow(display),
+				      width, height, depth);
+	GC gc = XCreateGC(display, pixmap, 0, NULL);
+	XPutImage(display, pixmap, gc, image, 0, 0, 0, 0, width, height);
+	XFreeGC(display, gc);
+	XDestroyImage(image);
+
+	return pixmap;
+}
+
+
+static void
+RunCapture(Display *display,
+	   Pixmap pixmap,
+	   int width,
+	   int height,
+	   int frames,
+	   const char *name,
+	   const char *path,
+	   Bool use_shm)
+{
+	int screen = DefaultScreen(display);
+	Capture *c = CaptureNew(display, DefaultVisual(display, screen),
+				DefaultDepth(display, screen), width, height,
+				30, path, use_shm);
+	if (!c) {
+		exit(1);
+	}
+
+	/* Warm up */
+	CaptureFrame(c, pixmap);
+
+	double start = Now();
+	for (int i = 0; i < frames; i++) {
+		if (!CaptureFrame(c, pixmap)) {
+			exit(1);
+		}
+	}
+	double elapsed = Now() - start;
+
+	CaptureFree(c);
+
+	fprintf(stderr, "%dx%d %-4s %-5s %7.1f fps, %6.2f ms/frame, "
+		"%7.1f MB/s read back\n", width, height, name,
+		use_shm ? "shm" : "noshm", frames / (elapsed / 1000.0),
+		elapsed / frames,
+		width * height * 4.0 * frames / (elapsed / 1000.0) /
+		(1024 * 1024));
+}
+
+
+int
+main(int argc, char **argv)
+{
+	if (argc < 2) {
+		fprintf(stderr, "Usage: capturebench WIDTHxHEIGHT...\n");
+		return 1;
+	}
+
+	Display *display = XOpenDisplay(NULL);
+	if (!display) {
+		fprintf(stderr, "Cannot open display\n");
+		return 1;
+	}
+
+	/* Keep CaptureNew's logging out of the results. */
+	freopen("/dev/null", "w", stdout);
+
+	char dir[] = "/tmp/capturebench-XXXXXX";
+	if (!mkdtemp(dir)) {
+		perror("mkdtemp");
+		return 1;
+	}
+	char y4m[64], png[64];
+	snprintf(y4m, sizeof(y4m), "%s/null.y4m", dir);
+	snprintf(png, sizeof(png), "%s/frame%%d.png", dir);
+	symlink("/dev/null", y4m);
+
+	for (int i = 1; i < argc; i++) {
+		int width, height;
+		if (sscanf(argv[i], "%dx%d", &width, &height) != 2) {
+			fprintf(stderr, "Invalid size '%s'\n", argv[i]);
+			return 1;
+		}
+
+		/* Roughly a second's worth each, at 30 fps and 640x480. */
+		int frames = MAX(10, 30 * 640 * 480 / (width * height));
+
+		Pixmap pixmap = CreatePattern(display, width, height);
+		for (int shm = 1; shm >= 0; shm--) {
+			RunCapture(display, pixmap, width, height, frames,
+				   "rgb", "/dev/null", shm);
+			RunCapture(display, pixmap, width, height, frames,
+				   "y4m", y4m, shm);
+			RunCapture(display, pixmap, width, height, frames,
+				   "png", png, shm);
+		}
+		XFreePixmap(display, pixmap);
+
+		char frame[64];
+		for (int f = 0; f <= frames; f++) {
+			snprintf(frame, sizeof(frame), png, f);
+			unlink(frame);
+		}
+	}
+
+	unlink(y4m);
+	rmdir(dir);
+	XCloseDisplay(display);
+
+	return 0;
+}
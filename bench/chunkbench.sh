@@ -0,0 +1,83 @@
+#!/bin/sh
+#
+# chunkbench.sh - Plugin calls and throughput when the network delivers
+# the body in small pieces, with and without --write-delay.
+# flasher (C) 2006 Alex Graveley
+#
+# Usage: bench/chunkbench.sh [STREAMBENCH-OPTION...]
+#
+# Serves each body with python3, written CHUNK bytes at a time with a
+# short pause in between, like a slow link.  Tunables, from the
+# environment:
+#   CHUNKS   piece sizes to sweep (1024 4096 16384 65536)
+#   SIZE     body bytes (1048576)
+#   GAP      pause between pieces, in seconds (0.0002)
+#   DELAY    --write-delay to compare against none (5)
+#   STREAMS  streams, fetched one at a time (4)
+#   PORT     port to serve on (8766)
+#
+
+BENCH=${BENCH:-bench/streambench}
+CHUNKS=${CHUNKS:-1024 4096 16384 65536}
+SIZE=${SIZE:-1048576}
+GAP=${GAP:-0.0002}
+DELAY=${DELAY:-5}
+STREAMS=${STREAMS:-4}
+PORT=${PORT:-8766}
+
+TMP=`mktemp -d /tmp/chunkbench-XXXXXX`
+
+cat >$TMP/server.py <<EOF
+import http.server, socket, time
+
+class Handler(http.server.BaseHTTPRequestHandler):
+    protocol_version = "HTTP/1.1"
+
+    def do_GET(self):
+        chunk, size = [int(x) for x in self.path.split("/")[1:3]]
+        self.send_response(200)
+        self.send_header("Content-Type", "application/octet-stream")
+        self.send_header("Content-Length", str(size))
+        self.end_headers()
+        self.connection.setsockopt(socket.IPPROTO_TCP,
+                                   socket.TCP_NODELAY, 1)
+        piece = bytes(chunk)
+        while size > 0:
+            self.wfile.write(piece[:size])
+            size -= chunk
+            time.sleep($GAP)
+
+    def log_message(self, *args):
+        pass
+
+server = http.server.ThreadingHTTPServer(("127.0.0.1", $PORT), Handler)
+print("Serving", flush=True)
+server.serve_forever()
+EOF
+
+python3 $TMP/server.py >$TMP/server.log 2>&1 &
+SERVER=$!
+trap 'kill $SERVER; rm -rf $TMP' 0 INT TERM
+
+while ! grep -q Serving $TMP/server.log 2>/dev/null; do
+	if ! kill -0 $SERVER 2>/dev/null; then
+		cat $TMP/server.log
+		exit 1
+	fi
+	sleep 0.1
+done
+
+for chunk in $CHUNKS; do
+	for delay in 0 $DELAY; do
+		echo "chunk $chunk, write delay $delay ms:"
+		# Each stream a URL of its own, so none share a transfer.
+		i=0
+		while [ $i -lt $STREAMS ]; do
+			$BENCH http://127.0.0.1:$PORT/$chunk/$SIZE/$i \
+				--streams 1 --concurrency 1 \
+				--write-delay $delay "$@" 2>&1 |
+				sed -n 's/^  \(.*writes.*\)/  \1/p'
+			i=`expr $i + 1`
+		done
+	done
+done
@@ -0,0 +1,83 @@
+#!/bin/sh
+#
+# hostbench.sh - Run flasher with the stub plugin and report startup time,
+# frame rate, stream throughput and memory use.
+# flasher (C) 2006 Alex Graveley
+#
+# Usage: bench/hostbench.sh [FLASHER-OPTION...]
+#
+# Runs under Xvfb unless DISPLAY is set.  Tunables, from the environment:
+#   FRAMES   frames to render per run (300)
+#   FPS      frame rate the stub aims for (60)
+#   URLS     extra URLs the stub loads after the SWF (8)
+#   BACKEND  stream backend for those URLs (synth:1048576:20)
+#   SIZES    window sizes to run at ("640x480 1920x1080")
+#   DIRTY    also run windowless redrawing only a square this wide (64)
+#
+# The headless run captures raw frames to /dev/null at FPS.
+#
+
+FLASHER=${FLASHER:-./flasher}
+STUB=${STUB:-bench/libstubplugin.so}
+FRAMES=${FRAMES:-300}
+FPS=${FPS:-60}
+URLS=${URLS:-8}
+BACKEND=${BACKEND:-synth:1048576:20}
+SIZES=${SIZES:-640x480 1920x1080}
+DIRTY=${DIRTY:-64}
+
+if [ -z "$DISPLAY" ]; then
+	exec sh `dirname $0`/xvfb-run.sh sh $0 "$@"
+fi
+
+TMP=`mktemp -d /tmp/hostbench-XXXXXX`
+trap 'rm -rf $TMP' 0 INT TERM
+
+# The stub ignores the SWF's contents, but streams all of it.
+head -c 262144 /dev/zero >$TMP/movie.swf
+
+STUB_URLS=
+i=0
+while [ $i -lt $URLS ]; do
+	STUB_URLS="$STUB_URLS${STUB_URLS:+,}http://bench/asset$i.bin"
+	i=`expr $i + 1`
+done
+
+run() {
+	name=$1
+	geometry=$2
+	shift 2
+
+	windowless=
+	dirty=
+	case $name in
+	windowless) windowless=1 ;;
+	dirty) windowless=1; dirty=$DIRTY ;;
+	headless) windowless=1; set -- --headless --capture /dev/null \
+		--capture-fps $FPS "$@" ;;
+	esac
+
+	STUB_T0=`date +%s%3N` STUB_FRAMES=$FRAMES STUB_FPS=$FPS \
+		STUB_URLS=$STUB_URLS STUB_WINDOWLESS=$windowless \
+		STUB_DIRTY=$dirty \
+		$FLASHER --plugin $STUB --backend $BACKEND \
+		--geometry $geometry --target-fps $FPS "$@" $TMP/movie.swf \
+		>$TMP/out.log 2>$TMP/err.log
+	status=$?
+
+	result=`grep '^stub: frames=' $TMP/err.log | sed 's/^stub: //'`
+	if [ $status -ne 0 ] || [ -z "$result" ]; then
+		echo "$name $geometry: FAILED (exit $status)"
+		cat $TMP/err.log $TMP/out.log | tail -20
+		return
+	fi
+	echo "$name $geometry: $result"
+	grep '^Frame' $TMP/out.log | sed 's/^/  host: /'
+}
+
+for size in $SIZES; do
+	run windowed $size "$@"
+	run windowless $size "$@"
+	run dirty $size "$@"
+	run headless $size "$@"
+done
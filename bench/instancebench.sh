@@ -0,0 +1,97 @@
+#!/bin/sh
+#
+# instancebench.sh - Compare the memory used by N movies played in one
+# flasher with N flashers playing one movie each, using the stub plugin.
+# flasher (C) 2006 Alex Graveley
+#
+# Usage: bench/instancebench.sh [FLASHER-OPTION...]
+#
+# Runs under Xvfb unless DISPLAY is set.  Tunables, from the environment:
+#   COUNTS   numbers of movies to run ("1 2 4 8")
+#   FRAMES   frames each movie renders (120)
+#   FPS      frame rate the stub aims for (30)
+#   SIZE     window size of each movie (320x240)
+#
+# Memory is each process's PSS once its movies are done, so libraries
+# shared between the separate processes are only counted once; RSS is
+# shown too.
+#
+
+FLASHER=${FLASHER:-./flasher}
+STUB=${STUB:-bench/libstubplugin.so}
+COUNTS=${COUNTS:-1 2 4 8}
+FRAMES=${FRAMES:-120}
+FPS=${FPS:-30}
+SIZE=${SIZE:-320x240}
+
+if [ -z "$DISPLAY" ]; then
+	exec sh `dirname $0`/xvfb-run.sh sh $0 "$@"
+fi
+
+TMP=`mktemp -d /tmp/instancebench-XXXXXX`
+trap 'rm -rf $TMP' 0 INT TERM
+
+head -c 65536 /dev/zero >$TMP/movie.swf
+
+# play LOG SWFFILE... [OPTION...]
+play() {
+	log=$1
+	shift
+	STUB_FRAMES=$FRAMES STUB_FPS=$FPS \
+		$FLASHER --plugin $STUB --geometry $SIZE "$@" \
+		>/dev/null 2>$log
+}
+
+# Sum a stub result field over the last report of each log.
+sum() {
+	field=$1
+	shift
+	for log in "$@"; do
+		grep '^stub: frames=' $log | tail -1
+	done | sed -n "s/.* $field=\([0-9]*\).*/\1/p" |
+		awk '{ t += $1 } END { print t + 0 }'
+}
+
+for n in $COUNTS; do
+	movies=
+	i=0
+	while [ $i -lt $n ]; do
+		cp $TMP/movie.swf $TMP/movie$i.swf
+		movies="$movies $TMP/movie$i.swf"
+		i=`expr $i + 1`
+	done
+
+	if ! play $TMP/one.log $movies "$@"; then
+		echo "$n movies: FAILED in one process"
+		tail -20 $TMP/one.log
+		continue
+	fi
+
+	i=0
+	pids=
+	logs=
+	while [ $i -lt $n ]; do
+		play $TMP/sep$i.log $TMP/movie$i.swf "$@" &
+		pids="$pids $!"
+		logs="$logs $TMP/sep$i.log"
+		i=`expr $i + 1`
+	done
+	failed=
+	for pid in $pids; do
+		wait $pid || failed=1
+	done
+	if [ -n "$failed" ]; then
+		echo "$n movies: FAILED in separate processes"
+		tail -20 $logs
+		continue
+	fi
+
+	one_pss=`sum pss_kb $TMP/one.log`
+	one_rss=`sum rss_kb $TMP/one.log`
+	sep_pss=`sum pss_kb $logs`
+	sep_rss=`sum rss_kb $logs`
+
+	echo "$n movies: one process pss=${one_pss}kB rss=${one_rss}kB," \
+		"$n processes pss=${sep_pss}kB rss=${sep_rss}kB," \
+		"saved `expr \( $sep_pss - $one_pss \) / $n`kB pss per movie"
+done
@@ -0,0 +1,325 @@
+/*==========================================================================*\
+ *
+ * isolatebench.c - Plugin process call and stream benchmark for flasher.
+ * flasher (C) 2006 Alex Graveley
+ *
+ * Links against flasher itself, with its main renamed, and loads a plugin
+ * (bench/libstubplugin.so by default) as flasher --isolate does, in a
+ * process of its own.  Times NPP_HandleEvent round trips to it, then
+ * streams --streams bodies to it from an offline --backend, as
+ * streambench does to a plugin in the same process.  --direct loads the
+ * plugin in this process instead, for comparison.
+ *
+\*==========================================================================*/
+
+#undef main /* Built with -Dmain=flasher_main */
+
+#include <dlfcn.h>
+#include <getopt.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "flasher.h"
+#include "curlstream.h"
+#include "filestream.h"
+#include "isolate.h"
+#include "mainloop.h"
+#include "stats.h"
+#include "stream.h"
+
+
+int flasher_main(int argc, char **argv);
+
+static char *url = NULL;
+static int streams = 1000;
+static int concurrency = 16;
+static int events = 100000;
+
+static int started = 0;
+static int finished = 0;
+static int failed = 0;
+static long bytes = 0;
+
+/* The plugin's, or the proxies for it */
+static NPP_WriteUPP plugin_write;
+static NPP_URLNotifyUPP plugin_urlnotify;
+
+
+static int32
+BenchWrite(NPP instance,
+	   NPStream *stream,
+	   int32 offset,
+	   int32 len,
+	   void *buffer)
+{
+	int32 written = CallNPP_WriteProc(plugin_write, instance, stream,
+					  offset, len, buffer);
+	if (written > 0) {
+		bytes += written;
+	}
+	return written;
+}
+
+
+static void
+BenchStart(NPP instance)
+{
+	if (started == streams) {
+		return;
+	}
+	started++;
+
+	if (NPN_GetURLNotify(instance, url, NULL, NULL) != NPERR_NO_ERROR) {
+		Error("Request for '%s' failed\n", url);
+	}
+}
+
+
+static void
+BenchURLNotify(NPP instance,
+	       const char *url,
+	       NPReason reason,
+	       void *notifyData)
+{
+	CallNPP_URLNotifyProc(plugin_urlnotify, instance, url, reason,
+			      notifyData);
+
+	if (reason != NPRES_DONE) {
+		failed++;
+	}
+	if (++finished == streams) {
+		MainLoopQuit();
+	} else {
+		BenchStart(instance);
+	}
+}
+
+
+/* --direct: the display and app context, which NPN_GetValue assumes */
+static NPError
+BenchGetValue(NPP instance, NPNVariable variable, void *value)
+{
+	switch (variable) {
+	case NPNVxDisplay:
+		*(void **) value = NULL;
+		return NPERR_NO_ERROR;
+	case NPNVxtAppContext:
+		*(void **) value = x_app_context;
+		return NPERR_NO_ERROR;
+	default:
+		return NPN_GetValue(instance, variable, value);
+	}
+}
+
+
+/* --direct: load the plugin here, calling it as flasher does. */
+static void
+BenchLoadDirect(const char *path)
+{
+	void *dlobj = dlopen(path, RTLD_LAZY);
+	if (!dlobj) {
+		Error("Unable to load plugin: %s\n", dlerror());
+	}
+	IsolateInitializeFunc initialize = (IsolateInitializeFunc)
+		dlsym(dlobj, "NP_Initialize");
+	if (!initialize) {
+		Error("Loading symbol NP_Initialize: %s\n", dlerror());
+	}
+
+	static NPNetscapeFuncs funcs;
+	funcs.size = sizeof(funcs);
+	funcs.version = (NP_VERSION_MAJOR << 8) + NP_VERSION_MINOR;
+	funcs.geturl = NewNPN_GetURLProc(NPN_GetURL);
+	funcs.geturlnotify = NewNPN_GetURLNotifyProc(NPN_GetURLNotify);
+	funcs.destroystream = NewNPN_DestroyStreamProc(NPN_DestroyStream);
+	funcs.status = NewNPN_StatusProc(NPN_Status);
+	funcs.memalloc = NewNPN_MemAllocProc(NPN_MemAlloc);
+	funcs.memfree = NewNPN_MemFreeProc(NPN_MemFree);
+	funcs.getvalue = NewNPN_GetValueProc(BenchGetValue);
+	funcs.setvalue = NewNPN_SetValueProc(NPN_SetValue);
+	funcs.invalidaterect = NewNPN_InvalidateRectProc(NPN_InvalidateRect);
+	funcs.forceredraw = NewNPN_ForceRedrawProc(NPN_ForceRedraw);
+
+	plugin_funcs.size = sizeof(plugin_funcs);
+	if (initialize(&funcs, &plugin_funcs) != NPERR_NO_ERROR) {
+		Error("NP_Initialize failed\n");
+	}
+}
+
+
+static int
+BenchCompare(const void *a, const void *b)
+{
+	double d = *(double *) a - *(double *) b;
+	return (d > 0) - (d < 0);
+}
+
+
+static void
+PrintUsage(void)
+{
+	printf("Usage: isolatebench URL [OPTION...]\n");
+	printf("  --plugin PATH\t\t\tLoad the plugin from PATH "
+	       "(bench/libstubplugin.so).\n");
+	printf("  --backend SPEC\t\tAs for flasher; default curl.\n");
+	printf("  --events N\t\t\tTime N NPP_HandleEvent calls (%d).\n",
+	       events);
+	printf("  --streams N\t\t\tComplete N requests (%d).\n", streams);
+	printf("  --concurrency N\t\tKeep N requests in flight (%d).\n",
+	       concurrency);
+	printf("  --direct\t\t\tLoad the plugin in this process.\n");
+	printf("  --verbose\t\t\tShow flasher's log.\n");
+	printf("\n");
+}
+
+
+int
+main(int argc, char **argv)
+{
+	if (argc > 1 && !strcmp(argv[1], "--plugin-host")) {
+		/* Started by IsolateStart: be flasher. */
+		return flasher_main(argc, argv);
+	}
+
+	struct option long_options[] = {
+		{ "plugin", required_argument, NULL, 'p' },
+		{ "backend", required_argument, NULL, 'B' },
+		{ "events", required_argument, NULL, 'e' },
+		{ "streams", required_argument, NULL, 'n' },
+		{ "concurrency", required_argument, NULL, 'c' },
+		{ "direct", no_argument, NULL, 'd' },
+		{ "verbose", no_argument, NULL, 'v' },
+		{ 0, 0, 0, 0 }
+	};
+	char *plugin_path = "bench/libstubplugin.so";
+	char *backend = NULL;
+	Bool direct = False;
+	Bool verbose = False;
+
+	while (True) {
+		int opt = getopt_long_only(argc, argv, "-h", long_options, NULL);
+		if (opt == -1) {
+			break;
+		}
+		switch (opt) {
+		case 'p':
+			plugin_path = optarg;
+			break;
+		case 'B':
+			backend = optarg;
+			break;
+		case 'e':
+			events = atoi(optarg);
+			break;
+		case 'n':
+			streams = atoi(optarg);
+			break;
+		case 'c':
+			concurrency = atoi(optarg);
+			break;
+		case 'd':
+			direct = True;
+			break;
+		case 'v':
+			verbose = True;
+			break;
+		case 1:
+			url = optarg;
+			break;
+		default:
+			PrintUsage();
+			return 1;
+		}
+	}
+	if (!url || streams <= 0 || concurrency <= 0 || events <= 0) {
+		PrintUsage();
+		return 1;
+	}
+
+	if (!verbose) {
+		/* Per-stream logging would dominate the timings. */
+		freopen("/dev/null", "w", stdout);
+	}
+
+	XtToolkitInitialize();
+	x_app_context = XtCreateApplicationContext();
+	MainLoopInit();
+
+	CURLStreamOptions curl_options = { 0 };
+	CURLStreamInit(&curl_options);
+	FileStreamInit(True);
+	if (!StreamInit(backend)) {
+		fprintf(stderr, "Invalid backend '%s'\n", backend);
+		return 1;
+	}
+
+	if (direct) {
+		BenchLoadDirect(plugin_path);
+	} else {
+		IsolateStart(plugin_path, NULL);
+	}
+
+	NPP_t plugin = { 0 };
+	char *args[] = { "SRC" };
+	char *vals[] = { url };
+	NPError err = CallNPP_NewProc(plugin_funcs.newp,
+				      "application/x-shockwave-flash",
+				      &plugin, NP_FULL, 1, args, vals, NULL);
+	if (err != NPERR_NO_ERROR) {
+		Error("NPP_New result = %d\n", err);
+	}
+
+	/* Round trips: an event the plugin ignores */
+	double *latency = malloc(events * sizeof(double));
+	XEvent event = { 0 };
+	event.type = FocusIn;
+
+	double start = StatsNow();
+	for (int i = 0; i < events; i++) {
+		double t = StatsNow();
+		CallNPP_HandleEventProc(plugin_funcs.event, &plugin, &event);
+		latency[i] = StatsNow() - t;
+	}
+	double elapsed = StatsNow() - start;
+	qsort(latency, events, sizeof(double), BenchCompare);
+
+	fprintf(stderr, "%s, %d NPP_HandleEvent calls\n",
+		direct ? "direct" : "isolated", events);
+	fprintf(stderr, "  %.1f ms, %.0f calls/s\n", elapsed,
+		events / (elapsed / 1000.0));
+	fprintf(stderr, "  latency us: p50 %.2f, p99 %.2f, max %.2f\n",
+		latency[events / 2] * 1000, latency[events * 99 / 100] * 1000,
+		latency[events - 1] * 1000);
+	free(latency);
+
+	/* Streams, counted as the plugin takes them */
+	plugin_write = plugin_funcs.write;
+	plugin_urlnotify = plugin_funcs.urlnotify;
+	plugin_funcs.write = NewNPP_WriteProc(BenchWrite);
+	plugin_funcs.urlnotify = NewNPP_URLNotifyProc(BenchURLNotify);
+
+	start = StatsNow();
+	for (int i = 0; i < concurrency; i++) {
+		BenchStart(&plugin);
+	}
+	MainLoopRun();
+	elapsed = StatsNow() - start;
+
+	fprintf(stderr, "%s %s, %d streams, %d in flight: %d failed\n",
+		direct ? "direct" : "isolated", backend ? backend : "curl",
+		streams, concurrency, failed);
+	fprintf(stderr, "  %.1f ms, %.0f streams/s, %.1f MB/s\n", elapsed,
+		streams / (elapsed / 1000.0),
+		bytes / (elapsed / 1000.0) / (1024 * 1024));
+
+	CallNPP_DestroyProc(plugin_funcs.destroy, &plugin, NULL);
+	if (!direct) {
+		IsolateShutdown();
+	}
+
+	StreamShutdown();
+	CURLStreamShutdown();
+	MainLoopShutdown();
+
+	return failed ? 1 : 0;
+}
@@ -0,0 +1,83 @@
+#!/bin/sh
+#
+# mmapbench.sh - Compare how soon a local SWF reaches the plugin when
+# flasher maps it and when it reads it (--no-mmap), using the stub plugin.
+# flasher (C) 2006 Alex Graveley
+#
+# Usage: bench/mmapbench.sh [FLASHER-OPTION...]
+#
+# Runs under Xvfb unless DISPLAY is set.  Tunables, from the environment:
+#   SIZES    SWF sizes to run at, in MB ("1 10 100 500")
+#   RUNS     runs of each size and mode (3)
+#   TIMEOUT  seconds to wait for a stream to finish (60)
+#   FILL     "sparse" SWFs, or "random" ones from /dev/urandom (sparse)
+#
+# Reports the "first NPP_Write" and "completed" times flasher logs for
+# the SWF stream.  Sparse files are cheap to make but read as zeroes
+# without touching the disk; FILL=random gives pages with real contents.
+#
+
+FLASHER=${FLASHER:-./flasher}
+STUB=${STUB:-bench/libstubplugin.so}
+SIZES=${SIZES:-1 10 100 500}
+RUNS=${RUNS:-3}
+TIMEOUT=${TIMEOUT:-60}
+FILL=${FILL:-sparse}
+
+if [ -z "$DISPLAY" ]; then
+	exec sh `dirname $0`/xvfb-run.sh sh $0 "$@"
+fi
+
+TMP=`mktemp -d /tmp/mmapbench-XXXXXX`
+trap 'rm -rf $TMP' 0 INT TERM
+
+run() {
+	size=$1
+	name=$2
+	shift 2
+
+	# The stub renders until killed; stop it once the SWF is in.  stdout
+	# is a file, so line-buffer it to see the log as it's written.
+	STUB_FRAMES=0 STUB_URLS= stdbuf -oL \
+		$FLASHER --plugin $STUB "$@" $TMP/movie-$size.swf \
+		>$TMP/out.log 2>$TMP/err.log &
+	pid=$!
+
+	ticks=`expr $TIMEOUT \* 10`
+	while ! grep -q ': \(completed\|failed\) after' $TMP/out.log; do
+		if ! kill -0 $pid 2>/dev/null || [ $ticks -le 0 ]; then
+			break
+		fi
+		sleep 0.1
+		ticks=`expr $ticks - 1`
+	done
+	kill $pid 2>/dev/null
+	wait $pid 2>/dev/null
+
+	first=`sed -n 's/^Stream .*: first NPP_Write after \(.*\) ms$/\1/p' \
+		$TMP/out.log | head -1`
+	completed=`sed -n 's/^Stream .*: completed after \(.*\) ms$/\1/p' \
+		$TMP/out.log | head -1`
+	if [ -z "$first" ] || [ -z "$completed" ]; then
+		echo "$size MB $name: FAILED"
+		cat $TMP/err.log $TMP/out.log | tail -20
+		return
+	fi
+	echo "$size MB $name: first NPP_Write $first ms, completed $completed ms"
+}
+
+for size in $SIZES; do
+	if [ "$FILL" = random ]; then
+		head -c ${size}M /dev/urandom >$TMP/movie-$size.swf
+	else
+		truncate -s ${size}M $TMP/movie-$size.swf
+	fi
+
+	i=0
+	while [ $i -lt $RUNS ]; do
+		run $size mmap "$@"
+		run $size read --no-mmap "$@"
+		i=`expr $i + 1`
+	done
+	rm -f $TMP/movie-$size.swf
+done
@@ -0,0 +1,51 @@
+#!/bin/sh
+#
+# netbench.sh - How late the main loop runs a timer, and what the host's
+# CPU costs per MB, while large files download, with libcurl on the main
+# loop and on a thread of its own.
+# flasher (C) 2006 Alex Graveley
+#
+# Usage: bench/netbench.sh [STREAMBENCH-OPTION...]
+#
+# Serves a sparse file with python3's http.server.  Tunables, from the
+# environment:
+#   SIZE     bytes to download (1G)
+#   TICK     timer interval in ms (5)
+#   RUNS     downloads of each kind (3)
+#   STREAMS  downloads at once in the second set of runs (8)
+#   PORT     port to serve on (8765)
+#
+# Each run first fetches the file alone, then STREAMS times at once, with
+# a query string apiece so they aren't joined into one transfer.
+#
+
+BENCH=${BENCH:-bench/streambench}
+SIZE=${SIZE:-1G}
+TICK=${TICK:-5}
+RUNS=${RUNS:-3}
+STREAMS=${STREAMS:-8}
+PORT=${PORT:-8765}
+
+TMP=`mktemp -d /tmp/netbench-XXXXXX`
+
+truncate -s $SIZE $TMP/body.bin
+
+(cd $TMP && exec python3 -m http.server $PORT >server.log 2>&1) &
+SERVER=$!
+trap 'kill $SERVER; rm -rf $TMP' 0 INT TERM
+
+while ! grep -q Serving $TMP/server.log 2>/dev/null; do
+	sleep 0.1
+done
+
+i=0
+while [ $i -lt $RUNS ]; do
+	for n in 1 $STREAMS; do
+		for thread in "" --net-thread; do
+			echo "${thread:-main loop}, $n at once:"
+			$BENCH "http://127.0.0.1:$PORT/body.bin?%d" --streams $n \
+				--concurrency $n --tick $TICK $thread "$@"
+		done
+	done
+	i=`expr $i + 1`
+done
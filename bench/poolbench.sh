@@ -0,0 +1,68 @@
+#!/bin/sh
+#
+# poolbench.sh - Compare the time to a movie's first frame when flasher
+# is started cold with when it is launched from a --server pool, using
+# the stub plugin.
+# flasher (C) 2006 Alex Graveley
+#
+# Usage: bench/poolbench.sh [FLASHER-OPTION...]
+#
+# Runs under Xvfb unless DISPLAY is set.  Tunables, from the environment:
+#   RUNS     launches of each kind (20)
+#   POOL     processes the server keeps ready (2)
+#   SIZE     window size (640x480)
+#
+
+FLASHER=${FLASHER:-./flasher}
+STUB=${STUB:-bench/libstubplugin.so}
+RUNS=${RUNS:-20}
+POOL=${POOL:-2}
+SIZE=${SIZE:-640x480}
+
+if [ -z "$DISPLAY" ]; then
+	exec sh `dirname $0`/xvfb-run.sh sh $0 "$@"
+fi
+
+TMP=`mktemp -d /tmp/poolbench-XXXXXX`
+
+head -c 65536 /dev/zero >$TMP/movie.swf
+
+$FLASHER --server $TMP/socket --pool $POOL --plugin $STUB \
+	>$TMP/server.log 2>&1 &
+SERVER=$!
+trap 'kill $SERVER; rm -rf $TMP' 0 INT TERM
+
+while [ ! -S $TMP/socket ]; do
+	sleep 0.1
+done
+# Let the pool warm up.
+sleep 1
+
+# launch NAME FLASHER-OPTION...
+launch() {
+	name=$1
+	shift
+
+	i=0
+	while [ $i -lt $RUNS ]; do
+		STUB_T0=`date +%s%3N` STUB_FRAMES=1 \
+			$FLASHER --plugin $STUB --geometry $SIZE "$@" \
+			$TMP/movie.swf >/dev/null 2>$TMP/err.log
+		sed -n 's/^stub: frames=.* startup_ms=\([0-9.]*\).*/\1/p' \
+			$TMP/err.log
+		i=`expr $i + 1`
+		# Give the server time to refill the pool.
+		[ $name = pool ] && sleep 0.2
+	done | sort -n | awk -v name=$name '
+		{ ms[NR] = $1; t += $1 }
+		END {
+			if (NR == 0) { print name ": FAILED"; exit }
+			printf "%s: %d launches, first frame after " \
+				"min %.1f p50 %.1f max %.1f mean %.1f ms\n",
+				name, NR, ms[1], ms[int((NR + 1) / 2)],
+				ms[NR], t / NR
+		}'
+}
+
+launch cold "$@"
+launch pool --connect $TMP/socket "$@"
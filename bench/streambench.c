@@ -0,0 +1,343 @@
+/*==========================================================================*\
+ *
+ * streambench.c - Stream dispatch benchmark for flasher.
+ * flasher (C) 2006 Alex Graveley
+ *
+ * Links against flasher itself, with its main renamed, and stands in for
+ * the plugin: it keeps a number of NPN_GetURLNotify or NPN_PostURLNotify
+ * requests in flight until enough have completed, accepting whatever the
+ * host writes.  Use an offline --backend to measure the host alone, or
+ * --tick to see how late the main loop runs a timer while it works.
+ *
+\*==========================================================================*/
+
+#undef main /* Built with -Dmain=flasher_main */
+
+#include <getopt.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+
+#include "flasher.h"
+#include "curlstream.h"
+#include "filestream.h"
+#include "mainloop.h"
+#include "stats.h"
+#include "stream.h"
+
+
+static char *url = NULL;
+static int streams = 1000;
+static int concurrency = 16;
+static int ready = 64 * 1024;
+static Bool post = False;
+
+static int started = 0;
+static int finished = 0;
+static int failed = 0;
+static long bytes = 0;
+static long writes = 0;
+static long ready_calls = 0;
+static double *latency; /* Per request, from StatsNow() at start to end */
+
+static int tick = 0;
+static double tick_due = 0;
+static double *tick_late; /* Per tick, ms past when it was due */
+static int ticks = 0;
+static int ticks_max = 0;
+
+
+static NPError
+BenchNewStream(NPP instance,
+	       NPMIMEType type,
+	       NPStream *stream,
+	       NPBool seekable,
+	       uint16 *stype)
+{
+	*stype = NP_NORMAL;
+	return NPERR_NO_ERROR;
+}
+
+
+static int32
+BenchWriteReady(NPP instance, NPStream *stream)
+{
+	ready_calls++;
+	return ready;
+}
+
+
+static int32
+BenchWrite(NPP instance,
+	   NPStream *stream,
+	   int32 offset,
+	   int32 len,
+	   void *buffer)
+{
+	writes++;
+	bytes += len;
+	return len;
+}
+
+
+static NPError
+BenchDestroyStream(NPP instance, NPStream *stream, NPReason reason)
+{
+	return NPERR_NO_ERROR;
+}
+
+
+static void BenchStart(NPP instance);
+
+
+static void
+BenchURLNotify(NPP instance,
+	       const char *url,
+	       NPReason reason,
+	       void *notifyData)
+{
+	double *start = (double *) notifyData;
+	*start = StatsNow() - *start;
+
+	if (reason != NPRES_DONE) {
+		failed++;
+	}
+	if (++finished == streams) {
+		MainLoopQuit();
+	} else {
+		BenchStart(instance);
+	}
+}
+
+
+/* Request the next stream, if any are left. */
+static void
+BenchStart(NPP instance)
+{
+	if (started == streams) {
+		return;
+	}
+
+	/* A %d in the URL becomes the stream's number, so that streams
+	 * don't share one transfer. */
+	char buf[1024];
+	char *u = url;
+	char *d = strstr(url, "%d");
+	if (d) {
+		snprintf(buf, sizeof(buf), "%.*s%d%s", (int)(d - url), url,
+			 started, d + 2);
+		u = buf;
+	}
+
+	double *start = &latency[started++];
+	*start = StatsNow();
+
+	NPError err;
+	if (post) {
+		static const char body[] = "bench=1";
+		err = NPN_PostURLNotify(instance, u, NULL, sizeof(body) - 1,
+					body, False, start);
+	} else {
+		err = NPN_GetURLNotify(instance, u, NULL, start);
+	}
+
+	if (err != NPERR_NO_ERROR) {
+		Error("Request for '%s' failed: %d\n", u, err);
+	}
+}
+
+
+/* Timer callback: note how late we are, and come back in tick ms. */
+static void
+BenchTick(void *data)
+{
+	double now = StatsNow();
+
+	if (ticks == ticks_max) {
+		ticks_max = MAX(1024, ticks_max * 2);
+		tick_late = realloc(tick_late, ticks_max * sizeof(double));
+	}
+	tick_late[ticks++] = MAX(0, now - tick_due);
+
+	tick_due = now + tick;
+	MainLoopAddTimer(tick, BenchTick, NULL);
+}
+
+
+static int
+BenchCompare(const void *a, const void *b)
+{
+	double d = *(double *) a - *(double *) b;
+	return (d > 0) - (d < 0);
+}
+
+
+static void
+PrintUsage(void)
+{
+	printf("Usage: streambench URL [OPTION...]\n");
+	printf("A %%d in URL becomes each request's number.\n");
+	printf("  --backend SPEC\t\tAs for flasher; default curl.\n");
+	printf("  --streams N\t\t\tComplete N requests (%d).\n", streams);
+	printf("  --concurrency N\t\tKeep N requests in flight (%d).\n",
+	       concurrency);
+	printf("  --ready BYTES\t\t\tAccept BYTES per NPP_Write (%d).\n",
+	       ready);
+	printf("  --post\t\t\tUse NPN_PostURLNotify.\n");
+	printf("  --max-streams N\t\tAs for flasher; default no limit.\n");
+	printf("  --max-host-streams N\t\tAs for flasher; default no limit.\n");
+	printf("  --net-thread\t\t\tRun libcurl on a thread of its own.\n");
+	printf("  --write-delay MS\t\tAs for flasher; default 0.\n");
+	printf("  --tick MS\t\t\tReport how late a timer due every MS "
+	       "ms runs.\n");
+	printf("  --verbose\t\t\tShow flasher's log.\n");
+	printf("\n");
+}
+
+
+int
+main(int argc, char **argv)
+{
+	struct option long_options[] = {
+		{ "backend", required_argument, NULL, 'B' },
+		{ "streams", required_argument, NULL, 'n' },
+		{ "concurrency", required_argument, NULL, 'c' },
+		{ "ready", required_argument, NULL, 'r' },
+		{ "post", no_argument, NULL, 'p' },
+		{ "max-streams", required_argument, NULL, 'S' },
+		{ "max-host-streams", required_argument, NULL, 'T' },
+		{ "net-thread", no_argument, NULL, 'N' },
+		{ "write-delay", required_argument, NULL, 'W' },
+		{ "tick", required_argument, NULL, 't' },
+		{ "verbose", no_argument, NULL, 'v' },
+		{ 0, 0, 0, 0 }
+	};
+	char *backend = NULL;
+	Bool verbose = False;
+	CURLStreamOptions curl_options = { 0 };
+
+	while (True) {
+		int opt = getopt_long_only(argc, argv, "-h", long_options, NULL);
+		if (opt == -1) {
+			break;
+		}
+		switch (opt) {
+		case 'B':
+			backend = optarg;
+			break;
+		case 'n':
+			streams = atoi(optarg);
+			break;
+		case 'c':
+			concurrency = atoi(optarg);
+			break;
+		case 'r':
+			ready = atoi(optarg);
+			break;
+		case 'p':
+			post = True;
+			break;
+		case 'S':
+			curl_options.max_streams = atoi(optarg);
+			break;
+		case 'T':
+			curl_options.max_host_streams = atoi(optarg);
+			break;
+		case 'N':
+			curl_options.thread = True;
+			break;
+		case 'W':
+			curl_options.write_delay = atoi(optarg);
+			break;
+		case 't':
+			tick = atoi(optarg);
+			break;
+		case 'v':
+			verbose = True;
+			break;
+		case 1:
+			url = optarg;
+			break;
+		default:
+			PrintUsage();
+			return 1;
+		}
+	}
+	if (!url || streams <= 0 || concurrency <= 0 || ready <= 0) {
+		PrintUsage();
+		return 1;
+	}
+
+	if (!verbose) {
+		/* Per-stream logging would dominate the timings. */
+		freopen("/dev/null", "w", stdout);
+	}
+
+	plugin_funcs.newstream = NewNPP_NewStreamProc(BenchNewStream);
+	plugin_funcs.writeready = NewNPP_WriteReadyProc(BenchWriteReady);
+	plugin_funcs.write = NewNPP_WriteProc(BenchWrite);
+	plugin_funcs.destroystream =
+		NewNPP_DestroyStreamProc(BenchDestroyStream);
+	plugin_funcs.urlnotify = NewNPP_URLNotifyProc(BenchURLNotify);
+
+	XtToolkitInitialize();
+	x_app_context = XtCreateApplicationContext();
+	MainLoopInit();
+
+	CURLStreamInit(&curl_options);
+	FileStreamInit(True);
+	if (!StreamInit(backend)) {
+		fprintf(stderr, "Invalid backend '%s'\n", backend);
+		return 1;
+	}
+
+	NPP_t plugin = { 0 };
+	latency = malloc(streams * sizeof(double));
+
+	double start = StatsNow();
+	if (tick > 0) {
+		tick_due = start + tick;
+		MainLoopAddTimer(tick, BenchTick, NULL);
+	}
+	for (int i = 0; i < concurrency; i++) {
+		BenchStart(&plugin);
+	}
+	MainLoopRun();
+	double elapsed = StatsNow() - start;
+
+	struct rusage ru;
+	getrusage(RUSAGE_SELF, &ru);
+	double cpu = ru.ru_utime.tv_sec + ru.ru_stime.tv_sec +
+		(ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1000000.0;
+
+	qsort(latency, streams, sizeof(double), BenchCompare);
+
+	fprintf(stderr, "%s %s, %d streams, %d in flight: %d failed\n",
+		backend ? backend : "curl", post ? "POST" : "GET",
+		streams, concurrency, failed);
+	fprintf(stderr, "  %.1f ms, %.0f streams/s, %.1f MB/s, "
+		"%ld writes, %ld write-readies\n", elapsed,
+		streams / (elapsed / 1000.0),
+		bytes / (elapsed / 1000.0) / (1024 * 1024), writes,
+		ready_calls);
+	fprintf(stderr, "  latency ms: p50 %.3f, p95 %.3f, p99 %.3f, "
+		"max %.3f\n", latency[streams / 2], latency[streams * 95 / 100],
+		latency[streams * 99 / 100], latency[streams - 1]);
+	fprintf(stderr, "  cpu %.3f s, %.1f us/stream, %.1f ms/MB\n", cpu,
+		cpu * 1000000.0 / streams,
+		bytes ? cpu * 1000.0 / (bytes / (1024.0 * 1024)) : 0.0);
+	if (ticks > 0) {
+		qsort(tick_late, ticks, sizeof(double), BenchCompare);
+		fprintf(stderr, "  %d ticks, late ms: p50 %.3f, p99 %.3f, "
+			"max %.3f\n", ticks, tick_late[ticks / 2],
+			tick_late[ticks * 99 / 100], tick_late[ticks - 1]);
+	}
+
+	StreamShutdown();
+	CURLStreamShutdown();
+	MainLoopShutdown();
+	free(latency);
+	free(tick_late);
+
+	return failed ? 1 : 0;
+}
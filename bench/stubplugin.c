@@ -0,0 +1,600 @@
+/*==========================================================================*\
+ *
+ * stubplugin.c - Stand-in Flash plugin for benchmarking flasher.
+ * flasher (C) 2006 Alex Graveley
+ *
+ * Loaded with flasher --plugin, it uses the host the way the Flash player
+ * does: it takes the SWF stream, then requests more URLs, and renders
+ * frames from an Xt timer, either straight into its window or, when
+ * windowless, through NPN_InvalidateRect and GraphicsExpose.  Behaviour
+ * comes from the environment:
+ *
+ *   STUB_FPS         Frames per second to aim for (30)
+ *   STUB_FRAMES      Quit once every instance has shown this many frames
+ *                    (0, run until killed)
+ *   STUB_URLS        Comma separated URLs to load once the SWF is in
+ *   STUB_WINDOWLESS  Ask to be windowless, if set and not empty
+ *   STUB_DIRTY       Only redraw a square this many pixels wide, moving
+ *                    across an otherwise static frame (0, everything)
+ *   STUB_T0          Launch time in ms since the epoch, for startup time
+ *
+ * When done each instance prints one line of results to stderr, and the
+ * last one sends the process SIGTERM, so the host shuts down as it would
+ * on ^C.
+ *
+\*==========================================================================*/
+
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+#include <X11/Xlib.h>
+#include <X11/Xutil.h>
+#include <X11/Intrinsic.h>
+
+#define XP_UNIX 1
+#define MOZ_X11 1
+#include "npapi.h"
+#include "npupp.h"
+
+
+#define MIN(a,b) ((a) < (b) ? (a) : (b))
+
+
+typedef struct _StubInstance
+{
+	NPP          instance;
+	Display     *display;
+	XtAppContext app_context;
+	Window       window;   /* 0 when windowless */
+	int          width;
+	int          height;
+	Visual      *visual;
+	int          depth;
+	GC           gc;
+	XImage      *image;
+	Bool         windowless;
+
+	XtIntervalId frame_id;
+	double       first_frame; /* Epoch ms */
+	double       next_frame;
+	int          frames;
+	int          frame_limit;
+	double       interval;
+	int          dirty;
+	Bool         done;
+
+	int          streams;       /* Started, including the SWF */
+	int          streams_done;
+	long         stream_bytes;
+	double       stream_start;  /* First NPP_NewStream */
+	double       stream_end;    /* Last NPP_DestroyStream */
+} StubInstance;
+
+
+static NPNetscapeFuncs moz_funcs;
+
+/* NPP_* calls from the host, and NPN_* calls to it */
+static struct {
+	long newp, destroy, setwindow, newstream, destroystream, writeready;
+	long write, asfile, handleevent, urlnotify;
+	long geturlnotify, invalidaterect;
+} calls;
+
+static int instances;      /* Alive */
+static int instances_done; /* Reached STUB_FRAMES */
+
+
+/* Milliseconds since the epoch */
+static double
+StubNow(void)
+{
+	struct timeval now;
+	gettimeofday(&now, NULL);
+
+	return now.tv_sec * 1000.0 + now.tv_usec / 1000.0;
+}
+
+
+/* 
+ * Read a "Field:  N kB" line from a /proc file, such as VmRSS from
+ * /proc/self/status.
+ */
+static long
+StubMemory(const char *path, const char *field)
+{
+	char line[256];
+	long kb = -1;
+	int len = strlen(field);
+
+	FILE *status = fopen(path, "r");
+	if (!status) {
+		return -1;
+	}
+	while (fgets(line, sizeof(line), status)) {
+		if (!strncmp(line, field, len) && line[len] == ':') {
+			kb = atol(line + len + 1);
+			break;
+		}
+	}
+	fclose(status);
+
+	return kb;
+}
+
+
+static void
+StubReport(StubInstance *stub)
+{
+	double now = StubNow();
+	double elapsed = now - stub->first_frame;
+	double stream_ms = stub->stream_end - stub->stream_start;
+	char *t0 = getenv("STUB_T0");
+
+	fprintf(stderr, "stub: frames=%d fps=%.2f startup_ms=%.1f "
+		"streams=%d/%d stream_bytes=%ld stream_ms=%.1f "
+		"stream_mbs=%.2f rss_kb=%ld hwm_kb=%ld pss_kb=%ld "
+		"instances=%d windowless=%d\n",
+		stub->frames,
+		(stub->frames > 1) ? (stub->frames - 1) / (elapsed / 1000.0) : 0,
+		t0 ? stub->first_frame - atof(t0) : -1.0,
+		stub->streams_done, stub->streams, stub->stream_bytes,
+		stream_ms,
+		(stream_ms > 0) ?
+		stub->stream_bytes / (stream_ms / 1000.0) / (1024 * 1024) : 0,
+		StubMemory("/proc/self/status", "VmRSS"),
+		StubMemory("/proc/self/status", "VmHWM"),
+		StubMemory("/proc/self/smaps_rollup", "Pss"),
+		instances, stub->windowless);
+	fprintf(stderr, "stub: calls NPP_New=%ld NPP_SetWindow=%ld "
+		"NPP_NewStream=%ld NPP_WriteReady=%ld NPP_Write=%ld "
+		"NPP_StreamAsFile=%ld NPP_DestroyStream=%ld NPP_URLNotify=%ld "
+		"NPP_HandleEvent=%ld NPN_GetURLNotify=%ld "
+		"NPN_InvalidateRect=%ld\n",
+		calls.newp, calls.setwindow, calls.newstream, calls.writeready,
+		calls.write, calls.asfile, calls.destroystream, calls.urlnotify,
+		calls.handleevent, calls.geturlnotify, calls.invalidaterect);
+}
+
+
+/* Fill part of the image with frame n of a moving pattern. */
+static void
+StubRender(StubInstance *stub, int n, XRectangle *rect)
+{
+	XImage *image = stub->image;
+
+	for (int y = rect->y; y < rect->y + rect->height; y++) {
+		unsigned int *row = (unsigned int *)
+			(image->data + y * image->bytes_per_line);
+		for (int x = rect->x; x < rect->x + rect->width; x++) {
+			unsigned char v = (x + n * 4) ^ y;
+			row[x] = (v << 16) | ((y + n) & 0xff) << 8 | (x & 0xff);
+		}
+	}
+}
+
+
+/* Copy part of the current frame to drawable. */
+static void
+StubPaint(StubInstance *stub, Drawable drawable,
+	  int x, int y, int width, int height)
+{
+	if (!stub->gc) {
+		stub->gc = XCreateGC(stub->display, drawable, 0, NULL);
+	}
+	XPutImage(stub->display, drawable, stub->gc, stub->image,
+		  x, y, x, y, width, height);
+}
+
+
+static void StubFrame(XtPointer closure, XtIntervalId *id);
+
+
+static void
+StubScheduleFrame(StubInstance *stub)
+{
+	double now = StubNow();
+
+	stub->next_frame += stub->interval;
+	if (stub->next_frame < now) {
+		/* Running late; don't try to catch up. */
+		stub->next_frame = now;
+	}
+	stub->frame_id = XtAppAddTimeOut(stub->app_context,
+					 stub->next_frame - now,
+					 StubFrame, stub);
+}
+
+
+/* 
+ * Count a frame as shown, and quit once every instance has shown
+ * enough.
+ */
+static void
+StubFrameShown(StubInstance *stub)
+{
+	if (stub->frames++ == 0) {
+		stub->first_frame = StubNow();
+	}
+
+	if (stub->frame_limit && stub->frames == stub->frame_limit &&
+	    !stub->done) {
+		stub->done = True;
+		StubReport(stub);
+		if (++instances_done == instances) {
+			kill(getpid(), SIGTERM);
+		}
+	}
+}
+
+
+/* Xt timeout callback: render the next frame. */
+static void
+StubFrame(XtPointer closure, XtIntervalId *id)
+{
+	StubInstance *stub = (StubInstance *) closure;
+	stub->frame_id = 0;
+
+	if (!stub->image) {
+		return;
+	}
+
+	XRectangle rect = { 0, 0, stub->width, stub->height };
+	if (stub->dirty && stub->frames > 0) {
+		int size = MIN(stub->dirty, MIN(stub->width, stub->height));
+		rect.x = (stub->frames * 8) % (stub->width - size + 1);
+		rect.y = (stub->frames * 4) % (stub->height - size + 1);
+		rect.width = rect.height = size;
+	}
+
+	StubRender(stub, stub->frames, &rect);
+
+	if (stub->windowless) {
+		NPRect invalid = { rect.y, rect.x, 
+				   rect.y + rect.height, rect.x + rect.width };
+		calls.invalidaterect++;
+		CallNPN_InvalidateRectProc(moz_funcs.invalidaterect,
+					   stub->instance, &invalid);
+	} else {
+		StubPaint(stub, stub->window, rect.x, rect.y, 
+			  rect.width, rect.height);
+		StubFrameShown(stub);
+	}
+
+	StubScheduleFrame(stub);
+}
+
+
+/* Request every URL in STUB_URLS. */
+static void
+StubLoadURLs(StubInstance *stub)
+{
+	char *urls = getenv("STUB_URLS");
+	if (!urls) {
+		return;
+	}
+
+	urls = strdup(urls);
+	for (char *url = strtok(urls, ","); url; url = strtok(NULL, ",")) {
+		calls.geturlnotify++;
+		NPError err = CallNPN_GetURLNotifyProc(moz_funcs.geturlnotify,
+						       stub->instance, url,
+						       NULL, NULL);
+		if (err != NPERR_NO_ERROR) {
+			fprintf(stderr, "stub: NPN_GetURLNotify %s: %d\n",
+				url, err);
+		}
+	}
+	free(urls);
+}
+
+
+static NPError
+StubNew(NPMIMEType type,
+	NPP instance,
+	uint16 mode,
+	int16 argc,
+	char *argn[],
+	char *argv[],
+	NPSavedData *saved)
+{
+	calls.newp++;
+
+	/* From the host, as Flash allocates */
+	StubInstance *stub = CallNPN_MemAllocProc(moz_funcs.memalloc,
+						  sizeof(StubInstance));
+	memset(stub, 0, sizeof(StubInstance));
+	stub->instance = instance;
+	instance->pdata = stub;
+	instances++;
+
+	CallNPN_GetValueProc(moz_funcs.getvalue, instance, NPNVxDisplay,
+			     &stub->display);
+	CallNPN_GetValueProc(moz_funcs.getvalue, instance, NPNVxtAppContext,
+			     &stub->app_context);
+
+	char *fps = getenv("STUB_FPS");
+	stub->interval = 1000.0 / ((fps && atof(fps) > 0) ? atof(fps) : 30);
+
+	char *frames = getenv("STUB_FRAMES");
+	stub->frame_limit = frames ? atoi(frames) : 0;
+
+	char *dirty = getenv("STUB_DIRTY");
+	stub->dirty = dirty ? atoi(dirty) : 0;
+
+	char *windowless = getenv("STUB_WINDOWLESS");
+	if (windowless && *windowless) {
+		NPError err = CallNPN_SetValueProc(moz_funcs.setvalue, instance,
+						   NPPVpluginWindowBool,
+						   (void *) False);
+		stub->windowless = (err == NPERR_NO_ERROR);
+		if (!stub->windowless) {
+			fprintf(stderr, "stub: host refused windowless mode\n");
+		}
+	}
+
+	return NPERR_NO_ERROR;
+}
+
+
+static NPError
+StubDestroy(NPP instance, NPSavedData **save)
+{
+	StubInstance *stub = (StubInstance *) instance->pdata;
+	calls.destroy++;
+
+	if (stub->done) {
+		instances_done--;
+	} else {
+		StubReport(stub);
+	}
+	instances--;
+	if (stub->frame_id) {
+		XtRemoveTimeOut(stub->frame_id);
+	}
+	if (stub->gc) {
+		XFreeGC(stub->display, stub->gc);
+	}
+	if (stub->image) {
+		XDestroyImage(stub->image);
+	}
+	CallNPN_MemFreeProc(moz_funcs.memfree, stub);
+
+	return NPERR_NO_ERROR;
+}
+
+
+static NPError
+StubSetWindow(NPP instance, NPWindow *window)
+{
+	StubInstance *stub = (StubInstance *) instance->pdata;
+	NPSetWindowCallbackStruct *ws_info = window->ws_info;
+	calls.setwindow++;
+
+	if (!stub->windowless && stub->gc &&
+	    stub->window != (Window) window->window) {
+		XFreeGC(stub->display, stub->gc);
+		stub->gc = NULL;
+	}
+	stub->window = (Window) window->window;
+
+	if (ws_info) {
+		stub->visual = ws_info->visual;
+		stub->depth = ws_info->depth;
+	}
+
+	if (!stub->image || stub->width != window->width ||
+	    stub->height != window->height) {
+		stub->width = window->width;
+		stub->height = window->height;
+
+		if (stub->image) {
+			XDestroyImage(stub->image);
+		}
+		stub->image = XCreateImage(stub->display, stub->visual,
+					   stub->depth, ZPixmap, 0,
+					   malloc(stub->width * stub->height * 4),
+					   stub->width, stub->height, 32, 0);
+	}
+
+	if (!stub->frame_id) {
+		stub->next_frame = StubNow();
+		stub->frame_id = XtAppAddTimeOut(stub->app_context, 0,
+						 StubFrame, stub);
+	}
+
+	return NPERR_NO_ERROR;
+}
+
+
+static NPError
+StubNewStream(NPP instance,
+	      NPMIMEType type,
+	      NPStream *stream,
+	      NPBool seekable,
+	      uint16 *stype)
+{
+	StubInstance *stub = (StubInstance *) instance->pdata;
+	calls.newstream++;
+
+	if (stub->streams++ == 0) {
+		stub->stream_start = StubNow();
+	}
+
+	/* Stands in for a decoder's state */
+	stream->pdata = CallNPN_MemAllocProc(moz_funcs.memalloc, 256);
+
+	*stype = NP_NORMAL;
+	return NPERR_NO_ERROR;
+}
+
+
+static NPError
+StubDestroyStream(NPP instance, NPStream *stream, NPReason reason)
+{
+	StubInstance *stub = (StubInstance *) instance->pdata;
+	calls.destroystream++;
+
+	CallNPN_MemFreeProc(moz_funcs.memfree, stream->pdata);
+	stream->pdata = NULL;
+
+	stub->stream_end = StubNow();
+	if (stub->streams_done++ == 0) {
+		/* The SWF is in; go get what it refers to. */
+		StubLoadURLs(stub);
+	}
+
+	return NPERR_NO_ERROR;
+}
+
+
+static int32
+StubWriteReady(NPP instance, NPStream *stream)
+{
+	calls.writeready++;
+	return 64 * 1024;
+}
+
+
+static int32
+StubWrite(NPP instance,
+	  NPStream *stream,
+	  int32 offset,
+	  int32 len,
+	  void *buffer)
+{
+	StubInstance *stub = (StubInstance *) instance->pdata;
+	calls.write++;
+
+	stub->stream_bytes += len;
+	return len;
+}
+
+
+static void
+StubStreamAsFile(NPP instance, NPStream *stream, const char *fname)
+{
+	calls.asfile++;
+}
+
+
+static void
+StubPrint(NPP instance, NPPrint *platformPrint)
+{
+}
+
+
+static int16
+StubHandleEvent(NPP instance, void *event)
+{
+	StubInstance *stub = (StubInstance *) instance->pdata;
+	XEvent *xev = (XEvent *) event;
+	calls.handleevent++;
+
+	if (xev->type != GraphicsExpose || !stub->image) {
+		return False;
+	}
+
+	XGraphicsExposeEvent *expose = &xev->xgraphicsexpose;
+	StubPaint(stub, expose->drawable, expose->x, expose->y,
+		  expose->width, expose->height);
+	StubFrameShown(stub);
+
+	return True;
+}
+
+
+static void
+StubURLNotify(NPP instance,
+	      const char *url,
+	      NPReason reason,
+	      void *notifyData)
+{
+	calls.urlnotify++;
+	if (reason != NPRES_DONE) {
+		fprintf(stderr, "stub: loading %s failed: %d\n", url, reason);
+	}
+}
+
+
+static NPError
+StubGetValue(NPP instance, NPPVariable variable, void *value)
+{
+	switch (variable) {
+	case NPPVpluginNameString:
+		*(const char **) value = "Stub Plugin";
+		break;
+	case NPPVpluginDescriptionString:
+		*(const char **) value = "Benchmark stand-in for Flash";
+		break;
+	default:
+		return NPERR_INVALID_PARAM;
+	}
+	return NPERR_NO_ERROR;
+}
+
+
+static NPError
+StubSetValue(NPP instance, NPNVariable variable, void *value)
+{
+	return NPERR_GENERIC_ERROR;
+}
+
+
+/*==========================================================================*\
+ * Entrypoints...
+\*==========================================================================*/
+
+char *
+NP_GetMIMEDescription(void)
+{
+	return "application/x-shockwave-flash:swf:Stub Flash Player";
+}
+
+
+NPError
+NP_GetValue(void *future, NPPVariable variable, void *value)
+{
+	return StubGetValue(NULL, variable, value);
+}
+
+
+NPError
+NP_Initialize(NPNetscapeFuncs *moz, NPPluginFuncs *funcs)
+{
+	if (!moz || !funcs) {
+		return NPERR_INVALID_FUNCTABLE_ERROR;
+	}
+
+	memset(&moz_funcs, 0, sizeof(moz_funcs));
+	memcpy(&moz_funcs, moz, MIN(moz->size, sizeof(moz_funcs)));
+
+	funcs->version = (NP_VERSION_MAJOR << 8) + NP_VERSION_MINOR;
+	funcs->size = sizeof(NPPluginFuncs);
+	funcs->newp = NewNPP_NewProc(StubNew);
+	funcs->destroy = NewNPP_DestroyProc(StubDestroy);
+	funcs->setwindow = NewNPP_SetWindowProc(StubSetWindow);
+	funcs->newstream = NewNPP_NewStreamProc(StubNewStream);
+	funcs->destroystream = NewNPP_DestroyStreamProc(StubDestroyStream);
+	funcs->asfile = NewNPP_StreamAsFileProc(StubStreamAsFile);
+	funcs->writeready = NewNPP_WriteReadyProc(StubWriteReady);
+	funcs->write = NewNPP_WriteProc(StubWrite);
+	funcs->print = NewNPP_PrintProc(StubPrint);
+	funcs->event = NewNPP_HandleEventProc(StubHandleEvent);
+	funcs->urlnotify = NewNPP_URLNotifyProc(StubURLNotify);
+	funcs->getvalue = NewNPP_GetValueProc(StubGetValue);
+	funcs->setvalue = NewNPP_SetValueProc(StubSetValue);
+
+	return NPERR_NO_ERROR;
+}
+
+
+NPError
+NP_Shutdown(void)
+{
+	return NPERR_NO_ERROR;
+}
@@ -0,0 +1,30 @@
+#!/bin/sh
+#
+# xvfb-run.sh - Run a command under a private Xvfb unless DISPLAY is set.
+# flasher (C) 2006 Alex Graveley
+#
+# Usage: bench/xvfb-run.sh COMMAND [ARG...]
+#
+# The server's screen is 1920x1080x24, or $XVFB_SCREEN.
+#
+
+if [ -n "$DISPLAY" ]; then
+	exec "$@"
+fi
+
+LOG=`mktemp /tmp/xvfb-XXXXXX`
+DISPLAY=:77
+Xvfb $DISPLAY -screen 0 ${XVFB_SCREEN:-1920x1080x24} -nolisten tcp \
+	>$LOG 2>&1 &
+XVFB_PID=$!
+trap 'kill $XVFB_PID; rm -f $LOG' 0 INT TERM
+export DISPLAY
+
+sleep 1
+if ! kill -0 $XVFB_PID 2>/dev/null; then
+	echo "Xvfb failed to start:" >&2
+	cat $LOG >&2
+	exit 1
+fi
+
+"$@"
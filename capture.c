@@ -0,0 +1,458 @@
+/*==========================================================================*\
+ *
+ * capture.c - Frame capture to disk for flasher.
+ * flasher (C) 2006 Alex Graveley
+ *
+\*==========================================================================*/
+
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+#include <zlib.h>
+
+#include <X11/Xutil.h>
+#include <X11/extensions/XShm.h>
+
+#include "capture.h"
+#include "flasher.h"
+
+
+/*
+ * Frames are read back from a drawable into image, through MIT-SHM when
+ * the server is local so the pixels don't cross the socket, converted to
+ * packed RGB and written as one of:
+ *
+ *   PATH with a printf %d   numbered PNG files
+ *   PATH ending in .y4m     a YUV4MPEG2 stream, 4:2:0
+ *   anything else           raw 8-bit RGB frames; "-" for stdout
+ */
+typedef enum {
+	CAPTURE_RGB,
+	CAPTURE_Y4M,
+	CAPTURE_PNG,
+} CaptureFormat;
+
+struct _Capture
+{
+	Display *display;
+	int      width;
+	int      height;
+	CaptureFormat format;
+	char    *path;
+	FILE    *out;
+	int      frames;
+
+	XImage  *image;
+	Bool     use_shm;
+	XShmSegmentInfo shminfo;
+	int      red_shift;
+	int      green_shift;
+	int      blue_shift;
+
+	unsigned char *rgb; /* width * height * 3 */
+	unsigned char *buf; /* Y4M planes, or filtered PNG rows */
+	unsigned char *zbuf;
+	uLong          zbuf_size;
+};
+
+
+static Bool capture_shm_failed;
+
+
+static int
+CaptureShmErrorHandler(Display *display, XErrorEvent *error)
+{
+	capture_shm_failed = True;
+	return 0;
+}
+
+
+/*
+ * Set up a shared memory image for XShmGetImage.  Returns False if the
+ * server can't do it, which remote servers can't.
+ */
+static Bool
+CaptureShmInit(Capture *c, Visual *visual, int depth)
+{
+	if (!XShmQueryExtension(c->display)) {
+		return False;
+	}
+
+	c->image = XShmCreateImage(c->display, visual, depth, ZPixmap, NULL,
+				   &c->shminfo, c->width, c->height);
+	if (!c->image) {
+		return False;
+	}
+
+	c->shminfo.shmid = shmget(IPC_PRIVATE,
+				  c->image->bytes_per_line * c->height,
+				  IPC_CREAT | 0600);
+	if (c->shminfo.shmid < 0) {
+		XDestroyImage(c->image);
+		c->image = NULL;
+		return False;
+	}
+
+	c->shminfo.shmaddr = shmat(c->shminfo.shmid, NULL, 0);
+	if (c->shminfo.shmaddr == (void *) -1) {
+		shmctl(c->shminfo.shmid, IPC_RMID, NULL);
+		XDestroyImage(c->image);
+		c->image = NULL;
+		return False;
+	}
+	c->image->data = c->shminfo.shmaddr;
+	c->shminfo.readOnly = False;
+
+	/* XShmAttach fails asynchronously. */
+	capture_shm_failed = False;
+	XErrorHandler old_handler = XSetErrorHandler(CaptureShmErrorHandler);
+	XShmAttach(c->display, &c->shminfo);
+	XSync(c->display, False);
+	XSetErrorHandler(old_handler);
+
+	/* Freed once both we and the server have detached. */
+	shmctl(c->shminfo.shmid, IPC_RMID, NULL);
+
+	if (capture_shm_failed) {
+		shmdt(c->shminfo.shmaddr);
+		c->image->data = NULL;
+		XDestroyImage(c->image);
+		c->image = NULL;
+		return False;
+	}
+
+	return True;
+}
+
+
+/* 
+ * True if path is a printf format taking just the frame number: one %d,
+ * with an optional 0 or - flag and width, and otherwise only %%.
+ */
+static Bool
+CaptureValidPattern(const char *path)
+{
+	int conversions = 0;
+
+	for (const char *p = strchr(path, '%'); p; p = strchr(p, '%')) {
+		p++;
+		if (*p == '%') {
+			p++;
+			continue;
+		}
+		p += strspn(p, "0-");
+		p += strspn(p, "0123456789");
+		if (*p != 'd') {
+			return False;
+		}
+		conversions++;
+	}
+
+	return conversions == 1;
+}
+
+
+static int
+CaptureMaskShift(unsigned long mask)
+{
+	return mask ? ffsl(mask) - 1 : 0;
+}
+
+
+Capture *
+CaptureNew(Display *display,
+	   Visual *visual,
+	   int depth,
+	   int width,
+	   int height,
+	   int fps,
+	   const char *path,
+	   Bool use_shm)
+{
+	Capture *c = calloc(1, sizeof(Capture));
+	c->display = display;
+	c->width = width;
+	c->height = height;
+	c->path = strdup(path);
+
+	int len = strlen(path);
+	if (strchr(path, '%')) {
+		c->format = CAPTURE_PNG;
+	} else if (len > 4 && !strcasecmp(path + len - 4, ".y4m")) {
+		c->format = CAPTURE_Y4M;
+	} else {
+		c->format = CAPTURE_RGB;
+	}
+
+	if (c->format == CAPTURE_PNG && !CaptureValidPattern(path)) {
+		Warning("Invalid capture file '%s': it needs one %%d for "
+			"the frame number, and %%%% for a %%\n", path);
+		free(c->path);
+		free(c);
+		return NULL;
+	}
+
+	if (c->format != CAPTURE_PNG) {
+		c->out = strcmp(path, "-") ? fopen(path, "w") : stdout;
+		if (!c->out) {
+			Warning("Error opening '%s': %s\n", path,
+				strerror(errno));
+			free(c->path);
+			free(c);
+			return NULL;
+		}
+	}
+
+	c->use_shm = use_shm && CaptureShmInit(c, visual, depth);
+	if (!c->use_shm) {
+		c->image = XCreateImage(display, visual, depth, ZPixmap, 0,
+					NULL, width, height, 32, 0);
+		c->image->data = malloc(c->image->bytes_per_line * height);
+	}
+
+	c->red_shift = CaptureMaskShift(visual->red_mask);
+	c->green_shift = CaptureMaskShift(visual->green_mask);
+	c->blue_shift = CaptureMaskShift(visual->blue_mask);
+
+	c->rgb = malloc(width * height * 3);
+
+	switch (c->format) {
+	case CAPTURE_Y4M:
+		c->buf = malloc(width * height +
+				2 * ((width + 1) / 2) * ((height + 1) / 2));
+		fprintf(c->out, "YUV4MPEG2 W%d H%d F%d:1 Ip A1:1 C420jpeg\n",
+			width, height, fps);
+		break;
+	case CAPTURE_PNG:
+		c->buf = malloc((width * 3 + 1) * height);
+		c->zbuf_size = compressBound((width * 3 + 1) * height);
+		c->zbuf = malloc(c->zbuf_size);
+		break;
+	default:
+		break;
+	}
+
+	Log("Capturing %dx%d to %s%s\n", width, height, path,
+	    c->use_shm ? " using MIT-SHM" : "");
+
+	return c;
+}
+
+
+/* Read drawable into image, and convert it to c->rgb. */
+static Bool
+CaptureReadBack(Capture *c, Drawable drawable)
+{
+	if (c->use_shm) {
+		if (!XShmGetImage(c->display, drawable, c->image, 0, 0,
+				  AllPlanes)) {
+			return False;
+		}
+	} else {
+		if (!XGetSubImage(c->display, drawable, 0, 0,
+				  c->width, c->height, AllPlanes, ZPixmap,
+				  c->image, 0, 0)) {
+			return False;
+		}
+	}
+
+	unsigned char *out = c->rgb;
+	for (int y = 0; y < c->height; y++) {
+		if (c->image->bits_per_pixel == 32) {
+			uint32 *row = (uint32 *)
+				(c->image->data + y * c->image->bytes_per_line);
+			for (int x = 0; x < c->width; x++) {
+				*out++ = row[x] >> c->red_shift;
+				*out++ = row[x] >> c->green_shift;
+				*out++ = row[x] >> c->blue_shift;
+			}
+		} else {
+			for (int x = 0; x < c->width; x++) {
+				unsigned long pixel = XGetPixel(c->image, x, y);
+				*out++ = pixel >> c->red_shift;
+				*out++ = pixel >> c->green_shift;
+				*out++ = pixel >> c->blue_shift;
+			}
+		}
+	}
+
+	return True;
+}
+
+
+/* Convert c->rgb to full range BT.601 4:2:0 planes and write them. */
+static Bool
+CaptureWriteY4M(Capture *c)
+{
+	int cw = (c->width + 1) / 2;
+	int ch = (c->height + 1) / 2;
+	unsigned char *py = c->buf;
+	unsigned char *pu = py + c->width * c->height;
+	unsigned char *pv = pu + cw * ch;
+
+	for (int y = 0; y < c->height; y++) {
+		unsigned char *rgb = c->rgb + y * c->width * 3;
+		for (int x = 0; x < c->width; x++, rgb += 3) {
+			*py++ = (77 * rgb[0] + 150 * rgb[1] + 29 * rgb[2]) >> 8;
+		}
+	}
+
+	for (int y = 0; y < ch; y++) {
+		int y1 = MIN(y * 2 + 1, c->height - 1);
+		for (int x = 0; x < cw; x++) {
+			int x1 = MIN(x * 2 + 1, c->width - 1);
+			unsigned char *p[4] = {
+				c->rgb + ((y * 2) * c->width + x * 2) * 3,
+				c->rgb + ((y * 2) * c->width + x1) * 3,
+				c->rgb + (y1 * c->width + x * 2) * 3,
+				c->rgb + (y1 * c->width + x1) * 3,
+			};
+			int r = (p[0][0] + p[1][0] + p[2][0] + p[3][0]) / 4;
+			int g = (p[0][1] + p[1][1] + p[2][1] + p[3][1]) / 4;
+			int b = (p[0][2] + p[1][2] + p[2][2] + p[3][2]) / 4;
+
+			*pu++ = ((-43 * r - 85 * g + 128 * b) >> 8) + 128;
+			*pv++ = ((128 * r - 107 * g - 21 * b) >> 8) + 128;
+		}
+	}
+
+	fputs("FRAME\n", c->out);
+	return fwrite(c->buf, 1, pv - c->buf, c->out) == pv - c->buf;
+}
+
+
+static void
+CapturePNGChunk(FILE *f, const char *type, unsigned char *data, uLong len)
+{
+	unsigned char header[8] = {
+		len >> 24, len >> 16, len >> 8, len,
+		type[0], type[1], type[2], type[3]
+	};
+	uLong crc = crc32(0, header + 4, 4);
+	if (len) {
+		/* crc32() restarts when passed NULL. */
+		crc = crc32(crc, data, len);
+	}
+	unsigned char trailer[4] = { crc >> 24, crc >> 16, crc >> 8, crc };
+
+	fwrite(header, 1, 8, f);
+	fwrite(data, 1, len, f);
+	fwrite(trailer, 1, 4, f);
+}
+
+
+/* Write c->rgb as the next numbered PNG, with the Sub filter. */
+static Bool
+CaptureWritePNG(Capture *c)
+{
+	char path[4096];
+	snprintf(path, sizeof(path), c->path, c->frames);
+
+	FILE *f = fopen(path, "w");
+	if (!f) {
+		Warning("Error writing '%s': %s\n", path, strerror(errno));
+		return False;
+	}
+
+	int stride = c->width * 3;
+	unsigned char *row = c->buf;
+	for (int y = 0; y < c->height; y++) {
+		unsigned char *rgb = c->rgb + y * stride;
+		*row++ = 1; /* Sub */
+		memcpy(row, rgb, 3);
+		for (int i = 3; i < stride; i++) {
+			row[i] = rgb[i] - rgb[i - 3];
+		}
+		row += stride;
+	}
+
+	uLong zlen = c->zbuf_size;
+	compress2(c->zbuf, &zlen, c->buf, (stride + 1) * c->height,
+		  Z_BEST_SPEED);
+
+	unsigned char ihdr[13] = {
+		c->width >> 24, c->width >> 16, c->width >> 8, c->width,
+		c->height >> 24, c->height >> 16, c->height >> 8, c->height,
+		8, 2, 0, 0, 0 /* 8-bit RGB, not interlaced */
+	};
+
+	fwrite("\211PNG\r\n\032\n", 1, 8, f);
+	CapturePNGChunk(f, "IHDR", ihdr, sizeof(ihdr));
+	CapturePNGChunk(f, "IDAT", c->zbuf, zlen);
+	CapturePNGChunk(f, "IEND", NULL, 0);
+
+	if (fclose(f) != 0) {
+		Warning("Error writing '%s': %s\n", path, strerror(errno));
+		return False;
+	}
+	return True;
+}
+
+
+/* Read back the contents of drawable and write them as the next frame. */
+Bool
+CaptureFrame(Capture *c, Drawable drawable)
+{
+	if (!CaptureReadBack(c, drawable)) {
+		Warning("Error reading back frame %d\n", c->frames);
+		return False;
+	}
+
+	Bool ok;
+	switch (c->format) {
+	case CAPTURE_Y4M:
+		ok = CaptureWriteY4M(c);
+		break;
+	case CAPTURE_PNG:
+		ok = CaptureWritePNG(c);
+		break;
+	default:
+		ok = fwrite(c->rgb, 1, c->width * c->height * 3, c->out) ==
+			c->width * c->height * 3;
+		break;
+	}
+	if (!ok) {
+		Warning("Error writing frame %d to '%s'\n", c->frames, c->path);
+		return False;
+	}
+
+	c->frames++;
+	return True;
+}
+
+
+int
+CaptureFrameCount(Capture *c)
+{
+	return c->frames;
+}
+
+
+void
+CaptureFree(Capture *c)
+{
+	Log("Captured %d frames to %s\n", c->frames, c->path);
+
+	if (c->out && c->out != stdout) {
+		fclose(c->out);
+	} else if (c->out) {
+		fflush(c->out);
+	}
+
+	if (c->use_shm) {
+		XShmDetach(c->display, &c->shminfo);
+		shmdt(c->shminfo.shmaddr);
+		c->image->data = NULL;
+	}
+	XDestroyImage(c->image);
+
+	free(c->rgb);
+	free(c->buf);
+	free(c->zbuf);
+	free(c->path);
+	free(c);
+}
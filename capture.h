@@ -0,0 +1,36 @@
+/*==========================================================================*\
+ *
+ * capture.h - Frame capture to disk for flasher.
+ * flasher (C) 2006 Alex Graveley
+ *
+\*==========================================================================*/
+
+#ifndef __CAPTURE_H__
+#define __CAPTURE_H__
+
+
+#include <X11/Xlib.h>
+
+#include "flasher.h"
+
+
+typedef struct _Capture Capture;
+
+
+Capture *CaptureNew(Display *display,
+		    Visual *visual,
+		    int depth,
+		    int width,
+		    int height,
+		    int fps,
+		    const char *path,
+		    Bool use_shm);
+
+Bool CaptureFrame(Capture *c, Drawable drawable);
+
+int CaptureFrameCount(Capture *c);
+
+void CaptureFree(Capture *c);
+
+
+#endif /* __CAPTURE_H__ */
@@ -0,0 +1,969 @@
+/*==========================================================================*\
+ *
+ * curlnet.c - libcurl transfers, on a network thread or in the main loop.
+ * flasher (C) 2006 Alex Graveley
+ *
+\*==========================================================================*/
+
+
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+#include "curlnet.h"
+#include "flasher.h"
+#include "mainloop.h"
+#include "stats.h"
+
+
+/*
+ * Transfers run on the network side: a thread of its own that sleeps in
+ * curl_multi_poll, or without one the main loop, watching libcurl's
+ * sockets.  Either way, the network side owns an added transfer's easy
+ * handle until it reports the transfer done, and its callbacks do no
+ * more than copy the body into the transfer's ring and keep the
+ * headers.  Calling the plugin is left to the main thread, which is
+ * woken through an eventfd in the main loop and reads the events and
+ * the body from there.  Commands to add, remove and resume transfers go
+ * the other way.  Both directions are lock-free queues of nodes built
+ * into the transfers, so nothing is allocated per chunk or event.
+ */
+
+
+/*
+ * Body buffered per transfer before it is paused.  A power of two, and
+ * more than CURL_MAX_WRITE_SIZE, the most libcurl hands over at once.
+ */
+#define CURLNET_RING_SIZE (256 * 1024)
+
+/* How many freed transfers to keep for reuse */
+#define CURLNET_POOL_SIZE 16
+
+
+typedef enum
+{
+	CURLNET_ADD,
+	CURLNET_REMOVE,
+	CURLNET_RESUME,
+	CURLNET_REMOVED, /* Event: CURLNET_REMOVE is done, free it */
+} CURLNetCommandKind;
+
+
+/* A link in a CURLNetQueue, built into the transfer it is about */
+typedef struct _CURLNetNode
+{
+	struct _CURLNetNode *_Atomic next;
+	CURLTransfer *t;
+	int kind; /* CURLNetEvent or CURLNetCommandKind */
+} CURLNetNode;
+
+
+/* Body a transfer that can't be paused had no room in its ring for */
+typedef struct _CURLNetChunk
+{
+	struct _CURLNetChunk *next;
+	int len;
+	char data[];
+} CURLNetChunk;
+
+
+/*
+ * Intrusive queue for any number of producers and one consumer.  A push
+ * never waits.  A pop may find nothing while a push is half done; the
+ * producer wakes the consumer again once it is through.
+ */
+typedef struct _CURLNetQueue
+{
+	CURLNetNode *_Atomic head; /* Pushed last */
+	CURLNetNode *tail;         /* Consumer's */
+	CURLNetNode stub;
+} CURLNetQueue;
+
+
+struct _CURLTransfer
+{
+	CURL *req;
+	void *data;
+	Bool  running; /* Main thread's: added, and not yet reported done */
+
+	/* Network side's until the first CURLNET_DATA or CURLNET_DONE */
+	CURLNetResponse response;
+	Bool responded;
+
+	/* Body: the network side advances head, the main thread tail. */
+	char *ring;
+	_Atomic unsigned long head;
+	_Atomic unsigned long tail;
+	_Atomic int paused;       /* Returned CURL_WRITEFUNC_PAUSE */
+	_Atomic int data_pending; /* ev_data is queued */
+
+	/*
+	 * libcurl can't pause file:// transfers, so once their ring is full
+	 * the rest waits here, oldest first, until the ring has been
+	 * emptied.  The network side sets no_pause at the first byte.
+	 */
+	Bool no_pause;
+	pthread_mutex_t spill_lock;
+	CURLNetChunk *spill;
+	CURLNetChunk *spill_tail;
+	int spill_start; /* Consumed of the first */
+	long spill_len;  /* Not consumed, in all of them */
+
+	CURLNetNode ev_data;
+	CURLNetNode ev_done;
+	CURLNetNode ev_removed;
+	CURLNetNode cmd_add;
+	CURLNetNode cmd_remove;
+	CURLNetNode cmd_resume;
+};
+
+
+static CURLM *curl_multi = NULL;
+static CURLSH *curl_share = NULL;
+static pthread_mutex_t curl_share_locks[CURL_LOCK_DATA_LAST];
+static CURLNetFunc curl_func = NULL;
+
+/* Network thread, if any */
+static Bool curl_threaded = False;
+static pthread_t curl_thread;
+static atomic_int curl_quit;
+static CURLNetQueue curl_commands;
+
+/* Main loop driven network side */
+static MainLoopTimer *curl_timer = NULL;
+static int curl_running_handles = 0;
+
+/* Events for the main thread, and the eventfd waking it */
+static CURLNetQueue curl_events;
+static int curl_event_fd = -1;
+static MainLoopWatch *curl_event_watch = NULL;
+static atomic_int curl_wake_pending;
+
+static CURLTransfer *curl_pool[CURLNET_POOL_SIZE];
+static int curl_pool_len = 0;
+
+
+static struct {
+	long wakeups;
+	long events;
+	atomic_long pauses;
+	atomic_long spilled;
+	long resumes;
+} curl_net_stats;
+
+
+static void
+CURLNetQueueInit(CURLNetQueue *q)
+{
+	atomic_init(&q->stub.next, NULL);
+	atomic_init(&q->head, &q->stub);
+	q->tail = &q->stub;
+}
+
+
+static void
+CURLNetQueuePush(CURLNetQueue *q, CURLNetNode *n)
+{
+	atomic_store_explicit(&n->next, NULL, memory_order_relaxed);
+	CURLNetNode *prev = atomic_exchange(&q->head, n);
+	atomic_store_explicit(&prev->next, n, memory_order_release);
+}
+
+
+static CURLNetNode *
+CURLNetQueuePop(CURLNetQueue *q)
+{
+	CURLNetNode *tail = q->tail;
+	CURLNetNode *next = atomic_load_explicit(&tail->next,
+						 memory_order_acquire);
+
+	if (tail == &q->stub) {
+		if (!next) {
+			return NULL;
+		}
+		q->tail = next;
+		tail = next;
+		next = atomic_load_explicit(&next->next, memory_order_acquire);
+	}
+	if (next) {
+		q->tail = next;
+		return tail;
+	}
+
+	if (tail != atomic_load(&q->head)) {
+		/* Push in progress */
+		return NULL;
+	}
+	CURLNetQueuePush(q, &q->stub);
+
+	next = atomic_load_explicit(&tail->next, memory_order_acquire);
+	if (next) {
+		q->tail = next;
+		return tail;
+	}
+	return NULL;
+}
+
+
+/* Network side: report n to the main thread. */
+static void
+CURLNetPost(CURLNetNode *n)
+{
+	CURLNetQueuePush(&curl_events, n);
+
+	if (!atomic_exchange(&curl_wake_pending, 1)) {
+		uint64_t one = 1;
+		if (write(curl_event_fd, &one, sizeof(one)) < 0) {
+			Warning("Error waking main thread: %s\n",
+				strerror(errno));
+		}
+	}
+}
+
+
+/* Network side: carry out a command from the main thread. */
+static void
+CURLNetRunCommand(CURLNetNode *n)
+{
+	CURLTransfer *t = n->t;
+
+	switch (n->kind) {
+	case CURLNET_ADD:
+		curl_multi_add_handle(curl_multi, t->req);
+		break;
+	case CURLNET_REMOVE:
+		/* Done already, if it finished first */
+		curl_multi_remove_handle(curl_multi, t->req);
+		CURLNetPost(&t->ev_removed);
+		break;
+	case CURLNET_RESUME:
+		/* May call CURLNetWriteCb before returning. */
+		curl_easy_pause(t->req, CURLPAUSE_CONT);
+		break;
+	}
+}
+
+
+/* Main thread: have the network side carry out n. */
+static void
+CURLNetCommand(CURLNetNode *n)
+{
+	if (curl_threaded) {
+		CURLNetQueuePush(&curl_commands, n);
+		curl_multi_wakeup(curl_multi);
+	} else {
+		CURLNetRunCommand(n);
+	}
+}
+
+
+/*
+ * Network side: note the response once per run, at the first body byte
+ * or the end of a transfer without one.
+ */
+static void
+CURLNetRespond(CURLTransfer *t)
+{
+	if (t->responded) {
+		return;
+	}
+	t->responded = True;
+
+	CURLNetResponse *r = &t->response;
+	char *content_type = NULL;
+
+	r->first_byte_at = StatsNow();
+	curl_easy_getinfo(t->req, CURLINFO_RESPONSE_CODE, &r->code);
+	curl_easy_getinfo(t->req, CURLINFO_CONTENT_TYPE, &content_type);
+	curl_easy_getinfo(t->req, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T,
+			  &r->length);
+	curl_easy_getinfo(t->req, CURLINFO_FILETIME, &r->filetime);
+	r->content_type = content_type ? strdup(content_type) : NULL;
+
+	char *scheme = NULL;
+	curl_easy_getinfo(t->req, CURLINFO_SCHEME, &scheme);
+	t->no_pause = scheme && !strcasecmp(scheme, "file");
+}
+
+
+/*
+ * Network side: keep a chunk of a transfer that can't be paused aside,
+ * if its ring has no room for it or something is kept aside already.
+ * Returns False if it should go in the ring.
+ */
+static Bool
+CURLNetSpill(CURLTransfer *t, const char *buffer, int len)
+{
+	unsigned long head = atomic_load_explicit(&t->head,
+						  memory_order_relaxed);
+	Bool spill = False;
+
+	pthread_mutex_lock(&t->spill_lock);
+	unsigned long tail = atomic_load(&t->tail);
+	if (t->spill || len > CURLNET_RING_SIZE - (head - tail)) {
+		CURLNetChunk *c = malloc(sizeof(CURLNetChunk) + len);
+		c->next = NULL;
+		c->len = len;
+		memcpy(c->data, buffer, len);
+
+		if (t->spill_tail) {
+			t->spill_tail->next = c;
+		} else {
+			t->spill = c;
+		}
+		t->spill_tail = c;
+		t->spill_len += len;
+		spill = True;
+	}
+	pthread_mutex_unlock(&t->spill_lock);
+
+	if (spill) {
+		atomic_fetch_add_explicit(&curl_net_stats.spilled, len,
+					  memory_order_relaxed);
+	}
+	return spill;
+}
+
+
+static void
+CURLNetSpillFree(CURLTransfer *t)
+{
+	while (t->spill) {
+		CURLNetChunk *next = t->spill->next;
+		free(t->spill);
+		t->spill = next;
+	}
+	t->spill_tail = NULL;
+	t->spill_start = 0;
+	t->spill_len = 0;
+}
+
+
+/*
+ * CURLOPT_WRITEFUNCTION: Copy the chunk into the ring for the main
+ * thread, or pause the transfer until it has taken enough out.
+ */
+static size_t
+CURLNetWriteCb(char *buffer, size_t size, size_t nitems, void *data)
+{
+	CURLTransfer *t = (CURLTransfer *) data;
+	unsigned long len = size * nitems;
+
+	assert(len <= CURLNET_RING_SIZE);
+	CURLNetRespond(t);
+
+	if (t->no_pause && CURLNetSpill(t, buffer, len)) {
+		if (!atomic_exchange(&t->data_pending, 1)) {
+			CURLNetPost(&t->ev_data);
+		}
+		return len;
+	}
+
+	unsigned long head = atomic_load_explicit(&t->head,
+						  memory_order_relaxed);
+	unsigned long tail = atomic_load(&t->tail);
+	if (len > CURLNET_RING_SIZE - (head - tail)) {
+		/* CURLNetConsume resumes us once it sees this... */
+		atomic_store(&t->paused, 1);
+
+		/* ...unless it has already made room. */
+		int paused = 1;
+		tail = atomic_load(&t->tail);
+		if (len > CURLNET_RING_SIZE - (head - tail) ||
+		    !atomic_compare_exchange_strong(&t->paused, &paused, 0)) {
+			atomic_fetch_add_explicit(&curl_net_stats.pauses, 1,
+						  memory_order_relaxed);
+			return CURL_WRITEFUNC_PAUSE;
+		}
+	}
+
+	unsigned long start = head & (CURLNET_RING_SIZE - 1);
+	unsigned long first = MIN(len, CURLNET_RING_SIZE - start);
+	memcpy(&t->ring[start], buffer, first);
+	memcpy(t->ring, buffer + first, len - first);
+	atomic_store_explicit(&t->head, head + len, memory_order_release);
+
+	if (!atomic_exchange(&t->data_pending, 1)) {
+		CURLNetPost(&t->ev_data);
+	}
+
+	return len;
+}
+
+
+/*
+ * CURLOPT_HEADERFUNCTION: Keep the header lines for the main thread.
+ * Trailers arrive after it may be reading them, and are dropped.
+ */
+static size_t
+CURLNetHeaderCb(char *buffer, size_t size, size_t nitems, void *data)
+{
+	CURLTransfer *t = (CURLTransfer *) data;
+	CURLNetResponse *r = &t->response;
+	int len = size * nitems;
+
+	if (t->responded) {
+		return len;
+	}
+
+	r->headers = realloc(r->headers, r->headers_len + len + 1);
+	memcpy(r->headers + r->headers_len, buffer, len);
+	r->headers_len += len;
+	r->headers[r->headers_len] = '\0';
+
+	return len;
+}
+
+
+/* Network side: report every transfer libcurl has finished. */
+static void
+CURLNetCheckDone(void)
+{
+	while (True) {
+		int msg_cnt = 0;
+		CURLMsg *msg = curl_multi_info_read(curl_multi, &msg_cnt);
+		if (!msg) {
+			break;
+		} else if (msg->msg != CURLMSG_DONE) {
+			continue;
+		}
+
+		CURLTransfer *t = NULL;
+		curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, &t);
+		assert(t);
+
+		CURLNetRespond(t);
+		t->response.result = msg->data.result;
+		curl_multi_remove_handle(curl_multi, t->req);
+
+		CURLNetPost(&t->ev_done);
+	}
+}
+
+
+/* The network thread */
+static void *
+CURLNetThread(void *data)
+{
+	while (!atomic_load(&curl_quit)) {
+		CURLNetNode *n;
+		while ((n = CURLNetQueuePop(&curl_commands))) {
+			CURLNetRunCommand(n);
+		}
+
+		curl_multi_perform(curl_multi, &curl_running_handles);
+		CURLNetCheckDone();
+
+		/* Until a socket is ready, a timeout, or curl_multi_wakeup */
+		curl_multi_poll(curl_multi, NULL, 0, 1000, NULL);
+	}
+
+	return NULL;
+}
+
+
+/* Watch callback: a socket libcurl asked us to watch is ready. */
+static void
+CURLNetSocketReady(int fd, int events, void *data)
+{
+	int ev_bitmask = 0;
+	if (events & MAINLOOP_READ) {
+		ev_bitmask |= CURL_CSELECT_IN;
+	}
+	if (events & MAINLOOP_WRITE) {
+		ev_bitmask |= CURL_CSELECT_OUT;
+	}
+
+	curl_multi_socket_action(curl_multi, fd, ev_bitmask,
+				 &curl_running_handles);
+	CURLNetCheckDone();
+}
+
+
+/* Timer callback: libcurl's requested timeout has expired. */
+static void
+CURLNetTimeout(void *data)
+{
+	curl_timer = NULL;
+
+	curl_multi_socket_action(curl_multi, CURL_SOCKET_TIMEOUT, 0,
+				 &curl_running_handles);
+	CURLNetCheckDone();
+}
+
+
+/*
+ * CURLMOPT_SOCKETFUNCTION: Keep one main loop watch per socket, for the
+ * directions libcurl wants, so only sockets that are actually ready get
+ * serviced.
+ */
+static int
+CURLNetSocketCb(CURL *easy,
+		curl_socket_t fd,
+		int action,
+		void *userp,
+		void *socketp)
+{
+	MainLoopWatch *watch = (MainLoopWatch *) socketp;
+
+	Debug("CURLNetSocketCb fd=%d, action=%d\n", fd, action);
+
+	if (action == CURL_POLL_REMOVE) {
+		if (watch) {
+			MainLoopRemoveWatch(watch);
+			curl_multi_assign(curl_multi, fd, NULL);
+		}
+		return 0;
+	}
+
+	int events = 0;
+	if (action == CURL_POLL_IN || action == CURL_POLL_INOUT) {
+		events |= MAINLOOP_READ;
+	}
+	if (action == CURL_POLL_OUT || action == CURL_POLL_INOUT) {
+		events |= MAINLOOP_WRITE;
+	}
+
+	if (watch) {
+		MainLoopModifyWatch(watch, events);
+	} else {
+		watch = MainLoopAddWatch(fd, events, CURLNetSocketReady, NULL);
+		curl_multi_assign(curl_multi, fd, watch);
+	}
+
+	return 0;
+}
+
+
+/*
+ * CURLMOPT_TIMERFUNCTION: (Re)arm the single timer libcurl uses to drive
+ * timeouts and newly added handles.
+ */
+static int
+CURLNetTimerCb(CURLM *multi, long timeout_ms, void *userp)
+{
+	Debug("CURLNetTimerCb timeout_ms=%ld\n", timeout_ms);
+
+	if (curl_timer) {
+		MainLoopRemoveTimer(curl_timer);
+		curl_timer = NULL;
+	}
+	if (timeout_ms >= 0) {
+		curl_timer = MainLoopAddTimer(timeout_ms, CURLNetTimeout, NULL);
+	}
+
+	return 0;
+}
+
+
+/*
+ * CURLSHOPT_LOCKFUNC: the share is used from both threads.  libcurl
+ * takes one kind of data while holding another, so each has its own.
+ */
+static void
+CURLNetShareLock(CURL *handle, curl_lock_data data,
+		 curl_lock_access access, void *userp)
+{
+	pthread_mutex_lock(&curl_share_locks[data]);
+}
+
+
+static void
+CURLNetShareUnlock(CURL *handle, curl_lock_data data, void *userp)
+{
+	pthread_mutex_unlock(&curl_share_locks[data]);
+}
+
+
+static void
+CURLNetNodeInit(CURLNetNode *n, CURLTransfer *t, int kind)
+{
+	n->t = t;
+	n->kind = kind;
+}
+
+
+/*
+ * Get a transfer with an easy handle ready for its options, reusing a
+ * pooled one if possible.  data is for the caller.
+ */
+CURLTransfer *
+CURLNetTransferNew(void *data)
+{
+	CURLTransfer *t;
+
+	if (curl_pool_len > 0) {
+		t = curl_pool[--curl_pool_len];
+	} else {
+		t = calloc(1, sizeof(CURLTransfer));
+		t->req = curl_easy_init();
+		t->ring = malloc(CURLNET_RING_SIZE);
+		pthread_mutex_init(&t->spill_lock, NULL);
+
+		CURLNetNodeInit(&t->ev_data, t, CURLNET_DATA);
+		CURLNetNodeInit(&t->ev_done, t, CURLNET_DONE);
+		CURLNetNodeInit(&t->ev_removed, t, CURLNET_REMOVED);
+		CURLNetNodeInit(&t->cmd_add, t, CURLNET_ADD);
+		CURLNetNodeInit(&t->cmd_remove, t, CURLNET_REMOVE);
+		CURLNetNodeInit(&t->cmd_resume, t, CURLNET_RESUME);
+	}
+
+	t->data = data;
+	curl_easy_setopt(t->req, CURLOPT_SHARE, curl_share);
+	curl_easy_setopt(t->req, CURLOPT_PRIVATE, t);
+	curl_easy_setopt(t->req, CURLOPT_WRITEFUNCTION, CURLNetWriteCb);
+	curl_easy_setopt(t->req, CURLOPT_WRITEDATA, t);
+	curl_easy_setopt(t->req, CURLOPT_HEADERFUNCTION, CURLNetHeaderCb);
+	curl_easy_setopt(t->req, CURLOPT_HEADERDATA, t);
+
+	return t;
+}
+
+
+static void
+CURLNetResponseFree(CURLNetResponse *r)
+{
+	free(r->content_type);
+	free(r->headers);
+	memset(r, 0, sizeof(CURLNetResponse));
+}
+
+
+/* Free a transfer that is not running, keeping it for reuse if we can. */
+void
+CURLNetTransferFree(CURLTransfer *t)
+{
+	assert(!t->running);
+
+	CURLNetResponseFree(&t->response);
+	CURLNetSpillFree(t);
+	t->responded = False;
+	t->data = NULL;
+
+	if (curl_pool_len == CURLNET_POOL_SIZE) {
+		curl_easy_cleanup(t->req);
+		pthread_mutex_destroy(&t->spill_lock);
+		free(t->ring);
+		free(t);
+		return;
+	}
+
+	curl_easy_reset(t->req);
+	curl_pool[curl_pool_len++] = t;
+}
+
+
+/* The easy handle, for options; only while the transfer is not running */
+CURL *
+CURLNetHandle(CURLTransfer *t)
+{
+	return t->req;
+}
+
+
+void *
+CURLNetGetData(CURLTransfer *t)
+{
+	return t->data;
+}
+
+
+void
+CURLNetSetData(CURLTransfer *t, void *data)
+{
+	t->data = data;
+}
+
+
+const CURLNetResponse *
+CURLNetGetResponse(CURLTransfer *t)
+{
+	return &t->response;
+}
+
+
+/* True from CURLNetAdd until CURLNET_DONE */
+Bool
+CURLNetRunning(CURLTransfer *t)
+{
+	return t->running;
+}
+
+
+/* Start t, or start it again once it is done. */
+void
+CURLNetAdd(CURLTransfer *t)
+{
+	assert(!t->running);
+
+	CURLNetResponseFree(&t->response);
+	t->response.length = -1;
+	t->response.filetime = -1;
+	t->responded = False;
+	t->no_pause = False;
+	CURLNetSpillFree(t);
+
+	atomic_store(&t->head, 0);
+	atomic_store(&t->tail, 0);
+	atomic_store(&t->paused, 0);
+	atomic_store(&t->data_pending, 0);
+
+	t->running = True;
+	CURLNetCommand(&t->cmd_add);
+}
+
+
+/*
+ * Stop t and forget about it: no more events are reported for it, and
+ * it is freed as soon as the network side lets go.
+ */
+void
+CURLNetRemove(CURLTransfer *t)
+{
+	t->data = NULL;
+
+	if (t->running) {
+		CURLNetCommand(&t->cmd_remove);
+	} else {
+		CURLNetTransferFree(t);
+	}
+}
+
+
+/*
+ * The next part of the body received and not yet consumed, as much of
+ * it as is contiguous in the ring, or once that is empty in the first
+ * chunk kept aside.  Returns its length.
+ */
+int
+CURLNetPeek(CURLTransfer *t, char **buffer)
+{
+	unsigned long head = atomic_load_explicit(&t->head,
+						  memory_order_acquire);
+	unsigned long tail = atomic_load_explicit(&t->tail,
+						  memory_order_relaxed);
+	unsigned long start = tail & (CURLNET_RING_SIZE - 1);
+	int len = 0;
+
+	if (head != tail || !t->no_pause) {
+		*buffer = &t->ring[start];
+		return MIN(head - tail, CURLNET_RING_SIZE - start);
+	}
+
+	/* Nothing goes in the ring again until this is empty. */
+	pthread_mutex_lock(&t->spill_lock);
+	if (t->spill) {
+		*buffer = t->spill->data + t->spill_start;
+		len = t->spill->len - t->spill_start;
+	}
+	pthread_mutex_unlock(&t->spill_lock);
+
+	return len;
+}
+
+
+/* How much of the body has been received and not yet consumed */
+long
+CURLNetPending(CURLTransfer *t)
+{
+	long len = atomic_load(&t->head) - atomic_load(&t->tail);
+
+	if (t->no_pause) {
+		pthread_mutex_lock(&t->spill_lock);
+		len += t->spill_len;
+		pthread_mutex_unlock(&t->spill_lock);
+	}
+
+	return len;
+}
+
+
+/*
+ * Drop len bytes from the front of the body, and resume the transfer if
+ * it was waiting for room.
+ */
+void
+CURLNetConsume(CURLTransfer *t, int len)
+{
+	unsigned long tail = atomic_load_explicit(&t->tail,
+						  memory_order_relaxed);
+
+	if (atomic_load(&t->head) == tail && t->no_pause) {
+		/* From the first chunk kept aside, as peeked */
+		pthread_mutex_lock(&t->spill_lock);
+		CURLNetChunk *c = t->spill;
+		t->spill_start += len;
+		t->spill_len -= len;
+		if (t->spill_start == c->len) {
+			t->spill = c->next;
+			if (!t->spill) {
+				t->spill_tail = NULL;
+			}
+			t->spill_start = 0;
+			free(c);
+		}
+		pthread_mutex_unlock(&t->spill_lock);
+		return;
+	}
+
+	atomic_store(&t->tail, tail + len);
+
+	/* Half full at most, so it does not stop again right away */
+	unsigned long head = atomic_load(&t->head);
+	int paused = 1;
+	if (atomic_load(&t->paused) &&
+	    head - (tail + len) <= CURLNET_RING_SIZE / 2 &&
+	    atomic_compare_exchange_strong(&t->paused, &paused, 0)) {
+		curl_net_stats.resumes++;
+		CURLNetCommand(&t->cmd_resume);
+	}
+}
+
+
+/* Watch callback: the network side has news. */
+static void
+CURLNetDispatch(int fd, int events, void *data)
+{
+	uint64_t count;
+	if (read(curl_event_fd, &count, sizeof(count)) < 0 &&
+	    errno != EAGAIN) {
+		Warning("Error reading network events: %s\n", strerror(errno));
+	}
+	atomic_store(&curl_wake_pending, 0);
+	curl_net_stats.wakeups++;
+
+	CURLNetNode *n;
+	while ((n = CURLNetQueuePop(&curl_events))) {
+		CURLTransfer *t = n->t;
+		curl_net_stats.events++;
+
+		switch (n->kind) {
+		case CURLNET_DATA:
+			/* Any more data from here on is news again. */
+			atomic_store(&t->data_pending, 0);
+			break;
+		case CURLNET_DONE:
+			t->running = False;
+			break;
+		case CURLNET_REMOVED:
+			t->running = False;
+			CURLNetTransferFree(t);
+			continue;
+		}
+
+		if (t->data) {
+			curl_func(t, n->kind);
+		}
+	}
+}
+
+
+/* StatsDumpFunc for the "curlnet" section. */
+static void
+CURLNetDumpStats(FILE *f)
+{
+	fprintf(f, "{\n    \"thread\": %s, \"wakeups\": %ld, \"events\": %ld, "
+		"\"pauses\": %ld, \"resumes\": %ld, \"spilled\": %ld\n  }",
+		curl_threaded ? "true" : "false", curl_net_stats.wakeups,
+		curl_net_stats.events, atomic_load(&curl_net_stats.pauses),
+		curl_net_stats.resumes, atomic_load(&curl_net_stats.spilled));
+}
+
+
+/*
+ * Start the network side, on a thread of its own if thread is set.
+ * func is called on the main thread with the events of every transfer
+ * that has not been removed.
+ */
+void
+CURLNetInit(Bool thread,
+	    Bool multiplex,
+	    long max_host_connections,
+	    CURLNetFunc func)
+{
+	curl_func = func;
+	curl_threaded = thread;
+
+	curl_global_init(CURL_GLOBAL_DEFAULT);
+	curl_multi = curl_multi_init();
+	assert(curl_multi);
+
+	curl_multi_setopt(curl_multi, CURLMOPT_PIPELINING,
+			  multiplex ? CURLPIPE_MULTIPLEX : CURLPIPE_NOTHING);
+	curl_multi_setopt(curl_multi, CURLMOPT_MAX_HOST_CONNECTIONS,
+			  max_host_connections);
+	if (!thread) {
+		curl_multi_setopt(curl_multi, CURLMOPT_SOCKETFUNCTION,
+				  CURLNetSocketCb);
+		curl_multi_setopt(curl_multi, CURLMOPT_TIMERFUNCTION,
+				  CURLNetTimerCb);
+	}
+
+	/* Share DNS, TLS sessions and connections between all handles. */
+	for (int i = 0; i < CURL_LOCK_DATA_LAST; i++) {
+		pthread_mutex_init(&curl_share_locks[i], NULL);
+	}
+	curl_share = curl_share_init();
+	curl_share_setopt(curl_share, CURLSHOPT_LOCKFUNC, CURLNetShareLock);
+	curl_share_setopt(curl_share, CURLSHOPT_UNLOCKFUNC,
+			  CURLNetShareUnlock);
+	curl_share_setopt(curl_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+	curl_share_setopt(curl_share, CURLSHOPT_SHARE,
+			  CURL_LOCK_DATA_SSL_SESSION);
+	curl_share_setopt(curl_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+
+	CURLNetQueueInit(&curl_events);
+	CURLNetQueueInit(&curl_commands);
+
+	curl_event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (curl_event_fd < 0) {
+		Error("Unable to create eventfd: %s\n", strerror(errno));
+	}
+	curl_event_watch = MainLoopAddWatch(curl_event_fd, MAINLOOP_READ,
+					    CURLNetDispatch, NULL);
+
+	if (thread) {
+		atomic_store(&curl_quit, 0);
+		int err = pthread_create(&curl_thread, NULL, CURLNetThread,
+					 NULL);
+		if (err) {
+			Error("Unable to start network thread: %s\n",
+			      strerror(err));
+		}
+	}
+
+	StatsAddSection("curlnet", CURLNetDumpStats);
+}
+
+
+void
+CURLNetShutdown(void)
+{
+	if (curl_threaded) {
+		atomic_store(&curl_quit, 1);
+		curl_multi_wakeup(curl_multi);
+		pthread_join(curl_thread, NULL);
+	}
+
+	if (curl_timer) {
+		MainLoopRemoveTimer(curl_timer);
+		curl_timer = NULL;
+	}
+	MainLoopRemoveWatch(curl_event_watch);
+	close(curl_event_fd);
+
+	while (curl_pool_len > 0) {
+		CURLTransfer *t = curl_pool[--curl_pool_len];
+		curl_easy_cleanup(t->req);
+		free(t->ring);
+		free(t);
+	}
+	curl_multi_cleanup(curl_multi);
+	curl_share_cleanup(curl_share);
+	curl_global_cleanup();
+}
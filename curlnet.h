@@ -0,0 +1,77 @@
+/*==========================================================================*\
+ *
+ * curlnet.h - libcurl transfers, on a network thread or in the main loop.
+ * flasher (C) 2006 Alex Graveley
+ *
+\*==========================================================================*/
+
+#ifndef __CURLNET_H__
+#define __CURLNET_H__
+
+
+#include <curl/curl.h>
+
+#include "flasher.h"
+
+
+typedef struct _CURLTransfer CURLTransfer;
+
+/* What happened to a transfer, reported on the main thread in order */
+typedef enum
+{
+	CURLNET_DATA, /* More of the body is in */
+	CURLNET_DONE, /* Finished; the transfer is the main thread's again */
+} CURLNetEvent;
+
+typedef void (*CURLNetFunc)(CURLTransfer *t, CURLNetEvent event);
+
+/*
+ * The response, as of the first CURLNET_DATA or the CURLNET_DONE of a
+ * run.  Only valid from then until the transfer is added again.
+ */
+typedef struct _CURLNetResponse
+{
+	long        code;
+	char       *content_type;
+	curl_off_t  length;        /* -1 if unknown */
+	long        filetime;      /* -1 if unknown */
+	char       *headers;       /* Every header line received, as is */
+	int         headers_len;
+	double      first_byte_at; /* StatsNow() ms, or 0 */
+	CURLcode    result;        /* At CURLNET_DONE */
+} CURLNetResponse;
+
+
+CURLTransfer *CURLNetTransferNew(void *data);
+
+void CURLNetTransferFree(CURLTransfer *t);
+
+CURL *CURLNetHandle(CURLTransfer *t);
+
+void *CURLNetGetData(CURLTransfer *t);
+
+void CURLNetSetData(CURLTransfer *t, void *data);
+
+const CURLNetResponse *CURLNetGetResponse(CURLTransfer *t);
+
+Bool CURLNetRunning(CURLTransfer *t);
+
+void CURLNetAdd(CURLTransfer *t);
+
+void CURLNetRemove(CURLTransfer *t);
+
+int CURLNetPeek(CURLTransfer *t, char **buffer);
+
+long CURLNetPending(CURLTransfer *t);
+
+void CURLNetConsume(CURLTransfer *t, int len);
+
+void CURLNetInit(Bool thread,
+		 Bool multiplex,
+		 long max_host_connections,
+		 CURLNetFunc func);
+
+void CURLNetShutdown(void);
+
+
+#endif /* __CURLNET_H__ */
@@ -6,323 +6,2258 @@
 \*==========================================================================*/
 
 
+#define _GNU_SOURCE /* for memfd_create, memrchr */
+
+#include <ctype.h>
 #include <errno.h>
-#include <curl/curl.h>
 #include <unistd.h>
+#include <sys/mman.h>
 
+#include "curlnet.h"
 #include "curlstream.h"
+#include "decoder.h"
 #include "flasher.h"
+#include "httpcache.h"
+#include "mainloop.h"
+#include "stats.h"
+
+
+/* 
+ * Admission order.  Within a class streams start first come, first
+ * served.
+ */
+typedef enum
+{
+	CURLSTREAM_URGENT, /* Byte ranges an NP_SEEK stream is waiting on */
+	CURLSTREAM_HIGH,   /* Notify streams and POSTs */
+	CURLSTREAM_BULK,   /* Plain NPN_GetURL; nobody waits on completion */
+	CURLSTREAM_PRIORITIES
+} CURLStreamPriority;
+
+
+/* Active transfers to one host[:port] */
+typedef struct _CURLStreamHost
+{
+	char *name;
+	int   active;
+	struct _CURLStreamHost *next;
+} CURLStreamHost;
 
 
 struct _CURLStream
 {
+	const StreamClass *klass;
 	NPP_t *plugin;
 	NPStream np_stream;
-	CURL *req;
+	CURLTransfer *xfer; /* Own, or none if a follower */
 	uint16 stype;
 	Bool notify;
 	char *absolute_url;
+	char *mimetype;
+
+	Bool started;  /* NPP_NewStream has been called */
+	Bool seekable; /* Server accepts byte range requests */
+	Bool is_post;
+
+	/* NPN_RequestRead ranges not yet requested, for NP_SEEK streams */
+	NPByteRange *ranges;
+	Bool range_active;
+	Bool range_check;
+	MainLoopTimer *range_timer;
+
+	/* On-disk cache entry, and the new body being stored into it */
+	HTTPCacheEntry *cache;
+	FILE *cache_file;
+	Bool  cache_hit; /* Body is being read from the cache */
+	struct curl_slist *headers;
 
 	FILE *outfile;
 	char *outfile_path;
+	Bool  outfile_memfd;
 	int   outfile_idx;
 	FILE *infile;
+
+	/* Bytes received but not yet accepted by NPP_Write */
+	char *ring;
+	int   ring_size;
+	int   ring_start;
+	int   ring_len;
+	MainLoopTimer *drain_timer;
+
+	/* The transfer holds more, for rings that have no room yet */
+	Bool  paused;
+
+	/* 
+	 * The Content-Encoding of the body, undone before anything but the
+	 * cache sees it.  A piece the transfer could not hand out yet stays
+	 * decoded until it can.  A chunk may decode to several pieces, each
+	 * no bigger than a ring; the rest waits in the decoder meanwhile.
+	 */
+	Decoder *decoder;
+	char    *decoded;
+	int      decoded_len;
+	int      decoded_raw;  /* Encoded bytes the piece used up */
+	Bool     decoded_held; /* decoded is waiting to be handed out */
+
+	/* Small chunks held back in the transfer, to be written together */
+	int    ready_max;   /* Last NPP_WriteReady, 0 before the first */
+	double batch_since; /* StatsNow() ms, or 0 */
+	MainLoopTimer *batch_timer;
+
+	/* Transfer finished, but ring still holds undelivered data */
+	Bool     done;
+	NPReason done_reason;
+
+	/* NPN_DestroyStream was called from inside NPP_Write */
+	int      busy;
+	Bool     destroy_pending;
+	NPReason destroy_reason;
+
+	/* 
+	 * GETs for the same URL share one transfer, owned by the first.  The
+	 * others are its followers, and get no easy handle of their own.
+	 */
+	char *key;         /* Normalized absolute_url, NULL for POSTs */
+	CURLStream *leader;
+	CURLStream *followers;
+	CURLStream *next_follower;
+	CURLStream *join_next; /* In curl_joinable */
+	Bool joinable;
+	Bool shared;       /* Was a follower */
+
+	/* Waiting in curl_queue, or admitted and running */
+	CURLStreamPriority priority;
+	CURLStreamHost *host;
+	CURLStream *queue_next;
+	Bool   queued;
+	Bool   active;
+	double queued_at;
+	double queue_ms;
+
+	/* Stats; times are StatsNow() ms */
+	double created_at;
+	double first_byte_at;
+	double blocked_since; /* NPP_WriteReady or NPP_Write refused data */
+	double blocked_ms;
+	long   bytes;
+	int    writes;
+	long   write_bytes;
 };
 
 
-static CURLM *curl_handle = NULL;
-static XtWorkProcId curl_work_id = 0;
-static int curl_running_handles = 0;
-static Bool curl_need_perform = False;
+/* 
+ * Per-stream backlog limit.  Must be at least CURL_MAX_WRITE_SIZE so a
+ * single libcurl chunk always fits into an empty ring.
+ */
+#define CURLSTREAM_RING_SIZE (256 * 1024)
+
+/* Stdio buffer for NP_ASFILE files, so writes reach the kernel in bulk */
+#define CURLSTREAM_FILE_BUFFER (256 * 1024)
+
+/* Most body held back for one NPP_Write, however much the plugin takes */
+#define CURLSTREAM_BATCH_MAX (64 * 1024)
+
+/* How often to retry delivering backlog to a plugin that is not ready */
+#define CURLSTREAM_DRAIN_INTERVAL 10 /* ms */
+
+/* How many finished streams to list individually in the stats */
+#define CURLSTREAM_STATS_RECENT 256
+
+
+static Bool curl_http2 = False;
 static char *curl_baseurl = NULL;
+static char *curl_asfile_dir = NULL;
+static Bool curl_asfile_memfd = False;
+static int curl_write_delay = 0; /* ms, 0 not to hold chunks back */
+
+/* Streams waiting for a transfer slot, one FIFO per priority */
+static struct {
+	CURLStream *head;
+	CURLStream *tail;
+} curl_queue[CURLSTREAM_PRIORITIES];
+static MainLoopTimer *curl_admit_timer = NULL;
+static CURLStreamHost *curl_hosts = NULL;
+static int curl_active = 0;
+static int curl_max_streams = 0;      /* 0 for no limit */
+static int curl_max_host_streams = 0; /* 0 for no limit */
+
+/* Transfers not yet started, which new GETs for the same URL can share */
+static CURLStream *curl_joinable = NULL;
+
+/* CURLOPT_STREAM_WEIGHT for each priority, with HTTP/2 */
+static const long curl_weights[CURLSTREAM_PRIORITIES] = { 256, 64, 8 };
+static const char *curl_priority_names[CURLSTREAM_PRIORITIES] = {
+	"urgent", "high", "bulk"
+};
 
 
-static Boolean CURLStreamPoll(NPP_t *plugin);
-static size_t CURLStreamWriteCb(char *buffer, size_t size, size_t nitems, 
-			 void *instream);
+/* One finished stream, as listed in the stats */
+typedef struct _CURLStreamRecord
+{
+	char  *url;
+	double start_ms;  /* Since program start */
+	double ttfb_ms;
+	double total_ms;
+	double blocked_ms;
+	double queue_ms;
+	long   bytes;
+	int    writes;
+	long   write_bytes;
+	Bool   cache_hit;
+	Bool   shared;
+	CURLStreamPriority priority;
+	NPReason reason;
+} CURLStreamRecord;
+
+
+static struct {
+	int  streams;
+	int  failed;
+	long bytes;
+	int  deduped;     /* Streams that shared another's transfer */
+	long bytes_saved; /* Body bytes they did not have to fetch */
+	long ready_calls; /* NPP_WriteReady */
+	long batched;     /* Times a chunk was held back for more */
+	int  encoded;        /* Responses with a Content-Encoding we undo */
+	long encoded_bytes;  /* Their bodies as sent... */
+	long decoded_bytes;  /* ...and as the plugin got them */
+
+	Histogram ttfb;
+	Histogram total;
+	Histogram namelookup;
+	Histogram connect;
+	Histogram appconnect;
+	Histogram starttransfer;
+	Histogram blocked;
+	Histogram size;
+	Histogram writes;
+	Histogram write_size;
+	Histogram queue[CURLSTREAM_PRIORITIES];
+
+	int active_max;
+	int queued;
+	int queued_max;
+
+	CURLStreamRecord recent[CURLSTREAM_STATS_RECENT];
+	int recent_next;
+} curl_stats;
+
+
+static void CURLStreamDestroyCb(void *stream, NPReason reason);
+static void CURLStreamScheduleDrain(CURLStream *s);
+static void CURLStreamScheduleBatch(CURLStream *s);
+static NPError CURLStreamRequestRead(void *stream, NPByteRange *ranges);
+static void CURLStreamNetEvent(CURLTransfer *t, CURLNetEvent event);
+
+
+static const StreamClass curlstream_class = {
+	CURLStreamDestroyCb,
+	CURLStreamRequestRead,
+};
 
 
-CURLStream *
-CURLStreamNew(NPP_t *plugin, const char *url, Bool notify, void* notifyData)
+/* Decode the body of the transfer of s from encoding, or not if NULL. */
+static void
+CURLStreamSetEncoding(CURLStream *s, const char *encoding)
 {
-	Debug("CURLStreamNew uri=%s, notify=%d, notifyData=%p\n",
-	      url, notify, notifyData);
+	if (s->decoder) {
+		DecoderFree(s->decoder);
+		s->decoder = NULL;
+	}
+	if (!encoding || !strcasecmp(encoding, "identity")) {
+		return;
+	}
 
-	CURLStream *s = malloc(sizeof(CURLStream));
+	s->decoder = DecoderNew(encoding);
+	if (!s->decoder) {
+		Warning("Unknown encoding '%s' for '%s', passing it on as is\n",
+			encoding, s->absolute_url);
+		return;
+	}
+	curl_stats.encoded++;
+}
 
-	s->plugin = plugin;
 
-	s->np_stream.url = strdup(url);
-	s->np_stream.notifyData = notifyData;
-	s->np_stream.ndata = s;
-	s->np_stream.end = 0;
-	s->np_stream.lastmodified = 0;
-	s->np_stream.pdata = NULL;
+/* Read the body from the cache entry instead of the network. */
+static void
+CURLStreamUseCache(CURLStream *s, Bool revalidated)
+{
+	char *file_url = malloc(strlen(s->cache->path) + 8);
+	sprintf(file_url, "file://%s", s->cache->path);
 
-	s->stype = 0;
-	s->notify = notify;
-	s->outfile = NULL;
-	s->outfile_path = NULL;
-	s->outfile_idx = 0;
-	s->infile = NULL;
+	Debug("CURLStreamUseCache curlstream=%p, revalidated=%d, path=%s\n", 
+	      s, revalidated, s->cache->path);
 
-	NPError err = CallNPP_NewStreamProc(plugin_funcs.newstream, plugin, 
-					    NULL /* FIXME: mimetype */, 
-					    &s->np_stream, False, &s->stype);
-	if (err != NPERR_NO_ERROR) {
-		free((char *) s->np_stream.url);
-		free(s);
-		return NULL;
-	}
+	CURL *req = CURLNetHandle(s->xfer);
+	curl_easy_setopt(req, CURLOPT_URL, file_url);
+	curl_easy_setopt(req, CURLOPT_HTTPHEADER, NULL);
+	free(file_url);
 
-	int baseurl_len = strlen(curl_baseurl ? curl_baseurl : "");
-	s->absolute_url = malloc(baseurl_len + strlen(url) + 2);
+	s->cache_hit = True;
+	HTTPCacheEntryUsed(s->cache, revalidated);
 
-	if (curl_baseurl && !strchr(url, ':')) {
-		strcpy(s->absolute_url, curl_baseurl);
-		if (curl_baseurl[baseurl_len] != '/') {
-			strcat(s->absolute_url, "/");
+	/* Kept as it was sent */
+	CURLStreamSetEncoding(s, s->cache->content_encoding);
+}
+
+
+/* 
+ * Fresh cache entries are served without touching the network; stale ones
+ * are revalidated with a conditional request.
+ */
+static void
+CURLStreamCheckCache(CURLStream *s)
+{
+	s->cache = HTTPCacheLookup(s->absolute_url);
+	if (!s->cache) {
+		if (HTTPCacheEnabled()) {
+			s->cache = HTTPCacheEntryNew(s->absolute_url);
 		}
-		strcat(s->absolute_url, url);
+		return;
+	}
 
-		Debug("CURLStreamNew: Using absolute URL '%s'\n", 
-		      s->absolute_url);
-	} else {
-		strcpy(s->absolute_url, url);
+	if (!s->cache->stale) {
+		CURLStreamUseCache(s, False);
+		return;
 	}
 
-	s->req = curl_easy_init();
-	curl_easy_setopt(s->req, CURLOPT_URL, s->absolute_url);
-	curl_easy_setopt(s->req, CURLOPT_PRIVATE, s);
-	curl_easy_setopt(s->req, CURLOPT_WRITEDATA, s);
-	curl_easy_setopt(s->req, CURLOPT_WRITEFUNCTION, CURLStreamWriteCb);
-	curl_multi_add_handle(curl_handle, s->req);
+	char header[4096];
+	if (s->cache->etag) {
+		snprintf(header, sizeof(header), "If-None-Match: %s", 
+			 s->cache->etag);
+		s->headers = curl_slist_append(s->headers, header);
+	}
+	if (s->cache->last_modified) {
+		snprintf(header, sizeof(header), "If-Modified-Since: %s", 
+			 s->cache->last_modified);
+		s->headers = curl_slist_append(s->headers, header);
+	}
+	curl_easy_setopt(CURLNetHandle(s->xfer), CURLOPT_HTTPHEADER, 
+			 s->headers);
+}
 
-	if (s->stype == NP_ASFILEONLY || s->stype == NP_ASFILE) {
-		char tmppath[100];
-		snprintf(tmppath, sizeof(tmppath), "/tmp/%s-%d-XXXXXX",
-			 PROGRAM_NAME, getpid());
 
-		int outfd = mkstemp(tmppath); // Mutates tmppath
-		s->outfile = fdopen(outfd, "w+");
-		s->outfile_path = strdup(tmppath);
+/* 
+ * The host[:port] url points at, shared by every stream to it for the
+ * per-host limit.  URLs without one, like file:, all share "".
+ */
+static CURLStreamHost *
+CURLStreamGetHost(const char *url)
+{
+	const char *name = strstr(url, "://");
+	int len = 0;
+
+	if (name) {
+		name += 3;
+		len = strcspn(name, "/?#");
+		const char *at = memchr(name, '@', len);
+		if (at) {
+			len -= at + 1 - name;
+			name = at + 1;
+		}
+	} else {
+		name = "";
 	}
 
-	if (curl_work_id == 0) {
-		curl_work_id = XtAppAddWorkProc(x_app_context, 
-						(XtWorkProc) CURLStreamPoll, 
-						&plugin);
+	CURLStreamHost *host;
+	for (host = curl_hosts; host; host = host->next) {
+		if (strlen(host->name) == len && 
+		    !strncasecmp(host->name, name, len)) {
+			return host;
+		}
 	}
-	curl_need_perform = True;
 
-	return s;
+	host = malloc(sizeof(CURLStreamHost));
+	host->name = strndup(name, len);
+	host->active = 0;
+	host->next = curl_hosts;
+	curl_hosts = host;
+
+	return host;
 }
 
 
-CURLStream *
-CURLStreamNewPost(NPP_t *plugin, 
-		  const char *url, 
-		  Bool notify, 
-		  void* notifyData,
-		  const char *buf, 
-		  uint32 len,
-		  Bool is_file)
+static void CURLStreamAdmitTimeout(void *data);
+
+
+/* Admit queued streams from the main loop, outside libcurl callbacks. */
+static void
+CURLStreamScheduleAdmit(void)
 {
-	FILE *infile = NULL;
+	if (!curl_admit_timer) {
+		curl_admit_timer = MainLoopAddTimer(0, CURLStreamAdmitTimeout, 
+						    NULL);
+	}
+}
 
-	if (is_file) {
-		infile = fopen(buf, "r");
-		if (!infile) {
-			Warning("Error opening file '%s' for posting: %s\n", 
-				buf, strerror(errno));
-			return NULL;
-		}
+
+/* Add s to the back of the queue for priority. */
+static void
+CURLStreamAppend(CURLStream *s, CURLStreamPriority priority)
+{
+	s->priority = priority;
+	s->queue_next = NULL;
+
+	if (curl_queue[priority].tail) {
+		curl_queue[priority].tail->queue_next = s;
+	} else {
+		curl_queue[priority].head = s;
 	}
+	curl_queue[priority].tail = s;
+}
 
-	CURLStream *s = CURLStreamNew(plugin, url, notify, notifyData);
-	if (!s) {
-		fclose(infile);
-		return NULL;
+
+/* The stream queued just ahead of s, or NULL if s is at the head. */
+static CURLStream *
+CURLStreamQueuedBefore(CURLStream *s)
+{
+	CURLStream *prev = NULL;
+	for (CURLStream *i = curl_queue[s->priority].head; i != s; 
+	     i = i->queue_next) {
+		prev = i;
 	}
+	return prev;
+}
 
-	if (is_file) {
-		s->infile = infile;
-		curl_easy_setopt(s->req, CURLOPT_INFILE, s->infile);
+
+/* Remove s from its queue; prev is the stream ahead of it, or NULL. */
+static void
+CURLStreamUnlink(CURLStream *s, CURLStream *prev)
+{
+	if (prev) {
+		prev->queue_next = s->queue_next;
 	} else {
-		curl_easy_setopt(s->req, CURLOPT_POSTFIELDS, buf);
-		curl_easy_setopt(s->req, CURLOPT_POSTFIELDSIZE, len);
+		curl_queue[s->priority].head = s->queue_next;
 	}
+	if (curl_queue[s->priority].tail == s) {
+		curl_queue[s->priority].tail = prev;
+	}
+	s->queue_next = NULL;
+}
 
-	curl_easy_setopt(s->req, CURLOPT_POST, True);
 
-	return s;
+/* Queue s for a transfer slot behind others of the same priority. */
+static void
+CURLStreamEnqueue(CURLStream *s, CURLStreamPriority priority)
+{
+	assert(!s->queued && !s->active);
+
+	CURLStreamAppend(s, priority);
+	s->queued = True;
+	s->queued_at = StatsNow();
+
+	curl_stats.queued++;
+	curl_stats.queued_max = MAX(curl_stats.queued_max, curl_stats.queued);
+
+	CURLStreamScheduleAdmit();
 }
 
 
-void 
-CURLStreamDestroy(CURLStream *s, NPReason reason)
+/* Take s out of its queue; prev is the stream ahead of it, or NULL. */
+static void
+CURLStreamDequeue(CURLStream *s, CURLStream *prev)
 {
-	Debug("CURLStreamDestroy curlstream=%p, reason=%d\n", s, reason);
+	CURLStreamUnlink(s, prev);
+	curl_stats.queued--;
 
-	if (reason == NPRES_DONE) {
-		CallNPP_StreamAsFileProc(plugin_funcs.asfile, s->plugin,
-					 &s->np_stream, s->outfile_path);
+	double waited = StatsNow() - s->queued_at;
+	s->queue_ms += waited;
+	HistogramAdd(&curl_stats.queue[s->priority], waited);
+
+	s->queued = False;
+}
+
+
+/* Take s out of its queue, wherever it is. */
+static void
+CURLStreamUnqueue(CURLStream *s)
+{
+	CURLStreamDequeue(s, CURLStreamQueuedBefore(s));
+}
+
+
+/* Move queued s up to a more urgent priority, keeping its wait so far. */
+static void
+CURLStreamPromote(CURLStream *s, CURLStreamPriority priority)
+{
+	CURLStreamUnlink(s, CURLStreamQueuedBefore(s));
+	CURLStreamAppend(s, priority);
+}
+
+
+/* Put n in the place of queued s. */
+static void
+CURLStreamQueueReplace(CURLStream *s, CURLStream *n)
+{
+	CURLStream *prev = CURLStreamQueuedBefore(s);
+
+	n->priority = s->priority;
+	n->queue_next = s->queue_next;
+	if (prev) {
+		prev->queue_next = n;
+	} else {
+		curl_queue[s->priority].head = n;
+	}
+	if (curl_queue[s->priority].tail == s) {
+		curl_queue[s->priority].tail = n;
 	}
+	n->queued = True;
+	n->queued_at = s->queued_at;
 
-	if (s->notify) {
-		CallNPP_URLNotifyProc(plugin_funcs.urlnotify, 
-				      s->plugin, s->np_stream.url,
-				      reason, s->np_stream.notifyData);
+	s->queued = False;
+	s->queue_next = NULL;
+}
+
+
+/* Start the transfer for s.  It holds its slot until CURLStreamRelease. */
+static void
+CURLStreamAdmit(CURLStream *s)
+{
+	Debug("CURLStreamAdmit curlstream=%p, priority=%s, host=%s\n", s,
+	      curl_priority_names[s->priority], s->host->name);
+
+	s->active = True;
+	s->host->active++;
+	curl_active++;
+	curl_stats.active_max = MAX(curl_stats.active_max, curl_active);
+
+	if (curl_http2) {
+		curl_easy_setopt(CURLNetHandle(s->xfer), CURLOPT_STREAM_WEIGHT,
+				 curl_weights[s->priority]);
 	}
-	CallNPP_DestroyStreamProc(plugin_funcs.destroystream, s->plugin, 
-				  &s->np_stream, reason);
+	CURLNetAdd(s->xfer);
+}
+
 
-	if (s->req) {
-		curl_easy_setopt(s->req, CURLOPT_PRIVATE, NULL);
-		curl_easy_cleanup(s->req);
+/* 
+ * Pass the slot of s on, if it has one.  A transfer still running is
+ * stopped and let go of; a finished one is kept for reuse.
+ */
+static void
+CURLStreamRelease(CURLStream *s)
+{
+	if (s->xfer && CURLNetRunning(s->xfer)) {
+		CURLNetRemove(s->xfer);
+		s->xfer = NULL;
+		s->paused = False;
 	}
 
-	free((char *) s->np_stream.url);
-	free(s->absolute_url);
+	if (!s->active) {
+		return;
+	}
 
-	if (s->outfile) {
-		fclose(s->outfile);
+	s->active = False;
+	s->host->active--;
+	curl_active--;
+
+	if (curl_stats.queued > 0) {
+		CURLStreamScheduleAdmit();
 	}
-	unlink(s->outfile_path);
-	free(s->outfile_path);
+}
 
-	if (s->infile) {
-		fclose(s->infile);
+
+/* 
+ * Timer callback: fill free slots, most urgent streams first.  Streams
+ * whose host is at its limit keep their place without holding up the
+ * streams behind them.
+ */
+static void
+CURLStreamAdmitTimeout(void *data)
+{
+	curl_admit_timer = NULL;
+
+	for (int p = 0; p < CURLSTREAM_PRIORITIES; p++) {
+		CURLStream *prev = NULL;
+		CURLStream *s = curl_queue[p].head;
+
+		while (s) {
+			if (curl_max_streams && curl_active >= curl_max_streams) {
+				return;
+			}
+
+			CURLStream *next = s->queue_next;
+			if (curl_max_host_streams && 
+			    s->host->active >= curl_max_host_streams) {
+				prev = s;
+			} else {
+				CURLStreamDequeue(s, prev);
+				CURLStreamAdmit(s);
+			}
+			s = next;
+		}
 	}
-	free(s);
 }
 
 
-void 
-CURLStreamInit(const char *baseurl)
+/* 
+ * url with its scheme and host in lower case, without a default port or
+ * fragment, and with an empty path made "/", so that requests for the
+ * same resource spelled differently share a transfer.
+ */
+static char *
+CURLStreamNormalizeURL(const char *url)
 {
-	curl_baseurl = baseurl ? strdup(baseurl) : NULL;
+	char *key = malloc(strlen(url) + 2);
+	char *k = key;
+	const char *host = strstr(url, "://");
+
+	if (host) {
+		host += 3;
+		for (const char *c = url; c < host; c++) {
+			*k++ = tolower(*c);
+		}
+
+		int len = strcspn(host, "/?#");
+		const char *at = memchr(host, '@', len);
+		if (at) {
+			/* User info is case sensitive. */
+			memcpy(k, host, at + 1 - host);
+			k += at + 1 - host;
+			len -= at + 1 - host;
+			host = at + 1;
+		}
+
+		const char *port = (len > 0) ? memrchr(host, ':', len) : NULL;
+		if (port && 
+		    ((!strncasecmp(url, "http:", 5) && 
+		      host + len - port == 3 && !strncmp(port, ":80", 3)) ||
+		     (!strncasecmp(url, "https:", 6) && 
+		      host + len - port == 4 && !strncmp(port, ":443", 4)))) {
+			len = port - host;
+		}
+		for (int i = 0; i < len; i++) {
+			*k++ = tolower(host[i]);
+		}
+
+		url = host + strcspn(host, "/?#");
+		if (*url != '/') {
+			*k++ = '/';
+		}
+	}
 
-  	curl_global_init(0);
-	curl_handle = curl_multi_init();
-	assert(curl_handle);
+	int len = strcspn(url, "#");
+	memcpy(k, url, len);
+	k[len] = '\0';
+
+	return key;
 }
 
 
-void 
-CURLStreamShutdown(void)
+/* The next stream after i sharing the transfer s owns, or NULL. */
+static CURLStream *
+CURLStreamNextSharing(CURLStream *s, CURLStream *i)
 {
-	curl_multi_cleanup(curl_handle);
-	curl_global_cleanup();
+	return (i == s) ? s->followers : i->next_follower;
+}
 
-	free(curl_baseurl);
+
+/* The stream owning the transfer s gets its data from */
+static CURLStream *
+CURLStreamOwner(CURLStream *s)
+{
+	return s->leader ? s->leader : s;
+}
+
+
+/* 
+ * Count every stream sharing the transfer of s as busy, so that
+ * NPN_DestroyStream on any of them waits until we are done with it.
+ */
+static void
+CURLStreamHold(CURLStream *s, int count)
+{
+	for (CURLStream *i = s; i; i = CURLStreamNextSharing(s, i)) {
+		i->busy += count;
+	}
 }
 
 
-static Boolean
-CURLStreamPoll(NPP_t *plugin)
+/* 
+ * Let GETs for the same URL share the transfer of s until it starts.
+ * From then on the plugin is handed bytes nothing keeps, and a stream
+ * joining later would need them from byte 0.  Keeping them would mean
+ * holding every body for as long as its transfer runs, on the chance of
+ * a duplicate, and for the large movies sharing matters most for that
+ * costs more memory than it saves.  The cache file can't stand in: it
+ * exists only with --cache-dir, not for no-store bodies, and holds them
+ * still encoded.  What this does catch are the URLs the plugin asks for
+ * together, from one frame or one load: those calls all return before
+ * the main loop can see a response, so they always share.
+ */
+static void
+CURLStreamJoin(CURLStream *s)
 {
-	if (curl_running_handles > 0) {
-		fd_set read;
-		fd_set write;
-		fd_set except;
-		int max_fd = 0;
+	s->join_next = curl_joinable;
+	curl_joinable = s;
+	s->joinable = True;
+}
 
-		curl_multi_fdset(curl_handle, &read, &write, &except, &max_fd);
-		if (max_fd > 0) {
-			struct timeval tv;
-			tv.tv_sec = 0;
-			tv.tv_usec = 0;
 
-			int res = select(max_fd, &read, &write, &except, &tv);
-			if (res < 0 && errno != EINTR) {
-				Warning("Error waiting for IO: %s\n", 
-					strerror(errno));
-				return False;
-			} else if (res > 0) {
-				curl_need_perform = True;
-			}
-		}
+static void
+CURLStreamUnjoin(CURLStream *s)
+{
+	if (!s->joinable) {
+		return;
 	}
 
-	if (curl_need_perform) {
-		while (curl_multi_perform(curl_handle, &curl_running_handles) ==
-		       CURLM_CALL_MULTI_PERFORM) {
-		}
-		curl_need_perform = False;
+	CURLStream **p = &curl_joinable;
+	while (*p != s) {
+		p = &(*p)->join_next;
 	}
+	*p = s->join_next;
 
-	while (True) {
-		int msg_cnt = 0;
-		CURLMsg *msg = curl_multi_info_read(curl_handle, &msg_cnt);
-		if (!msg) {
-			break;
-		} else if (msg->msg != CURLMSG_DONE) {
-			continue;
-		}
+	s->join_next = NULL;
+	s->joinable = False;
+}
 
-		CURLStream *s = NULL;
-		curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, &s);
-		assert(s);
 
-		CURLStreamDestroy(s, msg->data.result);
-	};
+/* Share the transfer of t, which fetches the same URL, with s. */
+static void
+CURLStreamAttach(CURLStream *t, CURLStream *s, CURLStreamPriority priority)
+{
+	Debug("CURLStreamAttach curlstream=%p, leader=%p\n", s, t);
 
-	if (curl_running_handles == 0) {
-		curl_work_id = 0;
-		return True; // Done for now.
+	CURLStream **p = &t->followers;
+	while (*p) {
+		p = &(*p)->next_follower;
 	}
+	*p = s;
 
-	return False;
+	s->leader = t;
+	s->shared = True;
+	s->host = t->host;
+	s->priority = priority;
+	curl_stats.deduped++;
+
+	if (t->queued && priority < t->priority) {
+		CURLStreamPromote(t, priority);
+	}
 }
 
 
-static size_t
-CURLStreamWriteCb(char *buffer,
-		  size_t size,
-		  size_t nitems,
-		  void *instream)
+/* Stop f sharing the transfer of its leader. */
+static void
+CURLStreamDetach(CURLStream *f)
 {
-	Debug("CURLStreamWriteCb buffer=%p, size=%d, nitems=%d, "
-	      "curlstream=%p\n", buffer, size, nitems, instream);
+	CURLStream *t = f->leader;
 
-	CURLStream *s = (CURLStream *) instream;
-	int bytes_written = 0;
-	int nwritten = nitems;
+	CURLStream **p = &t->followers;
+	while (*p != f) {
+		p = &(*p)->next_follower;
+	}
+	*p = f->next_follower;
 
-	if (s->outfile) {
-		nwritten = fwrite(buffer, size, nitems, s->outfile);
+	f->next_follower = NULL;
+	f->leader = NULL;
+
+	if (t->paused) {
+		/* f may have been what held it up. */
+		CURLStreamScheduleDrain(t);
 	}
-	if (s->stype == NP_ASFILEONLY) {
-		// Don't send WriteReady and Write calls for ASFILEONLY
-		return nwritten;
+}
+
+
+/* Give s a transfer of its own, with the options every stream shares. */
+static void
+CURLStreamSetupHandle(CURLStream *s)
+{
+	s->xfer = CURLNetTransferNew(s);
+
+	CURL *req = CURLNetHandle(s->xfer);
+	curl_easy_setopt(req, CURLOPT_URL, s->absolute_url);
+	curl_easy_setopt(req, CURLOPT_FILETIME, 1L);
+	curl_easy_setopt(req, CURLOPT_ACCEPT_ENCODING, 
+			 DecoderAcceptEncoding());
+	curl_easy_setopt(req, CURLOPT_HTTP_CONTENT_DECODING, 0L);
+	if (curl_http2) {
+		curl_easy_setopt(req, CURLOPT_HTTP_VERSION, 
+				 (long) CURL_HTTP_VERSION_2TLS);
+		curl_easy_setopt(req, CURLOPT_PIPEWAIT, 1L);
 	}
+}
 
-	while (bytes_written < (nwritten * size)) {
-		int write_max = 
-			CallNPP_WriteReadyProc(plugin_funcs.writeready,
-					       s->plugin, &s->np_stream);
-		Debug("NPP_WriteReady: write_max = %d, end = %d\n", 
-		      write_max, -1);
-		if (write_max <= 0) {
-			break;
-		}
 
-		bytes_written += 
-			CallNPP_WriteProc(plugin_funcs.write, s->plugin, 
-					  &s->np_stream, s->outfile_idx, 
-					  (nwritten * size) - bytes_written,
-					  (void *) buffer);
-		Debug("NPP_Write: offset = %d, end = %d, "
-		      "written = %d\n", s->outfile_idx, -1, 
-		      bytes_written);
-		if (bytes_written <= 0) {
-			break;
+/* 
+ * Pass the transfer of s, with its slot or place in the queue and its
+ * cache entry, on to the first of its followers.  Returns the new owner.
+ */
+static CURLStream *
+CURLStreamHandOver(CURLStream *s)
+{
+	CURLStream *n = s->followers;
+
+	Debug("CURLStreamHandOver curlstream=%p, to=%p\n", s, n);
+
+	n->leader = NULL;
+	n->followers = n->next_follower;
+	n->next_follower = NULL;
+	for (CURLStream *f = n->followers; f; f = f->next_follower) {
+		f->leader = n;
+	}
+	s->followers = NULL;
+
+	n->xfer = s->xfer;
+	s->xfer = NULL;
+	CURLNetSetData(n->xfer, n);
+
+	n->headers = s->headers;
+	n->cache = s->cache;
+	n->cache_file = s->cache_file;
+	n->cache_hit = s->cache_hit;
+	s->headers = NULL;
+	s->cache = NULL;
+	s->cache_file = NULL;
+	if (!n->started) {
+		/* Seen in the headers so far */
+		n->seekable = s->seekable;
+	}
+
+	n->priority = s->priority;
+	n->active = s->active;
+	s->active = False;
+	if (s->queued) {
+		CURLStreamQueueReplace(s, n);
+	}
+	if (s->joinable) {
+		CURLStreamUnjoin(s);
+		CURLStreamJoin(n);
+	}
+
+	n->paused = s->paused;
+	s->paused = False;
+	if (n->paused) {
+		CURLStreamScheduleDrain(n);
+	}
+
+	n->decoder = s->decoder;
+	n->decoded = s->decoded;
+	n->decoded_len = s->decoded_len;
+	n->decoded_raw = s->decoded_raw;
+	n->decoded_held = s->decoded_held;
+	s->decoder = NULL;
+	s->decoded_held = False;
+
+	n->batch_since = s->batch_since;
+	s->batch_since = 0;
+	if (s->batch_timer) {
+		MainLoopRemoveTimer(s->batch_timer);
+		s->batch_timer = NULL;
+		CURLStreamScheduleBatch(n);
+	}
+
+	return n;
+}
+
+
+/* Mark s as failed, unless it is already being destroyed. */
+static void
+CURLStreamFail(CURLStream *s)
+{
+	if (!s->destroy_pending) {
+		s->destroy_pending = True;
+		s->destroy_reason = NPRES_NETWORK_ERR;
+	}
+}
+
+
+/* 
+ * Let streams sharing the transfer of s that are being destroyed go, and
+ * destroy them from the drain timeout.  If s itself goes, the transfer
+ * is handed over to a stream that stays.  Returns the stream owning the
+ * transfer now, or NULL if s is left to be destroyed with it.
+ */
+static CURLStream *
+CURLStreamDropPending(CURLStream *s)
+{
+	CURLStream *f = s->followers;
+	while (f) {
+		CURLStream *next = f->next_follower;
+		if (f->destroy_pending) {
+			CURLStreamDetach(f);
+			CURLStreamScheduleDrain(f);
 		}
+		f = next;
+	}
 
-		s->outfile_idx += bytes_written;
-		buffer += bytes_written;
+	if (!s->destroy_pending) {
+		return s;
+	} else if (!s->followers) {
+		return NULL;
 	}
 
-	return nwritten;
+	CURLStream *n = CURLStreamHandOver(s);
+	CURLStreamScheduleDrain(s);
+	return n;
+}
+
+
+static CURLStream *
+CURLStreamCreate(NPP_t *plugin, 
+		 const char *url, 
+		 Bool notify, 
+		 void* notifyData,
+		 Bool is_post)
+{
+	Debug("CURLStreamNew uri=%s, notify=%d, notifyData=%p\n",
+	      url, notify, notifyData);
+
+	CURLStream *s = malloc(sizeof(CURLStream));
+
+	s->klass = &curlstream_class;
+	s->plugin = plugin;
+
+	s->np_stream.url = strdup(url);
+	s->np_stream.notifyData = notifyData;
+	s->np_stream.ndata = s;
+	s->np_stream.end = 0;
+	s->np_stream.lastmodified = 0;
+	s->np_stream.pdata = NULL;
+
+	s->stype = 0;
+	s->notify = notify;
+	s->mimetype = NULL;
+	s->started = False;
+	s->seekable = False;
+	s->is_post = is_post;
+	s->ranges = NULL;
+	s->range_active = False;
+	s->range_check = False;
+	s->range_timer = NULL;
+
+	s->cache = NULL;
+	s->cache_file = NULL;
+	s->cache_hit = False;
+	s->headers = NULL;
+
+	s->outfile = NULL;
+	s->outfile_path = NULL;
+	s->outfile_memfd = False;
+	s->outfile_idx = 0;
+	s->infile = NULL;
+
+	s->ring = NULL;
+	s->ring_size = 0;
+	s->ring_start = 0;
+	s->ring_len = 0;
+	s->paused = False;
+	s->drain_timer = NULL;
+	s->ready_max = 0;
+	s->batch_since = 0;
+	s->batch_timer = NULL;
+
+	s->decoder = NULL;
+	s->decoded = NULL;
+	s->decoded_len = 0;
+	s->decoded_raw = 0;
+	s->decoded_held = False;
+	s->done = False;
+	s->done_reason = NPRES_DONE;
+	s->busy = 0;
+	s->destroy_pending = False;
+	s->destroy_reason = NPRES_DONE;
+
+	s->key = NULL;
+	s->leader = NULL;
+	s->followers = NULL;
+	s->next_follower = NULL;
+	s->join_next = NULL;
+	s->joinable = False;
+	s->shared = False;
+
+	s->xfer = NULL;
+	s->host = NULL;
+	s->queue_next = NULL;
+	s->queued = False;
+	s->active = False;
+	s->queued_at = 0;
+	s->queue_ms = 0;
+
+	s->created_at = StatsNow();
+	s->first_byte_at = 0;
+	s->blocked_since = 0;
+	s->blocked_ms = 0;
+	s->bytes = 0;
+	s->writes = 0;
+	s->write_bytes = 0;
+
+	int baseurl_len = strlen(curl_baseurl ? curl_baseurl : "");
+	s->absolute_url = malloc(baseurl_len + strlen(url) + 2);
+
+	if (curl_baseurl && !strchr(url, ':')) {
+		strcpy(s->absolute_url, curl_baseurl);
+		if (!baseurl_len || curl_baseurl[baseurl_len - 1] != '/') {
+			strcat(s->absolute_url, "/");
+		}
+		strcat(s->absolute_url, url);
+
+		Debug("CURLStreamNew: Using absolute URL '%s'\n", 
+		      s->absolute_url);
+	} else {
+		strcpy(s->absolute_url, url);
+	}
+
+	CURLStreamPriority priority = (notify || is_post) ? CURLSTREAM_HIGH : 
+		CURLSTREAM_BULK;
+
+	if (!is_post) {
+		s->key = CURLStreamNormalizeURL(s->absolute_url);
+		for (CURLStream *t = curl_joinable; t; t = t->join_next) {
+			if (!t->destroy_pending && !strcmp(t->key, s->key)) {
+				CURLStreamAttach(t, s, priority);
+				return s;
+			}
+		}
+	}
+
+	CURLStreamSetupHandle(s);
+	if (!is_post) {
+		CURLStreamCheckCache(s);
+		CURLStreamJoin(s);
+	}
+
+	/* Started once admitted, after CURLStreamNewPost has set it up. */
+	s->host = CURLStreamGetHost(s->absolute_url);
+	CURLStreamEnqueue(s, priority);
+
+	return s;
+}
+
+
+CURLStream *
+CURLStreamNew(NPP_t *plugin, const char *url, Bool notify, void* notifyData)
+{
+	return CURLStreamCreate(plugin, url, notify, notifyData, False);
+}
+
+
+/* 
+ * Create the file NP_ASFILE streams are saved to.  With memfd it only
+ * exists in memory and the plugin opens it as /proc/self/fd/N; otherwise
+ * it is a temporary file in curl_asfile_dir.
+ */
+static void
+CURLStreamOpenFile(CURLStream *s)
+{
+	char path[4096];
+	int outfd = -1;
+
+	if (curl_asfile_memfd) {
+		outfd = memfd_create(PROGRAM_NAME, 0);
+		if (outfd < 0) {
+			Warning("memfd_create failed, using '%s': %s\n", 
+				curl_asfile_dir, strerror(errno));
+		} else {
+			snprintf(path, sizeof(path), "/proc/self/fd/%d", outfd);
+			s->outfile_memfd = True;
+		}
+	}
+
+	if (outfd < 0) {
+		snprintf(path, sizeof(path), "%s/%s-%d-XXXXXX", 
+			 curl_asfile_dir, PROGRAM_NAME, getpid());
+		outfd = mkstemp(path); // Mutates path
+	}
+
+	if (outfd < 0) {
+		Warning("Error creating file for '%s': %s\n", s->absolute_url, 
+			strerror(errno));
+		return;
+	}
+
+	s->outfile = fdopen(outfd, "w+");
+	s->outfile_path = strdup(path);
+	setvbuf(s->outfile, NULL, _IOFBF, CURLSTREAM_FILE_BUFFER);
+}
+
+
+/* True once the plugin has chosen to pull this stream by byte ranges. */
+static Bool
+CURLStreamIsSeeking(CURLStream *s)
+{
+	return s->started && s->stype == NP_SEEK && s->seekable;
+}
+
+
+/* 
+ * Announce the stream to the plugin once the response headers are in,
+ * so it sees the real MIME type, length, modification time and whether
+ * byte ranges can be requested.
+ */
+static NPError
+CURLStreamStart(CURLStream *s)
+{
+	CURLStream *t = CURLStreamOwner(s); /* Has the transfer */
+	const CURLNetResponse *r = CURLNetGetResponse(t->xfer);
+
+	s->started = True;
+
+	if (r->content_type) {
+		s->mimetype = strndup(r->content_type, 
+				      strcspn(r->content_type, "; \t"));
+	}
+	s->np_stream.end = (r->length > 0) ? r->length : 0;
+	s->np_stream.lastmodified = (r->filetime > 0) ? r->filetime : 0;
+	if (t->decoder) {
+		/* Content-Length and byte ranges are of the body as sent. */
+		s->np_stream.end = 0;
+	}
+
+	if (t->cache_hit) {
+		/* file:// knows nothing about the original response. */
+		free(s->mimetype);
+		s->mimetype = t->cache->mimetype ? 
+			strdup(t->cache->mimetype) : NULL;
+		if (t->cache->last_modified) {
+			s->np_stream.lastmodified = 
+				curl_getdate(t->cache->last_modified, NULL);
+		}
+		t->seekable = True;
+	}
+	s->seekable = t->seekable;
+	s->seekable = s->seekable && !s->is_post && s->np_stream.end > 0;
+
+	Debug("CURLStreamStart mimetype=%s, end=%d, seekable=%d\n", 
+	      s->mimetype, s->np_stream.end, s->seekable);
+
+	NPError err = CallNPP_NewStreamProc(plugin_funcs.newstream, s->plugin, 
+					    s->mimetype, &s->np_stream, 
+					    s->seekable, &s->stype);
+	if (err != NPERR_NO_ERROR) {
+		s->started = False;
+		return err;
+	}
+
+	if (s->stype == NP_SEEK && !s->seekable) {
+		Warning("Stream '%s' is not seekable, sending it whole\n", 
+			s->absolute_url);
+	}
+
+	if (s->cache && !s->cache_hit && r->code == 200 && 
+	    !CURLStreamIsSeeking(s)) {
+		s->cache_file = HTTPCacheEntryOpenWrite(s->cache);
+	}
+
+	if (s->stype == NP_ASFILEONLY || s->stype == NP_ASFILE) {
+		CURLStreamOpenFile(s);
+	}
+
+	return NPERR_NO_ERROR;
+}
+
+
+/* 
+ * Start every stream sharing the transfer of s.  Those that fail drop
+ * out, as do those that chose to pull byte ranges, which they do with
+ * easy handles of their own.  Returns the stream owning the transfer
+ * now, or NULL if s is left alone and failed or is seeking.
+ */
+static CURLStream *
+CURLStreamStartAll(CURLStream *s)
+{
+	/* Its first bytes go out now; see CURLStreamJoin. */
+	CURLStreamUnjoin(s);
+
+	CURLStreamHold(s, 1);
+	for (CURLStream *i = s; i; i = CURLStreamNextSharing(s, i)) {
+		if (!i->destroy_pending && 
+		    CURLStreamStart(i) != NPERR_NO_ERROR) {
+			CURLStreamFail(i);
+		}
+	}
+	CURLStreamHold(s, -1);
+
+	s = CURLStreamDropPending(s);
+	if (!s) {
+		return NULL;
+	}
+
+	CURLStream *f = s->followers;
+	while (f) {
+		CURLStream *next = f->next_follower;
+		if (CURLStreamIsSeeking(f)) {
+			CURLStreamDetach(f);
+			CURLStreamSetupHandle(f);
+		}
+		f = next;
+	}
+
+	if (CURLStreamIsSeeking(s)) {
+		if (!s->followers) {
+			return NULL;
+		}
+		CURLStream *n = CURLStreamHandOver(s);
+		CURLStreamSetupHandle(s);
+		s = n;
+	}
+
+	return s;
+}
+
+
+CURLStream *
+CURLStreamNewPost(NPP_t *plugin, 
+		  const char *url, 
+		  Bool notify, 
+		  void* notifyData,
+		  const char *buf, 
+		  uint32 len,
+		  Bool is_file)
+{
+	FILE *infile = NULL;
+
+	if (is_file) {
+		infile = fopen(buf, "r");
+		if (!infile) {
+			Warning("Error opening file '%s' for posting: %s\n", 
+				buf, strerror(errno));
+			return NULL;
+		}
+	}
+
+	CURLStream *s = CURLStreamCreate(plugin, url, notify, notifyData, True);
+	if (!s) {
+		fclose(infile);
+		return NULL;
+	}
+
+	CURL *req = CURLNetHandle(s->xfer);
+	if (is_file) {
+		s->infile = infile;
+		curl_easy_setopt(req, CURLOPT_INFILE, s->infile);
+	} else {
+		/* buf belongs to the plugin, and only until we return. */
+		curl_easy_setopt(req, CURLOPT_POSTFIELDSIZE, (long) len);
+		curl_easy_setopt(req, CURLOPT_COPYPOSTFIELDS, buf);
+	}
+
+	curl_easy_setopt(req, CURLOPT_POST, 1L);
+
+	return s;
+}
+
+
+/* Add a curl_easy_getinfo time, in microseconds, to h as ms. */
+static void
+CURLStreamAddTime(CURLStream *s, CURLINFO info, Histogram *h)
+{
+	curl_off_t usec = 0;
+	if (curl_easy_getinfo(CURLNetHandle(s->xfer), info, &usec) == 
+	    CURLE_OK && usec > 0) {
+		HistogramAdd(h, usec / 1000.0);
+	}
+}
+
+
+/* Fold the metrics of a finished stream into curl_stats. */
+static void
+CURLStreamRecordStats(CURLStream *s, NPReason reason)
+{
+	double now = StatsNow();
+
+	if (s->blocked_since) {
+		s->blocked_ms += now - s->blocked_since;
+		s->blocked_since = 0;
+	}
+
+	curl_stats.streams++;
+	if (reason != NPRES_DONE) {
+		curl_stats.failed++;
+	}
+	curl_stats.bytes += s->bytes;
+
+	if (s->first_byte_at) {
+		HistogramAdd(&curl_stats.ttfb, s->first_byte_at - s->created_at);
+	}
+	HistogramAdd(&curl_stats.total, now - s->created_at);
+	HistogramAdd(&curl_stats.blocked, s->blocked_ms);
+	HistogramAdd(&curl_stats.size, s->bytes);
+	HistogramAdd(&curl_stats.writes, s->writes);
+
+	if (s->xfer && !CURLNetRunning(s->xfer) && !s->cache_hit) {
+		CURLStreamAddTime(s, CURLINFO_NAMELOOKUP_TIME_T, 
+				  &curl_stats.namelookup);
+		CURLStreamAddTime(s, CURLINFO_CONNECT_TIME_T, 
+				  &curl_stats.connect);
+		CURLStreamAddTime(s, CURLINFO_APPCONNECT_TIME_T, 
+				  &curl_stats.appconnect);
+		CURLStreamAddTime(s, CURLINFO_STARTTRANSFER_TIME_T, 
+				  &curl_stats.starttransfer);
+	}
+
+	CURLStreamRecord *r = &curl_stats.recent[curl_stats.recent_next];
+	curl_stats.recent_next = 
+		(curl_stats.recent_next + 1) % CURLSTREAM_STATS_RECENT;
+
+	free(r->url);
+	r->url = strdup(s->absolute_url);
+	r->start_ms = s->created_at - (now - ElapsedMs());
+	r->ttfb_ms = s->first_byte_at ? s->first_byte_at - s->created_at : -1;
+	r->total_ms = now - s->created_at;
+	r->blocked_ms = s->blocked_ms;
+	r->queue_ms = s->queue_ms;
+	r->bytes = s->bytes;
+	r->writes = s->writes;
+	r->write_bytes = s->write_bytes;
+	r->cache_hit = s->cache_hit;
+	r->shared = s->shared;
+	r->priority = s->priority;
+	r->reason = reason;
+}
+
+
+/* StatsDumpFunc for the "curlstream" section. */
+static void
+CURLStreamDumpStats(FILE *f)
+{
+	fprintf(f, "{\n    \"streams\": %d, \"failed\": %d, \"bytes\": %ld",
+		curl_stats.streams, curl_stats.failed, curl_stats.bytes);
+	fprintf(f, ",\n    \"max_streams\": %d, \"max_host_streams\": %d, "
+		"\"active\": %d, \"active_max\": %d, \"queued\": %d, "
+		"\"queued_max\": %d", curl_max_streams, curl_max_host_streams,
+		curl_active, curl_stats.active_max, curl_stats.queued,
+		curl_stats.queued_max);
+	fprintf(f, ",\n    \"deduped\": %d, \"bytes_saved\": %ld",
+		curl_stats.deduped, curl_stats.bytes_saved);
+	fprintf(f, ",\n    \"write_delay\": %d, \"ready_calls\": %ld, "
+		"\"batched\": %ld", curl_write_delay, curl_stats.ready_calls,
+		curl_stats.batched);
+	fprintf(f, ",\n    \"encoded\": %d, \"encoded_bytes\": %ld, "
+		"\"decoded_bytes\": %ld", curl_stats.encoded,
+		curl_stats.encoded_bytes, curl_stats.decoded_bytes);
+
+	struct { const char *name; Histogram *h; } hists[] = {
+		{ "ttfb_ms",          &curl_stats.ttfb },
+		{ "total_ms",         &curl_stats.total },
+		{ "namelookup_ms",    &curl_stats.namelookup },
+		{ "connect_ms",       &curl_stats.connect },
+		{ "appconnect_ms",    &curl_stats.appconnect },
+		{ "starttransfer_ms", &curl_stats.starttransfer },
+		{ "blocked_ms",       &curl_stats.blocked },
+		{ "bytes",            &curl_stats.size },
+		{ "writes",           &curl_stats.writes },
+		{ "write_size",       &curl_stats.write_size },
+		{ "queue_urgent_ms",  &curl_stats.queue[CURLSTREAM_URGENT] },
+		{ "queue_high_ms",    &curl_stats.queue[CURLSTREAM_HIGH] },
+		{ "queue_bulk_ms",    &curl_stats.queue[CURLSTREAM_BULK] },
+	};
+	for (int i = 0; i < sizeof(hists) / sizeof(hists[0]); i++) {
+		fprintf(f, ",\n    ");
+		HistogramDump(f, hists[i].name, hists[i].h);
+	}
+
+	/* Oldest first */
+	fprintf(f, ",\n    \"recent\": [");
+	Bool first = True;
+	for (int i = 0; i < CURLSTREAM_STATS_RECENT; i++) {
+		CURLStreamRecord *r = &curl_stats.recent[
+			(curl_stats.recent_next + i) % CURLSTREAM_STATS_RECENT];
+		if (!r->url) {
+			continue;
+		}
+
+		fprintf(f, "%s\n      { \"url\": ", first ? "" : ",");
+		StatsJSONString(f, r->url);
+		fprintf(f, ", \"start_ms\": %.1f, \"ttfb_ms\": %.1f, "
+			"\"total_ms\": %.1f, \"blocked_ms\": %.1f, "
+			"\"queue_ms\": %.1f, \"priority\": \"%s\", "
+			"\"bytes\": %ld, \"writes\": %d, "
+			"\"avg_write\": %ld, \"cache_hit\": %s, "
+			"\"shared\": %s, \"reason\": %d }",
+			r->start_ms, r->ttfb_ms, r->total_ms, r->blocked_ms,
+			r->queue_ms, curl_priority_names[r->priority],
+			r->bytes, r->writes, 
+			r->writes ? r->write_bytes / r->writes : 0,
+			r->cache_hit ? "true" : "false",
+			r->shared ? "true" : "false", r->reason);
+		first = False;
+	}
+	fprintf(f, " ]\n  }");
+}
+
+
+void 
+CURLStreamDestroy(CURLStream *s, NPReason reason)
+{
+	Debug("CURLStreamDestroy curlstream=%p, reason=%d\n", s, reason);
+
+	if (s->busy) {
+		/* Called from NPP_Write; finish once the write returns. */
+		s->destroy_pending = True;
+		s->destroy_reason = reason;
+		return;
+	}
+
+	if (s->drain_timer) {
+		MainLoopRemoveTimer(s->drain_timer);
+		s->drain_timer = NULL;
+	}
+	if (s->range_timer) {
+		MainLoopRemoveTimer(s->range_timer);
+		s->range_timer = NULL;
+	}
+	if (s->batch_timer) {
+		MainLoopRemoveTimer(s->batch_timer);
+		s->batch_timer = NULL;
+	}
+	ByteRangeFree(s->ranges);
+
+	if (s->leader) {
+		CURLStreamDetach(s);
+	} else if (s->followers) {
+		CURLStreamHandOver(s);
+	}
+	CURLStreamUnjoin(s);
+	if (s->queued) {
+		CURLStreamUnqueue(s);
+	}
+
+	if (s->started && reason == NPRES_DONE && s->outfile_path) {
+		fflush(s->outfile);
+		CallNPP_StreamAsFileProc(plugin_funcs.asfile, s->plugin,
+					 &s->np_stream, s->outfile_path);
+	}
+
+	CURLStreamRecordStats(s, reason);
+
+	if (s->notify) {
+		CallNPP_URLNotifyProc(plugin_funcs.urlnotify, 
+				      s->plugin, s->np_stream.url,
+				      reason, s->np_stream.notifyData);
+	}
+	if (s->started) {
+		CallNPP_DestroyStreamProc(plugin_funcs.destroystream, 
+					  s->plugin, &s->np_stream, reason);
+	}
+
+	CURLStreamRelease(s);
+	if (s->xfer) {
+		CURLNetRemove(s->xfer);
+	}
+
+	if (s->cache_file) {
+		HTTPCacheEntryAbort(s->cache, s->cache_file);
+	}
+	if (s->cache) {
+		HTTPCacheEntryFree(s->cache);
+	}
+	curl_slist_free_all(s->headers);
+	if (s->decoder) {
+		DecoderFree(s->decoder);
+	}
+
+	free((char *) s->np_stream.url);
+	free(s->absolute_url);
+	free(s->key);
+	free(s->mimetype);
+
+	if (s->outfile) {
+		fclose(s->outfile);
+	}
+	if (s->outfile_path && !s->outfile_memfd) {
+		unlink(s->outfile_path);
+	}
+	free(s->outfile_path);
+
+	if (s->infile) {
+		fclose(s->infile);
+	}
+	free(s->ring);
+	free(s);
+}
+
+
+static void
+CURLStreamDestroyCb(void *stream, NPReason reason)
+{
+	CURLStreamDestroy((CURLStream *) stream, reason);
+}
+
+
+/* 
+ * Start an HTTP range request for the next queued NPN_RequestRead range,
+ * merged with any queued ranges it overlaps or adjoins.
+ */
+static void
+CURLStreamNextRange(CURLStream *s)
+{
+	uint32 offset, length;
+
+	if (s->range_active || !ByteRangePop(&s->ranges, &offset, &length)) {
+		return;
+	}
+
+	char range[64];
+	snprintf(range, sizeof(range), "%u-%u", offset, offset + length - 1);
+	Debug("CURLStreamNextRange curlstream=%p, range=%s\n", s, range);
+
+	CURLStreamRelease(s);
+	if (!s->xfer) {
+		CURLStreamSetupHandle(s);
+	}
+	CURL *req = CURLNetHandle(s->xfer);
+	curl_easy_setopt(req, CURLOPT_RANGE, range);
+	/* Ranges are of the body as is. */
+	curl_easy_setopt(req, CURLOPT_ACCEPT_ENCODING, NULL);
+
+	s->outfile_idx = offset;
+	s->range_active = True;
+	s->range_check = True;
+	CURLStreamEnqueue(s, CURLSTREAM_URGENT);
+}
+
+
+/* Timer callback: start range requests outside libcurl callbacks. */
+static void
+CURLStreamRangeTimeout(void *data)
+{
+	CURLStream *s = (CURLStream *) data;
+
+	s->range_timer = NULL;
+	CURLStreamNextRange(s);
+}
+
+
+/* Queue ranges of an NP_SEEK stream to be fetched with range requests. */
+static NPError
+CURLStreamRequestRead(void *stream, NPByteRange *ranges)
+{
+	CURLStream *s = (CURLStream *) stream;
+
+	if (!CURLStreamIsSeeking(s)) {
+		return NPERR_STREAM_NOT_SEEKABLE;
+	}
+
+	s->ranges = ByteRangeQueue(s->ranges, ranges, s->np_stream.end);
+	if (!s->range_active && !s->range_timer) {
+		/* Might be inside NPP_Write, where libcurl can't be reentered. */
+		s->range_timer = MainLoopAddTimer(0, CURLStreamRangeTimeout, s);
+	}
+
+	return NPERR_NO_ERROR;
+}
+
+
+/* 
+ * A transfer has finished and its data has been delivered.  Seekable
+ * streams stay open for the next range; all others are destroyed, as are
+ * streams whose range failed, since the plugin would wait for it forever.
+ */
+static void
+CURLStreamFinish(CURLStream *s, NPReason reason)
+{
+	Bool range_failed = s->range_active && reason != NPRES_DONE;
+
+	if (CURLStreamIsSeeking(s) && !s->destroy_pending && !range_failed) {
+		/* Idle until the plugin asks for more. */
+		s->range_active = False;
+		CURLStreamRelease(s);
+		CURLStreamNextRange(s);
+	} else {
+		CURLStreamDestroy(s, reason);
+	}
+}
+
+
+void 
+CURLStreamInit(const CURLStreamOptions *options)
+{
+	curl_baseurl = options->baseurl ? strdup(options->baseurl) : NULL;
+	curl_asfile_dir = strdup(options->asfile_dir ? 
+				 options->asfile_dir : "/tmp");
+	curl_asfile_memfd = options->asfile_memfd;
+	curl_write_delay = options->write_delay;
+
+	curl_http2 = options->http2;
+
+	/* HTTP/2 multiplexes a host's streams over one connection. */
+	curl_max_streams = options->max_streams;
+	curl_max_host_streams = curl_http2 ? 0 : options->max_host_streams;
+
+	CURLNetInit(options->thread, curl_http2, 
+		    options->max_host_connections, CURLStreamNetEvent);
+
+	StatsAddSection("curlstream", CURLStreamDumpStats);
+}
+
+
+void 
+CURLStreamShutdown(void)
+{
+	if (curl_admit_timer) {
+		MainLoopRemoveTimer(curl_admit_timer);
+		curl_admit_timer = NULL;
+	}
+	while (curl_hosts) {
+		CURLStreamHost *next = curl_hosts->next;
+		free(curl_hosts->name);
+		free(curl_hosts);
+		curl_hosts = next;
+	}
+	CURLNetShutdown();
+
+	for (int i = 0; i < CURLSTREAM_STATS_RECENT; i++) {
+		free(curl_stats.recent[i].url);
+		curl_stats.recent[i].url = NULL;
+	}
+
+	free(curl_baseurl);
+	free(curl_asfile_dir);
+}
+
+
+/* The transfer s was getting its data from has finished. */
+static void
+CURLStreamEnd(CURLStream *s, NPReason reason)
+{
+	if (s->ring_len > 0 && reason == NPRES_DONE) {
+		/* Let the drain timeout deliver the rest first. */
+		s->done = True;
+		s->done_reason = reason;
+	} else {
+		CURLStreamFinish(s, reason);
+	}
+}
+
+
+/* 
+ * Note whether the server accepts byte ranges and how the body is
+ * encoded, and collect validators for the cache, from the response
+ * headers of the transfer of s.
+ */
+static void
+CURLStreamReadHeaders(CURLStream *s)
+{
+	const CURLNetResponse *r = CURLNetGetResponse(s->xfer);
+	char *line = r->headers;
+
+	while (line && *line) {
+		int len = strcspn(line, "\n");
+		if (line[len] == '\n') {
+			len++;
+		}
+
+		if (s->cache && !s->cache_hit) {
+			HTTPCacheEntryHeader(s->cache, line, len);
+		}
+
+		char *header = strndup(line, len);
+		header[strcspn(header, "\r\n")] = '\0';
+		char *value = strchr(header, ':');
+		if (value) {
+			*value++ = '\0';
+			value += strspn(value, " \t");
+
+			if (!strcasecmp(header, "Accept-Ranges")) {
+				s->seekable = (strstr(value, "bytes") != NULL);
+			} else if (!strcasecmp(header, "Content-Encoding")) {
+				CURLStreamSetEncoding(s, value);
+			}
+		}
+		free(header);
+
+		line += len;
+	}
+}
+
+
+/* 
+ * True if the server answered the range request of s with neither the
+ * range nor the whole body, but an error.  Only HTTP has a code.
+ */
+static Bool
+CURLStreamRangeFailed(CURLStream *s)
+{
+	long code = CURLNetGetResponse(s->xfer)->code;
+
+	return s->range_active && code != 0 && code != 200 && code != 206;
+}
+
+
+/* Give up on the transfer of s, which nothing is sharing any more. */
+static void
+CURLStreamAbort(CURLStream *s)
+{
+	if (s->cache_file) {
+		HTTPCacheEntryAbort(s->cache, s->cache_file);
+		s->cache_file = NULL;
+	}
+
+	/* Streams between byte ranges go idle instead. */
+	CURLStreamFinish(s, s->destroy_pending ? s->destroy_reason : 
+			 NPRES_NETWORK_ERR);
+}
+
+
+/* 
+ * The transfer of s has finished and all of its body has been handed
+ * out.  Finish every stream that shared it.
+ */
+static void
+CURLStreamTransferDone(CURLStream *s)
+{
+	const CURLNetResponse *r = CURLNetGetResponse(s->xfer);
+
+	if (!s->started) {
+		CURLStreamReadHeaders(s);
+	}
+
+	NPReason reason = NPRES_DONE;
+	if (s->destroy_pending) {
+		reason = s->destroy_reason;
+	} else if (!s->started && s->cache && !s->cache_hit && 
+		   r->code == 304) {
+		/* Cached copy is still good. */
+		CURLStreamUseCache(s, True);
+		CURLNetAdd(s->xfer);
+		return;
+	} else if (r->result != CURLE_OK) {
+		Warning("Error loading '%s': %s\n", s->absolute_url,
+			curl_easy_strerror(r->result));
+		reason = NPRES_NETWORK_ERR;
+	} else if (CURLStreamRangeFailed(s)) {
+		Warning("Error loading a range of '%s': HTTP %ld\n",
+			s->absolute_url, r->code);
+		reason = NPRES_NETWORK_ERR;
+	} else if (s->decoder && !DecoderDone(s->decoder)) {
+		Warning("Error loading '%s': body cut short\n", 
+			s->absolute_url);
+		reason = NPRES_NETWORK_ERR;
+	} else if (!s->started) {
+		/* No body */
+		CURLStream *t = CURLStreamStartAll(s);
+		if (!t) {
+			CURLStreamAbort(s);
+			return;
+		}
+		s = t;
+	}
+
+	if (s->cache_file) {
+		if (reason == NPRES_DONE) {
+			HTTPCacheEntryCommit(s->cache, s->cache_file);
+		} else {
+			HTTPCacheEntryAbort(s->cache, s->cache_file);
+		}
+		s->cache_file = NULL;
+	}
+
+	while (s->followers) {
+		CURLStream *f = s->followers;
+		CURLStreamDetach(f);
+		CURLStreamEnd(f, reason);
+	}
+	CURLStreamEnd(s, reason);
+}
+
+
+/* 
+ * Hand len bytes at buffer to the plugin for as long as NPP_WriteReady
+ * allows.  Returns the number of bytes consumed, or -1 if the plugin
+ * failed the write and the stream should be aborted.
+ */
+static int
+CURLStreamDeliver(CURLStream *s, char *buffer, int len)
+{
+	int bytes_written = 0;
+
+	s->busy++;
+
+	while (bytes_written < len && !s->destroy_pending) {
+		int write_max = 
+			CallNPP_WriteReadyProc(plugin_funcs.writeready,
+					       s->plugin, &s->np_stream);
+		Debug("NPP_WriteReady: write_max = %d, end = %d\n", 
+		      write_max, s->np_stream.end);
+		curl_stats.ready_calls++;
+		s->ready_max = write_max;
+		if (write_max <= 0) {
+			break;
+		}
+
+		int written = 
+			CallNPP_WriteProc(plugin_funcs.write, s->plugin, 
+					  &s->np_stream, s->outfile_idx, 
+					  MIN(write_max, len - bytes_written),
+					  (void *) buffer);
+		Debug("NPP_Write: offset = %d, end = %d, "
+		      "written = %d\n", s->outfile_idx, s->np_stream.end, 
+		      written);
+		if (written < 0) {
+			s->busy--;
+			return -1;
+		} else if (written == 0) {
+			break;
+		}
+
+		s->writes++;
+		s->write_bytes += written;
+		HistogramAdd(&curl_stats.write_size, written);
+
+		s->outfile_idx += written;
+		buffer += written;
+		bytes_written += written;
+	}
+
+	double now = StatsNow();
+	if (s->blocked_since && bytes_written > 0) {
+		s->blocked_ms += now - s->blocked_since;
+		s->blocked_since = 0;
+	}
+	if (!s->blocked_since && bytes_written < len) {
+		s->blocked_since = now;
+	}
+
+	s->busy--;
+	return bytes_written;
+}
+
+
+/* 
+ * Append len bytes to the ring.  Caller checks there is room, unless the
+ * ring is empty, in which case it is grown to fit.
+ */
+static void
+CURLStreamRingPush(CURLStream *s, const char *buffer, int len)
+{
+	if (s->ring_len == 0 && len > s->ring_size) {
+		s->ring_size = MAX(len, CURLSTREAM_RING_SIZE);
+		s->ring = realloc(s->ring, s->ring_size);
+		s->ring_start = 0;
+	}
+	assert(len <= s->ring_size - s->ring_len);
+
+	int tail = (s->ring_start + s->ring_len) % s->ring_size;
+	int first = MIN(len, s->ring_size - tail);
+
+	memcpy(&s->ring[tail], buffer, first);
+	memcpy(s->ring, buffer + first, len - first);
+	s->ring_len += len;
+}
+
+
+/* 
+ * Feed buffered bytes to the plugin, oldest first, until the ring is empty
+ * or the plugin stops accepting data.  Returns False if the stream should
+ * be aborted.
+ */
+static Bool
+CURLStreamDrain(CURLStream *s)
+{
+	while (s->ring_len > 0) {
+		int len = MIN(s->ring_len, s->ring_size - s->ring_start);
+		int written = CURLStreamDeliver(s, &s->ring[s->ring_start], 
+						len);
+		if (written < 0) {
+			return False;
+		}
+
+		s->ring_start = (s->ring_start + written) % s->ring_size;
+		s->ring_len -= written;
+		if (s->ring_len == 0) {
+			s->ring_start = 0;
+		}
+		if (written < len) {
+			break;
+		}
+	}
+
+	return True;
+}
+
+
+static void CURLStreamDrainTimeout(void *data);
+static void CURLStreamPull(CURLStream *s);
+
+
+/* 
+ * Resume the paused transfer of s once every stream sharing it has room
+ * for more.
+ */
+static void
+CURLStreamCheckResume(CURLStream *s)
+{
+	if (!s->paused) {
+		return;
+	}
+	for (CURLStream *i = s; i; i = CURLStreamNextSharing(s, i)) {
+		if (i->ring_len > i->ring_size / 2) {
+			return;
+		}
+	}
+
+	/* May finish and destroy any of them before returning. */
+	s->paused = False;
+	CURLStreamPull(s);
+}
+
+
+static void
+CURLStreamScheduleDrain(CURLStream *s)
+{
+	if (!s->drain_timer) {
+		s->drain_timer = MainLoopAddTimer(CURLSTREAM_DRAIN_INTERVAL,
+						  CURLStreamDrainTimeout, s);
+	}
+}
+
+
+/* 
+ * Timer callback: retry delivering the backlog, resume a paused
+ * transfer once there is room again, and finish streams whose transfer
+ * completed while data was still buffered.
+ */
+static void
+CURLStreamDrainTimeout(void *data)
+{
+	CURLStream *s = (CURLStream *) data;
+	s->drain_timer = NULL;
+
+	Bool ok = CURLStreamDrain(s);
+	if (s->destroy_pending) {
+		CURLStreamDestroy(s, s->destroy_reason);
+		return;
+	} else if (!ok) {
+		CURLStreamDestroy(s, NPRES_USER_BREAK);
+		return;
+	}
+
+	if (s->ring_len == 0 && s->done) {
+		s->done = False;
+		CURLStreamFinish(s, s->done_reason);
+		return;
+	}
+
+	if (s->ring_len > 0) {
+		CURLStreamScheduleDrain(s);
+	}
+
+	CURLStreamCheckResume(CURLStreamOwner(s));
+}
+
+
+/* 
+ * Copy received data to the NP_ASFILE file.  Returns False if the file
+ * can't be written.
+ */
+static Bool
+CURLStreamSave(CURLStream *s, char *buffer, int len)
+{
+	s->bytes += len;
+
+	if (s->outfile && fwrite(buffer, 1, len, s->outfile) != len) {
+		Warning("Error writing '%s': %s\n", s->outfile_path, 
+			strerror(errno));
+		return False;
+	}
+
+	return True;
+}
+
+
+/* Copy a chunk of the body, as sent, to the cache. */
+static void
+CURLStreamSaveCache(CURLStream *s, char *buffer, int len)
+{
+	if (s->cache_file && fwrite(buffer, 1, len, s->cache_file) != len) {
+		Warning("Error writing '%s': %s\n", s->cache->tmp_path, 
+			strerror(errno));
+		HTTPCacheEntryAbort(s->cache, s->cache_file);
+		s->cache_file = NULL;
+	}
+}
+
+
+/* 
+ * Decode the len byte chunk at buffer, or with len 0 more of the last
+ * one, just once however many times the transfer of s tries handing the
+ * piece out.  Returns the length of the piece, at *data, or -1 if the
+ * body is corrupt.
+ */
+static int
+CURLStreamDecode(CURLStream *s, char *buffer, int len, char **data)
+{
+	if (!s->decoded_held) {
+		s->decoded_len = DecoderWrite(s->decoder, buffer, len, 
+					      &s->decoded);
+		s->decoded_raw = len;
+		s->decoded_held = True;
+
+		curl_stats.encoded_bytes += len;
+		curl_stats.decoded_bytes += MAX(s->decoded_len, 0);
+	}
+	assert(len == s->decoded_raw);
+
+	*data = s->decoded;
+	return s->decoded_len;
+}
+
+
+/* 
+ * Make sure s can take a len byte chunk, delivering any backlog first.
+ * Returns 1 if it can, 0 if the transfer must pause until its ring has
+ * room, or -1 if the stream failed.
+ */
+static int
+CURLStreamMakeRoom(CURLStream *s, int len)
+{
+	if (s->destroy_pending) {
+		return -1;
+	} else if (s->stype == NP_ASFILEONLY || s->ring_len == 0) {
+		return 1;
+	}
+
+	if (!CURLStreamDrain(s) || s->destroy_pending) {
+		return -1;
+	}
+	if (s->ring_len > 0 && len > s->ring_size - s->ring_len) {
+		CURLStreamScheduleDrain(s);
+		return 0;
+	}
+
+	return 1;
+}
+
+
+/* 
+ * Pass a chunk straight to the plugin when nothing is queued, and keep
+ * whatever it is not ready for in the ring.  Returns False if the stream
+ * failed.
+ */
+static Bool
+CURLStreamReceive(CURLStream *s, char *buffer, int len)
+{
+	if (!CURLStreamSave(s, buffer, len)) {
+		return False;
+	} else if (s->stype == NP_ASFILEONLY) {
+		// Don't send WriteReady and Write calls for ASFILEONLY
+		return True;
+	}
+
+	int written = 0;
+	if (s->ring_len == 0) {
+		written = CURLStreamDeliver(s, buffer, len);
+		if (written < 0 || s->destroy_pending) {
+			return False;
+		}
+	}
+
+	if (written < len) {
+		CURLStreamRingPush(s, buffer + written, len - written);
+		CURLStreamScheduleDrain(s);
+	}
+
+	return True;
+}
+
+
+/* 
+ * Hand the next chunk of the body to every stream sharing the transfer
+ * of s.  If any of their rings cannot take it, none gets it and s is
+ * left paused, to be pulled from again once they have room.  Returns
+ * the stream owning the transfer now, or NULL if it was given up.
+ */
+static CURLStream *
+CURLStreamWrite(CURLStream *s, char *buffer, int len)
+{
+	Debug("CURLStreamWrite buffer=%p, len=%d, curlstream=%p\n", 
+	      buffer, len, s);
+
+	const CURLNetResponse *r = CURLNetGetResponse(s->xfer);
+
+	CURLStream *t = CURLStreamDropPending(s);
+	if (!t) {
+		CURLStreamAbort(s);
+		return NULL;
+	}
+	s = t;
+
+	for (CURLStream *i = s; i; i = CURLStreamNextSharing(s, i)) {
+		if (!i->first_byte_at) {
+			i->first_byte_at = r->first_byte_at;
+		}
+	}
+
+	if (!s->started) {
+		CURLStreamReadHeaders(s);
+
+		t = CURLStreamStartAll(s);
+		if (!t) {
+			/* Failed, or waiting for NPN_RequestRead instead */
+			CURLStreamAbort(s);
+			return NULL;
+		}
+		s = t;
+	}
+
+	if (s->range_check) {
+		if (CURLStreamRangeFailed(s)) {
+			/* Not movie bytes; don't write them at outfile_idx. */
+			Warning("Error loading a range of '%s': HTTP %ld\n",
+				s->absolute_url, r->code);
+			CURLStreamAbort(s);
+			return NULL;
+		}
+		/* Servers may ignore Range and send the whole body. */
+		if (r->code == 200) {
+			s->outfile_idx = 0;
+		}
+		s->range_check = False;
+	}
+
+	/* What the plugin gets */
+	char *data = buffer;
+	int data_len = len;
+	if (s->decoder) {
+		data_len = CURLStreamDecode(s, buffer, len, &data);
+	}
+
+	Bool pause = False;
+	int sharing = 0;
+
+	CURLStreamHold(s, 1);
+	for (CURLStream *i = s; i; i = CURLStreamNextSharing(s, i)) {
+		int room = (data_len < 0) ? -1 : CURLStreamMakeRoom(i, data_len);
+		if (room < 0) {
+			CURLStreamFail(i);
+		} else if (room == 0) {
+			pause = True;
+		}
+	}
+	for (CURLStream *i = s; i && !pause; i = CURLStreamNextSharing(s, i)) {
+		if (i->destroy_pending) {
+			continue;
+		} else if (!CURLStreamReceive(i, data, data_len)) {
+			CURLStreamFail(i);
+		} else {
+			sharing++;
+		}
+	}
+	CURLStreamHold(s, -1);
+
+	if (!pause) {
+		CURLStreamSaveCache(s, buffer, len);
+		s->decoded_held = False;
+	}
+	if (sharing > 1) {
+		curl_stats.bytes_saved += (long) len * (sharing - 1);
+	}
+
+	CURLStream *n = CURLStreamDropPending(s);
+	if (!n) {
+		CURLStreamAbort(s);
+		return NULL;
+	} else if (pause) {
+		Debug("CURLStreamWrite: pausing curlstream=%p\n", n);
+		n->paused = True;
+	}
+
+	return n;
+}
+
+
+/* Timer callback: write what was held back, now that it is due. */
+static void
+CURLStreamBatchTimeout(void *data)
+{
+	CURLStream *s = (CURLStream *) data;
+	s->batch_timer = NULL;
+
+	if (!s->paused) {
+		CURLStreamPull(s);
+	}
+}
+
+
+static void
+CURLStreamScheduleBatch(CURLStream *s)
+{
+	if (!s->batch_timer) {
+		double wait = s->batch_since + curl_write_delay - StatsNow();
+		s->batch_timer = MainLoopAddTimer(MAX(0, (int) wait + 1), 
+						  CURLStreamBatchTimeout, s);
+	}
+}
+
+
+/* 
+ * Whether to leave the len bytes the transfer of s has received for
+ * later, so they can go to the plugin in one NPP_Write with more that
+ * is on its way.  Never for the first bytes, or past the write delay.
+ */
+static Bool
+CURLStreamHoldBack(CURLStream *s, int len)
+{
+	int want = MIN(s->ready_max, CURLSTREAM_BATCH_MAX);
+	double now = StatsNow();
+
+	/* Not if it is enough, the last of it, or the ring wraps after it */
+	if (curl_write_delay && s->started && len < want && 
+	    CURLNetRunning(s->xfer) && CURLNetPending(s->xfer) == len) {
+		if (!s->batch_since) {
+			s->batch_since = now;
+			curl_stats.batched++;
+		}
+		if (now - s->batch_since < curl_write_delay) {
+			CURLStreamScheduleBatch(s);
+			return True;
+		}
+	}
+
+	s->batch_since = 0;
+	if (s->batch_timer) {
+		MainLoopRemoveTimer(s->batch_timer);
+		s->batch_timer = NULL;
+	}
+	return False;
+}
+
+
+/* 
+ * Pass on what the transfer of s has received, until it is all out or
+ * some stream sharing it has no room, and finish them all once it is
+ * done.
+ */
+static void
+CURLStreamPull(CURLStream *s)
+{
+	while (s) {
+		char *buffer;
+		int len = CURLNetPeek(s->xfer, &buffer);
+
+		if (s->decoded_held) {
+			/* Decoded already, and waiting for room */
+			len = s->decoded_raw;
+		} else if (s->decoder && DecoderPending(s->decoder)) {
+			/* The rest of the last chunk goes first. */
+			len = 0;
+		} else if (len == 0) {
+			if (!CURLNetRunning(s->xfer)) {
+				CURLStreamTransferDone(s);
+			}
+			return;
+		} else if (CURLStreamHoldBack(s, len)) {
+			return;
+		} else {
+			len = MIN(len, CURLSTREAM_BATCH_MAX);
+		}
+
+		s = CURLStreamWrite(s, buffer, len);
+		if (s && !s->paused) {
+			CURLNetConsume(s->xfer, len);
+		} else {
+			return;
+		}
+	}
+}
+
+
+/* CURLNetFunc: The transfer of a stream has more data, or is done. */
+static void
+CURLStreamNetEvent(CURLTransfer *t, CURLNetEvent event)
+{
+	CURLStream *s = (CURLStream *) CURLNetGetData(t);
+
+	if (!s->paused) {
+		CURLStreamPull(s);
+	}
 }
@@ -14,6 +14,27 @@
 
 typedef struct _CURLStream CURLStream;
 
+typedef struct _CURLStreamOptions
+{
+	const char *baseurl;     /* Prefix for relative URLs */
+	const char *asfile_dir;  /* Where NP_ASFILE downloads go, or NULL */
+	Bool        asfile_memfd; /* Keep NP_ASFILE downloads in memory */
+	Bool        http2;       /* Multiplex requests over HTTP/2 */
+	int         max_host_connections; /* 0 for no limit */
+	int         max_streams; /* Transfers at once, 0 for no limit */
+	int         max_host_streams; /* Per host, 0 for no limit */
+	Bool        thread;      /* Run libcurl on a thread of its own */
+	int         write_delay; /* ms to hold small chunks back, 0 not to */
+} CURLStreamOptions;
+
+
+/* Browser-like admission limits */
+#define CURLSTREAM_MAX_STREAMS 24
+#define CURLSTREAM_MAX_HOST_STREAMS 6
+
+/* Long enough to gather a few packets, short of a frame at 60fps */
+#define CURLSTREAM_WRITE_DELAY 5 /* ms */
+
 
 CURLStream *CURLStreamNew(NPP_t *plugin, 
 			  const char *url, 
@@ -30,7 +51,7 @@ CURLStream *CURLStreamNewPost(NPP_t *plugin,
 
 void CURLStreamDestroy(CURLStream *s, NPReason reason);
 
-void CURLStreamInit(const char *baseurl);
+void CURLStreamInit(const CURLStreamOptions *options);
 
 void CURLStreamShutdown(void);
 
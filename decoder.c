@@ -0,0 +1,378 @@
+/*==========================================================================*\
+ *
+ * decoder.c - Streaming Content-Encoding decoders for flasher.
+ * flasher (C) 2006 Alex Graveley
+ *
+\*==========================================================================*/
+
+
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+#ifdef HAVE_BROTLI
+#include <brotli/decode.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "decoder.h"
+#include "flasher.h"
+
+
+/*
+ * We ask for and decode bodies ourselves, rather than have libcurl do
+ * it, so the cache can keep them as they were sent.  Each decoder takes
+ * the body a chunk at a time, and hands back at most DECODER_OUT_MAX
+ * bytes of what it decodes to; a chunk that decodes to more is kept
+ * until DecoderWrite is called again for the rest.
+ */
+
+
+/* No more than a CURLStream's ring holds, however well the body packs */
+#define DECODER_OUT_MAX (256 * 1024)
+
+
+typedef enum
+{
+	DECODER_GZIP,
+	DECODER_DEFLATE,
+#ifdef HAVE_BROTLI
+	DECODER_BROTLI,
+#endif
+#ifdef HAVE_ZSTD
+	DECODER_ZSTD,
+#endif
+} DecoderKind;
+
+
+struct _Decoder
+{
+	DecoderKind kind;
+	Bool done;     /* At the end of the encoded body, so far */
+	long total_in; /* Encoded bytes taken */
+
+	z_stream z;
+	Bool     raw; /* deflate without the zlib wrapper, as some send it */
+#ifdef HAVE_BROTLI
+	BrotliDecoderState *brotli;
+#endif
+#ifdef HAVE_ZSTD
+	ZSTD_DStream *zstd;
+#endif
+
+	char *out;
+	int   out_len;
+	Bool  full; /* Stopped with out full, maybe short of the input's end */
+
+	/* Input not decoded yet, for lack of room in out */
+	char *in;
+	int   in_len;
+	int   in_size;
+};
+
+
+static const char decoder_accept[] = "gzip, deflate"
+#ifdef HAVE_BROTLI
+	", br"
+#endif
+#ifdef HAVE_ZSTD
+	", zstd"
+#endif
+	;
+
+
+/* The Accept-Encoding to send: every coding we can decode */
+const char *
+DecoderAcceptEncoding(void)
+{
+	return decoder_accept;
+}
+
+
+/*
+ * A decoder for a Content-Encoding, or NULL if it is identity or one we
+ * don't support.
+ */
+Decoder *
+DecoderNew(const char *encoding)
+{
+	DecoderKind kind;
+
+	if (!strcasecmp(encoding, "gzip") || !strcasecmp(encoding, "x-gzip")) {
+		kind = DECODER_GZIP;
+	} else if (!strcasecmp(encoding, "deflate")) {
+		kind = DECODER_DEFLATE;
+#ifdef HAVE_BROTLI
+	} else if (!strcasecmp(encoding, "br")) {
+		kind = DECODER_BROTLI;
+#endif
+#ifdef HAVE_ZSTD
+	} else if (!strcasecmp(encoding, "zstd")) {
+		kind = DECODER_ZSTD;
+#endif
+	} else {
+		return NULL;
+	}
+
+	Decoder *d = calloc(1, sizeof(Decoder));
+	d->kind = kind;
+
+	switch (kind) {
+	case DECODER_GZIP:
+		/* Either wrapper, as servers mix them up */
+		inflateInit2(&d->z, MAX_WBITS + 32);
+		break;
+	case DECODER_DEFLATE:
+		inflateInit(&d->z);
+		break;
+#ifdef HAVE_BROTLI
+	case DECODER_BROTLI:
+		d->brotli = BrotliDecoderCreateInstance(NULL, NULL, NULL);
+		break;
+#endif
+#ifdef HAVE_ZSTD
+	case DECODER_ZSTD:
+		d->zstd = ZSTD_createDStream();
+		ZSTD_initDStream(d->zstd);
+		break;
+#endif
+	}
+
+	d->out = malloc(DECODER_OUT_MAX);
+
+	return d;
+}
+
+
+/*
+ * Each of these decodes from in until out is full or len bytes are used
+ * up, and returns how many were, or -1 if the body is corrupt.
+ */
+
+static int
+DecoderInflate(Decoder *d, const char *in, int len)
+{
+	d->z.next_in = (Bytef *) in;
+	d->z.avail_in = len;
+
+	while (d->out_len < DECODER_OUT_MAX) {
+		if (d->done) {
+			if (d->kind != DECODER_GZIP || !d->z.avail_in) {
+				/* Anything after the end is ignored. */
+				return len;
+			}
+			/* Another gzip member follows. */
+			inflateReset(&d->z);
+			d->done = False;
+		}
+
+		d->z.next_out = (Bytef *) d->out + d->out_len;
+		d->z.avail_out = DECODER_OUT_MAX - d->out_len;
+
+		int err = inflate(&d->z, Z_NO_FLUSH);
+		d->out_len = DECODER_OUT_MAX - d->z.avail_out;
+
+		if (err == Z_STREAM_END) {
+			d->done = True;
+		} else if (err == Z_DATA_ERROR && d->kind == DECODER_DEFLATE &&
+			   !d->raw && d->z.total_out == 0) {
+			/* No zlib wrapper; start over without one. */
+			inflateEnd(&d->z);
+			inflateInit2(&d->z, -MAX_WBITS);
+			d->raw = True;
+			d->z.next_in = (Bytef *) in;
+			d->z.avail_in = len;
+		} else if (err == Z_BUF_ERROR ||
+			   (err == Z_OK && d->z.avail_out > 0)) {
+			/* Wants more input */
+			break;
+		} else if (err != Z_OK) {
+			Warning("Error inflating body: %s\n",
+				d->z.msg ? d->z.msg : "unknown");
+			return -1;
+		}
+	}
+
+	return len - d->z.avail_in;
+}
+
+
+#ifdef HAVE_BROTLI
+static int
+DecoderBrotli(Decoder *d, const char *in, int len)
+{
+	const uint8_t *next_in = (const uint8_t *) in;
+	size_t avail_in = len;
+
+	while (!d->done && d->out_len < DECODER_OUT_MAX) {
+		uint8_t *next_out = (uint8_t *) d->out + d->out_len;
+		size_t avail_out = DECODER_OUT_MAX - d->out_len;
+
+		BrotliDecoderResult res =
+			BrotliDecoderDecompressStream(d->brotli,
+						      &avail_in, &next_in,
+						      &avail_out, &next_out,
+						      NULL);
+		d->out_len = DECODER_OUT_MAX - avail_out;
+
+		if (res == BROTLI_DECODER_RESULT_SUCCESS) {
+			d->done = True;
+		} else if (res == BROTLI_DECODER_RESULT_NEEDS_MORE_INPUT) {
+			break;
+		} else if (res == BROTLI_DECODER_RESULT_ERROR) {
+			Warning("Error decoding body: %s\n",
+				BrotliDecoderErrorString(
+					BrotliDecoderGetErrorCode(d->brotli)));
+			return -1;
+		}
+	}
+
+	/* Anything after the end is ignored. */
+	return d->done ? len : len - avail_in;
+}
+#endif
+
+
+#ifdef HAVE_ZSTD
+static int
+DecoderZstd(Decoder *d, const char *in, int len)
+{
+	ZSTD_inBuffer input = { in, len, 0 };
+
+	while (d->out_len < DECODER_OUT_MAX) {
+		ZSTD_outBuffer output = { d->out + d->out_len,
+					  DECODER_OUT_MAX - d->out_len, 0 };
+
+		size_t ret = ZSTD_decompressStream(d->zstd, &output, &input);
+		if (ZSTD_isError(ret)) {
+			Warning("Error decoding body: %s\n",
+				ZSTD_getErrorName(ret));
+			return -1;
+		}
+		d->out_len += output.pos;
+
+		/* Between frames; another may follow. */
+		d->done = (ret == 0);
+
+		if (input.pos == input.size && output.pos < output.size) {
+			break;
+		}
+	}
+
+	return input.pos;
+}
+#endif
+
+
+/*
+ * Decode len more bytes of the body, after any kept from before.
+ * Returns up to DECODER_OUT_MAX bytes they decode to, at *out until the
+ * next call, or -1 if the body is corrupt.  If DecoderPending says there
+ * is more, call again, with no new input if need be, to get it.
+ */
+int
+DecoderWrite(Decoder *d, const char *in, int len, char **out)
+{
+	d->out_len = 0;
+	d->total_in += len;
+
+	/* Decoded from the caller's buffer, unless some are kept already */
+	if (d->in_len > 0 && len > 0) {
+		if (d->in_len + len > d->in_size) {
+			d->in_size = d->in_len + len;
+			d->in = realloc(d->in, d->in_size);
+		}
+		memcpy(d->in + d->in_len, in, len);
+		d->in_len += len;
+	}
+	if (d->in_len > 0) {
+		in = d->in;
+		len = d->in_len;
+	}
+
+	int used = 0;
+	switch (d->kind) {
+	case DECODER_GZIP:
+	case DECODER_DEFLATE:
+		used = DecoderInflate(d, in, len);
+		break;
+#ifdef HAVE_BROTLI
+	case DECODER_BROTLI:
+		used = DecoderBrotli(d, in, len);
+		break;
+#endif
+#ifdef HAVE_ZSTD
+	case DECODER_ZSTD:
+		used = DecoderZstd(d, in, len);
+		break;
+#endif
+	}
+	if (used < 0) {
+		return -1;
+	}
+
+	/* Keep the rest for next time. */
+	if (used < len && in != d->in) {
+		if (len - used > d->in_size) {
+			d->in_size = len - used;
+			d->in = realloc(d->in, d->in_size);
+		}
+		memcpy(d->in, in + used, len - used);
+	} else if (used < len) {
+		memmove(d->in, d->in + used, len - used);
+	}
+	d->in_len = len - used;
+	d->full = (d->out_len == DECODER_OUT_MAX);
+
+	*out = d->out;
+	return d->out_len;
+}
+
+
+/*
+ * True if the last DecoderWrite stopped short for lack of room, and
+ * calling it again may hand back more.
+ */
+Bool
+DecoderPending(Decoder *d)
+{
+	return d->full;
+}
+
+
+/*
+ * True if the body decoded so far ends where an encoded body may end,
+ * or there was none.
+ */
+Bool
+DecoderDone(Decoder *d)
+{
+	return (d->done && !d->full) || d->total_in == 0;
+}
+
+
+void
+DecoderFree(Decoder *d)
+{
+	switch (d->kind) {
+	case DECODER_GZIP:
+	case DECODER_DEFLATE:
+		inflateEnd(&d->z);
+		break;
+#ifdef HAVE_BROTLI
+	case DECODER_BROTLI:
+		BrotliDecoderDestroyInstance(d->brotli);
+		break;
+#endif
+#ifdef HAVE_ZSTD
+	case DECODER_ZSTD:
+		ZSTD_freeDStream(d->zstd);
+		break;
+#endif
+	}
+
+	free(d->out);
+	free(d->in);
+	free(d);
+}
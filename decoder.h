@@ -0,0 +1,31 @@
+/*==========================================================================*\
+ *
+ * decoder.h - Streaming Content-Encoding decoders for flasher.
+ * flasher (C) 2006 Alex Graveley
+ *
+\*==========================================================================*/
+
+#ifndef __DECODER_H__
+#define __DECODER_H__
+
+
+#include "flasher.h"
+
+
+typedef struct _Decoder Decoder;
+
+
+const char *DecoderAcceptEncoding(void);
+
+Decoder *DecoderNew(const char *encoding);
+
+int DecoderWrite(Decoder *d, const char *in, int len, char **out);
+
+Bool DecoderPending(Decoder *d);
+
+Bool DecoderDone(Decoder *d);
+
+void DecoderFree(Decoder *d);
+
+
+#endif /* __DECODER_H__ */
@@ -0,0 +1,451 @@
+/*==========================================================================*\
+ *
+ * filestream.c - Local file streams for flasher.
+ * flasher (C) 2006 Alex Graveley
+ *
+\*==========================================================================*/
+
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "filestream.h"
+#include "flasher.h"
+#include "mainloop.h"
+#include "stats.h"
+
+
+struct _FileStream
+{
+	const StreamClass *klass;
+	NPP_t *plugin;
+	NPStream np_stream;
+	uint16 stype;
+	char *path;
+	Bool  notify;
+
+	int   fd;
+	char *map;       /* Whole file, or NULL when reading through buf */
+	char *buf;
+	int   buf_start; /* Stream offset of buf[0] */
+	int   buf_len;
+	int   write_idx;
+	int   write_end;
+
+	/* NPN_RequestRead ranges still to be served, for NP_SEEK streams */
+	NPByteRange *ranges;
+
+	/* Waiting its turn in the feed queue, or to retry */
+	Bool  queued;
+	FileStream *queue_prev;
+	FileStream *queue_next;
+	MainLoopTimer *retry_timer;
+	Bool  wrote_first;
+
+	/* NPN_DestroyStream was called from inside NPP_Write */
+	Bool     busy;
+	Bool     destroy_pending;
+	NPReason destroy_reason;
+};
+
+
+#define FILESTREAM_READ_SIZE (64 * 1024)
+
+/* How long to wait before asking a plugin that is not ready again */
+#define FILESTREAM_RETRY_INTERVAL 10 /* ms */
+
+/* How long to keep feeding before letting the main loop run */
+#define FILESTREAM_FEED_SLICE 2 /* ms */
+
+
+static Bool filestream_use_mmap = True;
+
+/* 
+ * Streams with data for the plugin take turns, one chunk each, from a
+ * single timer that runs once per main loop iteration for up to
+ * FILESTREAM_FEED_SLICE.
+ */
+static FileStream *filestream_queue_head = NULL;
+static FileStream *filestream_queue_tail = NULL;
+static int filestream_queue_len = 0;
+static MainLoopTimer *filestream_feed_timer = NULL;
+
+
+static void FileStreamQueue(FileStream *s);
+static void FileStreamUnqueue(FileStream *s);
+static void FileStreamDestroyCb(void *stream, NPReason reason);
+static NPError FileStreamRequestRead(void *stream, NPByteRange *ranges);
+
+
+static const StreamClass filestream_class = {
+	FileStreamDestroyCb,
+	FileStreamRequestRead,
+};
+
+
+/*
+ * Open path and announce it to the plugin.  The contents are then fed
+ * from the main loop as the plugin accepts them, and the stream
+ * destroys itself once done.  NP_SEEK streams instead serve the ranges
+ * the plugin asks for with NPN_RequestRead until it destroys them.
+ */
+NPError
+FileStreamNew(NPP_t *plugin, const char *path, const char *mimetype)
+{
+	return FileStreamNewURL(plugin, path, path, mimetype, False, NULL);
+}
+
+
+/*
+ * Like FileStreamNew, but the plugin sees the stream as url, and with
+ * notify set gets NPP_URLNotify for it when it ends.
+ */
+NPError
+FileStreamNewURL(NPP_t *plugin, 
+		 const char *url, 
+		 const char *path, 
+		 const char *mimetype,
+		 Bool notify,
+		 void *notifyData)
+{
+	Debug("FileStreamNew url=%s, path=%s, mimetype=%s\n", 
+	      url, path, mimetype);
+
+	struct stat st;
+	if (stat(path, &st) < 0) {
+		return NPERR_FILE_NOT_FOUND;
+	}
+
+	FileStream *s = calloc(1, sizeof(FileStream));
+	s->klass = &filestream_class;
+	s->plugin = plugin;
+	s->path = strdup(path);
+	s->notify = notify;
+	s->fd = -1;
+
+	s->np_stream.url = strdup(url);
+	s->np_stream.ndata = s;
+	s->np_stream.notifyData = notifyData;
+	s->np_stream.end = st.st_size;
+	s->np_stream.lastmodified = (uint32) st.st_ctime;
+
+	NPError err = CallNPP_NewStreamProc(plugin_funcs.newstream, plugin,
+					    (NPMIMEType) mimetype,
+					    &s->np_stream, True, &s->stype);
+	if (err != NPERR_NO_ERROR) {
+		free((char *) s->np_stream.url);
+		free(s->path);
+		free(s);
+		return err;
+	}
+
+	if (s->stype != NP_ASFILEONLY) {
+		s->fd = open(path, O_RDONLY);
+		if (s->fd < 0) {
+			FileStreamDestroy(s, NPRES_NETWORK_ERR);
+			return NPERR_NO_DATA;
+		}
+
+		if (filestream_use_mmap && s->np_stream.end > 0) {
+			s->map = mmap(NULL, s->np_stream.end, PROT_READ,
+				      MAP_PRIVATE, s->fd, 0);
+			if (s->map == MAP_FAILED) {
+				Debug("mmap failed: %s\n", strerror(errno));
+				s->map = NULL;
+			} else {
+				madvise(s->map, s->np_stream.end,
+					MADV_SEQUENTIAL);
+				madvise(s->map, s->np_stream.end,
+					MADV_WILLNEED);
+			}
+		}
+		if (!s->map) {
+			s->buf = malloc(FILESTREAM_READ_SIZE);
+		}
+	}
+
+	if (s->stype != NP_SEEK) {
+		s->write_end = s->np_stream.end;
+		FileStreamQueue(s);
+	}
+
+	return NPERR_NO_ERROR;
+}
+
+
+void
+FileStreamDestroy(FileStream *s, NPReason reason)
+{
+	Debug("FileStreamDestroy filestream=%p, reason=%d\n", s, reason);
+
+	if (s->busy) {
+		/* Called from NPP_Write; finish once the write returns. */
+		s->destroy_pending = True;
+		s->destroy_reason = reason;
+		return;
+	}
+
+	FileStreamUnqueue(s);
+	if (s->retry_timer) {
+		MainLoopRemoveTimer(s->retry_timer);
+	}
+
+	ByteRangeFree(s->ranges);
+
+	if (s->stype == NP_ASFILE || s->stype == NP_ASFILEONLY) {
+		CallNPP_StreamAsFileProc(plugin_funcs.asfile, s->plugin,
+					 &s->np_stream,
+					 (reason == NPRES_DONE) ?
+					 s->path : NULL);
+	}
+	if (s->notify) {
+		CallNPP_URLNotifyProc(plugin_funcs.urlnotify, s->plugin,
+				      s->np_stream.url, reason,
+				      s->np_stream.notifyData);
+	}
+	CallNPP_DestroyStreamProc(plugin_funcs.destroystream, s->plugin,
+				  &s->np_stream, reason);
+
+	Log("Stream %s: %s after %.1f ms\n", s->np_stream.url,
+	    (reason == NPRES_DONE) ? "completed" : "failed", ElapsedMs());
+
+	if (s->map) {
+		munmap(s->map, s->np_stream.end);
+	}
+	if (s->fd >= 0) {
+		close(s->fd);
+	}
+	free(s->buf);
+	free((char *) s->np_stream.url);
+	free(s->path);
+	free(s);
+}
+
+
+static void
+FileStreamDestroyCb(void *stream, NPReason reason)
+{
+	FileStreamDestroy((FileStream *) stream, reason);
+}
+
+
+/* Queue ranges of an NP_SEEK stream to be written to the plugin. */
+static NPError
+FileStreamRequestRead(void *stream, NPByteRange *ranges)
+{
+	FileStream *s = (FileStream *) stream;
+
+	if (s->stype != NP_SEEK) {
+		return NPERR_STREAM_NOT_SEEKABLE;
+	}
+
+	s->ranges = ByteRangeQueue(s->ranges, ranges, s->np_stream.end);
+	if (!s->queued && !s->retry_timer) {
+		FileStreamQueue(s);
+	}
+
+	return NPERR_NO_ERROR;
+}
+
+
+void
+FileStreamInit(Bool use_mmap)
+{
+	filestream_use_mmap = use_mmap;
+}
+
+
+/*
+ * Point *data at the bytes starting at write_idx, reading more of the file
+ * if needed.  Returns the number of bytes available, or -1 on error.
+ */
+static int
+FileStreamPeek(FileStream *s, char **data)
+{
+	if (s->map) {
+		*data = s->map + s->write_idx;
+		return s->write_end - s->write_idx;
+	}
+
+	if (s->write_idx < s->buf_start || 
+	    s->write_idx >= s->buf_start + s->buf_len) {
+		int bytes_read = pread(s->fd, s->buf, FILESTREAM_READ_SIZE, 
+				       s->write_idx);
+		if (bytes_read <= 0) {
+			Warning("Error reading '%s': %s\n", s->path,
+				bytes_read ? strerror(errno) : "short file");
+			return -1;
+		}
+		Debug("read: bytes_read = %d\n", bytes_read);
+
+		s->buf_start = s->write_idx;
+		s->buf_len = bytes_read;
+	}
+
+	*data = s->buf + (s->write_idx - s->buf_start);
+	return MIN(s->buf_start + s->buf_len, s->write_end) - s->write_idx;
+}
+
+
+/* Timer callback: resume feeding once the plugin had some time. */
+static void
+FileStreamRetry(void *data)
+{
+	FileStream *s = (FileStream *) data;
+
+	s->retry_timer = NULL;
+	FileStreamQueue(s);
+}
+
+
+/*
+ * Write the next chunk the plugin is ready for.  Returns True if s wants
+ * another turn; when the plugin is not ready, it backs off to a timer
+ * instead of spinning.  s may be destroyed.
+ */
+static Bool
+FileStreamFeed(FileStream *s)
+{
+
+	if (s->stype == NP_SEEK && s->write_idx >= s->write_end) {
+		uint32 offset, length;
+		if (!ByteRangePop(&s->ranges, &offset, &length)) {
+			/* Idle until the next NPN_RequestRead. */
+			return False;
+		}
+		Debug("FileStreamFeed: serving range %u+%u\n", offset, length);
+
+		s->write_idx = offset;
+		s->write_end = offset + length;
+	} else if (s->stype == NP_ASFILEONLY || 
+		   s->write_idx >= s->write_end) {
+		FileStreamDestroy(s, NPRES_DONE);
+		return False;
+	}
+
+	int write_max = CallNPP_WriteReadyProc(plugin_funcs.writeready,
+					       s->plugin, &s->np_stream);
+	Debug("NPP_WriteReady: write_max = %d, end = %d\n",
+	      write_max, s->np_stream.end);
+
+	int written = 0;
+	if (write_max > 0) {
+		char *data;
+		int len = FileStreamPeek(s, &data);
+		if (len < 0) {
+			FileStreamDestroy(s, NPRES_NETWORK_ERR);
+			return False;
+		}
+
+		s->busy = True;
+		written = CallNPP_WriteProc(plugin_funcs.write, s->plugin,
+					    &s->np_stream, s->write_idx,
+					    MIN(write_max, len), data);
+		s->busy = False;
+		Debug("NPP_Write: offset = %d, end = %d, written = %d\n",
+		      s->write_idx, s->np_stream.end, written);
+
+		if (!s->wrote_first) {
+			s->wrote_first = True;
+			Log("Stream %s: first NPP_Write after %.1f ms\n",
+			    s->np_stream.url, ElapsedMs());
+		}
+
+		if (s->destroy_pending || written < 0) {
+			s->destroy_pending = False;
+			FileStreamDestroy(s, (written < 0) ? 
+					  NPRES_USER_BREAK : s->destroy_reason);
+			return False;
+		}
+		s->write_idx += written;
+	}
+
+	if (written == 0) {
+		s->retry_timer = MainLoopAddTimer(FILESTREAM_RETRY_INTERVAL,
+						  FileStreamRetry, s);
+		return False;
+	}
+
+	return True;
+}
+
+
+/* 
+ * Timer callback: give queued streams turns in order, sending those that
+ * want more to the back of the queue, until the queue is empty or the
+ * slice is up.  Everything queued when it fired gets at least one.
+ */
+static void
+FileStreamFeedTimeout(void *data)
+{
+	filestream_feed_timer = NULL;
+
+	double deadline = StatsNow() + FILESTREAM_FEED_SLICE;
+	int turns = filestream_queue_len;
+	while (filestream_queue_head && 
+	       (turns-- > 0 || StatsNow() < deadline)) {
+		FileStream *s = filestream_queue_head;
+
+		FileStreamUnqueue(s);
+		if (FileStreamFeed(s)) {
+			FileStreamQueue(s);
+		}
+	}
+
+	if (filestream_queue_head && !filestream_feed_timer) {
+		filestream_feed_timer = 
+			MainLoopAddTimer(0, FileStreamFeedTimeout, NULL);
+	}
+}
+
+
+/* Add s to the back of the feed queue. */
+static void
+FileStreamQueue(FileStream *s)
+{
+	if (s->queued) {
+		return;
+	}
+	s->queued = True;
+	s->queue_next = NULL;
+	s->queue_prev = filestream_queue_tail;
+	if (filestream_queue_tail) {
+		filestream_queue_tail->queue_next = s;
+	} else {
+		filestream_queue_head = s;
+	}
+	filestream_queue_tail = s;
+	filestream_queue_len++;
+
+	if (!filestream_feed_timer) {
+		filestream_feed_timer = 
+			MainLoopAddTimer(0, FileStreamFeedTimeout, NULL);
+	}
+}
+
+
+static void
+FileStreamUnqueue(FileStream *s)
+{
+	if (!s->queued) {
+		return;
+	}
+	s->queued = False;
+	if (s->queue_prev) {
+		s->queue_prev->queue_next = s->queue_next;
+	} else {
+		filestream_queue_head = s->queue_next;
+	}
+	if (s->queue_next) {
+		s->queue_next->queue_prev = s->queue_prev;
+	} else {
+		filestream_queue_tail = s->queue_prev;
+	}
+	s->queue_prev = s->queue_next = NULL;
+	filestream_queue_len--;
+}
@@ -0,0 +1,34 @@
+/*==========================================================================*\
+ *
+ * filestream.h - Local file streams for flasher.
+ * flasher (C) 2006 Alex Graveley
+ *
+\*==========================================================================*/
+
+#ifndef __FILESTREAM_H__
+#define __FILESTREAM_H__
+
+
+#include "flasher.h"
+
+
+typedef struct _FileStream FileStream;
+
+
+NPError FileStreamNew(NPP_t *plugin,
+		      const char *path,
+		      const char *mimetype);
+
+NPError FileStreamNewURL(NPP_t *plugin,
+			 const char *url,
+			 const char *path,
+			 const char *mimetype,
+			 Bool notify,
+			 void *notifyData);
+
+void FileStreamDestroy(FileStream *s, NPReason reason);
+
+void FileStreamInit(Bool use_mmap);
+
+
+#endif /* __FILESTREAM_H__ */
@@ -6,13 +6,17 @@
 \*==========================================================================*/
 
 
+#include <ctype.h>
 #include <dlfcn.h>
+#include <errno.h>
 #include <getopt.h>
+#include <signal.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/time.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <unistd.h>
 
 #include <X11/X.h>
 #include <X11/Xlib.h>
@@ -22,13 +26,73 @@
 #include <X11/IntrinsicP.h> /* for XtTMRec */
 #include <X11/CoreP.h>      /* for CorePart */
 
+#ifdef HAVE_XDAMAGE
+#include <X11/extensions/Xdamage.h>
+#endif
+
 #include "flasher.h"
+#include "capture.h"
 #include "curlstream.h"
+#include "filestream.h"
+#include "framestats.h"
+#include "httpcache.h"
+#include "isolate.h"
+#include "mainloop.h"
+#include "mempool.h"
+#include "pluginreg.h"
+#include "server.h"
+#include "stats.h"
+#include "stream.h"
 
 
 static Display *x_display;
 XtAppContext x_app_context; /* for flasher.h */
 
+static Bool use_mmap = True;
+static CURLStreamOptions curl_options = {
+	.max_streams = CURLSTREAM_MAX_STREAMS,
+	.max_host_streams = CURLSTREAM_MAX_HOST_STREAMS,
+	.write_delay = CURLSTREAM_WRITE_DELAY,
+};
+static char *cache_dir = NULL;
+static long cache_size = 256; /* MB */
+static char *stats_file = NULL;
+static char *backend = NULL;
+static char *plugin_file = NULL;
+static char *plugin_search_path = NULL; /* Searched before the usual places */
+static Bool plugin_readahead = False;
+static Bool plugin_mlock = False;
+static Bool headless = False;
+static char *capture_file = NULL;
+static int capture_fps = 30;
+static int capture_frames = 0; /* Quit after this many, if set */
+static double target_fps = 60;
+static char **swf_files = NULL;
+static int nswf = 0;
+static NPP_t *plugins = NULL; /* One per SWF file */
+static int nplugins = 0;
+static char *server_socket = NULL;
+static char *connect_socket = NULL;
+static int pool_size = 2;
+static long mem_cap = 0; /* MB */
+static Bool isolate = False;
+static char *plugin_host = NULL; /* Set in --isolate plugin processes */
+static int x_argc; /* For InitializeXt in pool processes */
+static char **x_argv;
+static struct timeval start_time;
+
+
+/* Milliseconds since main started, for startup timing. */
+double
+ElapsedMs(void)
+{
+	struct timeval now;
+	gettimeofday(&now, NULL);
+
+	return (now.tv_sec - start_time.tv_sec) * 1000.0 +
+		(now.tv_usec - start_time.tv_usec) / 1000.0;
+}
+
 
 /*==========================================================================*\
  * Plugin entrypoints...
@@ -53,6 +117,145 @@ typedef NPError (*NP_ShutdownUPP)(void);
 static NP_ShutdownUPP gNP_Shutdown;
 
 
+/*==========================================================================*\
+ * Windowless plugins...
+\*==========================================================================*/
+
+/* 
+ * Window state of a plugin instance, kept in its ndata.  Windowless
+ * plugins draw into pixmap when sent a GraphicsExpose for it; the areas
+ * they invalidate collect in damage, and are repainted and copied to the
+ * window together once per main loop iteration.
+ */
+typedef struct _PluginInstance
+{
+	Widget   widget; /* Owns window */
+	Window   window;
+	NPWindow np_window;
+	NPSetWindowCallbackStruct ws_info;
+
+	Bool     windowless;
+	Bool     transparent;
+	Pixmap   pixmap;
+	GC       gc;
+	Region   damage;
+	MainLoopTimer *paint_timer;
+	FrameStats *frames;
+
+#ifdef HAVE_XDAMAGE
+	Damage   xdamage; /* Reports windowed plugins' drawing */
+#endif
+} PluginInstance;
+
+
+/* 
+ * Have a windowless plugin repaint everything damaged since the last
+ * paint, with one GraphicsExpose covering it all, then copy just the
+ * damaged area to the window.
+ */
+static void
+WindowlessPaint(NPP plugin)
+{
+	PluginInstance *inst = (PluginInstance *) plugin->ndata;
+
+	if (inst->paint_timer) {
+		MainLoopRemoveTimer(inst->paint_timer);
+		inst->paint_timer = NULL;
+	}
+	if (XEmptyRegion(inst->damage)) {
+		return;
+	}
+
+	XRectangle box;
+	XClipBox(inst->damage, &box);
+	XSetRegion(x_display, inst->gc, inst->damage);
+
+	if (inst->transparent) {
+		XSetForeground(x_display, inst->gc, 
+			       WhitePixel(x_display, DefaultScreen(x_display)));
+		XFillRectangle(x_display, inst->pixmap, inst->gc, 
+			       box.x, box.y, box.width, box.height);
+	}
+
+	XEvent event = { 0 };
+	event.xgraphicsexpose.type = GraphicsExpose;
+	event.xgraphicsexpose.display = x_display;
+	event.xgraphicsexpose.drawable = inst->pixmap;
+	event.xgraphicsexpose.x = box.x;
+	event.xgraphicsexpose.y = box.y;
+	event.xgraphicsexpose.width = box.width;
+	event.xgraphicsexpose.height = box.height;
+	CallNPP_HandleEventProc(plugin_funcs.event, plugin, &event);
+	FrameStatsAdd(inst->frames, StatsNow());
+
+	if (inst->window) {
+		XCopyArea(x_display, inst->pixmap, inst->window, inst->gc,
+			  box.x, box.y, box.width, box.height, box.x, box.y);
+	}
+	XSetClipMask(x_display, inst->gc, None);
+
+	XDestroyRegion(inst->damage);
+	inst->damage = XCreateRegion();
+}
+
+
+/* Timer callback: paint the damage collected this iteration. */
+static void
+WindowlessPaintCb(void *data)
+{
+	NPP plugin = (NPP) data;
+	PluginInstance *inst = (PluginInstance *) plugin->ndata;
+
+	inst->paint_timer = NULL;
+	WindowlessPaint(plugin);
+}
+
+
+/* Paint the damage once control returns to the main loop. */
+static void
+WindowlessSchedulePaint(NPP plugin)
+{
+	PluginInstance *inst = (PluginInstance *) plugin->ndata;
+
+	if (!inst->paint_timer) {
+		inst->paint_timer = MainLoopAddTimer(0, WindowlessPaintCb, 
+						     plugin);
+	}
+}
+
+
+/* 
+ * Xt event handler for the window of a windowless plugin: restore exposed
+ * areas from the pixmap, and pass input on to the plugin.
+ */
+static void
+WindowlessEventCb(Widget w, XtPointer closure, XEvent *event, Boolean *cont)
+{
+	NPP plugin = (NPP) closure;
+	PluginInstance *inst = (PluginInstance *) plugin->ndata;
+
+	switch (event->type) {
+	case Expose:
+		XCopyArea(x_display, inst->pixmap, inst->window, inst->gc,
+			  event->xexpose.x, event->xexpose.y,
+			  event->xexpose.width, event->xexpose.height,
+			  event->xexpose.x, event->xexpose.y);
+		break;
+	case ButtonPress:
+	case ButtonRelease:
+	case MotionNotify:
+	case KeyPress:
+	case KeyRelease:
+	case EnterNotify:
+	case LeaveNotify:
+	case FocusIn:
+	case FocusOut:
+		CallNPP_HandleEventProc(plugin_funcs.event, plugin, event);
+		break;
+	}
+}
+
+
 /*==========================================================================*\
  * Browser-side functions...
 \*==========================================================================*/
@@ -64,12 +267,12 @@ NPN_DestroyStream(NPP instance, NPStream *stream, NPError reason)
 	Debug("NPN_DestroyStream instance=%p, stream=%p, reason=%d\n", 
 	      instance, stream, reason);
 
-	CURLStream *s = stream->ndata;
-	if (!s) {
+	StreamClass **klass = stream->ndata;
+	if (!klass) {
 		return NPERR_GENERIC_ERROR;
 	}
 
-	CURLStreamDestroy(s, reason);
+	(*klass)->destroy(klass, reason);
 	return NPERR_NO_ERROR;
 }
 
@@ -79,7 +282,11 @@ void
 NPN_ForceRedraw(NPP instance)
 {
 	Debug("NPN_ForceRedraw instance=%p\n", instance);
-	NOT_IMPLEMENTED();
+
+	PluginInstance *inst = (PluginInstance *) instance->ndata;
+	if (inst && inst->windowless && inst->pixmap) {
+		WindowlessPaint(instance);
+	}
 }
 
 
@@ -95,8 +302,7 @@ NPN_GetURL(NPP instance, const char *url, const char *target)
 		return NPERR_INVALID_PARAM;
 	}
 
-	CURLStream *s = CURLStreamNew(instance, url, False, NULL);
-	return s ? NPERR_NO_ERROR : NPERR_GENERIC_ERROR;
+	return StreamNew(instance, url, False, NULL);
 }
 
 
@@ -115,8 +321,7 @@ NPN_GetURLNotify(NPP instance,
 		return NPERR_INVALID_PARAM;
 	}
 
-	CURLStream *s = CURLStreamNew(instance, url, True, notifyData);
-	return s ? NPERR_NO_ERROR : NPERR_GENERIC_ERROR;
+	return StreamNew(instance, url, True, notifyData);
 }
 
 
@@ -157,7 +362,19 @@ NPN_InvalidateRect(NPP instance, NPRect *invalidRect)
 	Debug("NPN_InvalidateRect top=%d, left=%d, bottom=%d, right=%d\n", 
 	      invalidRect->top, invalidRect->left, invalidRect->bottom, 
 	      invalidRect->right);
-	NOT_IMPLEMENTED();
+
+	PluginInstance *inst = (PluginInstance *) instance->ndata;
+	if (!inst || !inst->windowless || !inst->pixmap) {
+		return;
+	}
+
+	XRectangle rect;
+	rect.x = invalidRect->left;
+	rect.y = invalidRect->top;
+	rect.width = invalidRect->right - invalidRect->left;
+	rect.height = invalidRect->bottom - invalidRect->top;
+	XUnionRectWithRegion(&rect, inst->damage, inst->damage);
+	WindowlessSchedulePaint(instance);
 }
 
 
@@ -172,7 +389,14 @@ NPN_InvalidateRegion(NPP instance, NPRegion invalidRegion)
 	XClipBox(invalidRegion, &rect);
 	Debug("NPN_InvalidateRegion x=%d, y=%d, width=%d, height=%d\n", 
 	      rect.x, rect.y, rect.width, rect.height);
-	NOT_IMPLEMENTED();
+
+	PluginInstance *inst = (PluginInstance *) instance->ndata;
+	if (!inst || !inst->windowless || !inst->pixmap) {
+		return;
+	}
+
+	XUnionRegion(invalidRegion, inst->damage, inst->damage);
+	WindowlessSchedulePaint(instance);
 }
 
 
@@ -181,7 +405,7 @@ void *
 NPN_MemAlloc(uint32 size)
 {
 	Debug("NPN_MemAlloc size=%d\n", size);
-	return malloc(size);
+	return MemPoolAlloc(size);
 }
 
 
@@ -190,7 +414,7 @@ uint32
 NPN_MemFlush(uint32 size)
 {
 	Debug("NPN_MemFlush size=%d\n", size);
-	return 0;
+	return MemPoolFlush(size);
 }
 
 
@@ -199,7 +423,7 @@ void
 NPN_MemFree(void *ptr)
 {
 	Debug("NPN_MemFree ptr=%p\n", ptr);
-	free(ptr);
+	MemPoolFree(ptr);
 }
 
 
@@ -238,9 +462,7 @@ NPN_PostURL(NPP instance,
 		return NPERR_INVALID_PARAM;
 	}
 
-	CURLStream *s = CURLStreamNewPost(instance, url, False, NULL, buf, 
-					  len, file);
-	return s ? NPERR_NO_ERROR : NPERR_GENERIC_ERROR;
+	return StreamNewPost(instance, url, False, NULL, buf, len, file);
 }
 
 
@@ -263,9 +485,8 @@ NPN_PostURLNotify(NPP instance,
 		return NPERR_INVALID_PARAM;
 	}
 
-	CURLStream *s = CURLStreamNewPost(instance, url, True, notifyData, buf, 
-					  len, file);
-	return s ? NPERR_NO_ERROR : NPERR_GENERIC_ERROR;
+	return StreamNewPost(instance, url, True, notifyData, buf, len, 
+			     file);
 }
 
 
@@ -301,8 +522,102 @@ NPError
 NPN_RequestRead(NPStream *stream, NPByteRange *rangeList)
 {
 	Debug("NPN_RequestRead stream=%p\n", stream);
-	NOT_IMPLEMENTED();
-	return NPERR_GENERIC_ERROR;
+
+	StreamClass **klass = stream->ndata;
+	if (!klass || !rangeList) {
+		return NPERR_INVALID_PARAM;
+	}
+
+	return (*klass)->request_read(klass, rangeList);
+}
+
+
+/* 
+ * Append copies of ranges to queue, resolving offsets relative to the end
+ * of the stream and clipping to end.  Returns the new queue head.
+ */
+NPByteRange *
+ByteRangeQueue(NPByteRange *queue, NPByteRange *ranges, uint32 end)
+{
+	NPByteRange **tail = &queue;
+	while (*tail) {
+		tail = &(*tail)->next;
+	}
+
+	for (; ranges; ranges = ranges->next) {
+		int64_t offset = ranges->offset;
+		if (offset < 0) {
+			offset += end;
+		}
+		if (offset < 0 || offset >= end || ranges->length == 0) {
+			Warning("Ignoring byte range %d+%u, stream end = %u\n",
+				ranges->offset, ranges->length, end);
+			continue;
+		}
+
+		NPByteRange *r = malloc(sizeof(NPByteRange));
+		r->offset = offset;
+		r->length = MIN(ranges->length, end - offset);
+		r->next = NULL;
+
+		*tail = r;
+		tail = &r->next;
+	}
+
+	return queue;
+}
+
+
+/* Free every range in queue. */
+void
+ByteRangeFree(NPByteRange *queue)
+{
+	while (queue) {
+		NPByteRange *next = queue->next;
+		free(queue);
+		queue = next;
+	}
+}
+
+
+/* 
+ * Remove the first range from queue, merging any queued ranges that
+ * overlap or adjoin it.  Returns False if the queue is empty.
+ */
+Bool
+ByteRangePop(NPByteRange **queue, uint32 *offset, uint32 *length)
+{
+	NPByteRange *r = *queue;
+	if (!r) {
+		return False;
+	}
+
+	uint32 start = r->offset;
+	uint32 end = r->offset + r->length;
+	*queue = r->next;
+	free(r);
+
+	Bool merged = True;
+	while (merged) {
+		merged = False;
+		for (NPByteRange **p = queue; *p; p = &(*p)->next) {
+			r = *p;
+			if (r->offset > end || r->offset + r->length < start) {
+				continue;
+			}
+
+			start = MIN(start, r->offset);
+			end = MAX(end, r->offset + r->length);
+			*p = r->next;
+			free(r);
+			merged = True;
+			break;
+		}
+	}
+
+	*offset = start;
+	*length = end - start;
+	return True;
 }
 
 
@@ -311,8 +626,27 @@ NPError
 NPN_SetValue(NPP instance, NPPVariable variable, void *value)
 {
 	Debug("NPN_SetValue instance=%p, variable=%d\n", instance, variable);
-	NOT_IMPLEMENTED();
-	return NPERR_GENERIC_ERROR;
+
+	PluginInstance *inst = (PluginInstance *) instance->ndata;
+
+	switch (variable) {
+	case NPPVpluginWindowBool:
+		if ((inst->pixmap || inst->window) && 
+		    inst->windowless != !value) {
+			/* Too late; the window was already handed out. */
+			return NPERR_GENERIC_ERROR;
+		}
+		inst->windowless = !value;
+		break;
+	case NPPVpluginTransparentBool:
+		inst->transparent = (value != NULL);
+		break;
+	default:
+		NOT_IMPLEMENTED();
+		return NPERR_GENERIC_ERROR;
+	}
+
+	return NPERR_NO_ERROR;
 }
 
 
@@ -352,40 +686,27 @@ NPN_Write(NPP instance, NPStream *stream, int32 len, void *buf)
 \*==========================================================================*/
 
 /* 
- * Attempt to dynamically load libflashplayer.so and lookup entrypoints.  
- * First tries the regular library path, then ~/.mozilla/plugins/, and 
- * finally from /usr/lib/mozilla/plugins.
+ * Load the Flash plugin, with its symbols bound up front, and look up its
+ * entrypoints.  Loads path if given.  Otherwise uses the first plugin for
+ * SWF in the search path, or libflashplayer.so from the regular library
+ * path if there isn't one.
  */
 static void
-LoadFlashPlugin(void)
+LoadFlashPlugin(const char *path)
 {
-	char *user_plugin_path = NULL;
-
-	const char *plugin_path = "libflashplayer.so";
-	void *dlobj = dlopen(plugin_path, RTLD_LAZY);
-	if (!dlobj) {
-		const char *plugin = "/.mozilla/plugins/libflashplayer.so";
-		char *home = getenv("HOME");
-		assert(home);
+	char *found = path ? NULL : 
+		PluginRegFind("application/x-shockwave-flash");
+	const char *plugin_path = path ? path : found ? found : 
+		"libflashplayer.so";
 
-		user_plugin_path = malloc(strlen(home) + strlen(plugin));
-
-		strcpy(user_plugin_path, home);
-		strcpy(&user_plugin_path[strlen(home)], plugin);
-
-		plugin_path = user_plugin_path;
-		dlobj = dlopen(plugin_path, RTLD_LAZY);
-	}
-	if (!dlobj) {
-		plugin_path = "/usr/lib/mozilla/plugins/libflashplayer.so";
-		dlobj = dlopen(plugin_path, RTLD_LAZY);
-	}
+	void *dlobj = PluginRegLoad(plugin_path, plugin_readahead, 
+				    plugin_mlock);
 	if (!dlobj) {
 		Error("Unable to load Flash plugin: %s\n", dlerror());
 	}
 
 	Log("Using plugin: %s\n", plugin_path);
-	free(user_plugin_path);
+	free(found);
 
 	gNP_GetMIMEDescription = (NP_GetMIMEDescriptionUPP)
 		dlsym(dlobj, "NP_GetMIMEDescription");
@@ -408,6 +729,14 @@ LoadFlashPlugin(void)
 }
 
 
+/* Main loop callback for SIGINT and SIGTERM. */
+static void
+QuitSignalCb(int sig, void *data)
+{
+	MainLoopQuit();
+}
+
+
 /* Create X connection and store global Xt app context */
 static void
 InitializeXt(int *argc, char **argv)
@@ -417,6 +746,11 @@ InitializeXt(int *argc, char **argv)
         x_app_context = XtCreateApplicationContext();
         x_display = XtOpenDisplay(x_app_context, NULL, PROGRAM_NAME, 
 				  PROGRAM_NAME, NULL, 0, argc, argv);
+
+	/* Before the plugin starts threads, as signals get blocked. */
+	MainLoopInit();
+	MainLoopAddSignal(SIGINT, QuitSignalCb, NULL);
+	MainLoopAddSignal(SIGTERM, QuitSignalCb, NULL);
 }
 
 
@@ -450,6 +784,9 @@ InitializeFuncs(void)
 	mozilla_funcs.setvalue = NewNPN_SetValueProc(NPN_SetValue);
 	mozilla_funcs.invalidaterect = 
 		NewNPN_InvalidateRectProc(NPN_InvalidateRect);
+	mozilla_funcs.invalidateregion = 
+		NewNPN_InvalidateRegionProc(NPN_InvalidateRegion);
+	mozilla_funcs.forceredraw = NewNPN_ForceRedrawProc(NPN_ForceRedraw);
 
 	memset(&plugin_funcs, 0, sizeof(NPPluginFuncs));
 	plugin_funcs.size = sizeof(plugin_funcs);
@@ -460,12 +797,20 @@ InitializeFuncs(void)
  * Plugin instance creation, window creation, file reading...
 \*==========================================================================*/
 
-/* Create a new plugin instance, passing some very basic arguments */
+/* 
+ * Create a new plugin instance, passing some very basic arguments.  An
+ * instance being re-created keeps its window state.
+ */
 static NPError 
 CallNew(NPP plugin, char *swf_file, int width, int height)
 {
-	/* FIXME: Store window state. */
-	plugin->ndata = (void *) NULL;
+	PluginInstance *inst = (PluginInstance *) plugin->ndata;
+	if (!inst) {
+		inst = calloc(1, sizeof(PluginInstance));
+		inst->damage = XCreateRegion();
+		inst->frames = FrameStatsNew(swf_file);
+		plugin->ndata = inst;
+	}
 
 	char width_s[50];
 	sprintf(width_s, "%d", width);
@@ -494,30 +839,46 @@ CallNew(NPP plugin, char *swf_file, int width, int height)
 }
 
 
-/* Create a new Xt window and pass it to the plugin. */
-static NPError
-CallSetWindow(NPP plugin, int width, int height)
+/* Destroy a plugin instance created with CallNew, and its window state. */
+static void
+CallDestroy(NPP plugin)
 {
-	NPSetWindowCallbackStruct ws_info = { 0 };
-	NPWindow win = { 0 };
+	PluginInstance *inst = (PluginInstance *) plugin->ndata;
 
-	ws_info.type = NP_SETWINDOW;
-	ws_info.display = x_display;
+	CallNPP_DestroyProc(plugin_funcs.destroy, plugin, NULL);
 
-	int screen = DefaultScreen(ws_info.display);
-	ws_info.visual = DefaultVisual(ws_info.display, screen);
-	ws_info.colormap = DefaultColormap(ws_info.display, screen);
-	ws_info.depth = DefaultDepth(ws_info.display, screen);
+	if (inst->paint_timer) {
+		MainLoopRemoveTimer(inst->paint_timer);
+	}
+	if (inst->gc) {
+		XFreeGC(x_display, inst->gc);
+	}
+	if (inst->pixmap) {
+		XFreePixmap(x_display, inst->pixmap);
+	}
+#ifdef HAVE_XDAMAGE
+	if (inst->xdamage) {
+		XDamageDestroy(x_display, inst->xdamage);
+	}
+#endif
+	XDestroyRegion(inst->damage);
+	free(inst);
+	plugin->ndata = NULL;
+}
 
-	win.type = NPWindowTypeWindow;
-	win.x = win.y = 0;
-	win.width = width;
-	win.height = height;
-	win.ws_info = &ws_info;
+
+/* 
+ * Create the Xt window a plugin is shown in at x, y on the screen, sized
+ * and configured as described by win.  Returns the widget owning it.
+ */
+static Widget
+CreateXtWindow(NPWindow *win, int x, int y)
+{
+	NPSetWindowCallbackStruct *ws_info = win->ws_info;
 
 	XSetWindowAttributes attr;
 	attr.bit_gravity = NorthWestGravity;
-	attr.colormap = ws_info.colormap;
+	attr.colormap = ws_info->colormap;
 	attr.event_mask =
 		ButtonMotionMask |
 		ButtonPressMask |
@@ -535,12 +896,17 @@ CallSetWindow(NPP plugin, int width, int height)
 	unsigned long mask = CWBitGravity | CWEventMask;
 	if (attr.colormap)
 		mask |= CWColormap;
+	if (headless) {
+		/* Keep window managers away from it. */
+		attr.override_redirect = True;
+		mask |= CWOverrideRedirect;
+	}
 
 	Window x_root_win = DefaultRootWindow(x_display);
 	Window x_win = XCreateWindow(x_display, x_root_win,
-				     win.x, win.y, win.width, win.height,
-				     0, ws_info.depth, InputOutput, 
-				     ws_info.visual, mask, &attr);
+				     x, y, win->width, win->height,
+				     0, ws_info->depth, InputOutput, 
+				     ws_info->visual, mask, &attr);
 
 	XSelectInput(x_display, x_win, ExposureMask);
 	XMapWindow(x_display, x_win);
@@ -552,8 +918,8 @@ CallSetWindow(NPP plugin, int width, int height)
 
 	Arg args[7];
 	int n = 0;
-	XtSetArg(args[n], XtNwidth, win.width); n++;
-	XtSetArg(args[n], XtNheight, win.height); n++;
+	XtSetArg(args[n], XtNwidth, win->width); n++;
+	XtSetArg(args[n], XtNheight, win->height); n++;
 	XtSetValues(top_widget, args, n);
 
 	Widget form = XtVaCreateWidget("form", 
@@ -561,11 +927,11 @@ CallSetWindow(NPP plugin, int width, int height)
 				       top_widget, NULL);
 
 	n = 0;
-	XtSetArg(args[n], XtNwidth, win.width); n++;
-	XtSetArg(args[n], XtNheight, win.height); n++;
-	XtSetArg(args[n], XtNvisual, ws_info.visual); n++;
-	XtSetArg(args[n], XtNcolormap, ws_info.colormap); n++;
-	XtSetArg(args[n], XtNdepth, ws_info.depth); n++;
+	XtSetArg(args[n], XtNwidth, win->width); n++;
+	XtSetArg(args[n], XtNheight, win->height); n++;
+	XtSetArg(args[n], XtNvisual, ws_info->visual); n++;
+	XtSetArg(args[n], XtNcolormap, ws_info->colormap); n++;
+	XtSetArg(args[n], XtNdepth, ws_info->depth); n++;
 	XtSetValues(form, args, n);
 
 	XSync(x_display, False);
@@ -582,92 +948,199 @@ CallSetWindow(NPP plugin, int width, int height)
 
 	XSync(x_display, False);
 
-	win.window = (void *) XtWindow(form);
-
-	return CallNPP_SetWindowProc(plugin_funcs.setwindow, plugin, &win);
+	return form;
 }
 
 
-/* Open, read, and write the contents of swf_file to the plugin instance. */
-static NPError
-SendSrcStream(NPP plugin, char *swf_file)
+#ifdef HAVE_XDAMAGE
+static int x_damage_event_base;
+
+
+/* 
+ * Xt dispatcher for XDamageNotify: each report of new drawing in a
+ * plugin's window counts as a frame.  Subtracting the damage re-arms it.
+ */
+static Boolean
+DamageDispatch(XEvent *event)
 {
-	NPError err = NPERR_NO_ERROR;
-	NPStream stream = { 0 };
-	uint16 stype = 0;
+	XDamageNotifyEvent *notify = (XDamageNotifyEvent *) event;
+
+	XDamageSubtract(x_display, notify->damage, None, None);
 
-	struct stat swf_stat;
-	if (stat(swf_file, &swf_stat) < 0) {
-		return NPERR_FILE_NOT_FOUND;
+	for (int i = 0; i < nplugins; i++) {
+		PluginInstance *inst = (PluginInstance *) plugins[i].ndata;
+		if (inst && inst->xdamage == notify->damage) {
+			FrameStatsAdd(inst->frames, StatsNow());
+			break;
+		}
 	}
 
-	stream.url = swf_file;
-	stream.end = swf_stat.st_size;
-	stream.lastmodified = (uint32) swf_stat.st_ctime;
+	return True;
+}
+#endif
+
 
-	err = CallNPP_NewStreamProc(plugin_funcs.newstream, plugin, 
-				    "application/x-shockwave-flash", &stream,
-				    True, &stype);
-	if (err != NPERR_NO_ERROR) {
-		return err;
+/* 
+ * Time the frames a windowed plugin draws into its window, which takes
+ * the XDamage extension.
+ */
+static void
+WatchWindowDamage(PluginInstance *inst)
+{
+#ifdef HAVE_XDAMAGE
+	int error_base;
+	if (!XDamageQueryExtension(x_display, &x_damage_event_base, 
+				   &error_base)) {
+		Warning("No XDamage extension; not timing frames\n");
+		return;
 	}
 
-	if (stype == NP_NORMAL || stype == NP_ASFILE) {
-		FILE *swf_fd = fopen(swf_file, "r");
-		if (!swf_fd) {
-			return NPERR_NO_DATA;
-		}
+	XtSetEventDispatcher(x_display, x_damage_event_base + XDamageNotify,
+			     DamageDispatch);
+	inst->xdamage = XDamageCreate(x_display, inst->window, 
+				      XDamageReportNonEmpty);
+#else
+	Log("Built without XDamage; not timing frames\n");
+#endif
+}
 
-		int write_idx = 0;
-		unsigned char *data [1024 * 10];
-
-		while (stream.end > 0) {
-			int write_max = 
-				CallNPP_WriteReadyProc(plugin_funcs.writeready,
-						       plugin, &stream);
-			Debug("NPP_WriteReady: write_max = %d, end = %d\n", 
-			      write_max, stream.end);
-			if (write_max <= 0) {
-				break;
-			}
 
-			int bytes_read = MIN(sizeof(data), stream.end);
-			if (fread(data, bytes_read, 1, swf_fd) != 1) {
-				break;
-			}
-			Debug("fread: bytes_read = %d\n", bytes_read);
-
-			int bytes_written = 
-				CallNPP_WriteProc(plugin_funcs.write, plugin, 
-						  &stream, write_idx, 
-						  bytes_read,
-						  (void *) data);
-			Debug("NPP_Write: offset = %d, end = %d, "
-			      "written = %d\n", write_idx, stream.end, 
-			      bytes_read);
-			if (bytes_written <= 0) {
-				break;
-			}
+/* 
+ * Give the plugin somewhere to draw: a new Xt window at x, y, and for
+ * windowless plugins a pixmap.  In headless mode windowless plugins get
+ * no window.
+ */
+static NPError
+CallSetWindow(NPP plugin, int x, int y, int width, int height)
+{
+	PluginInstance *inst = (PluginInstance *) plugin->ndata;
+	NPSetWindowCallbackStruct *ws_info = &inst->ws_info;
+	NPWindow *win = &inst->np_window;
+
+	ws_info->type = NP_SETWINDOW;
+	ws_info->display = x_display;
+
+	int screen = DefaultScreen(ws_info->display);
+	ws_info->visual = DefaultVisual(ws_info->display, screen);
+	ws_info->colormap = DefaultColormap(ws_info->display, screen);
+	ws_info->depth = DefaultDepth(ws_info->display, screen);
+
+	win->type = NPWindowTypeWindow;
+	win->x = win->y = 0;
+	win->width = width;
+	win->height = height;
+	win->ws_info = ws_info;
+
+	if (!headless || !inst->windowless) {
+		if (headless) {
+			Warning("Windowed plugin; headless rendering needs "
+				"a mapped window\n");
+		}
+		inst->widget = CreateXtWindow(win, x, y);
+		inst->window = XtWindow(inst->widget);
+	} else {
+		Log("Rendering offscreen\n");
+	}
 
-			write_idx += bytes_written;
-			stream.end -= bytes_written;
+	if (inst->windowless) {
+		/* Draws into a pixmap we copy to the window from. */
+		inst->pixmap = XCreatePixmap(x_display, 
+					     DefaultRootWindow(x_display),
+					     win->width, win->height, 
+					     ws_info->depth);
+		inst->gc = XCreateGC(x_display, inst->pixmap, 0, NULL);
+		XSetForeground(x_display, inst->gc, 
+			       WhitePixel(x_display, screen));
+		XFillRectangle(x_display, inst->pixmap, inst->gc, 0, 0, 
+			       win->width, win->height);
+
+		if (inst->widget) {
+			XtAddEventHandler(inst->widget, 
+					  ExposureMask |
+					  ButtonPressMask |
+					  ButtonReleaseMask |
+					  PointerMotionMask |
+					  KeyPressMask |
+					  KeyReleaseMask |
+					  EnterWindowMask |
+					  LeaveWindowMask |
+					  FocusChangeMask,
+					  False, WindowlessEventCb, plugin);
 		}
 
-		fclose(swf_fd);
+		win->type = NPWindowTypeDrawable;
+		win->window = (void *) inst->pixmap;
+
+		XRectangle all = { 0, 0, win->width, win->height };
+		XUnionRectWithRegion(&all, inst->damage, inst->damage);
+		WindowlessSchedulePaint(plugin);
+	} else {
+		win->window = (void *) inst->window;
+		WatchWindowDamage(inst);
+	}
+
+	return CallNPP_SetWindowProc(plugin_funcs.setwindow, plugin, win);
+}
+
+
+/*==========================================================================*\
+ * Frame capture...
+\*==========================================================================*/
+
+static Capture *capture;
+static double capture_start;
+
+
+/* 
+ * Timer callback: capture the plugin's drawable, and schedule the
+ * next frame on a fixed clock so slow frames don't make the rate drift.
+ */
+static void
+CaptureTimeout(void *data)
+{
+	NPP plugin = (NPP) data;
+	PluginInstance *inst = (PluginInstance *) plugin->ndata;
+
+	if (inst->windowless) {
+		/* Bring the pixmap up to date first. */
+		WindowlessPaint(plugin);
+	}
+	if (!CaptureFrame(capture, inst->pixmap ? inst->pixmap : inst->window)) {
+		Error("Capture failed\n");
 	}
 
-	if (stype == NP_ASFILE || stype == NP_ASFILEONLY) {
-		CallNPP_StreamAsFileProc(plugin_funcs.asfile, plugin, &stream, 
-					 (stream.end == 0) ? swf_file : NULL);
+	int frames = CaptureFrameCount(capture);
+	if (capture_frames && frames >= capture_frames) {
+		MainLoopQuit();
+		return;
 	}
 
-	if (stype != NP_SEEK) {
-		err = CallNPP_DestroyStreamProc(
-			plugin_funcs.destroystream, plugin, &stream,
-			(stream.end == 0) ? NPRES_DONE : NPRES_NETWORK_ERR);
+	double next = capture_start + frames * 1000.0 / capture_fps;
+	double delay = next - StatsNow();
+	if (delay < 0) {
+		Debug("Capture running %.1f ms late\n", -delay);
+		delay = 0;
 	}
+	MainLoopAddTimer(delay, CaptureTimeout, plugin);
+}
+
 
-	return err;
+/* Start capturing the plugin's frames to capture_file. */
+static void
+StartCapture(NPP plugin)
+{
+	PluginInstance *inst = (PluginInstance *) plugin->ndata;
+	NPSetWindowCallbackStruct *ws_info = &inst->ws_info;
+
+	capture = CaptureNew(x_display, ws_info->visual, ws_info->depth,
+			     inst->np_window.width, inst->np_window.height,
+			     capture_fps, capture_file, True);
+	if (!capture) {
+		Error("Cannot capture to '%s'\n", capture_file);
+	}
+
+	capture_start = StatsNow();
+	MainLoopAddTimer(0, CaptureTimeout, plugin);
 }
 
 
@@ -675,15 +1148,10 @@ SendSrcStream(NPP plugin, char *swf_file)
  * Play utility, cmdline parsing, main...
 \*==========================================================================*/
 
-/* 
- * Helper to manage create a plugin instance, new window, then writing the 
- * file contents to the instance. 
- */
-static NPError
-PlaySWF(NPP_t *plugin, char *swf_file, int width, int height)
+/* Initialize the loaded plugin, once for all the instances. */
+static void
+InitializePlugin(void)
 {
-	NPError err = NPERR_NO_ERROR;
-
 	/* 
 	 * Without this, Flash segfaults attempting to dynamically invoke
 	 * gtk_major_mode.  Linking GTK+ means that Flash uses GTK's mainloop
@@ -693,45 +1161,237 @@ PlaySWF(NPP_t *plugin, char *swf_file, int width, int height)
 	 */
 	putenv("FLASH_GTK_LIBRARY=");
 
-	err = gNP_Initialize(&mozilla_funcs, &plugin_funcs);
+	double start = StatsNow();
+	NPError err = gNP_Initialize(&mozilla_funcs, &plugin_funcs);
 	if (err != NPERR_NO_ERROR) {
 		Error("NP_Initialize result = %d\n", err);
 	}
+	PluginRegStarted(StatsNow() - start);
+	MemPoolTrack(&plugin_funcs);
+}
 
-	err = CallNew(plugin, swf_file, width, height);
+
+/* 
+ * Helper to manage create a plugin instance, new window at x, y, then
+ * writing the file contents to the instance. 
+ */
+static NPError
+PlaySWF(NPP_t *plugin, char *swf_file, int x, int y, int width, int height)
+{
+	NPError err = CallNew(plugin, swf_file, width, height);
 	if (err != NPERR_NO_ERROR) {
 		Error("NPP_NewProc result = %d\n", err);
 	}
 
-	err = CallSetWindow(plugin, width, height);
+	err = CallSetWindow(plugin, x, y, width, height);
 	if (err != NPERR_NO_ERROR) {
 		Error("NPP_SetWindow result = %d\n", err);
 	}
 
 	Log("Loading: %s\n", swf_file);
 
-	err = SendSrcStream(plugin, swf_file);
+	err = FileStreamNew(plugin, swf_file, "application/x-shockwave-flash");
 	if (err != NPERR_NO_ERROR) {
-		Error("Writing SWF file, result = %d\n", err);
+		Error("Opening SWF file, result = %d\n", err);
 	}
 
 	return NPERR_NO_ERROR;
 }
 
 
+static void
+AddSWFFile(char *swf_file)
+{
+	swf_files = realloc(swf_files, (nswf + 1) * sizeof(char *));
+	swf_files[nswf++] = swf_file;
+}
+
+
+/* 
+ * Add the SWF files listed in playlist, one per line.  Blank lines and
+ * lines starting with '#' are skipped.
+ */
+static Bool
+ReadPlaylist(const char *playlist)
+{
+	FILE *f = strcmp(playlist, "-") ? fopen(playlist, "r") : stdin;
+	if (!f) {
+		Warning("Error opening playlist '%s': %s\n", playlist,
+			strerror(errno));
+		return False;
+	}
+
+	char line[4096];
+	while (fgets(line, sizeof(line), f)) {
+		int len = strlen(line);
+		while (len && isspace((unsigned char) line[len - 1])) {
+			line[--len] = '\0';
+		}
+		if (len && line[0] != '#') {
+			AddSWFFile(strdup(line));
+		}
+	}
+
+	if (f != stdin) {
+		fclose(f);
+	}
+	return True;
+}
+
+
+/* 
+ * Make a --server pool process ready to play: connected to X, and with
+ * the plugin initialized.
+ */
+static void
+WarmUp(void)
+{
+	InitializeXt(&x_argc, x_argv);
+	InitializePlugin();
+}
+
+
+/* 
+ * Called once a crashed --isolate plugin process has been replaced:
+ * create the instances again in their windows, and replay the movies.
+ */
+static void
+PluginRestarted(void)
+{
+	for (int i = 0; i < nplugins; i++) {
+		NPP plugin = &plugins[i];
+		PluginInstance *inst = (PluginInstance *) plugin->ndata;
+		NPWindow *win = &inst->np_window;
+
+		NPError err = CallNew(plugin, swf_files[i], win->width, 
+				      win->height);
+		if (err == NPERR_NO_ERROR) {
+			err = CallNPP_SetWindowProc(plugin_funcs.setwindow, 
+						    plugin, win);
+		}
+		if (err != NPERR_NO_ERROR) {
+			Warning("Restarting %s, result = %d\n", swf_files[i], 
+				err);
+			continue;
+		}
+
+		if (inst->windowless) {
+			XRectangle all = { 0, 0, win->width, win->height };
+			XUnionRectWithRegion(&all, inst->damage, inst->damage);
+			WindowlessSchedulePaint(plugin);
+		}
+
+		Log("Reloading: %s\n", swf_files[i]);
+		FileStreamNew(plugin, swf_files[i], 
+			      "application/x-shockwave-flash");
+	}
+}
+
+
+/* Main loop watch on a --connect client: quit when it goes away. */
+static void
+ClientHangupCb(int fd, int events, void *data)
+{
+	char buf[64];
+	if (read(fd, buf, sizeof(buf)) <= 0) {
+		Log("Client went away\n");
+		MainLoopQuit();
+	}
+}
+
+
+/* Length of an X display name without its screen number. */
+static int
+DisplayNameLen(const char *name)
+{
+	const char *colon = strrchr(name, ':');
+	const char *dot = colon ? strchr(colon, '.') : NULL;
+
+	return dot ? dot - name : strlen(name);
+}
+
+
+static Bool
+SameString(const char *a, const char *b)
+{
+	return a == b || (a && b && !strcmp(a, b));
+}
+
+
+/* 
+ * Refuse options from a --connect client that a pool process can't take
+ * any more, since WarmUp opened X and loaded the plugin with the server's
+ * before the client came.  The server_ arguments are the server's values.
+ */
+static void
+CheckClientOptions(const char *server_plugin,
+		   const char *server_search_path,
+		   Bool server_readahead,
+		   Bool server_mlock)
+{
+	const char *display = getenv("DISPLAY");
+	const char *ours = DisplayString(x_display);
+	int len = DisplayNameLen(ours);
+	if (display && (DisplayNameLen(display) != len || 
+			strncmp(display, ours, len))) {
+		Error("DISPLAY is %s, but the server plays on %s\n", 
+		      display, ours);
+	}
+
+	if (!SameString(plugin_file, server_plugin) ||
+	    !SameString(plugin_search_path, server_search_path) ||
+	    plugin_readahead != server_readahead ||
+	    plugin_mlock != server_mlock) {
+		Error("The server's plugin options can't be changed "
+		      "with --connect\n");
+	}
+	if (isolate) {
+		Error("--isolate can't be used with --connect\n");
+	}
+}
+
+
 static int
 ParseOptions(int argc, 
 	     char **argv, 
 	     char **geometry, 
 	     int *fullscreen, 
-	     char **baseurl,
-	     char **swf_file)
+	     char **baseurl)
 {
 	struct option long_options[] = {
 		{ "help", no_argument, NULL, 'h' },
 		{ "geometry", required_argument, NULL, 'g' },
 		{ "fullscreen", no_argument, NULL, 'f' },
 		{ "baseurl", required_argument, NULL, 'b' },
+		{ "no-mmap", no_argument, NULL, 'm' },
+		{ "cache-dir", required_argument, NULL, 'c' },
+		{ "cache-size", required_argument, NULL, 'C' },
+		{ "asfile-dir", required_argument, NULL, 'a' },
+		{ "asfile-memfd", no_argument, NULL, 'M' },
+		{ "http2", no_argument, NULL, '2' },
+		{ "max-host-connections", required_argument, NULL, 'H' },
+		{ "max-streams", required_argument, NULL, 'S' },
+		{ "max-host-streams", required_argument, NULL, 'T' },
+		{ "net-thread", no_argument, NULL, 'w' },
+		{ "write-delay", required_argument, NULL, 'W' },
+		{ "stats", required_argument, NULL, 's' },
+		{ "backend", required_argument, NULL, 'B' },
+		{ "plugin", required_argument, NULL, 'p' },
+		{ "headless", no_argument, NULL, 'x' },
+		{ "capture", required_argument, NULL, 'o' },
+		{ "capture-fps", required_argument, NULL, 'r' },
+		{ "capture-frames", required_argument, NULL, 'n' },
+		{ "target-fps", required_argument, NULL, 't' },
+		{ "playlist", required_argument, NULL, 'P' },
+		{ "server", required_argument, NULL, 'L' },
+		{ "pool", required_argument, NULL, 'N' },
+		{ "connect", required_argument, NULL, 'k' },
+		{ "isolate", no_argument, NULL, 'I' },
+		{ "mem-cap", required_argument, NULL, 'e' },
+		{ "plugin-path", required_argument, NULL, 'D' },
+		{ "plugin-readahead", no_argument, NULL, 'R' },
+		{ "plugin-mlock", no_argument, NULL, 'l' },
+		{ "plugin-host", required_argument, NULL, 'Z' },
 		{ 0, 0, 0, 0 }
 	};
 
@@ -755,8 +1415,97 @@ ParseOptions(int argc,
 		case 'b':
 			*baseurl = optarg;
 			break;
+		case 'm':
+			use_mmap = False;
+			break;
+		case 'c':
+			cache_dir = optarg;
+			break;
+		case 'C':
+			cache_size = atol(optarg);
+			break;
+		case 'a':
+			curl_options.asfile_dir = optarg;
+			break;
+		case 'M':
+			curl_options.asfile_memfd = True;
+			break;
+		case '2':
+			curl_options.http2 = True;
+			break;
+		case 'H':
+			curl_options.max_host_connections = atoi(optarg);
+			break;
+		case 'S':
+			curl_options.max_streams = atoi(optarg);
+			break;
+		case 'T':
+			curl_options.max_host_streams = atoi(optarg);
+			break;
+		case 'w':
+			curl_options.thread = True;
+			break;
+		case 'W':
+			curl_options.write_delay = atoi(optarg);
+			break;
+		case 's':
+			stats_file = optarg;
+			break;
+		case 'B':
+			backend = optarg;
+			break;
+		case 'p':
+			plugin_file = optarg;
+			break;
+		case 'x':
+			headless = True;
+			break;
+		case 'o':
+			capture_file = optarg;
+			break;
+		case 'r':
+			capture_fps = atoi(optarg);
+			break;
+		case 'n':
+			capture_frames = atoi(optarg);
+			break;
+		case 't':
+			target_fps = atof(optarg);
+			break;
+		case 'L':
+			server_socket = optarg;
+			break;
+		case 'N':
+			pool_size = atoi(optarg);
+			break;
+		case 'k':
+			connect_socket = optarg;
+			break;
+		case 'I':
+			isolate = True;
+			break;
+		case 'e':
+			mem_cap = atol(optarg);
+			break;
+		case 'D':
+			plugin_search_path = optarg;
+			break;
+		case 'R':
+			plugin_readahead = True;
+			break;
+		case 'l':
+			plugin_mlock = True;
+			break;
+		case 'Z':
+			plugin_host = optarg;
+			break;
+		case 'P':
+			if (!ReadPlaylist(optarg)) {
+				return False;
+			}
+			break;
 		case 1:
-			*swf_file = optarg;
+			AddSWFFile(optarg);
 			break;
 		}
 	}
@@ -768,10 +1517,63 @@ ParseOptions(int argc,
 static void
 PrintUsage(void)
 {
-	printf("Usage: %s SWFFILE [OPTION...]\n", PROGRAM_NAME);
+	printf("Usage: %s SWFFILE... [OPTION...]\n", PROGRAM_NAME);
+	printf("       %s --server SOCKET [OPTION...]\n", PROGRAM_NAME);
 	printf("  --geometry WIDTHxHEIGHT\tSpecify window width and height.\n");
 	printf("  --fullsreen\t\t\tRun fullscreen.\n");
 	printf("  --baseurl URL\t\t\tAppend relative references to URL.\n");
+	printf("  --playlist FILE\t\tAlso play the SWF files listed in "
+	       "FILE,\n\t\t\t\tone per line.\n");
+	printf("  --no-mmap\t\t\tRead SWFFILE instead of mapping it.\n");
+	printf("  --cache-dir DIR\t\tCache downloads in DIR.\n");
+	printf("  --cache-size MB\t\tLimit the cache to MB megabytes.\n");
+	printf("  --asfile-dir DIR\t\tSave downloaded files in DIR.\n");
+	printf("  --asfile-memfd\t\tKeep downloaded files in memory.\n");
+	printf("  --http2\t\t\tMultiplex requests over HTTP/2.\n");
+	printf("  --max-host-connections N\tLimit connections per host.\n");
+	printf("  --max-streams N\t\tRun at most N transfers at once,"
+	       "\n\t\t\t\tqueueing the rest (%d, 0 for no limit).\n",
+	       CURLSTREAM_MAX_STREAMS);
+	printf("  --max-host-streams N\t\tRun at most N transfers at once "
+	       "to\n\t\t\t\tany one host, without --http2 (%d).\n",
+	       CURLSTREAM_MAX_HOST_STREAMS);
+	printf("  --net-thread\t\t\tRun transfers on a thread of their own,"
+	       "\n\t\t\t\tpassing data to the main loop.\n");
+	printf("  --write-delay MS\t\tHold small chunks back up to MS ms "
+	       "to\n\t\t\t\twrite them to the plugin together "
+	       "(%d).\n", CURLSTREAM_WRITE_DELAY);
+	printf("  --stats FILE\t\t\tWrite stream statistics to FILE "
+	       "on exit\n\t\t\t\tand SIGUSR1 ('-' for stdout).\n");
+	printf("  --backend curl|dir:DIR|synth:BYTES[:MS]\n"
+	       "\t\t\t\tLoad URLs from the network, from files in\n"
+	       "\t\t\t\tDIR, or as generated BYTES long bodies\n"
+	       "\t\t\t\tarriving after MS milliseconds.\n");
+	printf("  --plugin PATH\t\t\tLoad the plugin from PATH.\n");
+	printf("  --plugin-path DIRS\t\tLook for plugins in the colon "
+	       "separated\n\t\t\t\tDIRS, then MOZ_PLUGIN_PATH and the "
+	       "usual\n\t\t\t\tplaces.\n");
+	printf("  --plugin-readahead\t\tRead the plugin into memory before "
+	       "loading.\n");
+	printf("  --plugin-mlock\t\tLock the plugin's code in memory.\n");
+	printf("  --headless\t\t\tDon't show windowless plugins.\n");
+	printf("  --capture FILE\t\tWrite the first movie's frames to FILE:\n"
+	       "\t\t\t\traw RGB, Y4M if it ends in .y4m, or PNGs\n"
+	       "\t\t\t\tnumbered by a printf %%d in FILE.\n");
+	printf("  --capture-fps N\t\tCapture N frames a second (%d).\n",
+	       capture_fps);
+	printf("  --capture-frames N\t\tQuit after capturing N frames.\n");
+	printf("  --target-fps N\t\tCount frames dropped below N fps "
+	       "(%g,\n\t\t\t\t0 to not).\n", target_fps);
+	printf("  --server SOCKET\t\tKeep processes ready to play movies "
+	       "for\n\t\t\t\t--connect SOCKET, with the plugin loaded.\n"
+	       "\t\t\t\tOther options are defaults for them.\n");
+	printf("  --pool N\t\t\tKeep N processes ready (%d).\n", pool_size);
+	printf("  --connect SOCKET\t\tPlay using a --server process, on its "
+	       "X\n\t\t\t\tdisplay and with its plugin options.\n");
+	printf("  --mem-cap MB\t\t\tLimit the plugin to MB megabytes of"
+	       "\n\t\t\t\tNPN_MemAlloc, without --isolate.\n");
+	printf("  --isolate\t\t\tRun the plugin in its own process, "
+	       "and\n\t\t\t\trestart it if it crashes.\n");
 	printf("  --help\t\t\tPrint this usage information.\n");
 	printf("\n");
 }
@@ -780,43 +1582,156 @@ PrintUsage(void)
 int
 main(int argc, char **argv)
 {
-	NPP_t plugin = { 0 };
 	char *geometry = NULL;
 	int fullscreen = False; /* FIXME: Implement */
 	char *baseurl = NULL;
-	char *swf_file = NULL;
 	int width = 700;  /* Default height */
 	int height = 400; /* Default width */
 
+	gettimeofday(&start_time, NULL);
+
 	if (!ParseOptions(argc, argv, 
 			  &geometry, 
 			  &fullscreen, 
-			  &baseurl, 
-			  &swf_file) || !swf_file) {
+			  &baseurl) || (!nswf && !server_socket && !plugin_host) || 
+	    capture_fps <= 0 || pool_size <= 0) {
 		PrintUsage();
 		return 1;
 	}
+	if (isolate && mem_cap) {
+		/* The plugin allocates in its own process, uncapped. */
+		Error("--mem-cap can't be used with --isolate\n");
+	}
+
+	if (connect_socket) {
+		return ServerConnect(connect_socket, argc, argv);
+	}
+
+	PluginRegInit(plugin_search_path);
+
+	if (plugin_host) {
+		/* Started by IsolateStart, to run the plugin for it. */
+		LoadFlashPlugin(plugin_file);
+		InitializeXt(&argc, argv);
+		putenv("FLASH_GTK_LIBRARY="); /* See InitializePlugin */
+		IsolateServe(plugin_host, x_display, gNP_Initialize, 
+			     gNP_Shutdown);
+		MainLoopShutdown();
+		return 0;
+	}
+
+	if (server_socket) {
+		LoadFlashPlugin(plugin_file);
+		InitializeFuncs();
+
+		/* Returns in a pool process, with a client to play for. */
+		x_argc = argc;
+		x_argv = argv;
+		int client = ServerRun(server_socket, pool_size, WarmUp, 
+				       &argc, &argv);
+		gettimeofday(&start_time, NULL);
+
+		/* Our own options are the defaults for the client's. */
+		const char *server_plugin = plugin_file;
+		const char *server_search_path = plugin_search_path;
+		Bool server_readahead = plugin_readahead;
+		Bool server_mlock = plugin_mlock;
+		nswf = 0;
+		optind = 0;
+		if (!ParseOptions(argc, argv, 
+				  &geometry, 
+				  &fullscreen, 
+				  &baseurl) || !nswf || capture_fps <= 0) {
+			PrintUsage();
+			return 1;
+		}
+		CheckClientOptions(server_plugin, server_search_path,
+				   server_readahead, server_mlock);
+		MainLoopAddWatch(client, MAINLOOP_READ, ClientHangupCb, NULL);
+	} else if (isolate) {
+		InitializeXt(&argc, argv);
+		InitializeFuncs();
+		char *found = plugin_file ? NULL : 
+			PluginRegFind("application/x-shockwave-flash");
+		IsolateStart(plugin_file ? plugin_file : found, 
+			     PluginRestarted);
+		free(found);
+	} else {
+		LoadFlashPlugin(plugin_file);
+		InitializeXt(&argc, argv);
+		InitializeFuncs();
+		InitializePlugin();
+	}
 
 	if (geometry) {
 		sscanf(geometry, "%dx%d", &width, &height);
 		Log("Geometry: %dx%d\n", width, height);
 	}
 
-	CURLStreamInit(baseurl);
-	
-	LoadFlashPlugin();
+	curl_options.baseurl = baseurl;
+	CURLStreamInit(&curl_options);
+	FileStreamInit(use_mmap);
+	if (!StreamInit(backend)) {
+		Error("Invalid backend '%s'\n", backend);
+	}
+	if (cache_dir) {
+		HTTPCacheInit(cache_dir, cache_size * 1024 * 1024);
+	}
 
-	InitializeXt(&argc, argv);
-	InitializeFuncs();
+	if (stats_file) {
+		StatsInit(stats_file);
+	}
+	FrameStatsInit(target_fps);
+	if (!isolate) {
+		/* Nothing allocates from it otherwise; leave it out of --stats. */
+		MemPoolInit(mem_cap * 1024 * 1024);
+	}
 
-	PlaySWF(&plugin, swf_file, width, height);
+	/* 
+	 * Every movie gets its own instance and window, tiled across the
+	 * screen, but shares the plugin, the X connection and the streams.
+	 */
+	int screen = DefaultScreen(x_display);
+	int cols = MAX(1, DisplayWidth(x_display, screen) / width);
+	plugins = calloc(nswf, sizeof(NPP_t));
+	for (nplugins = 0; nplugins < nswf; nplugins++) {
+		PlaySWF(&plugins[nplugins], swf_files[nplugins], 
+			(nplugins % cols) * width, (nplugins / cols) * height,
+			width, height);
+	}
+	if (nplugins > 1) {
+		Log("Playing %d movies\n", nplugins);
+	}
+	if (capture_file) {
+		StartCapture(&plugins[0]);
+	}
 
-	XtAppMainLoop(x_app_context);
+	MainLoopRun();
 
 	Log("Quitting...\n");
-	gNP_Shutdown();
+	FrameStatsPrint();
+	if (capture) {
+		CaptureFree(capture);
+	}
+	for (int i = 0; i < nplugins; i++) {
+		CallDestroy(&plugins[i]);
+	}
+	if (isolate) {
+		IsolateShutdown();
+	} else {
+		gNP_Shutdown();
+	}
 
+	StatsShutdown();
+	FrameStatsShutdown();
+	if (!isolate) {
+		MemPoolShutdown();
+	}
+	PluginRegShutdown();
+	StreamShutdown();
 	CURLStreamShutdown();
+	HTTPCacheShutdown();
+	MainLoopShutdown();
 
 	return 0;
 }
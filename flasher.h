@@ -37,10 +37,33 @@
 #define Error(fmt...) Log("ERROR: " fmt); exit(1)
 
 #define MIN(a,b) ((a) < (b) ? (a) : (b))
+#define MAX(a,b) ((a) > (b) ? (a) : (b))
 #define NOT_IMPLEMENTED() \
 	Warning("Unimplemented function %s at line %d\n", __func__, __LINE__)
 
 
+/*==========================================================================*\
+ * Streams...
+\*==========================================================================*/
+
+/* 
+ * Objects handed to the plugin as NPStream.ndata start with a pointer to
+ * one of these, so NPN_DestroyStream and NPN_RequestRead can find their
+ * implementation.
+ */
+typedef struct _StreamClass
+{
+	void    (*destroy)     (void *stream, NPReason reason);
+	NPError (*request_read)(void *stream, NPByteRange *ranges);
+} StreamClass;
+
+NPByteRange *ByteRangeQueue(NPByteRange *queue, 
+			    NPByteRange *ranges, 
+			    uint32 end);
+Bool ByteRangePop(NPByteRange **queue, uint32 *offset, uint32 *length);
+void ByteRangeFree(NPByteRange *queue);
+
+
 /*==========================================================================*\
  * Globals...
 \*==========================================================================*/
@@ -48,5 +71,7 @@
 extern XtAppContext x_app_context;
 extern NPPluginFuncs plugin_funcs;
 
+double ElapsedMs(void);
+
 
 #endif /* __FLASHER_H__ */
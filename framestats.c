@@ -0,0 +1,207 @@
+/*==========================================================================*\
+ *
+ * framestats.c - Frame timing for flasher.
+ * flasher (C) 2006 Alex Graveley
+ *
+\*==========================================================================*/
+
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "framestats.h"
+#include "stats.h"
+
+
+/* Percentiles are over the most recent frame intervals. */
+#define FRAMESTATS_RECENT 8192
+
+
+/* Frame timing for one plugin instance */
+struct _FrameStats
+{
+	char     *name;
+	double    first;
+	double    last;
+	long      frames;
+	long      dropped;
+	Histogram intervals;
+	double    recent[FRAMESTATS_RECENT];
+	int       recent_next;
+
+	FrameStats *next;
+};
+
+
+static double framestats_target_fps = 0;
+
+/* In creation order */
+static FrameStats *framestats_head = NULL;
+static FrameStats *framestats_tail = NULL;
+
+
+/* 
+ * Time the frames of the instance showing name.  It is reported on until
+ * FrameStatsShutdown, even once the instance is gone.
+ */
+FrameStats *
+FrameStatsNew(const char *name)
+{
+	FrameStats *fs = calloc(1, sizeof(FrameStats));
+	fs->name = strdup(name);
+
+	if (framestats_tail) {
+		framestats_tail->next = fs;
+	} else {
+		framestats_head = fs;
+	}
+	framestats_tail = fs;
+
+	return fs;
+}
+
+
+/* 
+ * Record a frame shown at time now, from StatsNow().  An interval
+ * spanning n frame budgets at the target rate means n - 1 were dropped.
+ */
+void
+FrameStatsAdd(FrameStats *fs, double now)
+{
+	if (fs->frames++ == 0) {
+		fs->first = fs->last = now;
+		return;
+	}
+
+	double interval = now - fs->last;
+	fs->last = now;
+
+	HistogramAdd(&fs->intervals, interval);
+	fs->recent[fs->recent_next++ % FRAMESTATS_RECENT] = interval;
+
+	if (framestats_target_fps > 0) {
+		double budget = 1000.0 / framestats_target_fps;
+		long missed = lround(interval / budget) - 1;
+		if (missed > 0) {
+			fs->dropped += missed;
+		}
+	}
+}
+
+
+static int
+FrameStatsCompare(const void *a, const void *b)
+{
+	double d = *(double *) a - *(double *) b;
+	return (d > 0) - (d < 0);
+}
+
+
+/* Sorted copy of the recent intervals; free it.  Sets *count. */
+static double *
+FrameStatsSorted(FrameStats *fs, int *count)
+{
+	*count = MIN(fs->recent_next, FRAMESTATS_RECENT);
+
+	double *sorted = malloc(MAX(*count, 1) * sizeof(double));
+	memcpy(sorted, fs->recent, *count * sizeof(double));
+	qsort(sorted, *count, sizeof(double), FrameStatsCompare);
+
+	return sorted;
+}
+
+
+static double
+FrameStatsFPS(FrameStats *fs)
+{
+	double span = fs->last - fs->first;
+	return span > 0 ? (fs->frames - 1) / (span / 1000.0) : 0.0;
+}
+
+
+static void
+FrameStatsDump(FILE *f)
+{
+	fprintf(f, "[");
+	for (FrameStats *fs = framestats_head; fs; fs = fs->next) {
+		int count;
+		double *sorted = FrameStatsSorted(fs, &count);
+
+		fprintf(f, "%s\n    { \"movie\": ", 
+			fs == framestats_head ? "" : ",");
+		StatsJSONString(f, fs->name);
+		fprintf(f, ", \"frames\": %ld, \"fps\": %.2f, "
+			"\"target_fps\": %.2f, \"dropped\": %ld",
+			fs->frames, FrameStatsFPS(fs), framestats_target_fps,
+			fs->dropped);
+		if (count) {
+			fprintf(f, ",\n      \"interval_p50_ms\": %.3f, "
+				"\"interval_p95_ms\": %.3f, "
+				"\"interval_p99_ms\": %.3f",
+				sorted[count / 2], sorted[count * 95 / 100],
+				sorted[count * 99 / 100]);
+		}
+		fprintf(f, ",\n      ");
+		HistogramDump(f, "interval_ms", &fs->intervals);
+		fprintf(f, " }");
+
+		free(sorted);
+	}
+	fprintf(f, "\n  ]");
+}
+
+
+/* Log a summary of the frame timing so far, per instance. */
+void
+FrameStatsPrint(void)
+{
+	for (FrameStats *fs = framestats_head; fs; fs = fs->next) {
+		if (fs->frames < 2) {
+			Log("Frames of %s: %ld\n", fs->name, fs->frames);
+			continue;
+		}
+
+		int count;
+		double *sorted = FrameStatsSorted(fs, &count);
+
+		Log("Frames of %s: %ld at %.2f fps", fs->name, fs->frames, 
+		    FrameStatsFPS(fs));
+		if (framestats_target_fps > 0) {
+			Log(", %ld dropped at %.2f fps", fs->dropped,
+			    framestats_target_fps);
+		}
+		Log("\n");
+		Log("Frame interval ms: p50 %.3f, p95 %.3f, p99 %.3f, "
+		    "max %.3f\n", sorted[count / 2], sorted[count * 95 / 100],
+		    sorted[count * 99 / 100], fs->intervals.max);
+
+		free(sorted);
+	}
+}
+
+
+/* 
+ * Count dropped frames against target_fps, or not if it's 0, and add a
+ * "frames" stats section.
+ */
+void
+FrameStatsInit(double target_fps)
+{
+	framestats_target_fps = target_fps;
+
+	StatsAddSection("frames", FrameStatsDump);
+}
+
+
+void
+FrameStatsShutdown(void)
+{
+	while (framestats_head) {
+		FrameStats *fs = framestats_head;
+		framestats_head = fs->next;
+		free(fs->name);
+		free(fs);
+	}
+	framestats_tail = NULL;
+}
@@ -0,0 +1,29 @@
+/*==========================================================================*\
+ *
+ * framestats.h - Frame timing for flasher.
+ * flasher (C) 2006 Alex Graveley
+ *
+\*==========================================================================*/
+
+#ifndef __FRAMESTATS_H__
+#define __FRAMESTATS_H__
+
+
+#include "flasher.h"
+
+
+typedef struct _FrameStats FrameStats;
+
+
+void FrameStatsInit(double target_fps);
+
+FrameStats *FrameStatsNew(const char *name);
+
+void FrameStatsAdd(FrameStats *fs, double now);
+
+void FrameStatsPrint(void);
+
+void FrameStatsShutdown(void);
+
+
+#endif /* __FRAMESTATS_H__ */
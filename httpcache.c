@@ -0,0 +1,513 @@
+/*==========================================================================*\
+ *
+ * httpcache.c - On-disk HTTP response cache for flasher.
+ * flasher (C) 2006 Alex Graveley
+ *
+\*==========================================================================*/
+
+
+#include <curl/curl.h>
+#include <dirent.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include "httpcache.h"
+#include "flasher.h"
+#include "stats.h"
+
+
+/*
+ * Entries live in one directory, named by a hash of their URL: the body
+ * in HASH and its validators and expiry in HASH.meta.  Body files are
+ * touched whenever an entry is used, so their mtime orders eviction.
+ */
+
+static char *cache_dir = NULL;
+static long cache_max_size = 0;
+static long cache_size = 0;
+
+static int cache_hits = 0;
+static int cache_revalidated = 0;
+static int cache_misses = 0;
+
+
+static void HTTPCacheEvict(void);
+
+
+/* 64-bit FNV-1a hash of url, as 16 hex digits in buf. */
+static void
+HTTPCacheHash(const char *url, char *buf)
+{
+	unsigned long long hash = 14695981039346656037ULL;
+
+	for (; *url; url++) {
+		hash ^= (unsigned char) *url;
+		hash *= 1099511628211ULL;
+	}
+
+	sprintf(buf, "%016llx", hash);
+}
+
+
+HTTPCacheEntry *
+HTTPCacheEntryNew(const char *url)
+{
+	char hash[17];
+	HTTPCacheHash(url, hash);
+
+	HTTPCacheEntry *e = calloc(1, sizeof(HTTPCacheEntry));
+	e->url = strdup(url);
+
+	int len = strlen(cache_dir) + strlen(hash) + 32;
+	e->path = malloc(len);
+	e->meta_path = malloc(len);
+	e->tmp_path = malloc(len);
+	snprintf(e->path, len, "%s/%s", cache_dir, hash);
+	snprintf(e->meta_path, len, "%s/%s.meta", cache_dir, hash);
+	/* Entries for the same URL may be written at the same time. */
+	static unsigned int serial = 0;
+	snprintf(e->tmp_path, len, "%s/%s.%d.%u", cache_dir, hash, getpid(),
+		 serial++);
+
+	return e;
+}
+
+
+void
+HTTPCacheEntryFree(HTTPCacheEntry *e)
+{
+	free(e->url);
+	free(e->path);
+	free(e->meta_path);
+	free(e->tmp_path);
+	free(e->etag);
+	free(e->last_modified);
+	free(e->mimetype);
+	free(e->content_encoding);
+	free(e);
+}
+
+
+/*
+ * Find the cache entry for url.  Returns NULL on a miss, including when
+ * the stored entry belongs to a different URL with the same hash.
+ */
+HTTPCacheEntry *
+HTTPCacheLookup(const char *url)
+{
+	if (!cache_dir) {
+		return NULL;
+	}
+
+	HTTPCacheEntry *e = HTTPCacheEntryNew(url);
+	Bool found = False;
+
+	FILE *meta = fopen(e->meta_path, "r");
+	if (meta) {
+		char line[4096];
+		while (fgets(line, sizeof(line), meta)) {
+			line[strcspn(line, "\n")] = '\0';
+
+			char *value = strchr(line, ' ');
+			if (!value) {
+				continue;
+			}
+			*value++ = '\0';
+
+			if (!strcmp(line, "url")) {
+				found = !strcmp(value, url);
+			} else if (!strcmp(line, "etag")) {
+				e->etag = strdup(value);
+			} else if (!strcmp(line, "last-modified")) {
+				e->last_modified = strdup(value);
+			} else if (!strcmp(line, "content-type")) {
+				e->mimetype = strdup(value);
+			} else if (!strcmp(line, "content-encoding")) {
+				e->content_encoding = strdup(value);
+			} else if (!strcmp(line, "expires")) {
+				e->expires = atol(value);
+			} else if (!strcmp(line, "no-cache")) {
+				e->no_cache = atoi(value);
+			}
+		}
+		fclose(meta);
+	}
+
+	if (!found || access(e->path, R_OK) < 0) {
+		Debug("HTTPCacheLookup miss url=%s\n", url);
+		cache_misses++;
+		HTTPCacheEntryFree(e);
+		return NULL;
+	}
+
+	e->stale = !HTTPCacheEntryIsFresh(e);
+	Debug("HTTPCacheLookup %s url=%s\n", e->stale ? "stale" : "fresh", url);
+
+	return e;
+}
+
+
+/* Update e from the directives of a Cache-Control header. */
+static void
+HTTPCacheControl(HTTPCacheEntry *e, char *value)
+{
+	char *save;
+	for (char *d = strtok_r(value, ",", &save); d; 
+	     d = strtok_r(NULL, ",", &save)) {
+		d += strspn(d, " \t");
+		int len = strcspn(d, "= \t");
+
+		if (len == 7 && !strncasecmp(d, "max-age", len) && 
+		    d[len] == '=') {
+			e->expires = time(NULL) + atol(d + len + 1);
+			e->max_age = True;
+		} else if (len == 8 && !strncasecmp(d, "no-cache", len)) {
+			e->no_cache = True;
+		} else if ((len == 8 && !strncasecmp(d, "no-store", len)) ||
+			   (len == 7 && !strncasecmp(d, "private", len))) {
+			e->no_store = True;
+		}
+	}
+}
+
+
+/* Update e from one response header line, as passed by libcurl. */
+void
+HTTPCacheEntryHeader(HTTPCacheEntry *e, const char *line, int len)
+{
+	char *header = strndup(line, len);
+	header[strcspn(header, "\r\n")] = '\0';
+
+	char *value = strchr(header, ':');
+	if (value) {
+		*value++ = '\0';
+		value += strspn(value, " \t");
+	}
+
+	if (!strncmp(header, "HTTP/", 5)) {
+		char *code = strchr(header, ' ');
+		e->max_age = False;
+		if (code && atoi(code) == 200) {
+			/* A new body; forget the old validators. */
+			free(e->etag);
+			free(e->last_modified);
+			free(e->mimetype);
+			free(e->content_encoding);
+			e->etag = e->last_modified = e->mimetype = NULL;
+			e->content_encoding = NULL;
+			e->expires = 0;
+			e->no_cache = False;
+			e->no_store = False;
+		}
+	} else if (!value) {
+		/* Blank line or garbage */
+	} else if (!strcasecmp(header, "ETag")) {
+		free(e->etag);
+		e->etag = strdup(value);
+	} else if (!strcasecmp(header, "Last-Modified")) {
+		free(e->last_modified);
+		e->last_modified = strdup(value);
+	} else if (!strcasecmp(header, "Content-Type")) {
+		free(e->mimetype);
+		e->mimetype = strndup(value, strcspn(value, "; \t"));
+	} else if (!strcasecmp(header, "Content-Encoding")) {
+		free(e->content_encoding);
+		e->content_encoding = strdup(value);
+	} else if (!strcasecmp(header, "Expires")) {
+		time_t expires = curl_getdate(value, NULL);
+		if (expires > 0 && !e->max_age) {
+			e->expires = expires;
+		}
+	} else if (!strcasecmp(header, "Cache-Control")) {
+		HTTPCacheControl(e, value);
+	}
+
+	free(header);
+}
+
+
+Bool
+HTTPCacheEntryIsFresh(HTTPCacheEntry *e)
+{
+	return !e->no_cache && e->expires > time(NULL);
+}
+
+
+static void
+HTTPCacheWriteMeta(HTTPCacheEntry *e)
+{
+	FILE *meta = fopen(e->tmp_path, "w");
+	if (!meta) {
+		Warning("Error writing cache entry '%s': %s\n", e->tmp_path,
+			strerror(errno));
+		return;
+	}
+
+	fprintf(meta, "url %s\n", e->url);
+	if (e->etag) {
+		fprintf(meta, "etag %s\n", e->etag);
+	}
+	if (e->last_modified) {
+		fprintf(meta, "last-modified %s\n", e->last_modified);
+	}
+	if (e->mimetype) {
+		fprintf(meta, "content-type %s\n", e->mimetype);
+	}
+	if (e->content_encoding) {
+		fprintf(meta, "content-encoding %s\n", e->content_encoding);
+	}
+	fprintf(meta, "expires %ld\n", (long) e->expires);
+	if (e->no_cache) {
+		fprintf(meta, "no-cache 1\n");
+	}
+	fclose(meta);
+
+	rename(e->tmp_path, e->meta_path);
+}
+
+
+/*
+ * Start storing a new body for e.  Returns NULL if the response may not
+ * be cached.
+ */
+FILE *
+HTTPCacheEntryOpenWrite(HTTPCacheEntry *e)
+{
+	if (e->no_store) {
+		return NULL;
+	}
+
+	FILE *body = fopen(e->tmp_path, "w");
+	if (!body) {
+		Warning("Error writing cache entry '%s': %s\n", e->tmp_path,
+			strerror(errno));
+	}
+	return body;
+}
+
+
+/* Finish a body started with HTTPCacheEntryOpenWrite and store e. */
+void
+HTTPCacheEntryCommit(HTTPCacheEntry *e, FILE *body)
+{
+	if (fclose(body) != 0) {
+		HTTPCacheEntryAbort(e, NULL);
+		return;
+	}
+
+	if (e->stale) {
+		/* Changed on the server since we cached it. */
+		cache_misses++;
+	}
+
+	if (!e->expires && !e->no_cache && e->last_modified) {
+		/* No explicit lifetime; use a tenth of its age, as browsers do. */
+		time_t modified = curl_getdate(e->last_modified, NULL);
+		time_t now = time(NULL);
+		if (modified > 0 && modified < now) {
+			e->expires = now + (now - modified) / 10;
+		}
+	}
+
+	struct stat st;
+	if (stat(e->path, &st) == 0) {
+		cache_size -= st.st_size;
+	}
+	if (stat(e->tmp_path, &st) == 0) {
+		cache_size += st.st_size;
+	}
+
+	rename(e->tmp_path, e->path);
+	HTTPCacheWriteMeta(e);
+	Debug("HTTPCacheEntryCommit url=%s, cache_size=%ld\n", e->url,
+	      cache_size);
+
+	if (cache_size > cache_max_size) {
+		HTTPCacheEvict();
+	}
+}
+
+
+void
+HTTPCacheEntryAbort(HTTPCacheEntry *e, FILE *body)
+{
+	if (body) {
+		fclose(body);
+	}
+	unlink(e->tmp_path);
+}
+
+
+/*
+ * Count a use of e, served either fresh or after the server confirmed it
+ * is unchanged, and mark it recently used.
+ */
+void
+HTTPCacheEntryUsed(HTTPCacheEntry *e, Bool revalidated)
+{
+	if (revalidated) {
+		cache_revalidated++;
+		HTTPCacheWriteMeta(e);
+	} else {
+		cache_hits++;
+	}
+
+	utimes(e->path, NULL);
+}
+
+
+typedef struct _HTTPCacheFile
+{
+	char  *name;
+	time_t mtime;
+	long   size;
+} HTTPCacheFile;
+
+
+static int
+HTTPCacheFileCompare(const void *a, const void *b)
+{
+	return ((HTTPCacheFile *) a)->mtime - ((HTTPCacheFile *) b)->mtime;
+}
+
+
+/*
+ * List body files in the cache directory, and return the sum of their
+ * sizes.  Caller frees *files and its names.
+ */
+static long
+HTTPCacheScan(HTTPCacheFile **files, int *nfiles)
+{
+	long total = 0;
+	int alloc = 0;
+
+	*files = NULL;
+	*nfiles = 0;
+
+	DIR *dir = opendir(cache_dir);
+	if (!dir) {
+		return 0;
+	}
+
+	struct dirent *ent;
+	while ((ent = readdir(dir))) {
+		if (strchr(ent->d_name, '.')) {
+			continue; /* Metadata, temp files, . and .. */
+		}
+
+		char path[4096];
+		snprintf(path, sizeof(path), "%s/%s", cache_dir, ent->d_name);
+
+		struct stat st;
+		if (stat(path, &st) < 0 || !S_ISREG(st.st_mode)) {
+			continue;
+		}
+
+		if (*nfiles == alloc) {
+			alloc = alloc ? alloc * 2 : 64;
+			*files = realloc(*files, alloc * sizeof(HTTPCacheFile));
+		}
+		(*files)[*nfiles].name = strdup(ent->d_name);
+		(*files)[*nfiles].mtime = st.st_mtime;
+		(*files)[*nfiles].size = st.st_size;
+		(*nfiles)++;
+
+		total += st.st_size;
+	}
+	closedir(dir);
+
+	return total;
+}
+
+
+/* Remove least recently used entries until the cache is at 90% of max. */
+static void
+HTTPCacheEvict(void)
+{
+	HTTPCacheFile *files;
+	int nfiles;
+
+	cache_size = HTTPCacheScan(&files, &nfiles);
+	qsort(files, nfiles, sizeof(HTTPCacheFile), HTTPCacheFileCompare);
+
+	for (int i = 0; i < nfiles; i++) {
+		if (cache_size > cache_max_size / 10 * 9) {
+			char path[4096];
+
+			Debug("HTTPCacheEvict %s\n", files[i].name);
+			snprintf(path, sizeof(path), "%s/%s", cache_dir,
+				 files[i].name);
+			unlink(path);
+			strcat(path, ".meta");
+			unlink(path);
+
+			cache_size -= files[i].size;
+		}
+		free(files[i].name);
+	}
+	free(files);
+}
+
+
+/* StatsDumpFunc for the "httpcache" section. */
+static void
+HTTPCacheDumpStats(FILE *f)
+{
+	fprintf(f, "{ \"hits\": %d, \"revalidated\": %d, \"misses\": %d, "
+		"\"size\": %ld }", cache_hits, cache_revalidated, 
+		cache_misses, cache_size);
+}
+
+
+Bool
+HTTPCacheEnabled(void)
+{
+	return cache_dir != NULL;
+}
+
+
+void
+HTTPCacheInit(const char *dir, long max_size)
+{
+	if (mkdir(dir, 0700) < 0 && errno != EEXIST) {
+		Warning("Not caching, can't create '%s': %s\n", dir,
+			strerror(errno));
+		return;
+	}
+
+	cache_dir = strdup(dir);
+	cache_max_size = max_size;
+
+	HTTPCacheFile *files;
+	int nfiles;
+	cache_size = HTTPCacheScan(&files, &nfiles);
+	for (int i = 0; i < nfiles; i++) {
+		free(files[i].name);
+	}
+	free(files);
+
+	if (cache_size > cache_max_size) {
+		HTTPCacheEvict();
+	}
+
+	StatsAddSection("httpcache", HTTPCacheDumpStats);
+}
+
+
+void
+HTTPCacheShutdown(void)
+{
+	if (!cache_dir) {
+		return;
+	}
+
+	Log("HTTP cache: %d hits, %d revalidated, %d misses, %ld bytes\n",
+	    cache_hits, cache_revalidated, cache_misses, cache_size);
+
+	free(cache_dir);
+	cache_dir = NULL;
+}
@@ -0,0 +1,61 @@
+/*==========================================================================*\
+ *
+ * httpcache.h - On-disk HTTP response cache for flasher.
+ * flasher (C) 2006 Alex Graveley
+ *
+\*==========================================================================*/
+
+#ifndef __HTTPCACHE_H__
+#define __HTTPCACHE_H__
+
+
+#include <time.h>
+
+#include "flasher.h"
+
+
+typedef struct _HTTPCacheEntry
+{
+	char  *url;
+	char  *path;          /* Body file */
+	char  *meta_path;
+	char  *tmp_path;      /* Body being downloaded */
+
+	char  *etag;
+	char  *last_modified; /* Raw Last-Modified header */
+	char  *mimetype;
+	char  *content_encoding; /* The body is kept as sent */
+	time_t expires;       /* Must be revalidated after this */
+	Bool   max_age;       /* expires is from max-age, which beats Expires */
+	Bool   no_cache;      /* Must be revalidated on every use */
+	Bool   no_store;
+	Bool   stale;         /* Found in the cache, but expired */
+} HTTPCacheEntry;
+
+
+HTTPCacheEntry *HTTPCacheLookup(const char *url);
+
+HTTPCacheEntry *HTTPCacheEntryNew(const char *url);
+
+void HTTPCacheEntryFree(HTTPCacheEntry *e);
+
+void HTTPCacheEntryHeader(HTTPCacheEntry *e, const char *line, int len);
+
+Bool HTTPCacheEntryIsFresh(HTTPCacheEntry *e);
+
+FILE *HTTPCacheEntryOpenWrite(HTTPCacheEntry *e);
+
+void HTTPCacheEntryCommit(HTTPCacheEntry *e, FILE *body);
+
+void HTTPCacheEntryAbort(HTTPCacheEntry *e, FILE *body);
+
+void HTTPCacheEntryUsed(HTTPCacheEntry *e, Bool revalidated);
+
+Bool HTTPCacheEnabled(void);
+
+void HTTPCacheInit(const char *dir, long max_size);
+
+void HTTPCacheShutdown(void);
+
+
+#endif /* __HTTPCACHE_H__ */
@@ -0,0 +1,2303 @@
+/*==========================================================================*\
+ *
+ * isolate.c - Running the plugin in a separate process.
+ * flasher (C) 2006 Alex Graveley
+ *
+\*==========================================================================*/
+
+
+#define _GNU_SOURCE /* for memfd_create */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+
+#include <X11/Xutil.h>
+#include <X11/Shell.h>
+#include <X11/IntrinsicP.h> /* for XtTMRec */
+#include <X11/CoreP.h>      /* for CorePart */
+
+#include "isolate.h"
+#include "mainloop.h"
+#include "mempool.h"
+#include "stats.h"
+
+
+/*
+ * With --isolate the plugin is loaded by a second flasher process,
+ * started as "flasher --plugin-host FDS", and every NPP_* call the host
+ * makes and NPN_* call the plugin makes is sent over a socketpair
+ * between them.  Calls are synchronous: the caller sends a request and
+ * handles requests from the other side until the reply arrives, so the
+ * plugin calling back into the host from inside NPP_Write works as it
+ * would in one process.  Calls without a result are sent one-way.
+ *
+ * NPP_Write data goes through a shared memory buffer rather than the
+ * socket, and the reply to each NPP_Write carries the plugin's next
+ * NPP_WriteReady, saving a round trip per write.  Memory, Java and the
+ * X display are the plugin process's own, and answered there.
+ *
+ * If the plugin process crashes, or a call to it takes longer than
+ * ISOLATE_CALL_TIMEOUT, it is killed and started again, and the host's
+ * restart function re-creates its instances.  If it exits cleanly, say
+ * on SIGTERM, the host quits too.
+ */
+
+
+#define ISOLATE_SHM_SIZE     (4 * 1024 * 1024)
+#define ISOLATE_CALL_TIMEOUT 10000 /* ms */
+#define ISOLATE_RESTART_MAX  8000  /* ms between restarts when crashing */
+
+/* NPP_WriteReady when the stream is unknown, so NPP_Write fails it */
+#define ISOLATE_READY_UNKNOWN (64 * 1024)
+
+
+typedef enum {
+	ISOLATE_CALL,
+	ISOLATE_ONEWAY,
+	ISOLATE_REPLY,
+} IsolateKind;
+
+typedef enum {
+	/* Host to plugin */
+	ISOLATE_NPP_NEW,
+	ISOLATE_NPP_DESTROY,
+	ISOLATE_NPP_SETWINDOW,
+	ISOLATE_NPP_NEWSTREAM,
+	ISOLATE_NPP_DESTROYSTREAM,
+	ISOLATE_NPP_ASFILE,
+	ISOLATE_NPP_WRITEREADY,
+	ISOLATE_NPP_WRITE,
+	ISOLATE_NPP_PRINT,
+	ISOLATE_NPP_HANDLEEVENT,
+	ISOLATE_NPP_URLNOTIFY,
+	ISOLATE_NPP_GETVALUE,
+	ISOLATE_NPP_SETVALUE,
+
+	/* Plugin to host */
+	ISOLATE_NPN_GETURL,
+	ISOLATE_NPN_GETURLNOTIFY,
+	ISOLATE_NPN_POSTURL,
+	ISOLATE_NPN_POSTURLNOTIFY,
+	ISOLATE_NPN_REQUESTREAD,
+	ISOLATE_NPN_NEWSTREAM,
+	ISOLATE_NPN_WRITE,
+	ISOLATE_NPN_DESTROYSTREAM,
+	ISOLATE_NPN_STATUS,
+	ISOLATE_NPN_USERAGENT,
+	ISOLATE_NPN_RELOADPLUGINS,
+	ISOLATE_NPN_GETVALUE,
+	ISOLATE_NPN_SETVALUE,
+	ISOLATE_NPN_INVALIDATERECT,
+	ISOLATE_NPN_FORCEREDRAW,
+
+	ISOLATE_OPS
+} IsolateOp;
+
+
+typedef struct _IsolateHeader
+{
+	uint32 len; /* Of the body */
+	uint16 kind;
+	uint16 op;
+	uint32 serial;
+} IsolateHeader;
+
+/*
+ * A message body: 64-bit integers, and strings and byte arrays as a
+ * 32-bit length, -1 for NULL, then the bytes and a NUL.
+ */
+typedef struct _IsolateMsg
+{
+	char  *data;
+	uint32 len;
+	uint32 size;
+	uint32 pos;  /* Read position */
+	Bool   bad;  /* Read past the end */
+} IsolateMsg;
+
+typedef void (*IsolateHandler)(IsolateMsg *args, IsolateMsg *reply);
+
+
+/* Host side: the instances and streams the plugin process knows about */
+typedef struct _IsolateRef
+{
+	void  *ptr;   /* NPP or NPStream */
+	NPP    owner; /* Streams: their instance */
+	int32  ready; /* Streams: NPP_WriteReady from the last write, or -1 */
+	struct _IsolateRef *next;
+} IsolateRef;
+
+/* Plugin side: an instance, named by the host's NPP */
+typedef struct _IsolateInstance
+{
+	uint64   id;
+	NPP_t    npp;   /* ndata is id */
+	NPWindow window;
+	NPSetWindowCallbackStruct ws_info;
+	Widget   widget; /* Wraps the host's window */
+	struct _IsolateInstance *next;
+} IsolateInstance;
+
+/* Plugin side: a stream, named by the host's NPStream */
+typedef struct _IsolateStream
+{
+	uint64   id;
+	NPStream stream; /* ndata is id */
+	IsolateInstance *inst;
+	struct _IsolateStream *next;
+} IsolateStream;
+
+
+static int isolate_fd = -1;
+static MainLoopWatch *isolate_watch;
+static uint32 isolate_serial;
+static IsolateHandler isolate_handlers[ISOLATE_OPS];
+static char *isolate_shm;
+static uint32 isolate_shm_pos;
+
+/* Host side */
+static Bool isolate_host;
+static int isolate_shm_fd = -1;
+static pid_t isolate_pid;
+static char *isolate_plugin_path;
+static IsolateRestartFunc isolate_restarted;
+static double isolate_started_at;
+static long isolate_restart_delay;
+static MainLoopTimer *isolate_restart_timer;
+static IsolateRef *isolate_instances;
+static IsolateRef *isolate_streams;
+
+/* Plugin side */
+static Display *isolate_display;
+static NPPluginFuncs isolate_plugin;
+static IsolateInstance *isolate_plugin_instances;
+static IsolateStream *isolate_plugin_streams;
+static char *isolate_user_agent;
+
+static struct {
+	long      calls;
+	long      oneway;
+	long      handled; /* Calls from the plugin */
+	long      shm_bytes;
+	int       restarts;
+	Histogram call_ms;
+} isolate_stats;
+
+
+/*==========================================================================*\
+ * Messages...
+\*==========================================================================*/
+
+static void
+IsolateMsgReserve(IsolateMsg *m, uint32 len)
+{
+	if (m->len + len > m->size) {
+		m->size = MAX(m->size * 2, m->len + len + 256);
+		m->data = realloc(m->data, m->size);
+	}
+}
+
+
+static void
+IsolatePutInt(IsolateMsg *m, int64 value)
+{
+	IsolateMsgReserve(m, sizeof(value));
+	memcpy(m->data + m->len, &value, sizeof(value));
+	m->len += sizeof(value);
+}
+
+
+static void
+IsolatePutBytes(IsolateMsg *m, const void *data, int32 len)
+{
+	int32 n = data ? len : -1;
+	IsolateMsgReserve(m, sizeof(n) + MAX(n, 0) + 1);
+	memcpy(m->data + m->len, &n, sizeof(n));
+	m->len += sizeof(n);
+	if (n > 0) {
+		memcpy(m->data + m->len, data, n);
+		m->len += n;
+	}
+	m->data[m->len++] = '\0';
+}
+
+
+static void
+IsolatePutString(IsolateMsg *m, const char *str)
+{
+	IsolatePutBytes(m, str, str ? strlen(str) : 0);
+}
+
+
+static int64
+IsolateGetInt(IsolateMsg *m)
+{
+	int64 value = 0;
+	if (m->pos + sizeof(value) > m->len) {
+		m->bad = True;
+		return 0;
+	}
+	memcpy(&value, m->data + m->pos, sizeof(value));
+	m->pos += sizeof(value);
+	return value;
+}
+
+
+/* Returns a pointer into m, NUL terminated, or NULL.  Sets *len. */
+static char *
+IsolateGetBytes(IsolateMsg *m, int32 *len)
+{
+	int32 n;
+	*len = 0;
+	if (m->pos + sizeof(n) > m->len) {
+		m->bad = True;
+		return NULL;
+	}
+	memcpy(&n, m->data + m->pos, sizeof(n));
+	m->pos += sizeof(n);
+	if (n < -1 || m->pos + MAX(n, 0) + 1 > m->len) {
+		m->bad = True;
+		return NULL;
+	}
+
+	char *data = m->data + m->pos;
+	m->pos += MAX(n, 0) + 1;
+	if (n < 0) {
+		return NULL;
+	}
+	*len = n;
+	return data;
+}
+
+
+static char *
+IsolateGetString(IsolateMsg *m)
+{
+	int32 len;
+	return IsolateGetBytes(m, &len);
+}
+
+
+static void
+IsolateMsgFree(IsolateMsg *m)
+{
+	free(m->data);
+	memset(m, 0, sizeof(IsolateMsg));
+}
+
+
+static Bool
+IsolateSend(IsolateKind kind, IsolateOp op, uint32 serial, IsolateMsg *m)
+{
+	IsolateHeader h = { m->len, kind, op, serial };
+	struct iovec iov[2] = {
+		{ &h, sizeof(h) },
+		{ m->data, m->len },
+	};
+	int niov = 2;
+	struct iovec *v = iov;
+
+	while (niov) {
+		ssize_t n = writev(isolate_fd, v, niov);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n < 0) {
+			return False;
+		}
+		while (niov && n >= (ssize_t) v->iov_len) {
+			n -= v->iov_len;
+			v++;
+			niov--;
+		}
+		if (niov) {
+			v->iov_base = (char *) v->iov_base + n;
+			v->iov_len -= n;
+		}
+	}
+
+	return True;
+}
+
+
+static Bool
+IsolateRead(void *buf, size_t len)
+{
+	while (len) {
+		ssize_t n = read(isolate_fd, buf, len);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			return False;
+		}
+		buf = (char *) buf + n;
+		len -= n;
+	}
+	return True;
+}
+
+
+/*
+ * Read the next message.  On the host side, gives up if none starts
+ * within ISOLATE_CALL_TIMEOUT.
+ */
+static Bool
+IsolateRecv(IsolateHeader *h, IsolateMsg *m)
+{
+	if (isolate_host) {
+		struct pollfd pfd = { isolate_fd, POLLIN, 0 };
+		int n;
+		do {
+			n = poll(&pfd, 1, ISOLATE_CALL_TIMEOUT);
+		} while (n < 0 && errno == EINTR);
+		if (n == 0) {
+			Warning("Plugin process not responding\n");
+		}
+		if (n <= 0) {
+			return False;
+		}
+	}
+
+	memset(m, 0, sizeof(IsolateMsg));
+	if (!IsolateRead(h, sizeof(IsolateHeader))) {
+		return False;
+	}
+	if (h->op >= ISOLATE_OPS || h->len > 2 * ISOLATE_SHM_SIZE) {
+		Warning("Invalid message from %s process\n",
+			isolate_host ? "plugin" : "host");
+		return False;
+	}
+
+	m->size = m->len = h->len;
+	m->data = malloc(MAX(m->size, 1));
+	return IsolateRead(m->data, m->len);
+}
+
+
+static void IsolateLost(void);
+
+
+/* Handle a call or one-way message from the other side. */
+static void
+IsolateDispatch(IsolateHeader *h, IsolateMsg *args)
+{
+	IsolateMsg reply = { 0 };
+
+	if (isolate_handlers[h->op]) {
+		isolate_handlers[h->op](args, &reply);
+	} else {
+		Warning("Unexpected message %d from %s process\n", h->op,
+			isolate_host ? "plugin" : "host");
+	}
+	if (args->bad) {
+		Warning("Malformed message %d from %s process\n", h->op,
+			isolate_host ? "plugin" : "host");
+	}
+	isolate_stats.handled++;
+
+	if (h->kind == ISOLATE_CALL) {
+		if (!IsolateSend(ISOLATE_REPLY, h->op, h->serial, &reply)) {
+			IsolateLost();
+		}
+	}
+	IsolateMsgFree(&reply);
+}
+
+
+/*
+ * Send op with args, handling calls from the other side until its reply
+ * arrives.  Returns False, with the other process lost, if it doesn't.
+ */
+static Bool
+IsolateCall(IsolateOp op, IsolateMsg *args, IsolateMsg *reply)
+{
+	memset(reply, 0, sizeof(IsolateMsg));
+	if (isolate_fd < 0) {
+		IsolateMsgFree(args);
+		return False;
+	}
+
+	double start = StatsNow();
+	uint32 serial = ++isolate_serial;
+	Bool ok = IsolateSend(ISOLATE_CALL, op, serial, args);
+	IsolateMsgFree(args);
+
+	while (ok) {
+		IsolateHeader h;
+		IsolateMsg in;
+		if (!IsolateRecv(&h, &in)) {
+			IsolateMsgFree(&in);
+			ok = False;
+			break;
+		}
+		if (h.kind == ISOLATE_REPLY) {
+			if (h.serial != serial) {
+				Warning("Reply out of order from %s process\n",
+					isolate_host ? "plugin" : "host");
+				IsolateMsgFree(&in);
+				ok = False;
+				break;
+			}
+			*reply = in;
+			break;
+		}
+
+		IsolateDispatch(&h, &in);
+		IsolateMsgFree(&in);
+		if (isolate_fd < 0) {
+			ok = False;
+		}
+	}
+
+	if (!ok) {
+		IsolateLost();
+		return False;
+	}
+
+	isolate_stats.calls++;
+	HistogramAdd(&isolate_stats.call_ms, StatsNow() - start);
+	return True;
+}
+
+
+/* Send op without waiting for anything back. */
+static void
+IsolateOneway(IsolateOp op, IsolateMsg *args)
+{
+	if (isolate_fd >= 0 && !IsolateSend(ISOLATE_ONEWAY, op, 0, args)) {
+		IsolateLost();
+	}
+	IsolateMsgFree(args);
+	isolate_stats.oneway++;
+}
+
+
+/* Main loop watch: handle messages from the other side as they come. */
+static void
+IsolateWatchCb(int fd, int events, void *data)
+{
+	do {
+		IsolateHeader h;
+		IsolateMsg in;
+		if (!IsolateRecv(&h, &in) || h.kind == ISOLATE_REPLY) {
+			IsolateMsgFree(&in);
+			IsolateLost();
+			return;
+		}
+		IsolateDispatch(&h, &in);
+		IsolateMsgFree(&in);
+
+		struct pollfd pfd = { fd, POLLIN, 0 };
+		if (isolate_fd < 0 || poll(&pfd, 1, 0) <= 0) {
+			break;
+		}
+	} while (True);
+}
+
+
+/*==========================================================================*\
+ * Host side: proxies for the plugin's NPP_* functions...
+\*==========================================================================*/
+
+static IsolateRef *
+IsolateRefAdd(IsolateRef **list, void *ptr, NPP owner)
+{
+	IsolateRef *ref = calloc(1, sizeof(IsolateRef));
+	ref->ptr = ptr;
+	ref->owner = owner;
+	ref->ready = -1;
+	ref->next = *list;
+	*list = ref;
+	return ref;
+}
+
+
+static IsolateRef *
+IsolateRefFind(IsolateRef *list, uint64 id)
+{
+	for (; list; list = list->next) {
+		if ((uint64) (uintptr_t) list->ptr == id) {
+			return list;
+		}
+	}
+	return NULL;
+}
+
+
+/* Remove the ref for ptr, or with owner == ptr if owned. */
+static void
+IsolateRefRemove(IsolateRef **list, void *ptr, Bool owned)
+{
+	while (*list) {
+		IsolateRef *ref = *list;
+		if ((owned ? (void *) ref->owner : ref->ptr) == ptr) {
+			*list = ref->next;
+			free(ref);
+		} else {
+			list = &ref->next;
+		}
+	}
+}
+
+
+static void
+IsolateRefClear(IsolateRef **list)
+{
+	while (*list) {
+		IsolateRef *ref = *list;
+		*list = ref->next;
+		free(ref);
+	}
+}
+
+
+static NPP
+IsolateHostInstance(uint64 id)
+{
+	IsolateRef *ref = IsolateRefFind(isolate_instances, id);
+	return ref ? ref->ptr : NULL;
+}
+
+
+static NPError
+IsolateNPP_New(NPMIMEType type,
+	       NPP instance,
+	       uint16 mode,
+	       int16 argc,
+	       char *argn[],
+	       char *argv[],
+	       NPSavedData *saved)
+{
+	IsolateMsg args = { 0 }, reply;
+	IsolatePutInt(&args, (uintptr_t) instance);
+	IsolatePutString(&args, type);
+	IsolatePutInt(&args, mode);
+	IsolatePutInt(&args, argc);
+	for (int i = 0; i < argc; i++) {
+		IsolatePutString(&args, argn[i]);
+		IsolatePutString(&args, argv[i]);
+	}
+
+	/* Known before the plugin calls back with it. */
+	IsolateRefAdd(&isolate_instances, instance, NULL);
+
+	NPError err = NPERR_GENERIC_ERROR;
+	if (IsolateCall(ISOLATE_NPP_NEW, &args, &reply)) {
+		err = IsolateGetInt(&reply);
+		IsolateMsgFree(&reply);
+	}
+	if (err != NPERR_NO_ERROR) {
+		IsolateRefRemove(&isolate_instances, instance, False);
+	}
+	return err;
+}
+
+
+static NPError
+IsolateNPP_Destroy(NPP instance, NPSavedData **save)
+{
+	if (save) {
+		*save = NULL;
+	}
+	if (!IsolateRefFind(isolate_instances, (uintptr_t) instance)) {
+		return NPERR_INVALID_INSTANCE_ERROR;
+	}
+
+	IsolateMsg args = { 0 }, reply;
+	IsolatePutInt(&args, (uintptr_t) instance);
+
+	NPError err = NPERR_GENERIC_ERROR;
+	if (IsolateCall(ISOLATE_NPP_DESTROY, &args, &reply)) {
+		err = IsolateGetInt(&reply);
+		IsolateMsgFree(&reply);
+	}
+
+	IsolateRefRemove(&isolate_streams, instance, True);
+	IsolateRefRemove(&isolate_instances, instance, False);
+	return err;
+}
+
+
+static NPError
+IsolateNPP_SetWindow(NPP instance, NPWindow *window)
+{
+	NPSetWindowCallbackStruct *ws_info = window->ws_info;
+
+	/* The plugin process draws with its own connection. */
+	XSync(ws_info->display, False);
+
+	IsolateMsg args = { 0 }, reply;
+	IsolatePutInt(&args, (uintptr_t) instance);
+	IsolatePutInt(&args, window->type);
+	IsolatePutInt(&args, (uintptr_t) window->window);
+	IsolatePutInt(&args, window->x);
+	IsolatePutInt(&args, window->y);
+	IsolatePutInt(&args, window->width);
+	IsolatePutInt(&args, window->height);
+	IsolatePutInt(&args, window->clipRect.top);
+	IsolatePutInt(&args, window->clipRect.left);
+	IsolatePutInt(&args, window->clipRect.bottom);
+	IsolatePutInt(&args, window->clipRect.right);
+	IsolatePutInt(&args, XVisualIDFromVisual(ws_info->visual));
+	IsolatePutInt(&args, ws_info->colormap);
+	IsolatePutInt(&args, ws_info->depth);
+
+	NPError err = NPERR_GENERIC_ERROR;
+	if (IsolateCall(ISOLATE_NPP_SETWINDOW, &args, &reply)) {
+		err = IsolateGetInt(&reply);
+		IsolateMsgFree(&reply);
+	}
+	return err;
+}
+
+
+static NPError
+IsolateNPP_NewStream(NPP instance,
+		     NPMIMEType type,
+		     NPStream *stream,
+		     NPBool seekable,
+		     uint16 *stype)
+{
+	IsolateMsg args = { 0 }, reply;
+	IsolatePutInt(&args, (uintptr_t) instance);
+	IsolatePutInt(&args, (uintptr_t) stream);
+	IsolatePutString(&args, type);
+	IsolatePutString(&args, stream->url);
+	IsolatePutInt(&args, stream->end);
+	IsolatePutInt(&args, stream->lastmodified);
+	IsolatePutInt(&args, (uintptr_t) stream->notifyData);
+	IsolatePutInt(&args, seekable);
+
+	IsolateRefAdd(&isolate_streams, stream, instance);
+
+	NPError err = NPERR_GENERIC_ERROR;
+	if (IsolateCall(ISOLATE_NPP_NEWSTREAM, &args, &reply)) {
+		err = IsolateGetInt(&reply);
+		*stype = IsolateGetInt(&reply);
+		IsolateMsgFree(&reply);
+	}
+	if (err != NPERR_NO_ERROR) {
+		IsolateRefRemove(&isolate_streams, stream, False);
+	}
+	return err;
+}
+
+
+static NPError
+IsolateNPP_DestroyStream(NPP instance, NPStream *stream, NPReason reason)
+{
+	if (!IsolateRefFind(isolate_streams, (uintptr_t) stream)) {
+		return NPERR_INVALID_PARAM;
+	}
+
+	IsolateMsg args = { 0 }, reply;
+	IsolatePutInt(&args, (uintptr_t) instance);
+	IsolatePutInt(&args, (uintptr_t) stream);
+	IsolatePutInt(&args, reason);
+
+	NPError err = NPERR_GENERIC_ERROR;
+	if (IsolateCall(ISOLATE_NPP_DESTROYSTREAM, &args, &reply)) {
+		err = IsolateGetInt(&reply);
+		IsolateMsgFree(&reply);
+	}
+
+	IsolateRefRemove(&isolate_streams, stream, False);
+	return err;
+}
+
+
+static void
+IsolateNPP_StreamAsFile(NPP instance, NPStream *stream, const char *fname)
+{
+	if (!IsolateRefFind(isolate_streams, (uintptr_t) stream)) {
+		return;
+	}
+
+	/* Memory files are named through our /proc entry. */
+	char path[4096];
+	if (fname && !strncmp(fname, "/proc/self/", 11)) {
+		snprintf(path, sizeof(path), "/proc/%d/%s", getpid(),
+			 fname + 11);
+		fname = path;
+	}
+
+	/* Waits, as the file may go once this returns. */
+	IsolateMsg args = { 0 }, reply;
+	IsolatePutInt(&args, (uintptr_t) instance);
+	IsolatePutInt(&args, (uintptr_t) stream);
+	IsolatePutString(&args, fname);
+	if (IsolateCall(ISOLATE_NPP_ASFILE, &args, &reply)) {
+		IsolateMsgFree(&reply);
+	}
+}
+
+
+static int32
+IsolateNPP_WriteReady(NPP instance, NPStream *stream)
+{
+	IsolateRef *ref = IsolateRefFind(isolate_streams, (uintptr_t) stream);
+	if (!ref) {
+		return ISOLATE_READY_UNKNOWN;
+	}
+	if (ref->ready >= 0) {
+		int32 ready = ref->ready;
+		ref->ready = -1;
+		return ready;
+	}
+
+	IsolateMsg args = { 0 }, reply;
+	IsolatePutInt(&args, (uintptr_t) instance);
+	IsolatePutInt(&args, (uintptr_t) stream);
+
+	int32 ready = ISOLATE_READY_UNKNOWN;
+	if (IsolateCall(ISOLATE_NPP_WRITEREADY, &args, &reply)) {
+		ready = IsolateGetInt(&reply);
+		IsolateMsgFree(&reply);
+	}
+	return MIN(ready, ISOLATE_SHM_SIZE);
+}
+
+
+/* Room for len bytes in the shared buffer.  Returns the offset. */
+static uint32
+IsolateShmAlloc(uint32 len)
+{
+	if (isolate_shm_pos + len > ISOLATE_SHM_SIZE) {
+		isolate_shm_pos = 0;
+	}
+	uint32 offset = isolate_shm_pos;
+	isolate_shm_pos += len;
+	return offset;
+}
+
+
+static int32
+IsolateNPP_Write(NPP instance,
+		 NPStream *stream,
+		 int32 offset,
+		 int32 len,
+		 void *buffer)
+{
+	IsolateRef *ref = IsolateRefFind(isolate_streams, (uintptr_t) stream);
+	if (!ref || isolate_fd < 0 || len < 0) {
+		return -1;
+	}
+	ref->ready = -1;
+
+	/* Less is fine; the host offers the rest again. */
+	len = MIN(len, ISOLATE_SHM_SIZE);
+	uint32 shm_offset = IsolateShmAlloc(len);
+	memcpy(isolate_shm + shm_offset, buffer, len);
+	isolate_stats.shm_bytes += len;
+
+	IsolateMsg args = { 0 }, reply;
+	IsolatePutInt(&args, (uintptr_t) instance);
+	IsolatePutInt(&args, (uintptr_t) stream);
+	IsolatePutInt(&args, offset);
+	IsolatePutInt(&args, len);
+	IsolatePutInt(&args, shm_offset);
+
+	int32 written = -1;
+	if (IsolateCall(ISOLATE_NPP_WRITE, &args, &reply)) {
+		written = IsolateGetInt(&reply);
+		int32 ready = IsolateGetInt(&reply);
+		IsolateMsgFree(&reply);
+
+		/* The stream may have gone during the call. */
+		ref = IsolateRefFind(isolate_streams, (uintptr_t) stream);
+		if (ref && written >= 0) {
+			ref->ready = MIN(ready, ISOLATE_SHM_SIZE);
+		}
+	}
+	return written;
+}
+
+
+static void
+IsolateNPP_Print(NPP instance, NPPrint *platformPrint)
+{
+	IsolateMsg args = { 0 }, reply;
+	IsolatePutInt(&args, (uintptr_t) instance);
+	IsolatePutInt(&args, platformPrint->mode);
+	if (IsolateCall(ISOLATE_NPP_PRINT, &args, &reply)) {
+		IsolateMsgFree(&reply);
+	}
+}
+
+
+static int16
+IsolateNPP_HandleEvent(NPP instance, void *event)
+{
+	XEvent *xev = (XEvent *) event;
+	if (xev->type == GraphicsExpose) {
+		/* Have what we drew underneath land first. */
+		XSync(xev->xany.display, False);
+	}
+
+	IsolateMsg args = { 0 }, reply;
+	IsolatePutInt(&args, (uintptr_t) instance);
+	IsolatePutBytes(&args, xev, sizeof(XEvent));
+
+	int16 handled = False;
+	if (IsolateCall(ISOLATE_NPP_HANDLEEVENT, &args, &reply)) {
+		handled = IsolateGetInt(&reply);
+		IsolateMsgFree(&reply);
+	}
+	return handled;
+}
+
+
+static void
+IsolateNPP_URLNotify(NPP instance,
+		     const char *url,
+		     NPReason reason,
+		     void *notifyData)
+{
+	if (!IsolateRefFind(isolate_instances, (uintptr_t) instance)) {
+		return;
+	}
+
+	IsolateMsg args = { 0 };
+	IsolatePutInt(&args, (uintptr_t) instance);
+	IsolatePutString(&args, url);
+	IsolatePutInt(&args, reason);
+	IsolatePutInt(&args, (uintptr_t) notifyData);
+	IsolateOneway(ISOLATE_NPP_URLNOTIFY, &args);
+}
+
+
+static NPError
+IsolateNPP_GetValue(NPP instance, NPPVariable variable, void *value)
+{
+	IsolateMsg args = { 0 }, reply;
+	IsolatePutInt(&args, (uintptr_t) instance);
+	IsolatePutInt(&args, variable);
+	if (!IsolateCall(ISOLATE_NPP_GETVALUE, &args, &reply)) {
+		return NPERR_GENERIC_ERROR;
+	}
+
+	NPError err = IsolateGetInt(&reply);
+	if (err == NPERR_NO_ERROR) {
+		switch (variable) {
+		case NPPVpluginNameString:
+		case NPPVpluginDescriptionString: {
+			/* Static in the plugin, so kept here too. */
+			char *str = IsolateGetString(&reply);
+			*(char **) value = str ? strdup(str) : NULL;
+			break;
+		}
+		case NPPVpluginWindowSize:
+		case NPPVpluginTimerInterval:
+			*(int32 *) value = IsolateGetInt(&reply);
+			break;
+		default:
+			*(NPBool *) value = IsolateGetInt(&reply);
+			break;
+		}
+	}
+	IsolateMsgFree(&reply);
+	return err;
+}
+
+
+static NPError
+IsolateNPP_SetValue(NPP instance, NPNVariable variable, void *value)
+{
+	IsolateMsg args = { 0 }, reply;
+	IsolatePutInt(&args, (uintptr_t) instance);
+	IsolatePutInt(&args, variable);
+	IsolatePutInt(&args, (uintptr_t) value);
+
+	NPError err = NPERR_GENERIC_ERROR;
+	if (IsolateCall(ISOLATE_NPP_SETVALUE, &args, &reply)) {
+		err = IsolateGetInt(&reply);
+		IsolateMsgFree(&reply);
+	}
+	return err;
+}
+
+
+/*==========================================================================*\
+ * Host side: the plugin's NPN_* calls...
+\*==========================================================================*/
+
+/*
+ * Read the instance and, if stream, the stream a call is for.  Replies
+ * with an error and returns False if either is unknown.
+ */
+static Bool
+IsolateHostArgs(IsolateMsg *args,
+		IsolateMsg *reply,
+		NPP *instance,
+		NPStream **stream)
+{
+	*instance = IsolateHostInstance(IsolateGetInt(args));
+	if (!*instance) {
+		IsolatePutInt(reply, NPERR_INVALID_INSTANCE_ERROR);
+		return False;
+	}
+	if (stream) {
+		IsolateRef *ref = IsolateRefFind(isolate_streams,
+						 IsolateGetInt(args));
+		if (!ref) {
+			IsolatePutInt(reply, NPERR_INVALID_PARAM);
+			return False;
+		}
+		*stream = ref->ptr;
+	}
+	return True;
+}
+
+
+static void
+IsolateHostGetURL(IsolateMsg *args, IsolateMsg *reply)
+{
+	NPP instance;
+	if (IsolateHostArgs(args, reply, &instance, NULL)) {
+		char *url = IsolateGetString(args);
+		char *target = IsolateGetString(args);
+		IsolatePutInt(reply, NPN_GetURL(instance, url, target));
+	}
+}
+
+
+static void
+IsolateHostGetURLNotify(IsolateMsg *args, IsolateMsg *reply)
+{
+	NPP instance;
+	if (IsolateHostArgs(args, reply, &instance, NULL)) {
+		char *url = IsolateGetString(args);
+		char *target = IsolateGetString(args);
+		void *notify = (void *) (uintptr_t) IsolateGetInt(args);
+		IsolatePutInt(reply,
+			      NPN_GetURLNotify(instance, url, target, notify));
+	}
+}
+
+
+static void
+IsolateHostPostURL(IsolateMsg *args, IsolateMsg *reply)
+{
+	NPP instance;
+	if (IsolateHostArgs(args, reply, &instance, NULL)) {
+		char *url = IsolateGetString(args);
+		char *target = IsolateGetString(args);
+		int32 len;
+		char *buf = IsolateGetBytes(args, &len);
+		NPBool file = IsolateGetInt(args);
+		IsolatePutInt(reply, NPN_PostURL(instance, url, target, len,
+						 buf, file));
+	}
+}
+
+
+static void
+IsolateHostPostURLNotify(IsolateMsg *args, IsolateMsg *reply)
+{
+	NPP instance;
+	if (IsolateHostArgs(args, reply, &instance, NULL)) {
+		char *url = IsolateGetString(args);
+		char *target = IsolateGetString(args);
+		int32 len;
+		char *buf = IsolateGetBytes(args, &len);
+		NPBool file = IsolateGetInt(args);
+		void *notify = (void *) (uintptr_t) IsolateGetInt(args);
+		IsolatePutInt(reply, NPN_PostURLNotify(instance, url, target,
+						       len, buf, file,
+						       notify));
+	}
+}
+
+
+static void
+IsolateHostRequestRead(IsolateMsg *args, IsolateMsg *reply)
+{
+	NPP instance;
+	NPStream *stream;
+	if (!IsolateHostArgs(args, reply, &instance, &stream)) {
+		return;
+	}
+
+	int count = IsolateGetInt(args);
+	NPByteRange *ranges = NULL, **tail = &ranges;
+	for (int i = 0; i < count && !args->bad; i++) {
+		*tail = calloc(1, sizeof(NPByteRange));
+		(*tail)->offset = IsolateGetInt(args);
+		(*tail)->length = IsolateGetInt(args);
+		tail = &(*tail)->next;
+	}
+
+	IsolatePutInt(reply, NPN_RequestRead(stream, ranges));
+	ByteRangeFree(ranges);
+}
+
+
+static void
+IsolateHostNewStream(IsolateMsg *args, IsolateMsg *reply)
+{
+	NPP instance;
+	if (IsolateHostArgs(args, reply, &instance, NULL)) {
+		char *type = IsolateGetString(args);
+		char *target = IsolateGetString(args);
+		NPStream *stream = NULL;
+		NPError err = NPN_NewStream(instance, type, target, &stream);
+		if (err == NPERR_NO_ERROR) {
+			/* Plugin-produced streams aren't proxied. */
+			NPN_DestroyStream(instance, stream, NPRES_USER_BREAK);
+			err = NPERR_GENERIC_ERROR;
+		}
+		IsolatePutInt(reply, err);
+	}
+}
+
+
+static void
+IsolateHostWrite(IsolateMsg *args, IsolateMsg *reply)
+{
+	NPP instance;
+	NPStream *stream;
+	if (IsolateHostArgs(args, reply, &instance, &stream)) {
+		int32 len;
+		char *buf = IsolateGetBytes(args, &len);
+		IsolatePutInt(reply, NPN_Write(instance, stream, len, buf));
+	}
+}
+
+
+static void
+IsolateHostDestroyStream(IsolateMsg *args, IsolateMsg *reply)
+{
+	NPP instance;
+	NPStream *stream;
+	if (IsolateHostArgs(args, reply, &instance, &stream)) {
+		NPReason reason = IsolateGetInt(args);
+		IsolatePutInt(reply,
+			      NPN_DestroyStream(instance, stream, reason));
+	}
+}
+
+
+static void
+IsolateHostStatus(IsolateMsg *args, IsolateMsg *reply)
+{
+	NPP instance;
+	if (IsolateHostArgs(args, reply, &instance, NULL)) {
+		NPN_Status(instance, IsolateGetString(args));
+	}
+}
+
+
+static void
+IsolateHostUserAgent(IsolateMsg *args, IsolateMsg *reply)
+{
+	/* No instance needed */
+	NPP instance = IsolateHostInstance(IsolateGetInt(args));
+	IsolatePutString(reply, NPN_UserAgent(instance));
+}
+
+
+static void
+IsolateHostReloadPlugins(IsolateMsg *args, IsolateMsg *reply)
+{
+	NPN_ReloadPlugins(IsolateGetInt(args));
+}
+
+
+static void
+IsolateHostGetValue(IsolateMsg *args, IsolateMsg *reply)
+{
+	/* Instance may be NULL */
+	NPP instance = IsolateHostInstance(IsolateGetInt(args));
+	NPNVariable variable = IsolateGetInt(args);
+
+	union { void *p; int32 i; NPBool b; int64 l; } value = { 0 };
+	NPError err = NPN_GetValue(instance, variable, &value);
+	IsolatePutInt(reply, err);
+	IsolatePutInt(reply, variable == NPNVToolkit ? value.i : value.b);
+}
+
+
+static void
+IsolateHostSetValue(IsolateMsg *args, IsolateMsg *reply)
+{
+	NPP instance;
+	if (IsolateHostArgs(args, reply, &instance, NULL)) {
+		NPPVariable variable = IsolateGetInt(args);
+		void *value = (void *) (uintptr_t) IsolateGetInt(args);
+		IsolatePutInt(reply, NPN_SetValue(instance, variable, value));
+	}
+}
+
+
+static void
+IsolateHostInvalidateRect(IsolateMsg *args, IsolateMsg *reply)
+{
+	NPP instance;
+	if (IsolateHostArgs(args, reply, &instance, NULL)) {
+		NPRect rect;
+		rect.top = IsolateGetInt(args);
+		rect.left = IsolateGetInt(args);
+		rect.bottom = IsolateGetInt(args);
+		rect.right = IsolateGetInt(args);
+		NPN_InvalidateRect(instance, &rect);
+	}
+}
+
+
+static void
+IsolateHostForceRedraw(IsolateMsg *args, IsolateMsg *reply)
+{
+	NPP instance;
+	if (IsolateHostArgs(args, reply, &instance, NULL)) {
+		NPN_ForceRedraw(instance);
+	}
+}
+
+
+/*==========================================================================*\
+ * Host side: starting and restarting the plugin process...
+\*==========================================================================*/
+
+static void IsolateRestartCb(void *data);
+
+
+/* Start the plugin process, connected through isolate_fd. */
+static void
+IsolateSpawn(void)
+{
+	int fds[2];
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) < 0) {
+		Error("Creating socketpair: %s\n", strerror(errno));
+	}
+
+	char fd_spec[32];
+	snprintf(fd_spec, sizeof(fd_spec), "%d:%d", fds[1], isolate_shm_fd);
+
+	fflush(stdout);
+	fflush(stderr);
+
+	isolate_pid = fork();
+	if (isolate_pid < 0) {
+		Error("Forking plugin process: %s\n", strerror(errno));
+	}
+	if (isolate_pid == 0) {
+		/* Only these two survive the exec. */
+		int flags = fcntl(fds[1], F_GETFD);
+		fcntl(fds[1], F_SETFD, flags & ~FD_CLOEXEC);
+		flags = fcntl(isolate_shm_fd, F_GETFD);
+		fcntl(isolate_shm_fd, F_SETFD, flags & ~FD_CLOEXEC);
+
+		/* We block these for the main loop's signalfd. */
+		sigset_t all;
+		sigfillset(&all);
+		sigprocmask(SIG_UNBLOCK, &all, NULL);
+
+		char *argv[] = {
+			PROGRAM_NAME, "--plugin-host", fd_spec,
+			isolate_plugin_path ? "--plugin" : NULL,
+			isolate_plugin_path, NULL
+		};
+		execv("/proc/self/exe", argv);
+		fprintf(stderr, "Starting plugin process: %s\n",
+			strerror(errno));
+		_exit(127);
+	}
+
+	close(fds[1]);
+	isolate_fd = fds[0];
+	isolate_shm_pos = 0;
+	isolate_started_at = StatsNow();
+	isolate_watch = MainLoopAddWatch(isolate_fd, MAINLOOP_READ,
+					 IsolateWatchCb, NULL);
+
+	Log("Started plugin process %d\n", isolate_pid);
+}
+
+
+/*
+ * The plugin process has gone, or stopped making sense: make sure it's
+ * dead, forget everything it knew, and start another unless it quit by
+ * choice.
+ */
+static void
+IsolateLost(void)
+{
+	if (isolate_fd < 0) {
+		return;
+	}
+
+	if (!isolate_host) {
+		/* The host has gone; nothing left to do. */
+		Log("Lost host process\n");
+		close(isolate_fd);
+		isolate_fd = -1;
+		MainLoopQuit();
+		return;
+	}
+
+	MainLoopRemoveWatch(isolate_watch);
+	isolate_watch = NULL;
+	close(isolate_fd);
+	isolate_fd = -1;
+	IsolateRefClear(&isolate_streams);
+	IsolateRefClear(&isolate_instances);
+
+	/* Give it a moment to finish exiting on its own. */
+	int status = 0;
+	pid_t pid = 0;
+	for (int i = 0; i < 100 && pid == 0; i++) {
+		pid = waitpid(isolate_pid, &status, WNOHANG);
+		if (pid == 0) {
+			usleep(1000);
+		}
+	}
+	if (pid == 0) {
+		kill(isolate_pid, SIGKILL);
+		waitpid(isolate_pid, &status, 0);
+	}
+
+	if (pid > 0 && WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+		Log("Plugin process exited; quitting\n");
+		MainLoopQuit();
+		return;
+	}
+
+	if (pid > 0 && WIFSIGNALED(status)) {
+		Warning("Plugin process crashed with signal %d\n",
+			WTERMSIG(status));
+	} else if (pid > 0) {
+		Warning("Plugin process exited with status %d\n",
+			WEXITSTATUS(status));
+	} else {
+		Warning("Plugin process killed\n");
+	}
+
+	/* Back off if it keeps crashing on startup. */
+	if (StatsNow() - isolate_started_at < 5000) {
+		isolate_restart_delay = MIN(ISOLATE_RESTART_MAX,
+					    MAX(250, isolate_restart_delay * 2));
+	} else {
+		isolate_restart_delay = 0;
+	}
+	Log("Restarting plugin process in %ld ms\n", isolate_restart_delay);
+
+	/* Not from inside whatever call found it gone. */
+	isolate_restart_timer = MainLoopAddTimer(isolate_restart_delay,
+						 IsolateRestartCb, NULL);
+}
+
+
+static void
+IsolateRestartCb(void *data)
+{
+	isolate_restart_timer = NULL;
+	isolate_stats.restarts++;
+
+	IsolateSpawn();
+	if (isolate_restarted) {
+		isolate_restarted();
+	}
+}
+
+
+static void
+IsolateDumpStats(FILE *f)
+{
+	fprintf(f, "{\n    \"calls\": %ld, \"oneway\": %ld, "
+		"\"handled\": %ld, \"shm_bytes\": %ld, \"restarts\": %d,"
+		"\n    ", isolate_stats.calls, isolate_stats.oneway,
+		isolate_stats.handled, isolate_stats.shm_bytes,
+		isolate_stats.restarts);
+	HistogramDump(f, "call_ms", &isolate_stats.call_ms);
+	fprintf(f, "\n  }");
+}
+
+
+/*
+ * Start a process loading the plugin from plugin_path, or the default,
+ * and point plugin_funcs at proxies for it.  restarted is called after
+ * it has crashed and been replaced, to create the instances again.
+ */
+void
+IsolateStart(const char *plugin_path, IsolateRestartFunc restarted)
+{
+	isolate_host = True;
+	isolate_plugin_path = plugin_path ? strdup(plugin_path) : NULL;
+	isolate_restarted = restarted;
+
+	isolate_shm_fd = memfd_create("flasher-isolate", MFD_CLOEXEC);
+	if (isolate_shm_fd < 0 ||
+	    ftruncate(isolate_shm_fd, ISOLATE_SHM_SIZE) < 0) {
+		Error("Creating shared memory: %s\n", strerror(errno));
+	}
+	isolate_shm = mmap(NULL, ISOLATE_SHM_SIZE, PROT_READ | PROT_WRITE,
+			   MAP_SHARED, isolate_shm_fd, 0);
+	if (isolate_shm == MAP_FAILED) {
+		Error("Mapping shared memory: %s\n", strerror(errno));
+	}
+
+	isolate_handlers[ISOLATE_NPN_GETURL] = IsolateHostGetURL;
+	isolate_handlers[ISOLATE_NPN_GETURLNOTIFY] = IsolateHostGetURLNotify;
+	isolate_handlers[ISOLATE_NPN_POSTURL] = IsolateHostPostURL;
+	isolate_handlers[ISOLATE_NPN_POSTURLNOTIFY] = IsolateHostPostURLNotify;
+	isolate_handlers[ISOLATE_NPN_REQUESTREAD] = IsolateHostRequestRead;
+	isolate_handlers[ISOLATE_NPN_NEWSTREAM] = IsolateHostNewStream;
+	isolate_handlers[ISOLATE_NPN_WRITE] = IsolateHostWrite;
+	isolate_handlers[ISOLATE_NPN_DESTROYSTREAM] = IsolateHostDestroyStream;
+	isolate_handlers[ISOLATE_NPN_STATUS] = IsolateHostStatus;
+	isolate_handlers[ISOLATE_NPN_USERAGENT] = IsolateHostUserAgent;
+	isolate_handlers[ISOLATE_NPN_RELOADPLUGINS] = IsolateHostReloadPlugins;
+	isolate_handlers[ISOLATE_NPN_GETVALUE] = IsolateHostGetValue;
+	isolate_handlers[ISOLATE_NPN_SETVALUE] = IsolateHostSetValue;
+	isolate_handlers[ISOLATE_NPN_INVALIDATERECT] =
+		IsolateHostInvalidateRect;
+	isolate_handlers[ISOLATE_NPN_FORCEREDRAW] = IsolateHostForceRedraw;
+
+	memset(&plugin_funcs, 0, sizeof(NPPluginFuncs));
+	plugin_funcs.size = sizeof(plugin_funcs);
+	plugin_funcs.version = (NP_VERSION_MAJOR << 8) + NP_VERSION_MINOR;
+	plugin_funcs.newp = NewNPP_NewProc(IsolateNPP_New);
+	plugin_funcs.destroy = NewNPP_DestroyProc(IsolateNPP_Destroy);
+	plugin_funcs.setwindow = NewNPP_SetWindowProc(IsolateNPP_SetWindow);
+	plugin_funcs.newstream = NewNPP_NewStreamProc(IsolateNPP_NewStream);
+	plugin_funcs.destroystream =
+		NewNPP_DestroyStreamProc(IsolateNPP_DestroyStream);
+	plugin_funcs.asfile = NewNPP_StreamAsFileProc(IsolateNPP_StreamAsFile);
+	plugin_funcs.writeready =
+		NewNPP_WriteReadyProc(IsolateNPP_WriteReady);
+	plugin_funcs.write = NewNPP_WriteProc(IsolateNPP_Write);
+	plugin_funcs.print = NewNPP_PrintProc(IsolateNPP_Print);
+	plugin_funcs.event = NewNPP_HandleEventProc(IsolateNPP_HandleEvent);
+	plugin_funcs.urlnotify = NewNPP_URLNotifyProc(IsolateNPP_URLNotify);
+	plugin_funcs.getvalue = NewNPP_GetValueProc(IsolateNPP_GetValue);
+	plugin_funcs.setvalue = NewNPP_SetValueProc(IsolateNPP_SetValue);
+
+	StatsAddSection("isolate", IsolateDumpStats);
+
+	IsolateSpawn();
+}
+
+
+/* Close the connection, so the plugin process shuts down, and reap it. */
+void
+IsolateShutdown(void)
+{
+	if (isolate_restart_timer) {
+		MainLoopRemoveTimer(isolate_restart_timer);
+		isolate_restart_timer = NULL;
+	}
+	if (isolate_fd >= 0) {
+		MainLoopRemoveWatch(isolate_watch);
+		close(isolate_fd);
+		isolate_fd = -1;
+		waitpid(isolate_pid, NULL, 0);
+	}
+
+	Log("Plugin process calls: %ld, %ld one-way, %ld from the plugin, "
+	    "%d restarts\n", isolate_stats.calls, isolate_stats.oneway,
+	    isolate_stats.handled, isolate_stats.restarts);
+	if (isolate_stats.call_ms.count) {
+		Log("Plugin process call ms: mean %.3f, max %.3f\n",
+		    isolate_stats.call_ms.sum / isolate_stats.call_ms.count,
+		    isolate_stats.call_ms.max);
+	}
+
+	munmap(isolate_shm, ISOLATE_SHM_SIZE);
+	close(isolate_shm_fd);
+	IsolateRefClear(&isolate_streams);
+	IsolateRefClear(&isolate_instances);
+	free(isolate_plugin_path);
+}
+
+
+/*==========================================================================*\
+ * Plugin side: proxies for the host's NPN_* functions...
+\*==========================================================================*/
+
+static uint64
+IsolateId(NPP instance)
+{
+	return instance ? (uintptr_t) instance->ndata : 0;
+}
+
+
+static NPError
+IsolateReplyError(IsolateMsg *reply)
+{
+	NPError err = IsolateGetInt(reply);
+	IsolateMsgFree(reply);
+	return err;
+}
+
+
+static NPError
+IsolateNPN_GetURL(NPP instance, const char *url, const char *target)
+{
+	IsolateMsg args = { 0 }, reply;
+	IsolatePutInt(&args, IsolateId(instance));
+	IsolatePutString(&args, url);
+	IsolatePutString(&args, target);
+	if (!IsolateCall(ISOLATE_NPN_GETURL, &args, &reply)) {
+		return NPERR_GENERIC_ERROR;
+	}
+	return IsolateReplyError(&reply);
+}
+
+
+static NPError
+IsolateNPN_GetURLNotify(NPP instance,
+			const char *url,
+			const char *target,
+			void *notifyData)
+{
+	IsolateMsg args = { 0 }, reply;
+	IsolatePutInt(&args, IsolateId(instance));
+	IsolatePutString(&args, url);
+	IsolatePutString(&args, target);
+	IsolatePutInt(&args, (uintptr_t) notifyData);
+	if (!IsolateCall(ISOLATE_NPN_GETURLNOTIFY, &args, &reply)) {
+		return NPERR_GENERIC_ERROR;
+	}
+	return IsolateReplyError(&reply);
+}
+
+
+static NPError
+IsolateNPN_PostURL(NPP instance,
+		   const char *url,
+		   const char *target,
+		   uint32 len,
+		   const char *buf,
+		   NPBool file)
+{
+	IsolateMsg args = { 0 }, reply;
+	IsolatePutInt(&args, IsolateId(instance));
+	IsolatePutString(&args, url);
+	IsolatePutString(&args, target);
+	IsolatePutBytes(&args, buf, len);
+	IsolatePutInt(&args, file);
+	if (!IsolateCall(ISOLATE_NPN_POSTURL, &args, &reply)) {
+		return NPERR_GENERIC_ERROR;
+	}
+	return IsolateReplyError(&reply);
+}
+
+
+static NPError
+IsolateNPN_PostURLNotify(NPP instance,
+			 const char *url,
+			 const char *target,
+			 uint32 len,
+			 const char *buf,
+			 NPBool file,
+			 void *notifyData)
+{
+	IsolateMsg args = { 0 }, reply;
+	IsolatePutInt(&args, IsolateId(instance));
+	IsolatePutString(&args, url);
+	IsolatePutString(&args, target);
+	IsolatePutBytes(&args, buf, len);
+	IsolatePutInt(&args, file);
+	IsolatePutInt(&args, (uintptr_t) notifyData);
+	if (!IsolateCall(ISOLATE_NPN_POSTURLNOTIFY, &args, &reply)) {
+		return NPERR_GENERIC_ERROR;
+	}
+	return IsolateReplyError(&reply);
+}
+
+
+static IsolateStream *
+IsolatePluginStream(NPStream *stream)
+{
+	for (IsolateStream *s = isolate_plugin_streams; s; s = s->next) {
+		if (&s->stream == stream) {
+			return s;
+		}
+	}
+	return NULL;
+}
+
+
+static NPError
+IsolateNPN_RequestRead(NPStream *stream, NPByteRange *rangeList)
+{
+	IsolateStream *s = IsolatePluginStream(stream);
+	if (!s) {
+		return NPERR_INVALID_PARAM;
+	}
+
+	int count = 0;
+	for (NPByteRange *r = rangeList; r; r = r->next) {
+		count++;
+	}
+
+	IsolateMsg args = { 0 }, reply;
+	IsolatePutInt(&args, s->inst->id);
+	IsolatePutInt(&args, s->id);
+	IsolatePutInt(&args, count);
+	for (NPByteRange *r = rangeList; r; r = r->next) {
+		IsolatePutInt(&args, r->offset);
+		IsolatePutInt(&args, r->length);
+	}
+	if (!IsolateCall(ISOLATE_NPN_REQUESTREAD, &args, &reply)) {
+		return NPERR_GENERIC_ERROR;
+	}
+	return IsolateReplyError(&reply);
+}
+
+
+static NPError
+IsolateNPN_NewStream(NPP instance,
+		     NPMIMEType type,
+		     const char *target,
+		     NPStream **stream)
+{
+	*stream = NULL;
+
+	IsolateMsg args = { 0 }, reply;
+	IsolatePutInt(&args, IsolateId(instance));
+	IsolatePutString(&args, type);
+	IsolatePutString(&args, target);
+	if (!IsolateCall(ISOLATE_NPN_NEWSTREAM, &args, &reply)) {
+		return NPERR_GENERIC_ERROR;
+	}
+	return IsolateReplyError(&reply);
+}
+
+
+static int32
+IsolateNPN_Write(NPP instance, NPStream *stream, int32 len, void *buf)
+{
+	IsolateMsg args = { 0 }, reply;
+	IsolatePutInt(&args, IsolateId(instance));
+	IsolatePutInt(&args, (uintptr_t) stream->ndata);
+	IsolatePutBytes(&args, buf, len);
+	if (!IsolateCall(ISOLATE_NPN_WRITE, &args, &reply)) {
+		return -1;
+	}
+	return IsolateReplyError(&reply);
+}
+
+
+static NPError
+IsolateNPN_DestroyStream(NPP instance, NPStream *stream, NPReason reason)
+{
+	IsolateMsg args = { 0 }, reply;
+	IsolatePutInt(&args, IsolateId(instance));
+	IsolatePutInt(&args, (uintptr_t) stream->ndata);
+	IsolatePutInt(&args, reason);
+	if (!IsolateCall(ISOLATE_NPN_DESTROYSTREAM, &args, &reply)) {
+		return NPERR_GENERIC_ERROR;
+	}
+	return IsolateReplyError(&reply);
+}
+
+
+static void
+IsolateNPN_Status(NPP instance, const char *message)
+{
+	IsolateMsg args = { 0 };
+	IsolatePutInt(&args, IsolateId(instance));
+	IsolatePutString(&args, message);
+	IsolateOneway(ISOLATE_NPN_STATUS, &args);
+}
+
+
+static const char *
+IsolateNPN_UserAgent(NPP instance)
+{
+	if (isolate_user_agent) {
+		return isolate_user_agent;
+	}
+
+	IsolateMsg args = { 0 }, reply;
+	IsolatePutInt(&args, IsolateId(instance));
+	if (!IsolateCall(ISOLATE_NPN_USERAGENT, &args, &reply)) {
+		return "";
+	}
+	char *agent = IsolateGetString(&reply);
+	isolate_user_agent = strdup(agent ? agent : "");
+	IsolateMsgFree(&reply);
+
+	return isolate_user_agent;
+}
+
+
+static void *
+IsolateNPN_MemAlloc(uint32 size)
+{
+	return MemPoolAlloc(size);
+}
+
+
+static void
+IsolateNPN_MemFree(void *ptr)
+{
+	MemPoolFree(ptr);
+}
+
+
+static uint32
+IsolateNPN_MemFlush(uint32 size)
+{
+	return MemPoolFlush(size);
+}
+
+
+static void
+IsolateNPN_ReloadPlugins(NPBool reloadPages)
+{
+	IsolateMsg args = { 0 };
+	IsolatePutInt(&args, reloadPages);
+	IsolateOneway(ISOLATE_NPN_RELOADPLUGINS, &args);
+}
+
+
+static JRIEnv *
+IsolateNPN_GetJavaEnv(void)
+{
+	return NULL;
+}
+
+
+static jref
+IsolateNPN_GetJavaPeer(NPP instance)
+{
+	return NULL;
+}
+
+
+static NPError
+IsolateNPN_GetValue(NPP instance, NPNVariable variable, void *value)
+{
+	switch (variable) {
+	case NPNVxDisplay:
+		*(void **) value = isolate_display;
+		return NPERR_NO_ERROR;
+	case NPNVxtAppContext:
+		*(void **) value = x_app_context;
+		return NPERR_NO_ERROR;
+	default:
+		break;
+	}
+
+	IsolateMsg args = { 0 }, reply;
+	IsolatePutInt(&args, IsolateId(instance));
+	IsolatePutInt(&args, variable);
+	if (!IsolateCall(ISOLATE_NPN_GETVALUE, &args, &reply)) {
+		return NPERR_GENERIC_ERROR;
+	}
+
+	NPError err = IsolateGetInt(&reply);
+	int64 result = IsolateGetInt(&reply);
+	IsolateMsgFree(&reply);
+	if (err == NPERR_NO_ERROR) {
+		if (variable == NPNVToolkit) {
+			*(NPNToolkitType *) value = result;
+		} else {
+			*(NPBool *) value = result;
+		}
+	}
+	return err;
+}
+
+
+static NPError
+IsolateNPN_SetValue(NPP instance, NPPVariable variable, void *value)
+{
+	IsolateMsg args = { 0 }, reply;
+	IsolatePutInt(&args, IsolateId(instance));
+	IsolatePutInt(&args, variable);
+	IsolatePutInt(&args, (uintptr_t) value);
+	if (!IsolateCall(ISOLATE_NPN_SETVALUE, &args, &reply)) {
+		return NPERR_GENERIC_ERROR;
+	}
+	return IsolateReplyError(&reply);
+}
+
+
+static void
+IsolateNPN_InvalidateRect(NPP instance, NPRect *invalidRect)
+{
+	IsolateMsg args = { 0 };
+	IsolatePutInt(&args, IsolateId(instance));
+	IsolatePutInt(&args, invalidRect->top);
+	IsolatePutInt(&args, invalidRect->left);
+	IsolatePutInt(&args, invalidRect->bottom);
+	IsolatePutInt(&args, invalidRect->right);
+	IsolateOneway(ISOLATE_NPN_INVALIDATERECT, &args);
+}
+
+
+/* Regions live in Xlib, so this sends their bounds. */
+static void
+IsolateNPN_InvalidateRegion(NPP instance, NPRegion invalidRegion)
+{
+	XRectangle box;
+	XClipBox(invalidRegion, &box);
+
+	NPRect rect = { box.y, box.x, box.y + box.height, box.x + box.width };
+	IsolateNPN_InvalidateRect(instance, &rect);
+}
+
+
+static void
+IsolateNPN_ForceRedraw(NPP instance)
+{
+	IsolateMsg args = { 0 };
+	IsolatePutInt(&args, IsolateId(instance));
+	IsolateOneway(ISOLATE_NPN_FORCEREDRAW, &args);
+}
+
+
+/*==========================================================================*\
+ * Plugin side: the host's NPP_* calls...
+\*==========================================================================*/
+
+static IsolateInstance *
+IsolatePluginInstance(uint64 id)
+{
+	for (IsolateInstance *inst = isolate_plugin_instances; inst;
+	     inst = inst->next) {
+		if (inst->id == id) {
+			return inst;
+		}
+	}
+	return NULL;
+}
+
+
+static IsolateStream *
+IsolatePluginStreamById(uint64 id)
+{
+	for (IsolateStream *s = isolate_plugin_streams; s; s = s->next) {
+		if (s->id == id) {
+			return s;
+		}
+	}
+	return NULL;
+}
+
+
+static void
+IsolatePluginStreamFree(IsolateStream *s)
+{
+	for (IsolateStream **p = &isolate_plugin_streams; *p;
+	     p = &(*p)->next) {
+		if (*p == s) {
+			*p = s->next;
+			break;
+		}
+	}
+	free((char *) s->stream.url);
+	free(s);
+}
+
+
+/*
+ * Read the instance and, if stream, the stream a call is for.  Replies
+ * with err and returns False if either is unknown.
+ */
+static Bool
+IsolatePluginArgs(IsolateMsg *args,
+		  IsolateMsg *reply,
+		  int64 err,
+		  IsolateInstance **inst,
+		  IsolateStream **stream)
+{
+	*inst = IsolatePluginInstance(IsolateGetInt(args));
+	if (stream) {
+		*stream = IsolatePluginStreamById(IsolateGetInt(args));
+	}
+	if (!*inst || (stream && !*stream)) {
+		IsolatePutInt(reply, err);
+		return False;
+	}
+	return True;
+}
+
+
+static void
+IsolatePluginNew(IsolateMsg *args, IsolateMsg *reply)
+{
+	IsolateInstance *inst = calloc(1, sizeof(IsolateInstance));
+	inst->id = IsolateGetInt(args);
+	inst->npp.ndata = (void *) (uintptr_t) inst->id;
+
+	char *type = IsolateGetString(args);
+	uint16 mode = IsolateGetInt(args);
+	int16 argc = IsolateGetInt(args);
+	char **argn = calloc(MAX(argc, 1), sizeof(char *));
+	char **argv = calloc(MAX(argc, 1), sizeof(char *));
+	for (int i = 0; i < argc && !args->bad; i++) {
+		argn[i] = IsolateGetString(args);
+		argv[i] = IsolateGetString(args);
+	}
+
+	NPError err = NPERR_GENERIC_ERROR;
+	if (!args->bad) {
+		err = CallNPP_NewProc(isolate_plugin.newp, type, &inst->npp,
+				      mode, argc, argn, argv, NULL);
+	}
+	free(argn);
+	free(argv);
+
+	if (err == NPERR_NO_ERROR) {
+		inst->next = isolate_plugin_instances;
+		isolate_plugin_instances = inst;
+	} else {
+		free(inst);
+	}
+	IsolatePutInt(reply, err);
+}
+
+
+static void
+IsolatePluginDestroy(IsolateMsg *args, IsolateMsg *reply)
+{
+	IsolateInstance *inst;
+	if (!IsolatePluginArgs(args, reply, NPERR_INVALID_INSTANCE_ERROR,
+			       &inst, NULL)) {
+		return;
+	}
+
+	NPSavedData *saved = NULL;
+	NPError err = CallNPP_DestroyProc(isolate_plugin.destroy,
+					  &inst->npp, &saved);
+	if (saved) {
+		free(saved->buf);
+		free(saved);
+	}
+	IsolatePutInt(reply, err);
+
+	IsolateStream *s = isolate_plugin_streams;
+	while (s) {
+		IsolateStream *next = s->next;
+		if (s->inst == inst) {
+			IsolatePluginStreamFree(s);
+		}
+		s = next;
+	}
+
+	for (IsolateInstance **p = &isolate_plugin_instances; *p;
+	     p = &(*p)->next) {
+		if (*p == inst) {
+			*p = inst->next;
+			break;
+		}
+	}
+	if (inst->widget) {
+		/* The window is the host's to destroy. */
+		XtUnregisterDrawable(isolate_display, inst->widget->core.window);
+		inst->widget->core.window = None;
+		XtDestroyWidget(inst->widget);
+	}
+	free(inst);
+}
+
+
+/*
+ * Give the host's window, which the plugin may treat as an Xt widget's,
+ * a widget on our display.
+ */
+static void
+IsolateWrapWindow(IsolateInstance *inst, Window window)
+{
+	if (inst->widget) {
+		if (inst->widget->core.window == window) {
+			return;
+		}
+		XtUnregisterDrawable(isolate_display, inst->widget->core.window);
+		inst->widget->core.window = None;
+		XtDestroyWidget(inst->widget);
+	}
+
+	inst->widget = XtAppCreateShell("plugin", PROGRAM_NAME,
+					applicationShellWidgetClass,
+					isolate_display, NULL, 0);
+	inst->widget->core.window = window;
+	XtRegisterDrawable(isolate_display, window, inst->widget);
+}
+
+
+static void
+IsolatePluginSetWindow(IsolateMsg *args, IsolateMsg *reply)
+{
+	IsolateInstance *inst;
+	if (!IsolatePluginArgs(args, reply, NPERR_INVALID_INSTANCE_ERROR,
+			       &inst, NULL)) {
+		return;
+	}
+
+	NPWindow *win = &inst->window;
+	NPSetWindowCallbackStruct *ws_info = &inst->ws_info;
+	win->type = IsolateGetInt(args);
+	win->window = (void *) (uintptr_t) IsolateGetInt(args);
+	win->x = IsolateGetInt(args);
+	win->y = IsolateGetInt(args);
+	win->width = IsolateGetInt(args);
+	win->height = IsolateGetInt(args);
+	win->clipRect.top = IsolateGetInt(args);
+	win->clipRect.left = IsolateGetInt(args);
+	win->clipRect.bottom = IsolateGetInt(args);
+	win->clipRect.right = IsolateGetInt(args);
+	VisualID visual_id = IsolateGetInt(args);
+	ws_info->colormap = IsolateGetInt(args);
+	ws_info->depth = IsolateGetInt(args);
+	ws_info->type = NP_SETWINDOW;
+	ws_info->display = isolate_display;
+	win->ws_info = ws_info;
+
+	if (isolate_display) {
+		int screen = DefaultScreen(isolate_display);
+		ws_info->visual = DefaultVisual(isolate_display, screen);
+
+		XVisualInfo template = { 0 };
+		template.visualid = visual_id;
+		int n;
+		XVisualInfo *info = XGetVisualInfo(isolate_display,
+						   VisualIDMask,
+						   &template, &n);
+		if (info) {
+			ws_info->visual = info->visual;
+			XFree(info);
+		}
+
+		if (win->type == NPWindowTypeWindow) {
+			IsolateWrapWindow(inst, (Window) win->window);
+		}
+	}
+
+	IsolatePutInt(reply, CallNPP_SetWindowProc(isolate_plugin.setwindow,
+						   &inst->npp, win));
+}
+
+
+static void
+IsolatePluginNewStream(IsolateMsg *args, IsolateMsg *reply)
+{
+	IsolateInstance *inst;
+	if (!IsolatePluginArgs(args, reply, NPERR_INVALID_INSTANCE_ERROR,
+			       &inst, NULL)) {
+		return;
+	}
+
+	IsolateStream *s = calloc(1, sizeof(IsolateStream));
+	s->inst = inst;
+	s->id = IsolateGetInt(args);
+	s->stream.ndata = (void *) (uintptr_t) s->id;
+	char *type = IsolateGetString(args);
+	char *url = IsolateGetString(args);
+	s->stream.url = strdup(url ? url : "");
+	s->stream.end = IsolateGetInt(args);
+	s->stream.lastmodified = IsolateGetInt(args);
+	s->stream.notifyData = (void *) (uintptr_t) IsolateGetInt(args);
+	NPBool seekable = IsolateGetInt(args);
+
+	/* Known before the plugin calls back with it. */
+	s->next = isolate_plugin_streams;
+	isolate_plugin_streams = s;
+
+	uint16 stype = NP_NORMAL;
+	NPError err = CallNPP_NewStreamProc(isolate_plugin.newstream,
+					    &inst->npp, type, &s->stream,
+					    seekable, &stype);
+	if (err != NPERR_NO_ERROR) {
+		IsolatePluginStreamFree(s);
+	}
+	IsolatePutInt(reply, err);
+	IsolatePutInt(reply, stype);
+}
+
+
+static void
+IsolatePluginDestroyStream(IsolateMsg *args, IsolateMsg *reply)
+{
+	IsolateInstance *inst;
+	IsolateStream *s;
+	if (!IsolatePluginArgs(args, reply, NPERR_INVALID_PARAM, &inst, &s)) {
+		return;
+	}
+
+	NPReason reason = IsolateGetInt(args);
+	IsolatePutInt(reply,
+		      CallNPP_DestroyStreamProc(isolate_plugin.destroystream,
+						&inst->npp, &s->stream,
+						reason));
+	IsolatePluginStreamFree(s);
+}
+
+
+static void
+IsolatePluginStreamAsFile(IsolateMsg *args, IsolateMsg *reply)
+{
+	IsolateInstance *inst;
+	IsolateStream *s;
+	if (IsolatePluginArgs(args, reply, 0, &inst, &s)) {
+		CallNPP_StreamAsFileProc(isolate_plugin.asfile, &inst->npp,
+					 &s->stream, IsolateGetString(args));
+	}
+}
+
+
+static void
+IsolatePluginWriteReady(IsolateMsg *args, IsolateMsg *reply)
+{
+	IsolateInstance *inst;
+	IsolateStream *s;
+	if (IsolatePluginArgs(args, reply, -1, &inst, &s)) {
+		IsolatePutInt(reply,
+			      CallNPP_WriteReadyProc(isolate_plugin.writeready,
+						     &inst->npp, &s->stream));
+	}
+}
+
+
+static void
+IsolatePluginWrite(IsolateMsg *args, IsolateMsg *reply)
+{
+	IsolateInstance *inst;
+	IsolateStream *s;
+	if (!IsolatePluginArgs(args, reply, -1, &inst, &s)) {
+		IsolatePutInt(reply, 0);
+		return;
+	}
+
+	int32 offset = IsolateGetInt(args);
+	int64 len = IsolateGetInt(args);
+	int64 shm_offset = IsolateGetInt(args);
+	if (len < 0 || shm_offset < 0 ||
+	    shm_offset + len > ISOLATE_SHM_SIZE) {
+		IsolatePutInt(reply, -1);
+		IsolatePutInt(reply, 0);
+		return;
+	}
+
+	int32 written = CallNPP_WriteProc(isolate_plugin.write, &inst->npp,
+					  &s->stream, offset, len,
+					  isolate_shm + shm_offset);
+
+	/* Saves the host asking next time, unless it's gone. */
+	int32 ready = 0;
+	if (written >= 0 && IsolatePluginStreamById(s->id) == s) {
+		ready = CallNPP_WriteReadyProc(isolate_plugin.writeready,
+					       &inst->npp, &s->stream);
+	}
+	IsolatePutInt(reply, written);
+	IsolatePutInt(reply, ready);
+}
+
+
+static void
+IsolatePluginPrint(IsolateMsg *args, IsolateMsg *reply)
+{
+	IsolateInstance *inst;
+	if (IsolatePluginArgs(args, reply, 0, &inst, NULL)) {
+		NPPrint print = { 0 };
+		print.mode = IsolateGetInt(args);
+		CallNPP_PrintProc(isolate_plugin.print, &inst->npp, &print);
+	}
+}
+
+
+static void
+IsolatePluginHandleEvent(IsolateMsg *args, IsolateMsg *reply)
+{
+	IsolateInstance *inst;
+	if (!IsolatePluginArgs(args, reply, False, &inst, NULL)) {
+		return;
+	}
+
+	int32 len;
+	char *data = IsolateGetBytes(args, &len);
+	if (len != sizeof(XEvent)) {
+		IsolatePutInt(reply, False);
+		return;
+	}
+
+	XEvent event;
+	memcpy(&event, data, sizeof(XEvent));
+	event.xany.display = isolate_display;
+
+	int16 handled = CallNPP_HandleEventProc(isolate_plugin.event,
+						&inst->npp, &event);
+	if (event.type == GraphicsExpose && isolate_display) {
+		/* Drawn before the host copies it to the window */
+		XSync(isolate_display, False);
+	}
+	IsolatePutInt(reply, handled);
+}
+
+
+static void
+IsolatePluginURLNotify(IsolateMsg *args, IsolateMsg *reply)
+{
+	IsolateInstance *inst;
+	if (IsolatePluginArgs(args, reply, 0, &inst, NULL)) {
+		char *url = IsolateGetString(args);
+		NPReason reason = IsolateGetInt(args);
+		void *notify = (void *) (uintptr_t) IsolateGetInt(args);
+		CallNPP_URLNotifyProc(isolate_plugin.urlnotify, &inst->npp,
+				      url, reason, notify);
+	}
+}
+
+
+static void
+IsolatePluginGetValue(IsolateMsg *args, IsolateMsg *reply)
+{
+	/* Instance may be NULL */
+	IsolateInstance *inst = IsolatePluginInstance(IsolateGetInt(args));
+	NPPVariable variable = IsolateGetInt(args);
+
+	union { void *p; int32 i; NPBool b; int64 l; } value = { 0 };
+	NPError err = CallNPP_GetValueProc(isolate_plugin.getvalue,
+					   inst ? &inst->npp : NULL,
+					   variable, &value);
+	IsolatePutInt(reply, err);
+
+	switch (variable) {
+	case NPPVpluginNameString:
+	case NPPVpluginDescriptionString:
+		IsolatePutString(reply, err == NPERR_NO_ERROR ? value.p : NULL);
+		break;
+	case NPPVpluginWindowSize:
+	case NPPVpluginTimerInterval:
+		IsolatePutInt(reply, value.i);
+		break;
+	default:
+		IsolatePutInt(reply, value.b);
+		break;
+	}
+}
+
+
+static void
+IsolatePluginSetValue(IsolateMsg *args, IsolateMsg *reply)
+{
+	IsolateInstance *inst;
+	if (IsolatePluginArgs(args, reply, NPERR_INVALID_INSTANCE_ERROR,
+			       &inst, NULL)) {
+		NPNVariable variable = IsolateGetInt(args);
+		void *value = (void *) (uintptr_t) IsolateGetInt(args);
+		IsolatePutInt(reply,
+			      CallNPP_SetValueProc(isolate_plugin.setvalue,
+						   &inst->npp, variable,
+						   value));
+	}
+}
+
+
+/*
+ * Run the plugin for the host that started us with --plugin-host fds,
+ * "SOCKET:SHM".  The Xt app context and main loop should be set up, and
+ * the plugin loaded; initialize calls its NP_Initialize.  Returns once
+ * the host goes away.
+ */
+void
+IsolateServe(const char *fds,
+	     Display *display,
+	     IsolateInitializeFunc initialize,
+	     IsolateShutdownFunc shutdown)
+{
+	int shm_fd;
+	if (sscanf(fds, "%d:%d", &isolate_fd, &shm_fd) != 2) {
+		Error("Invalid --plugin-host '%s'\n", fds);
+	}
+	fcntl(isolate_fd, F_SETFD, FD_CLOEXEC);
+
+	isolate_shm = mmap(NULL, ISOLATE_SHM_SIZE, PROT_READ, MAP_SHARED,
+			   shm_fd, 0);
+	if (isolate_shm == MAP_FAILED) {
+		Error("Mapping shared memory: %s\n", strerror(errno));
+	}
+	close(shm_fd);
+
+	isolate_display = display;
+
+	isolate_handlers[ISOLATE_NPP_NEW] = IsolatePluginNew;
+	isolate_handlers[ISOLATE_NPP_DESTROY] = IsolatePluginDestroy;
+	isolate_handlers[ISOLATE_NPP_SETWINDOW] = IsolatePluginSetWindow;
+	isolate_handlers[ISOLATE_NPP_NEWSTREAM] = IsolatePluginNewStream;
+	isolate_handlers[ISOLATE_NPP_DESTROYSTREAM] =
+		IsolatePluginDestroyStream;
+	isolate_handlers[ISOLATE_NPP_ASFILE] = IsolatePluginStreamAsFile;
+	isolate_handlers[ISOLATE_NPP_WRITEREADY] = IsolatePluginWriteReady;
+	isolate_handlers[ISOLATE_NPP_WRITE] = IsolatePluginWrite;
+	isolate_handlers[ISOLATE_NPP_PRINT] = IsolatePluginPrint;
+	isolate_handlers[ISOLATE_NPP_HANDLEEVENT] = IsolatePluginHandleEvent;
+	isolate_handlers[ISOLATE_NPP_URLNOTIFY] = IsolatePluginURLNotify;
+	isolate_handlers[ISOLATE_NPP_GETVALUE] = IsolatePluginGetValue;
+	isolate_handlers[ISOLATE_NPP_SETVALUE] = IsolatePluginSetValue;
+
+	NPNetscapeFuncs funcs = { 0 };
+	funcs.size = sizeof(funcs);
+	funcs.version = (NP_VERSION_MAJOR << 8) + NP_VERSION_MINOR;
+	funcs.geturl = NewNPN_GetURLProc(IsolateNPN_GetURL);
+	funcs.posturl = NewNPN_PostURLProc(IsolateNPN_PostURL);
+	funcs.requestread = NewNPN_RequestReadProc(IsolateNPN_RequestRead);
+	funcs.newstream = NewNPN_NewStreamProc(IsolateNPN_NewStream);
+	funcs.write = NewNPN_WriteProc(IsolateNPN_Write);
+	funcs.destroystream =
+		NewNPN_DestroyStreamProc(IsolateNPN_DestroyStream);
+	funcs.status = NewNPN_StatusProc(IsolateNPN_Status);
+	funcs.uagent = NewNPN_UserAgentProc(IsolateNPN_UserAgent);
+	funcs.memalloc = NewNPN_MemAllocProc(IsolateNPN_MemAlloc);
+	funcs.memfree = NewNPN_MemFreeProc(IsolateNPN_MemFree);
+	funcs.memflush = NewNPN_MemFlushProc(IsolateNPN_MemFlush);
+	funcs.reloadplugins =
+		NewNPN_ReloadPluginsProc(IsolateNPN_ReloadPlugins);
+	funcs.getJavaEnv = NewNPN_GetJavaEnvProc(IsolateNPN_GetJavaEnv);
+	funcs.getJavaPeer = NewNPN_GetJavaPeerProc(IsolateNPN_GetJavaPeer);
+	funcs.geturlnotify = NewNPN_GetURLNotifyProc(IsolateNPN_GetURLNotify);
+	funcs.posturlnotify =
+		NewNPN_PostURLNotifyProc(IsolateNPN_PostURLNotify);
+	funcs.getvalue = NewNPN_GetValueProc(IsolateNPN_GetValue);
+	funcs.setvalue = NewNPN_SetValueProc(IsolateNPN_SetValue);
+	funcs.invalidaterect =
+		NewNPN_InvalidateRectProc(IsolateNPN_InvalidateRect);
+	funcs.invalidateregion =
+		NewNPN_InvalidateRegionProc(IsolateNPN_InvalidateRegion);
+	funcs.forceredraw = NewNPN_ForceRedrawProc(IsolateNPN_ForceRedraw);
+
+	static NPNetscapeFuncs moz_funcs; /* The plugin may keep a pointer */
+	moz_funcs = funcs;
+
+	isolate_plugin.size = sizeof(isolate_plugin);
+	NPError err = initialize(&moz_funcs, &isolate_plugin);
+	if (err != NPERR_NO_ERROR) {
+		Error("NP_Initialize result = %d\n", err);
+	}
+	MemPoolTrack(&isolate_plugin);
+
+	isolate_watch = MainLoopAddWatch(isolate_fd, MAINLOOP_READ,
+					 IsolateWatchCb, NULL);
+	MainLoopRun();
+
+	while (isolate_plugin_instances) {
+		IsolateInstance *inst = isolate_plugin_instances;
+		isolate_plugin_instances = inst->next;
+		CallNPP_DestroyProc(isolate_plugin.destroy, &inst->npp, NULL);
+		free(inst);
+	}
+	shutdown();
+
+	if (isolate_watch) {
+		MainLoopRemoveWatch(isolate_watch);
+	}
+	if (isolate_fd >= 0) {
+		close(isolate_fd);
+		isolate_fd = -1;
+	}
+}
@@ -0,0 +1,40 @@
+/*==========================================================================*\
+ *
+ * isolate.h - Running the plugin in a separate process.
+ * flasher (C) 2006 Alex Graveley
+ *
+\*==========================================================================*/
+
+#ifndef __ISOLATE_H__
+#define __ISOLATE_H__
+
+
+#include <X11/Xlib.h>
+
+#include "flasher.h"
+
+
+/* Called once a crashed plugin process has been replaced */
+typedef void (*IsolateRestartFunc)(void);
+
+typedef NPError (*IsolateInitializeFunc)(NPNetscapeFuncs *moz_funcs,
+					 NPPluginFuncs *plugin_funcs);
+typedef NPError (*IsolateShutdownFunc)(void);
+
+
+/* Host side */
+
+void IsolateStart(const char *plugin_path, IsolateRestartFunc restarted);
+
+void IsolateShutdown(void);
+
+
+/* Plugin side, in the process started by IsolateStart */
+
+void IsolateServe(const char *fds,
+		  Display *display,
+		  IsolateInitializeFunc initialize,
+		  IsolateShutdownFunc shutdown);
+
+
+#endif /* __ISOLATE_H__ */
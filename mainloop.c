@@ -0,0 +1,526 @@
+/*==========================================================================*\
+ *
+ * mainloop.c - epoll main loop for flasher.
+ * flasher (C) 2006 Alex Graveley
+ *
+\*==========================================================================*/
+
+
+#include <assert.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+
+#include "mainloop.h"
+#include "flasher.h"
+
+
+/*
+ * The host's file descriptors, timers and signals all live in one epoll
+ * set: timers in a timing wheel behind a timerfd, signals behind a
+ * signalfd.  The plugin expects to be driven by Xt, and registers Xt
+ * timeouts and inputs we can't see into, so Xt's select stays the one
+ * place the process sleeps: the epoll fd is an Xt input, readable
+ * whenever something in the set is ready, and the X connection is left
+ * to Xt.
+ */
+
+
+/* Wheel slots are one ms each; timers further out wait for later laps */
+#define MAINLOOP_WHEEL_SLOTS 256
+#define MAINLOOP_WHEEL_MASK  (MAINLOOP_WHEEL_SLOTS - 1)
+
+#define MAINLOOP_MAX_EVENTS 64
+
+
+struct _MainLoopWatch
+{
+	int   fd;
+	int   events;
+	MainLoopWatchFunc func;
+	void *data;
+
+	/* Removed during dispatch; freed once it is over */
+	Bool  removed;
+	MainLoopWatch *next_dead;
+};
+
+struct _MainLoopTimer
+{
+	long long expires; /* ms on the monotonic clock */
+	MainLoopTimerFunc func;
+	void *data;
+
+	/* In a wheel slot or the due list */
+	MainLoopTimer *prev;
+	MainLoopTimer *next;
+};
+
+
+static int mainloop_epoll_fd = -1;
+static XtInputId mainloop_input_id;
+static Bool mainloop_quit;
+
+static Bool mainloop_dispatching;
+static MainLoopWatch *mainloop_dead;
+
+/* List heads: timers due as soon as possible, and the wheel */
+static MainLoopTimer mainloop_due;
+static MainLoopTimer mainloop_wheel[MAINLOOP_WHEEL_SLOTS];
+static long long mainloop_tick;   /* Timers up to here have fired */
+static long long mainloop_armed;  /* When the timerfd fires, or 0 */
+static int mainloop_ntimers;
+static MainLoopWatch *mainloop_timer_watch;
+
+static struct
+{
+	MainLoopSignalFunc func;
+	void *data;
+} mainloop_signals[NSIG];
+static sigset_t mainloop_sigmask;
+static MainLoopWatch *mainloop_signal_watch;
+
+/* Every signal anyone may pass MainLoopAddSignal */
+static const int mainloop_handled[] = { SIGINT, SIGTERM, SIGUSR1 };
+
+
+static long long
+MainLoopNow(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+
+static void
+MainLoopListInit(MainLoopTimer *head)
+{
+	head->prev = head->next = head;
+}
+
+
+static void
+MainLoopListAppend(MainLoopTimer *head, MainLoopTimer *t)
+{
+	t->prev = head->prev;
+	t->next = head;
+	head->prev->next = t;
+	head->prev = t;
+}
+
+
+static void
+MainLoopListUnlink(MainLoopTimer *t)
+{
+	t->prev->next = t->next;
+	t->next->prev = t->prev;
+	t->prev = t->next = NULL;
+}
+
+
+/*==========================================================================*\
+ * File descriptors...
+\*==========================================================================*/
+
+static uint32_t
+MainLoopEpollEvents(int events)
+{
+	return ((events & MAINLOOP_READ) ? EPOLLIN : 0) |
+		((events & MAINLOOP_WRITE) ? EPOLLOUT : 0);
+}
+
+
+/* Call func whenever fd is ready for the MAINLOOP_ flags in events. */
+MainLoopWatch *
+MainLoopAddWatch(int fd, int events, MainLoopWatchFunc func, void *data)
+{
+	MainLoopWatch *w = calloc(1, sizeof(MainLoopWatch));
+	w->fd = fd;
+	w->events = events;
+	w->func = func;
+	w->data = data;
+
+	struct epoll_event ev = { 0 };
+	ev.events = MainLoopEpollEvents(events);
+	ev.data.ptr = w;
+	if (epoll_ctl(mainloop_epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+		Warning("Error watching fd %d: %s\n", fd, strerror(errno));
+	}
+
+	return w;
+}
+
+
+void
+MainLoopModifyWatch(MainLoopWatch *w, int events)
+{
+	if (w->events == events) {
+		return;
+	}
+	w->events = events;
+
+	struct epoll_event ev = { 0 };
+	ev.events = MainLoopEpollEvents(events);
+	ev.data.ptr = w;
+	epoll_ctl(mainloop_epoll_fd, EPOLL_CTL_MOD, w->fd, &ev);
+}
+
+
+void
+MainLoopRemoveWatch(MainLoopWatch *w)
+{
+	/* Fails harmlessly if fd is already closed, which removes it too. */
+	epoll_ctl(mainloop_epoll_fd, EPOLL_CTL_DEL, w->fd, NULL);
+
+	if (mainloop_dispatching) {
+		/* Its event may be later in the batch being dispatched. */
+		w->removed = True;
+		w->next_dead = mainloop_dead;
+		mainloop_dead = w;
+	} else {
+		free(w);
+	}
+}
+
+
+/*
+ * Xt input callback: the epoll set has something ready.  Dispatch one
+ * batch and return to Xt, so X events get their turn.
+ */
+static void
+MainLoopDispatch(XtPointer closure, int *source, XtInputId *id)
+{
+	struct epoll_event events[MAINLOOP_MAX_EVENTS];
+
+	int n = epoll_wait(mainloop_epoll_fd, events, MAINLOOP_MAX_EVENTS, 0);
+	if (n < 0 && errno != EINTR) {
+		Error("epoll_wait: %s\n", strerror(errno));
+	}
+
+	mainloop_dispatching = True;
+	for (int i = 0; i < n; i++) {
+		MainLoopWatch *w = (MainLoopWatch *) events[i].data.ptr;
+		if (w->removed) {
+			continue;
+		}
+
+		int ready = 0;
+		if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+			/* Let the owner find the error by trying. */
+			ready = w->events;
+		}
+		if (events[i].events & EPOLLIN) {
+			ready |= MAINLOOP_READ;
+		}
+		if (events[i].events & EPOLLOUT) {
+			ready |= MAINLOOP_WRITE;
+		}
+		w->func(w->fd, ready, w->data);
+	}
+	mainloop_dispatching = False;
+
+	while (mainloop_dead) {
+		MainLoopWatch *w = mainloop_dead;
+		mainloop_dead = w->next_dead;
+		free(w);
+	}
+}
+
+
+/*==========================================================================*\
+ * Timers...
+\*==========================================================================*/
+
+/* Have the timerfd fire at when, unless it already fires sooner. */
+static void
+MainLoopArm(long long when)
+{
+	if (mainloop_armed && mainloop_armed <= when) {
+		return;
+	}
+	mainloop_armed = when;
+
+	/* Fires at once if when is past. */
+	struct itimerspec its = { { 0, 0 }, { 0, 0 } };
+	its.it_value.tv_sec = when / 1000;
+	its.it_value.tv_nsec = (when % 1000) * 1000000;
+	timerfd_settime(mainloop_timer_watch->fd, TFD_TIMER_ABSTIME, &its,
+			NULL);
+}
+
+
+/* Arm the timerfd for the next timer due, after the wheel has turned. */
+static void
+MainLoopRearm(void)
+{
+	if (mainloop_due.next != &mainloop_due) {
+		MainLoopArm(MainLoopNow());
+		return;
+	}
+	if (mainloop_ntimers == 0) {
+		return;
+	}
+
+	for (int i = 1; i <= MAINLOOP_WHEEL_SLOTS; i++) {
+		long long tick = mainloop_tick + i;
+		MainLoopTimer *head = &mainloop_wheel[tick & MAINLOOP_WHEEL_MASK];
+		for (MainLoopTimer *t = head->next; t != head; t = t->next) {
+			if (t->expires <= tick) {
+				MainLoopArm(tick);
+				return;
+			}
+		}
+	}
+
+	/* Everything is at least a lap away; wake to turn the wheel. */
+	MainLoopArm(mainloop_tick + MAINLOOP_WHEEL_SLOTS);
+}
+
+
+/*
+ * Call func once, ms from now.  Timers due at the same time fire in the
+ * order they were added, and a timer added by a timer callback never
+ * fires in the same pass, so rescheduling with ms 0 can't starve I/O.
+ */
+MainLoopTimer *
+MainLoopAddTimer(long ms, MainLoopTimerFunc func, void *data)
+{
+	MainLoopTimer *t = calloc(1, sizeof(MainLoopTimer));
+	t->func = func;
+	t->data = data;
+	mainloop_ntimers++;
+
+	if (ms <= 0) {
+		t->expires = MainLoopNow();
+		MainLoopListAppend(&mainloop_due, t);
+	} else {
+		/* Round up, so it never fires early. */
+		struct timespec ts;
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		t->expires = ts.tv_sec * 1000LL + 
+			(ts.tv_nsec + 999999) / 1000000 + ms;
+		MainLoopListAppend(&mainloop_wheel[t->expires &
+						   MAINLOOP_WHEEL_MASK], t);
+	}
+	MainLoopArm(t->expires);
+
+	return t;
+}
+
+
+void
+MainLoopRemoveTimer(MainLoopTimer *t)
+{
+	MainLoopListUnlink(t);
+	mainloop_ntimers--;
+	free(t);
+}
+
+
+static void
+MainLoopFire(MainLoopTimer *t)
+{
+	MainLoopTimerFunc func = t->func;
+	void *data = t->data;
+
+	MainLoopRemoveTimer(t);
+	func(data);
+}
+
+
+/* Watch callback for the timerfd: fire every timer that is due. */
+static void
+MainLoopTimerReady(int fd, int events, void *data)
+{
+	uint64_t expirations;
+	read(fd, &expirations, sizeof(expirations));
+	mainloop_armed = 0;
+
+	/* Only those due now; ones they add wait for the next pass. */
+	MainLoopTimer due;
+	MainLoopListInit(&due);
+	if (mainloop_due.next != &mainloop_due) {
+		due.next = mainloop_due.next;
+		due.prev = mainloop_due.prev;
+		due.next->prev = due.prev->next = &due;
+		MainLoopListInit(&mainloop_due);
+	}
+	while (due.next != &due) {
+		MainLoopFire(due.next);
+	}
+
+	/* Timers added from here on expire after now. */
+	long long now = MainLoopNow();
+	long long from = mainloop_tick + 1;
+	if (now - mainloop_tick > MAINLOOP_WHEEL_SLOTS) {
+		from = now - MAINLOOP_WHEEL_SLOTS + 1;
+	}
+	for (long long tick = from; tick <= now; tick++) {
+		MainLoopTimer *head = &mainloop_wheel[tick & MAINLOOP_WHEEL_MASK];
+		MainLoopTimer *t = head->next;
+		while (t != head) {
+			if (t->expires > now) {
+				t = t->next;
+				continue;
+			}
+			/* The callback may remove anything; start over. */
+			MainLoopFire(t);
+			t = head->next;
+		}
+	}
+	mainloop_tick = now;
+
+	MainLoopRearm();
+}
+
+
+/*==========================================================================*\
+ * Signals...
+\*==========================================================================*/
+
+/* Watch callback for the signalfd. */
+static void
+MainLoopSignalReady(int fd, int events, void *data)
+{
+	struct signalfd_siginfo info;
+
+	while (read(fd, &info, sizeof(info)) == sizeof(info)) {
+		int sig = info.ssi_signo;
+		if (sig < NSIG && mainloop_signals[sig].func) {
+			mainloop_signals[sig].func(sig,
+						   mainloop_signals[sig].data);
+		} else if (sig < NSIG) {
+			/* Nobody wants it; do what it would have done. */
+			sigset_t set;
+			sigemptyset(&set);
+			sigaddset(&set, sig);
+			signal(sig, SIG_DFL);
+			raise(sig);
+			pthread_sigmask(SIG_UNBLOCK, &set, NULL);
+		}
+	}
+}
+
+
+/*
+ * Call func from the main loop when sig, one of mainloop_handled,
+ * arrives.  MainLoopInit blocked it already, so this may happen after
+ * threads are started.
+ */
+void
+MainLoopAddSignal(int sig, MainLoopSignalFunc func, void *data)
+{
+	assert(sig > 0 && sig < NSIG);
+	assert(sigismember(&mainloop_sigmask, sig));
+
+	mainloop_signals[sig].func = func;
+	mainloop_signals[sig].data = data;
+}
+
+
+/*==========================================================================*\
+ * Running...
+\*==========================================================================*/
+
+/* Set up the loop in x_app_context, which must exist by now. */
+void
+MainLoopInit(void)
+{
+	mainloop_epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (mainloop_epoll_fd < 0) {
+		Error("epoll_create1: %s\n", strerror(errno));
+	}
+
+	MainLoopListInit(&mainloop_due);
+	for (int i = 0; i < MAINLOOP_WHEEL_SLOTS; i++) {
+		MainLoopListInit(&mainloop_wheel[i]);
+	}
+	mainloop_tick = MainLoopNow();
+
+	int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (fd < 0) {
+		Error("timerfd_create: %s\n", strerror(errno));
+	}
+	mainloop_timer_watch = MainLoopAddWatch(fd, MAINLOOP_READ,
+						MainLoopTimerReady, NULL);
+
+	/* 
+	 * Threads inherit the mask they start with.  Blocking the signals
+	 * here, before the plugin or libcurl can start one, leaves them to
+	 * the signalfd; a thread that had them unblocked would take them,
+	 * and the default action ends the process.
+	 */
+	sigemptyset(&mainloop_sigmask);
+	for (int i = 0; i < sizeof(mainloop_handled) / sizeof(int); i++) {
+		sigaddset(&mainloop_sigmask, mainloop_handled[i]);
+	}
+	pthread_sigmask(SIG_BLOCK, &mainloop_sigmask, NULL);
+
+	fd = signalfd(-1, &mainloop_sigmask, SFD_NONBLOCK | SFD_CLOEXEC);
+	if (fd < 0) {
+		Error("signalfd: %s\n", strerror(errno));
+	}
+	mainloop_signal_watch = MainLoopAddWatch(fd, MAINLOOP_READ,
+						 MainLoopSignalReady, NULL);
+
+	mainloop_input_id = XtAppAddInput(x_app_context, mainloop_epoll_fd,
+					  (XtPointer) XtInputReadMask,
+					  MainLoopDispatch, NULL);
+}
+
+
+/* Run until MainLoopQuit, or until something sets Xt's exit flag. */
+void
+MainLoopRun(void)
+{
+	mainloop_quit = False;
+	while (!mainloop_quit && !XtAppGetExitFlag(x_app_context)) {
+		XtAppProcessEvent(x_app_context, XtIMAll);
+	}
+}
+
+
+void
+MainLoopQuit(void)
+{
+	mainloop_quit = True;
+}
+
+
+void
+MainLoopShutdown(void)
+{
+	XtRemoveInput(mainloop_input_id);
+
+	while (mainloop_due.next != &mainloop_due) {
+		MainLoopRemoveTimer(mainloop_due.next);
+	}
+	for (int i = 0; i < MAINLOOP_WHEEL_SLOTS; i++) {
+		while (mainloop_wheel[i].next != &mainloop_wheel[i]) {
+			MainLoopRemoveTimer(mainloop_wheel[i].next);
+		}
+	}
+
+	int fd = mainloop_timer_watch->fd;
+	MainLoopRemoveWatch(mainloop_timer_watch);
+	mainloop_timer_watch = NULL;
+	close(fd);
+
+	if (mainloop_signal_watch) {
+		fd = mainloop_signal_watch->fd;
+		MainLoopRemoveWatch(mainloop_signal_watch);
+		mainloop_signal_watch = NULL;
+		close(fd);
+	}
+
+	close(mainloop_epoll_fd);
+	mainloop_epoll_fd = -1;
+}
@@ -0,0 +1,52 @@
+/*==========================================================================*\
+ *
+ * mainloop.h - epoll main loop for flasher.
+ * flasher (C) 2006 Alex Graveley
+ *
+\*==========================================================================*/
+
+#ifndef __MAINLOOP_H__
+#define __MAINLOOP_H__
+
+
+#include "flasher.h"
+
+
+#define MAINLOOP_READ  (1 << 0)
+#define MAINLOOP_WRITE (1 << 1)
+
+
+typedef struct _MainLoopWatch MainLoopWatch;
+typedef struct _MainLoopTimer MainLoopTimer;
+
+/* events is the MAINLOOP_ flags that are ready, or both on error/hangup */
+typedef void (*MainLoopWatchFunc)(int fd, int events, void *data);
+typedef void (*MainLoopTimerFunc)(void *data);
+typedef void (*MainLoopSignalFunc)(int sig, void *data);
+
+
+MainLoopWatch *MainLoopAddWatch(int fd, 
+				int events, 
+				MainLoopWatchFunc func, 
+				void *data);
+
+void MainLoopModifyWatch(MainLoopWatch *watch, int events);
+
+void MainLoopRemoveWatch(MainLoopWatch *watch);
+
+MainLoopTimer *MainLoopAddTimer(long ms, MainLoopTimerFunc func, void *data);
+
+void MainLoopRemoveTimer(MainLoopTimer *timer);
+
+void MainLoopAddSignal(int sig, MainLoopSignalFunc func, void *data);
+
+void MainLoopInit(void);
+
+void MainLoopRun(void);
+
+void MainLoopQuit(void);
+
+void MainLoopShutdown(void);
+
+
+#endif /* __MAINLOOP_H__ */
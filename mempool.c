@@ -0,0 +1,508 @@
+/*==========================================================================*\
+ *
+ * mempool.c - Pooled allocator behind NPN_MemAlloc.
+ * flasher (C) 2006 Alex Graveley
+ *
+\*==========================================================================*/
+
+
+#include <malloc.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mempool.h"
+#include "stats.h"
+
+
+/*
+ * Blocks up to 4KB are rounded up to a power of two and, once freed, kept
+ * on a free list per size to be handed out again, up to MEMPOOL_CACHE_MAX
+ * bytes of them.  Larger ones go straight to malloc.  Every block is
+ * charged to the plugin instance whose NPP_* call was running when it was
+ * allocated, found by wrapping the plugin's functions.  With a cap, the
+ * cache is flushed when allocations would pass it, and they fail if that
+ * isn't enough.
+ */
+
+
+#define MEMPOOL_MIN_SHIFT 4 /* 16 bytes */
+#define MEMPOOL_CLASSES   9 /* Up to 4KB; one more counts larger blocks */
+#define MEMPOOL_CACHE_MAX (8 * 1024 * 1024)
+
+
+/* Allocations charged to a plugin instance */
+typedef struct _MemOwner
+{
+	char *name;
+	NPP   instance; /* NULL once destroyed */
+	long  live;     /* Bytes */
+	long  peak;
+	long  allocs;
+
+	struct _MemOwner *next;
+} MemOwner;
+
+/* Ahead of each block, keeping what follows 16 byte aligned */
+typedef struct _MemBlock
+{
+	union {
+		MemOwner *owner;        /* In use */
+		struct _MemBlock *next; /* Cached */
+	} u;
+	uint32 size;  /* Rounded up to the class size */
+	uint32 class;
+} MemBlock;
+
+typedef struct _MemClass
+{
+	long allocs;
+	long frees;
+	long live;   /* Blocks */
+	long cached; /* Blocks */
+} MemClass;
+
+
+static long mempool_cap = 0;
+static long mempool_live = 0;
+static long mempool_peak = 0;
+static long mempool_cached = 0;
+static long mempool_flushed = 0;
+static long mempool_failed = 0;
+static double mempool_start = 0;
+
+static MemBlock *mempool_free[MEMPOOL_CLASSES];
+static MemClass mempool_classes[MEMPOOL_CLASSES + 1];
+
+/* Allocations made outside any instance's calls */
+static MemOwner mempool_global = { "(no instance)" };
+
+/* In creation order, after mempool_global */
+static MemOwner *mempool_owners_tail = &mempool_global;
+static MemOwner *mempool_current = &mempool_global;
+
+static NPPluginFuncs mempool_plugin; /* The plugin's own functions */
+
+
+static int
+MemPoolClass(uint32 size)
+{
+	int class = 0;
+	while (class < MEMPOOL_CLASSES &&
+	       size > (1u << (class + MEMPOOL_MIN_SHIFT))) {
+		class++;
+	}
+	return class;
+}
+
+
+/* Free cached blocks, largest first, until size bytes have gone. */
+uint32
+MemPoolFlush(uint32 size)
+{
+	uint32 freed = 0;
+
+	for (int class = MEMPOOL_CLASSES - 1; class >= 0; class--) {
+		while (mempool_free[class] && freed < size) {
+			MemBlock *block = mempool_free[class];
+			mempool_free[class] = block->u.next;
+			mempool_classes[class].cached--;
+			mempool_cached -= block->size;
+			freed += block->size;
+			free(block);
+		}
+	}
+
+	if (freed) {
+		/* Give the heap's free pages back, too. */
+		malloc_trim(0);
+		mempool_flushed += freed;
+		Debug("Flushed %u bytes of plugin memory\n", freed);
+	}
+
+	return freed;
+}
+
+
+void *
+MemPoolAlloc(uint32 size)
+{
+	int class = MemPoolClass(size);
+	uint32 block_size = class < MEMPOOL_CLASSES ?
+		1u << (class + MEMPOOL_MIN_SHIFT) : size;
+
+	if (mempool_cap &&
+	    mempool_live + mempool_cached + block_size > mempool_cap) {
+		MemPoolFlush(mempool_cached);
+		if (mempool_live + block_size > mempool_cap) {
+			Warning("Plugin memory cap of %ld bytes reached\n",
+				mempool_cap);
+			mempool_failed++;
+			return NULL;
+		}
+	}
+
+	MemBlock *block;
+	if (class < MEMPOOL_CLASSES && mempool_free[class]) {
+		block = mempool_free[class];
+		mempool_free[class] = block->u.next;
+		mempool_classes[class].cached--;
+		mempool_cached -= block_size;
+	} else {
+		block = malloc(sizeof(MemBlock) + block_size);
+		if (!block) {
+			mempool_failed++;
+			return NULL;
+		}
+	}
+
+	block->u.owner = mempool_current;
+	block->size = block_size;
+	block->class = class;
+
+	mempool_classes[class].allocs++;
+	mempool_classes[class].live++;
+	mempool_live += block_size;
+	mempool_peak = MAX(mempool_peak, mempool_live);
+
+	MemOwner *owner = mempool_current;
+	owner->allocs++;
+	owner->live += block_size;
+	owner->peak = MAX(owner->peak, owner->live);
+
+	return block + 1;
+}
+
+
+void
+MemPoolFree(void *ptr)
+{
+	if (!ptr) {
+		return;
+	}
+
+	MemBlock *block = (MemBlock *) ptr - 1;
+	int class = block->class;
+
+	block->u.owner->live -= block->size;
+	mempool_classes[class].frees++;
+	mempool_classes[class].live--;
+	mempool_live -= block->size;
+
+	if (class < MEMPOOL_CLASSES &&
+	    mempool_cached + block->size <= MEMPOOL_CACHE_MAX) {
+		block->u.next = mempool_free[class];
+		mempool_free[class] = block;
+		mempool_classes[class].cached++;
+		mempool_cached += block->size;
+	} else {
+		free(block);
+	}
+}
+
+
+/*==========================================================================*\
+ * Charging allocations to instances...
+\*==========================================================================*/
+
+static MemOwner *
+MemPoolOwner(NPP instance)
+{
+	for (MemOwner *owner = mempool_global.next; owner;
+	     owner = owner->next) {
+		if (owner->instance == instance) {
+			return owner;
+		}
+	}
+	return &mempool_global;
+}
+
+
+/* Charge allocations to instance until the returned owner is restored. */
+static MemOwner *
+MemPoolEnter(NPP instance)
+{
+	MemOwner *saved = mempool_current;
+	mempool_current = MemPoolOwner(instance);
+	return saved;
+}
+
+
+static NPError
+MemPoolNew(NPMIMEType type,
+	   NPP instance,
+	   uint16 mode,
+	   int16 argc,
+	   char *argn[],
+	   char *argv[],
+	   NPSavedData *saved)
+{
+	const char *name = type;
+	for (int i = 0; i < argc; i++) {
+		if (!strcasecmp(argn[i], "SRC") && argv[i]) {
+			name = argv[i];
+		}
+	}
+
+	MemOwner *owner = calloc(1, sizeof(MemOwner));
+	owner->name = strdup(name ? name : "");
+	owner->instance = instance;
+	mempool_owners_tail->next = owner;
+	mempool_owners_tail = owner;
+
+	MemOwner *prev = mempool_current;
+	mempool_current = owner;
+	NPError err = CallNPP_NewProc(mempool_plugin.newp, type, instance,
+				      mode, argc, argn, argv, saved);
+	mempool_current = prev;
+
+	if (err != NPERR_NO_ERROR) {
+		owner->instance = NULL;
+	}
+	return err;
+}
+
+
+static NPError
+MemPoolDestroy(NPP instance, NPSavedData **save)
+{
+	MemOwner *prev = MemPoolEnter(instance);
+	MemOwner *owner = mempool_current;
+	NPError err = CallNPP_DestroyProc(mempool_plugin.destroy, instance,
+					  save);
+	mempool_current = prev;
+
+	if (owner != &mempool_global) {
+		/* Kept for the stats; blocks still point to it. */
+		owner->instance = NULL;
+		if (owner->live) {
+			Log("Instance for %s left %ld bytes allocated\n",
+			    owner->name, owner->live);
+		}
+	}
+	return err;
+}
+
+
+static NPError
+MemPoolSetWindow(NPP instance, NPWindow *window)
+{
+	MemOwner *prev = MemPoolEnter(instance);
+	NPError err = CallNPP_SetWindowProc(mempool_plugin.setwindow,
+					    instance, window);
+	mempool_current = prev;
+	return err;
+}
+
+
+static NPError
+MemPoolNewStream(NPP instance,
+		 NPMIMEType type,
+		 NPStream *stream,
+		 NPBool seekable,
+		 uint16 *stype)
+{
+	MemOwner *prev = MemPoolEnter(instance);
+	NPError err = CallNPP_NewStreamProc(mempool_plugin.newstream,
+					    instance, type, stream, seekable,
+					    stype);
+	mempool_current = prev;
+	return err;
+}
+
+
+static NPError
+MemPoolDestroyStream(NPP instance, NPStream *stream, NPReason reason)
+{
+	MemOwner *prev = MemPoolEnter(instance);
+	NPError err = CallNPP_DestroyStreamProc(mempool_plugin.destroystream,
+						instance, stream, reason);
+	mempool_current = prev;
+	return err;
+}
+
+
+static void
+MemPoolStreamAsFile(NPP instance, NPStream *stream, const char *fname)
+{
+	MemOwner *prev = MemPoolEnter(instance);
+	CallNPP_StreamAsFileProc(mempool_plugin.asfile, instance, stream,
+				 fname);
+	mempool_current = prev;
+}
+
+
+static int32
+MemPoolWriteReady(NPP instance, NPStream *stream)
+{
+	MemOwner *prev = MemPoolEnter(instance);
+	int32 ready = CallNPP_WriteReadyProc(mempool_plugin.writeready,
+					     instance, stream);
+	mempool_current = prev;
+	return ready;
+}
+
+
+static int32
+MemPoolWrite(NPP instance,
+	     NPStream *stream,
+	     int32 offset,
+	     int32 len,
+	     void *buffer)
+{
+	MemOwner *prev = MemPoolEnter(instance);
+	int32 written = CallNPP_WriteProc(mempool_plugin.write, instance,
+					  stream, offset, len, buffer);
+	mempool_current = prev;
+	return written;
+}
+
+
+static void
+MemPoolPrint(NPP instance, NPPrint *platformPrint)
+{
+	MemOwner *prev = MemPoolEnter(instance);
+	CallNPP_PrintProc(mempool_plugin.print, instance, platformPrint);
+	mempool_current = prev;
+}
+
+
+static int16
+MemPoolHandleEvent(NPP instance, void *event)
+{
+	MemOwner *prev = MemPoolEnter(instance);
+	int16 handled = CallNPP_HandleEventProc(mempool_plugin.event,
+						instance, event);
+	mempool_current = prev;
+	return handled;
+}
+
+
+static void
+MemPoolURLNotify(NPP instance,
+		 const char *url,
+		 NPReason reason,
+		 void *notifyData)
+{
+	MemOwner *prev = MemPoolEnter(instance);
+	CallNPP_URLNotifyProc(mempool_plugin.urlnotify, instance, url,
+			      reason, notifyData);
+	mempool_current = prev;
+}
+
+
+static NPError
+MemPoolGetValue(NPP instance, NPPVariable variable, void *value)
+{
+	MemOwner *prev = MemPoolEnter(instance);
+	NPError err = CallNPP_GetValueProc(mempool_plugin.getvalue, instance,
+					   variable, value);
+	mempool_current = prev;
+	return err;
+}
+
+
+static NPError
+MemPoolSetValue(NPP instance, NPNVariable variable, void *value)
+{
+	MemOwner *prev = MemPoolEnter(instance);
+	NPError err = CallNPP_SetValueProc(mempool_plugin.setvalue, instance,
+					   variable, value);
+	mempool_current = prev;
+	return err;
+}
+
+
+/*
+ * Wrap the plugin's functions in funcs, as filled in by NP_Initialize,
+ * to charge what it allocates to the instance it's called for.
+ */
+void
+MemPoolTrack(NPPluginFuncs *funcs)
+{
+	mempool_plugin = *funcs;
+
+	funcs->newp = NewNPP_NewProc(MemPoolNew);
+	funcs->destroy = NewNPP_DestroyProc(MemPoolDestroy);
+	funcs->setwindow = NewNPP_SetWindowProc(MemPoolSetWindow);
+	funcs->newstream = NewNPP_NewStreamProc(MemPoolNewStream);
+	funcs->destroystream = NewNPP_DestroyStreamProc(MemPoolDestroyStream);
+	funcs->asfile = NewNPP_StreamAsFileProc(MemPoolStreamAsFile);
+	funcs->writeready = NewNPP_WriteReadyProc(MemPoolWriteReady);
+	funcs->write = NewNPP_WriteProc(MemPoolWrite);
+	funcs->print = NewNPP_PrintProc(MemPoolPrint);
+	funcs->event = NewNPP_HandleEventProc(MemPoolHandleEvent);
+	funcs->urlnotify = NewNPP_URLNotifyProc(MemPoolURLNotify);
+	if (funcs->getvalue) {
+		funcs->getvalue = NewNPP_GetValueProc(MemPoolGetValue);
+	}
+	if (funcs->setvalue) {
+		funcs->setvalue = NewNPP_SetValueProc(MemPoolSetValue);
+	}
+}
+
+
+/*==========================================================================*\
+ * Stats...
+\*==========================================================================*/
+
+static void
+MemPoolDump(FILE *f)
+{
+	double seconds = MAX(StatsNow() - mempool_start, 1) / 1000.0;
+
+	fprintf(f, "{\n    \"cap\": %ld, \"live\": %ld, \"peak\": %ld, "
+		"\"cached\": %ld, \"flushed\": %ld, \"failed\": %ld,\n"
+		"    \"classes\": [", mempool_cap, mempool_live, mempool_peak,
+		mempool_cached, mempool_flushed, mempool_failed);
+	for (int class = 0; class <= MEMPOOL_CLASSES; class++) {
+		MemClass *mc = &mempool_classes[class];
+		fprintf(f, "%s\n      { \"size\": ", class ? "," : "");
+		if (class < MEMPOOL_CLASSES) {
+			fprintf(f, "%u", 1u << (class + MEMPOOL_MIN_SHIFT));
+		} else {
+			StatsJSONString(f, "large");
+		}
+		fprintf(f, ", \"allocs\": %ld, \"frees\": %ld, "
+			"\"live\": %ld, \"cached\": %ld, "
+			"\"allocs_per_s\": %.1f }", mc->allocs, mc->frees,
+			mc->live, mc->cached, mc->allocs / seconds);
+	}
+	fprintf(f, " ],\n    \"instances\": [");
+	for (MemOwner *owner = &mempool_global; owner; owner = owner->next) {
+		fprintf(f, "%s\n      { \"movie\": ",
+			owner == &mempool_global ? "" : ",");
+		StatsJSONString(f, owner->name);
+		fprintf(f, ", \"live\": %ld, \"peak\": %ld, \"allocs\": %ld }",
+			owner->live, owner->peak, owner->allocs);
+	}
+	fprintf(f, " ]\n  }");
+}
+
+
+/*
+ * Cap plugin memory at cap bytes, or not if it's 0, and add a "memory"
+ * stats section.
+ */
+void
+MemPoolInit(long cap)
+{
+	mempool_cap = cap;
+	mempool_start = StatsNow();
+
+	StatsAddSection("memory", MemPoolDump);
+}
+
+
+/* Log a summary, and free the cached blocks. */
+void
+MemPoolShutdown(void)
+{
+	long allocs = 0;
+	for (int class = 0; class <= MEMPOOL_CLASSES; class++) {
+		allocs += mempool_classes[class].allocs;
+	}
+	Log("Plugin memory: %ld allocations, peak %ld KB, %ld KB still "
+	    "allocated\n", allocs, mempool_peak / 1024, mempool_live / 1024);
+
+	MemPoolFlush(mempool_cached);
+}
@@ -0,0 +1,28 @@
+/*==========================================================================*\
+ *
+ * mempool.h - Pooled allocator behind NPN_MemAlloc.
+ * flasher (C) 2006 Alex Graveley
+ *
+\*==========================================================================*/
+
+#ifndef __MEMPOOL_H__
+#define __MEMPOOL_H__
+
+
+#include "flasher.h"
+
+
+void MemPoolInit(long cap);
+
+void MemPoolTrack(NPPluginFuncs *funcs);
+
+void *MemPoolAlloc(uint32 size);
+
+void MemPoolFree(void *ptr);
+
+uint32 MemPoolFlush(uint32 size);
+
+void MemPoolShutdown(void);
+
+
+#endif /* __MEMPOOL_H__ */
@@ -0,0 +1,479 @@
+/*==========================================================================*\
+ *
+ * pluginreg.c - Finding and loading plugin libraries.
+ * flasher (C) 2006 Alex Graveley
+ *
+\*==========================================================================*/
+
+
+#define _GNU_SOURCE /* for readahead, dlinfo and dl_iterate_phdr */
+
+#include <dirent.h>
+#include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <link.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "pluginreg.h"
+#include "stats.h"
+
+
+/*
+ * Plugins are looked for in the directories of --plugin-path, then
+ * MOZ_PLUGIN_PATH, then ~/.mozilla/plugins and /usr/lib/mozilla/plugins,
+ * as a browser would.  Finding which MIME types a library handles means
+ * loading it to call NP_GetMIMEDescription, so the answers are kept in
+ * ~/.flasher-pluginreg, one line per library:
+ *
+ *   PATH \t MTIME \t SIZE \t MIME DESCRIPTION
+ *
+ * and a library is only loaded again when its mtime or size changes.
+ */
+
+
+#define PLUGINREG_FILE "/.flasher-pluginreg"
+
+
+typedef struct _PluginRegEntry
+{
+	char  *path;
+	long   mtime;
+	long   size;
+	char  *mime; /* From NP_GetMIMEDescription */
+	Bool   seen; /* Found by this scan */
+
+	struct _PluginRegEntry *next;
+} PluginRegEntry;
+
+
+static char *pluginreg_search_path = NULL;
+static char *pluginreg_file = NULL;
+static PluginRegEntry *pluginreg_entries = NULL;
+static Bool pluginreg_scanned = False;
+
+static struct {
+	char  *path;
+	int    libraries;
+	int    cached;
+	int    probed;
+	double scan_ms;
+	double readahead_ms;
+	double load_ms;
+	double locked_kb;
+	double before_init_ms; /* Since main started */
+	double init_ms;
+} pluginreg_stats;
+
+
+static PluginRegEntry *
+PluginRegLookup(const char *path)
+{
+	for (PluginRegEntry *e = pluginreg_entries; e; e = e->next) {
+		if (!strcmp(e->path, path)) {
+			return e;
+		}
+	}
+	return NULL;
+}
+
+
+static PluginRegEntry *
+PluginRegAdd(const char *path, long mtime, long size, const char *mime)
+{
+	PluginRegEntry *e = calloc(1, sizeof(PluginRegEntry));
+	e->path = strdup(path);
+	e->mtime = mtime;
+	e->size = size;
+	e->mime = strdup(mime);
+	e->next = pluginreg_entries;
+	pluginreg_entries = e;
+	return e;
+}
+
+
+static void
+PluginRegRead(void)
+{
+	FILE *f = fopen(pluginreg_file, "r");
+	if (!f) {
+		return;
+	}
+
+	char line[8192];
+	while (fgets(line, sizeof(line), f)) {
+		line[strcspn(line, "\n")] = '\0';
+
+		char *path = strtok(line, "\t");
+		char *mtime = strtok(NULL, "\t");
+		char *size = strtok(NULL, "\t");
+		char *mime = strtok(NULL, "");
+		if (path && mtime && size && mime && !PluginRegLookup(path)) {
+			PluginRegAdd(path, atol(mtime), atol(size), mime);
+		}
+	}
+
+	fclose(f);
+}
+
+
+/* Replace the cache with the libraries found by this scan. */
+static void
+PluginRegWrite(void)
+{
+	char *tmp_path = malloc(strlen(pluginreg_file) + 32);
+	sprintf(tmp_path, "%s.%d", pluginreg_file, getpid());
+
+	FILE *f = fopen(tmp_path, "w");
+	if (!f) {
+		Debug("Writing '%s': %s\n", tmp_path, strerror(errno));
+		free(tmp_path);
+		return;
+	}
+
+	for (PluginRegEntry *e = pluginreg_entries; e; e = e->next) {
+		if (e->seen) {
+			fprintf(f, "%s\t%ld\t%ld\t%s\n", e->path, e->mtime,
+				e->size, e->mime);
+		}
+	}
+
+	if (fclose(f) != 0 || rename(tmp_path, pluginreg_file) < 0) {
+		Debug("Writing '%s': %s\n", pluginreg_file, strerror(errno));
+		unlink(tmp_path);
+	}
+	free(tmp_path);
+}
+
+
+/* Load path just long enough to ask which MIME types it handles. */
+static char *
+PluginRegProbe(const char *path)
+{
+	void *dlobj = dlopen(path, RTLD_LAZY | RTLD_LOCAL);
+	if (!dlobj) {
+		Debug("Not a plugin: %s\n", dlerror());
+		return NULL;
+	}
+
+	char *mime = NULL;
+	char *(*get_mime)(void) = (char *(*)(void))
+		dlsym(dlobj, "NP_GetMIMEDescription");
+	if (get_mime && dlsym(dlobj, "NP_Initialize")) {
+		const char *desc = get_mime();
+		/* Tabs and newlines would break the cache file. */
+		mime = strdup(desc ? desc : "");
+		for (char *p = mime; *p; p++) {
+			if (*p == '\t' || *p == '\n') {
+				*p = ' ';
+			}
+		}
+	}
+
+	dlclose(dlobj);
+	return mime;
+}
+
+
+static void
+PluginRegScanDir(const char *dir)
+{
+	struct dirent **names;
+	int n = scandir(dir, &names, NULL, alphasort);
+	if (n < 0) {
+		return;
+	}
+
+	for (int i = 0; i < n; i++) {
+		const char *name = names[i]->d_name;
+		int len = strlen(name);
+		if (len < 4 || strcmp(name + len - 3, ".so")) {
+			free(names[i]);
+			continue;
+		}
+
+		char path[4096];
+		snprintf(path, sizeof(path), "%s/%s", dir, name);
+		free(names[i]);
+
+		struct stat st;
+		if (stat(path, &st) < 0 || !S_ISREG(st.st_mode)) {
+			continue;
+		}
+
+		PluginRegEntry *e = PluginRegLookup(path);
+		if (e && e->seen) {
+			/* Listed twice in the search path */
+			continue;
+		}
+		if (e && e->mtime == st.st_mtime && e->size == st.st_size) {
+			pluginreg_stats.cached++;
+		} else {
+			char *mime = PluginRegProbe(path);
+			pluginreg_stats.probed++;
+			if (!mime) {
+				/* Remembered as no plugin, so not probed again */
+				mime = strdup("");
+			}
+			if (!e) {
+				e = PluginRegAdd(path, 0, 0, "");
+			}
+			free(e->mime);
+			e->mime = mime;
+			e->mtime = st.st_mtime;
+			e->size = st.st_size;
+		}
+
+		e->seen = True;
+		pluginreg_stats.libraries++;
+	}
+
+	free(names);
+}
+
+
+/* The search path: colon separated directories, in order. */
+static char *
+PluginRegSearchPath(void)
+{
+	const char *home = getenv("HOME");
+	const char *moz = getenv("MOZ_PLUGIN_PATH");
+
+	size_t len = 256;
+	len += pluginreg_search_path ? strlen(pluginreg_search_path) : 0;
+	len += moz ? strlen(moz) : 0;
+	len += home ? strlen(home) : 0;
+
+	char *path = malloc(len);
+	sprintf(path, "%s:%s:%s/.mozilla/plugins:/usr/lib/mozilla/plugins",
+		pluginreg_search_path ? pluginreg_search_path : "",
+		moz ? moz : "", home ? home : "");
+	return path;
+}
+
+
+static void
+PluginRegScan(void)
+{
+	double start = StatsNow();
+
+	PluginRegRead();
+
+	char *path = PluginRegSearchPath();
+	char *save;
+	for (char *dir = strtok_r(path, ":", &save); dir;
+	     dir = strtok_r(NULL, ":", &save)) {
+		if (*dir) {
+			PluginRegScanDir(dir);
+		}
+	}
+	free(path);
+
+	Bool stale = False;
+	for (PluginRegEntry *e = pluginreg_entries; e; e = e->next) {
+		stale |= !e->seen;
+	}
+	if (pluginreg_stats.probed || stale) {
+		PluginRegWrite();
+	}
+
+	pluginreg_scanned = True;
+	pluginreg_stats.scan_ms = StatsNow() - start;
+	Debug("Found %d libraries in %.1f ms, %d probed\n",
+	      pluginreg_stats.libraries, pluginreg_stats.scan_ms,
+	      pluginreg_stats.probed);
+}
+
+
+/* Does the NP_GetMIMEDescription string desc list mime_type? */
+static Bool
+PluginRegHandles(const char *desc, const char *mime_type)
+{
+	size_t len = strlen(mime_type);
+	for (const char *p = desc; p && *p; ) {
+		while (*p == ' ' || *p == ';') {
+			p++;
+		}
+		if (!strncasecmp(p, mime_type, len) &&
+		    (p[len] == ':' || p[len] == ';' || p[len] == '\0')) {
+			return True;
+		}
+		p = strchr(p, ';');
+	}
+	return False;
+}
+
+
+/*
+ * Returns the path of the first library in the search path handling
+ * mime_type, or NULL.  Free it.
+ */
+char *
+PluginRegFind(const char *mime_type)
+{
+	if (!pluginreg_scanned) {
+		PluginRegScan();
+	}
+
+	/* Entries aren't in search path order; scan again to pick. */
+	PluginRegEntry *found = NULL;
+	char *path = PluginRegSearchPath();
+	char *save;
+	for (char *dir = strtok_r(path, ":", &save); dir && !found;
+	     dir = strtok_r(NULL, ":", &save)) {
+		size_t len = strlen(dir);
+		for (PluginRegEntry *e = pluginreg_entries; e; e = e->next) {
+			if (e->seen && !strncmp(e->path, dir, len) &&
+			    e->path[len] == '/' && !strchr(e->path + len + 1, '/') &&
+			    PluginRegHandles(e->mime, mime_type) &&
+			    (!found || strcmp(e->path, found->path) < 0)) {
+				found = e;
+			}
+		}
+	}
+	free(path);
+
+	return found ? strdup(found->path) : NULL;
+}
+
+
+/* dl_iterate_phdr callback: lock the executable segments of data's map. */
+static int
+PluginRegLockSegments(struct dl_phdr_info *info, size_t size, void *data)
+{
+	struct link_map *map = (struct link_map *) data;
+	if (info->dlpi_addr != map->l_addr) {
+		return 0;
+	}
+
+	long page = sysconf(_SC_PAGESIZE);
+	for (int i = 0; i < info->dlpi_phnum; i++) {
+		const ElfW(Phdr) *ph = &info->dlpi_phdr[i];
+		if (ph->p_type != PT_LOAD || !(ph->p_flags & PF_X)) {
+			continue;
+		}
+
+		uintptr_t start = (info->dlpi_addr + ph->p_vaddr) & ~(page - 1);
+		uintptr_t end = info->dlpi_addr + ph->p_vaddr + ph->p_memsz;
+		if (mlock((void *) start, end - start) < 0) {
+			Warning("Locking plugin in memory: %s\n",
+				strerror(errno));
+		} else {
+			pluginreg_stats.locked_kb += (end - start) / 1024.0;
+		}
+	}
+	return 1;
+}
+
+
+/*
+ * Load the plugin at path, with every symbol bound now rather than in
+ * the middle of playback.  With readahead, its file is read into the page
+ * cache first, in one go.  With lock, its code is locked in memory.
+ * Returns NULL if it can't be loaded.
+ */
+void *
+PluginRegLoad(const char *path, Bool readahead_file, Bool lock)
+{
+	double start = StatsNow();
+
+	if (readahead_file) {
+		int fd = open(path, O_RDONLY);
+		struct stat st;
+		if (fd >= 0 && fstat(fd, &st) == 0) {
+			readahead(fd, 0, st.st_size);
+		}
+		if (fd >= 0) {
+			close(fd);
+		}
+		pluginreg_stats.readahead_ms = StatsNow() - start;
+	}
+
+	void *dlobj = dlopen(path, RTLD_NOW);
+	if (!dlobj) {
+		return NULL;
+	}
+
+	struct link_map *map;
+	if (lock && dlinfo(dlobj, RTLD_DI_LINKMAP, &map) == 0) {
+		dl_iterate_phdr(PluginRegLockSegments, map);
+	}
+
+	pluginreg_stats.load_ms = StatsNow() - start;
+	free(pluginreg_stats.path);
+	pluginreg_stats.path = strdup(path);
+
+	return dlobj;
+}
+
+
+/*
+ * The loaded plugin's NP_Initialize took init_ms: log how long getting
+ * this far took.
+ */
+void
+PluginRegStarted(double init_ms)
+{
+	pluginreg_stats.init_ms = init_ms;
+	pluginreg_stats.before_init_ms = ElapsedMs() - init_ms;
+
+	Log("Plugin started in %.1f ms: search %.1f ms, load %.1f ms, "
+	    "NP_Initialize %.1f ms\n", pluginreg_stats.before_init_ms + init_ms,
+	    pluginreg_stats.scan_ms, pluginreg_stats.load_ms, init_ms);
+}
+
+
+static void
+PluginRegDump(FILE *f)
+{
+	fprintf(f, "{\n    \"path\": ");
+	StatsJSONString(f, pluginreg_stats.path ? pluginreg_stats.path : "");
+	fprintf(f, ", \"libraries\": %d, \"cached\": %d, \"probed\": %d,\n"
+		"    \"scan_ms\": %.3f, \"readahead_ms\": %.3f, "
+		"\"load_ms\": %.3f, \"locked_kb\": %.0f,\n"
+		"    \"before_init_ms\": %.3f, \"init_ms\": %.3f\n  }",
+		pluginreg_stats.libraries, pluginreg_stats.cached,
+		pluginreg_stats.probed, pluginreg_stats.scan_ms,
+		pluginreg_stats.readahead_ms, pluginreg_stats.load_ms,
+		pluginreg_stats.locked_kb, pluginreg_stats.before_init_ms,
+		pluginreg_stats.init_ms);
+}
+
+
+/*
+ * Search the colon separated directories in search_path, if set, before
+ * the usual ones, and add a "plugin" stats section.
+ */
+void
+PluginRegInit(const char *search_path)
+{
+	pluginreg_search_path = search_path ? strdup(search_path) : NULL;
+
+	const char *home = getenv("HOME");
+	pluginreg_file = malloc((home ? strlen(home) : 0) +
+				sizeof(PLUGINREG_FILE));
+	sprintf(pluginreg_file, "%s%s", home ? home : "", PLUGINREG_FILE);
+
+	StatsAddSection("plugin", PluginRegDump);
+}
+
+
+void
+PluginRegShutdown(void)
+{
+	while (pluginreg_entries) {
+		PluginRegEntry *e = pluginreg_entries;
+		pluginreg_entries = e->next;
+		free(e->path);
+		free(e->mime);
+		free(e);
+	}
+	free(pluginreg_search_path);
+	free(pluginreg_file);
+	free(pluginreg_stats.path);
+}
@@ -0,0 +1,26 @@
+/*==========================================================================*\
+ *
+ * pluginreg.h - Finding and loading plugin libraries.
+ * flasher (C) 2006 Alex Graveley
+ *
+\*==========================================================================*/
+
+#ifndef __PLUGINREG_H__
+#define __PLUGINREG_H__
+
+
+#include "flasher.h"
+
+
+void PluginRegInit(const char *search_path);
+
+char *PluginRegFind(const char *mime_type);
+
+void *PluginRegLoad(const char *path, Bool readahead, Bool lock);
+
+void PluginRegStarted(double init_ms);
+
+void PluginRegShutdown(void);
+
+
+#endif /* __PLUGINREG_H__ */
@@ -0,0 +1,410 @@
+/*==========================================================================*\
+ *
+ * server.c - Pool of pre-initialized flasher processes.
+ * flasher (C) 2006 Alex Graveley
+ *
+\*==========================================================================*/
+
+
+#define _GNU_SOURCE /* for ppoll and environ */
+
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#include "server.h"
+
+
+/*
+ * flasher --server keeps a pool of forked processes that have already
+ * opened the X connection and initialized the plugin, each blocked in
+ * accept() on a Unix socket.  flasher --connect sends one its working
+ * directory, command line and environment, along with its stdin, stdout
+ * and stderr, and the pool process plays the movie as if it had been
+ * started that way.  The parent only refills the pool as processes are
+ * taken, and never touches X itself, so nothing is shared over the
+ * connection after the fork.
+ *
+ * A request is a 32-bit length, sent with the descriptors, then that many
+ * bytes of NUL terminated strings:
+ *
+ *   CWD ARGV... "" ENV...
+ *
+ * The client then waits for the connection to close, which it does when
+ * the movie quits.  Closing it from the client's end quits the movie.
+ */
+
+
+/* Idle pool processes, which the parent kills on exit */
+static pid_t *server_idle;
+static int server_nidle;
+
+static volatile sig_atomic_t server_quit;
+
+
+static void
+ServerSignal(int sig)
+{
+	if (sig != SIGCHLD) {
+		server_quit = True;
+	}
+}
+
+
+static int
+ServerListen(const char *path)
+{
+	struct sockaddr_un addr = { 0 };
+	addr.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		Error("Socket path too long: %s\n", path);
+	}
+	strcpy(addr.sun_path, path);
+
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0) {
+		Error("Creating socket: %s\n", strerror(errno));
+	}
+
+	/* A stale socket from an earlier server */
+	unlink(path);
+
+	if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 ||
+	    listen(fd, 16) < 0) {
+		Error("Listening on '%s': %s\n", path, strerror(errno));
+	}
+
+	return fd;
+}
+
+
+static Bool
+ServerReadAll(int fd, void *buf, size_t len)
+{
+	while (len) {
+		ssize_t n = read(fd, buf, len);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			return False;
+		}
+		buf = (char *) buf + n;
+		len -= n;
+	}
+	return True;
+}
+
+
+static Bool
+ServerWriteAll(int fd, const void *buf, size_t len)
+{
+	while (len) {
+		ssize_t n = write(fd, buf, len);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n < 0) {
+			return False;
+		}
+		buf = (const char *) buf + n;
+		len -= n;
+	}
+	return True;
+}
+
+
+/*
+ * Read a client's request, and take on its working directory,
+ * environment and stdio.  Returns its command line in *argc and *argv.
+ */
+static Bool
+ServerReceive(int fd, int *argc, char ***argv)
+{
+	uint32 len;
+	int fds[3];
+	char control[CMSG_SPACE(sizeof(fds))];
+	struct iovec iov = { &len, sizeof(len) };
+	struct msghdr msg = { 0 };
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+
+	if (recvmsg(fd, &msg, MSG_WAITALL) != sizeof(len)) {
+		return False;
+	}
+
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	if (!cmsg || cmsg->cmsg_type != SCM_RIGHTS ||
+	    cmsg->cmsg_len != CMSG_LEN(sizeof(fds))) {
+		return False;
+	}
+	memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+
+	/* Kept for argv and putenv; NUL terminated for the parsing below */
+	char *buf = malloc(len + 1);
+	if (!ServerReadAll(fd, buf, len)) {
+		free(buf);
+		return False;
+	}
+	buf[len] = '\0';
+
+	char *p = buf, *end = buf + len;
+	if (chdir(p) < 0) {
+		Warning("Changing to '%s': %s\n", p, strerror(errno));
+	}
+	p += strlen(p) + 1;
+
+	*argc = 0;
+	*argv = malloc(sizeof(char *));
+	for (; p < end && *p; p += strlen(p) + 1) {
+		*argv = realloc(*argv, (*argc + 2) * sizeof(char *));
+		(*argv)[(*argc)++] = p;
+	}
+	(*argv)[*argc] = NULL;
+
+	clearenv();
+	for (p++; p < end; p += strlen(p) + 1) {
+		putenv(p);
+	}
+
+	fflush(stdout);
+	fflush(stderr);
+	for (int i = 0; i < 3; i++) {
+		dup2(fds[i], i);
+		close(fds[i]);
+	}
+
+	return *argc > 0;
+}
+
+
+/*
+ * Pool process: warm up, then wait for a client and tell the parent it's
+ * been taken.  Returns the client's connection.
+ */
+static int
+ServerChild(int listen_fd,
+	    int taken_fd,
+	    ServerWarmFunc warm,
+	    int *argc,
+	    char ***argv)
+{
+	warm();
+
+	int fd;
+	do {
+		fd = accept(listen_fd, NULL, NULL);
+	} while (fd < 0 && errno == EINTR);
+	if (fd < 0) {
+		Error("Accepting client: %s\n", strerror(errno));
+	}
+
+	pid_t self = getpid();
+	write(taken_fd, &self, sizeof(self));
+	close(taken_fd);
+	close(listen_fd);
+
+	if (!ServerReceive(fd, argc, argv)) {
+		Error("Invalid request from client\n");
+	}
+
+	return fd;
+}
+
+
+/* Forget an idle pool process.  Returns False if it wasn't idle. */
+static Bool
+ServerTaken(pid_t pid)
+{
+	for (int i = 0; i < server_nidle; i++) {
+		if (server_idle[i] == pid) {
+			server_idle[i] = server_idle[--server_nidle];
+			return True;
+		}
+	}
+	return False;
+}
+
+
+/*
+ * Serve flasher --connect clients on the Unix socket at path, with
+ * pool_size processes forked and prepared by warm() ahead of time.  The
+ * parent exits on SIGINT or SIGTERM.  Returns in a pool process that has
+ * taken a client, with the client's command line in *argc and *argv, and
+ * the connection to it, which should be watched for the client going
+ * away.
+ */
+int
+ServerRun(const char *path,
+	  int pool_size,
+	  ServerWarmFunc warm,
+	  int *argc,
+	  char ***argv)
+{
+	int listen_fd = ServerListen(path);
+
+	int taken[2];
+	if (pipe(taken) < 0) {
+		Error("Creating pipe: %s\n", strerror(errno));
+	}
+
+	/* Only delivered inside ppoll, so none are missed. */
+	sigset_t block, old;
+	sigemptyset(&block);
+	sigaddset(&block, SIGCHLD);
+	sigaddset(&block, SIGINT);
+	sigaddset(&block, SIGTERM);
+	sigprocmask(SIG_BLOCK, &block, &old);
+
+	struct sigaction action = { 0 };
+	action.sa_handler = ServerSignal;
+	sigaction(SIGCHLD, &action, NULL);
+	sigaction(SIGINT, &action, NULL);
+	sigaction(SIGTERM, &action, NULL);
+
+	server_idle = calloc(pool_size, sizeof(pid_t));
+	Log("Serving on %s with %d processes\n", path, pool_size);
+
+	while (!server_quit) {
+		while (server_nidle < pool_size) {
+			pid_t pid = fork();
+			if (pid < 0) {
+				Error("Forking: %s\n", strerror(errno));
+			}
+			if (pid == 0) {
+				action.sa_handler = SIG_DFL;
+				sigaction(SIGCHLD, &action, NULL);
+				sigaction(SIGINT, &action, NULL);
+				sigaction(SIGTERM, &action, NULL);
+				sigprocmask(SIG_SETMASK, &old, NULL);
+				close(taken[0]);
+				free(server_idle);
+
+				return ServerChild(listen_fd, taken[1], warm,
+						   argc, argv);
+			}
+			server_idle[server_nidle++] = pid;
+		}
+
+		struct pollfd pfd = { taken[0], POLLIN, 0 };
+		if (ppoll(&pfd, 1, NULL, &old) > 0) {
+			pid_t pids[16];
+			ssize_t n = read(taken[0], pids, sizeof(pids));
+			for (int i = 0; i < n / (ssize_t) sizeof(pid_t); i++) {
+				Debug("Process %d took a client\n", pids[i]);
+				ServerTaken(pids[i]);
+			}
+		}
+
+		pid_t pid;
+		int status;
+		Bool failed = False;
+		while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+			if (ServerTaken(pid) && !server_quit) {
+				Warning("Pool process %d exited before taking "
+					"a client\n", pid);
+				failed = True;
+			}
+		}
+		if (failed && !server_quit) {
+			/* Don't spin if they can't start, say with no X. */
+			sleep(1);
+		}
+	}
+
+	Log("Shutting down server\n");
+	for (int i = 0; i < server_nidle; i++) {
+		/* They block SIGTERM once warm. */
+		kill(server_idle[i], SIGKILL);
+	}
+	unlink(path);
+	exit(0);
+}
+
+
+/*
+ * Have the server listening at path play a movie with this command line,
+ * in our working directory and environment, and with our stdio.  Returns
+ * once it quits.
+ */
+int
+ServerConnect(const char *path, int argc, char **argv)
+{
+	struct sockaddr_un addr = { 0 };
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0 ||
+	    connect(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+		Warning("Connecting to '%s': %s\n", path, strerror(errno));
+		return 1;
+	}
+
+	char cwd[4096];
+	if (!getcwd(cwd, sizeof(cwd))) {
+		strcpy(cwd, "/");
+	}
+
+	size_t size = strlen(cwd) + 2;
+	for (int i = 0; i < argc; i++) {
+		size += strlen(argv[i]) + 1;
+	}
+	for (char **env = environ; *env; env++) {
+		size += strlen(*env) + 1;
+	}
+
+	char *buf = malloc(size), *p = buf;
+	p = stpcpy(p, cwd) + 1;
+	for (int i = 0; i < argc; i++) {
+		p = stpcpy(p, argv[i]) + 1;
+	}
+	*p++ = '\0';
+	for (char **env = environ; *env; env++) {
+		p = stpcpy(p, *env) + 1;
+	}
+
+	uint32 len = p - buf;
+	int fds[3] = { 0, 1, 2 };
+	char control[CMSG_SPACE(sizeof(fds))];
+	struct iovec iov = { &len, sizeof(len) };
+	struct msghdr msg = { 0 };
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+	memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+	if (sendmsg(fd, &msg, 0) != sizeof(len) ||
+	    !ServerWriteAll(fd, buf, len)) {
+		Warning("Sending request to '%s': %s\n", path,
+			strerror(errno));
+		free(buf);
+		return 1;
+	}
+	free(buf);
+
+	/* Until the movie quits */
+	char c;
+	ssize_t n;
+	do {
+		n = read(fd, &c, 1);
+	} while (n > 0 || (n < 0 && errno == EINTR));
+
+	close(fd);
+	return 0;
+}
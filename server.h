@@ -0,0 +1,28 @@
+/*==========================================================================*\
+ *
+ * server.h - Pool of pre-initialized flasher processes.
+ * flasher (C) 2006 Alex Graveley
+ *
+\*==========================================================================*/
+
+#ifndef __SERVER_H__
+#define __SERVER_H__
+
+
+#include "flasher.h"
+
+
+/* Called in each pool process before it waits for a client */
+typedef void (*ServerWarmFunc)(void);
+
+
+int ServerRun(const char *path,
+	      int pool_size,
+	      ServerWarmFunc warm,
+	      int *argc,
+	      char ***argv);
+
+int ServerConnect(const char *path, int argc, char **argv);
+
+
+#endif /* __SERVER_H__ */
@@ -0,0 +1,176 @@
+/*==========================================================================*\
+ *
+ * stats.c - Performance counters and histograms for flasher.
+ * flasher (C) 2006 Alex Graveley
+ *
+\*==========================================================================*/
+
+
+#include <assert.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "stats.h"
+#include "flasher.h"
+#include "mainloop.h"
+
+
+#define STATS_MAX_SECTIONS 16
+
+typedef struct _StatsSection
+{
+	const char   *name;
+	StatsDumpFunc dump;
+} StatsSection;
+
+
+static StatsSection stats_sections[STATS_MAX_SECTIONS];
+static int stats_nsections = 0;
+static char *stats_path = NULL;
+
+
+void
+HistogramAdd(Histogram *h, double value)
+{
+	int bucket = 0;
+	while (bucket < HISTOGRAM_BUCKETS - 1 && value >= (1L << bucket)) {
+		bucket++;
+	}
+
+	if (h->count == 0 || value < h->min) {
+		h->min = value;
+	}
+	if (h->count == 0 || value > h->max) {
+		h->max = value;
+	}
+	h->count++;
+	h->sum += value;
+	h->buckets[bucket]++;
+}
+
+
+/* Write h as a JSON member called name. */
+void
+HistogramDump(FILE *f, const char *name, Histogram *h)
+{
+	fprintf(f, "\"%s\": { \"count\": %ld, \"sum\": %.3f, "
+		"\"min\": %.3f, \"max\": %.3f, \"mean\": %.3f, \"buckets\": [",
+		name, h->count, h->sum, h->min, h->max,
+		h->count ? h->sum / h->count : 0.0);
+
+	Bool first = True;
+	for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+		if (!h->buckets[i]) {
+			continue;
+		}
+		fprintf(f, "%s{ \"lt\": %ld, \"count\": %ld }",
+			first ? " " : ", ", 1L << i, h->buckets[i]);
+		first = False;
+	}
+
+	fprintf(f, " ] }");
+}
+
+
+/* Write str as a quoted JSON string. */
+void
+StatsJSONString(FILE *f, const char *str)
+{
+	fputc('"', f);
+	for (; str && *str; str++) {
+		if (*str == '"' || *str == '\\') {
+			fprintf(f, "\\%c", *str);
+		} else if ((unsigned char) *str < 0x20) {
+			fprintf(f, "\\u%04x", *str);
+		} else {
+			fputc(*str, f);
+		}
+	}
+	fputc('"', f);
+}
+
+
+/* Milliseconds on a monotonic clock. */
+double
+StatsNow(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+
+/* Have dump write a JSON object for name into every stats dump. */
+void
+StatsAddSection(const char *name, StatsDumpFunc dump)
+{
+	assert(stats_nsections < STATS_MAX_SECTIONS);
+
+	stats_sections[stats_nsections].name = name;
+	stats_sections[stats_nsections].dump = dump;
+	stats_nsections++;
+}
+
+
+/* Write every section to the stats file as one JSON object. */
+void
+StatsDump(void)
+{
+	if (!stats_path) {
+		return;
+	}
+
+	FILE *f = strcmp(stats_path, "-") ? fopen(stats_path, "w") : stdout;
+	if (!f) {
+		Warning("Error writing stats to '%s': %s\n", stats_path,
+			strerror(errno));
+		return;
+	}
+
+	fprintf(f, "{\n  \"uptime_ms\": %.1f", ElapsedMs());
+	for (int i = 0; i < stats_nsections; i++) {
+		fprintf(f, ",\n  \"%s\": ", stats_sections[i].name);
+		stats_sections[i].dump(f);
+	}
+	fprintf(f, "\n}\n");
+
+	if (f == stdout) {
+		fflush(f);
+	} else {
+		fclose(f);
+	}
+}
+
+
+static void
+StatsSignalCb(int sig, void *data)
+{
+	StatsDump();
+}
+
+
+/*
+ * Dump stats to path ("-" for stdout) at shutdown and whenever SIGUSR1
+ * arrives.
+ */
+void
+StatsInit(const char *path)
+{
+	stats_path = strdup(path);
+
+	MainLoopAddSignal(SIGUSR1, StatsSignalCb, NULL);
+}
+
+
+void
+StatsShutdown(void)
+{
+	StatsDump();
+
+	free(stats_path);
+	stats_path = NULL;
+}
@@ -0,0 +1,48 @@
+/*==========================================================================*\
+ *
+ * stats.h - Performance counters and histograms for flasher.
+ * flasher (C) 2006 Alex Graveley
+ *
+\*==========================================================================*/
+
+#ifndef __STATS_H__
+#define __STATS_H__
+
+
+#include "flasher.h"
+
+
+/* Bucket i counts values in [2^(i-1), 2^i); bucket 0 counts values < 1 */
+#define HISTOGRAM_BUCKETS 32
+
+typedef struct _Histogram
+{
+	long   count;
+	double sum;
+	double min;
+	double max;
+	long   buckets[HISTOGRAM_BUCKETS];
+} Histogram;
+
+
+typedef void (*StatsDumpFunc)(FILE *f);
+
+
+void HistogramAdd(Histogram *h, double value);
+
+void HistogramDump(FILE *f, const char *name, Histogram *h);
+
+void StatsJSONString(FILE *f, const char *str);
+
+double StatsNow(void);
+
+void StatsAddSection(const char *name, StatsDumpFunc dump);
+
+void StatsDump(void);
+
+void StatsInit(const char *path);
+
+void StatsShutdown(void);
+
+
+#endif /* __STATS_H__ */
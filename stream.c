@@ -0,0 +1,309 @@
+/*==========================================================================*\
+ *
+ * stream.c - URL stream backends for flasher.
+ * flasher (C) 2006 Alex Graveley
+ *
+\*==========================================================================*/
+
+
+#define _GNU_SOURCE /* for memfd_create */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "stream.h"
+#include "curlstream.h"
+#include "filestream.h"
+#include "flasher.h"
+#include "mainloop.h"
+
+
+/*
+ * Where the streams the plugin asks for with NPN_GetURL and NPN_PostURL
+ * come from.  Besides the network, URLs can be served from a local
+ * directory, or from a generated body of fixed size and latency, so the
+ * host can be measured without a network.  Both of the latter are read
+ * through FileStream, and POSTs to them are answered like GETs.
+ */
+typedef enum {
+	STREAM_BACKEND_CURL,  /* "curl" */
+	STREAM_BACKEND_DIR,   /* "dir:PATH" */
+	STREAM_BACKEND_SYNTH, /* "synth:SIZE[:LATENCY]" */
+} StreamBackend;
+
+
+/* A FileStream waiting to be announced from the main loop */
+typedef struct _StreamOpen
+{
+	NPP_t *plugin;
+	char  *url;
+	char  *path;
+	Bool   notify;
+	void  *notifyData;
+} StreamOpen;
+
+
+static StreamBackend stream_backend = STREAM_BACKEND_CURL;
+static char *stream_dir = NULL;
+
+static long stream_synth_size = 0;
+static long stream_synth_latency = 0; /* ms */
+static int  stream_synth_fd = -1;
+static char stream_synth_path[64];
+
+
+static const struct {
+	const char *ext;
+	const char *mimetype;
+} stream_mimetypes[] = {
+	{ ".swf",  "application/x-shockwave-flash" },
+	{ ".flv",  "video/x-flv" },
+	{ ".mp3",  "audio/mpeg" },
+	{ ".jpg",  "image/jpeg" },
+	{ ".jpeg", "image/jpeg" },
+	{ ".png",  "image/png" },
+	{ ".gif",  "image/gif" },
+	{ ".xml",  "text/xml" },
+	{ ".txt",  "text/plain" },
+	{ ".html", "text/html" },
+};
+
+
+/* Guess the MIME type of url from its extension. */
+static const char *
+StreamGuessMimeType(const char *url)
+{
+	int len = strcspn(url, "?#");
+
+	for (int i = 0; i < sizeof(stream_mimetypes) /
+		     sizeof(stream_mimetypes[0]); i++) {
+		int ext_len = strlen(stream_mimetypes[i].ext);
+		if (len >= ext_len &&
+		    !strncasecmp(url + len - ext_len, stream_mimetypes[i].ext,
+				 ext_len)) {
+			return stream_mimetypes[i].mimetype;
+		}
+	}
+
+	return "application/octet-stream";
+}
+
+
+/*
+ * Map url to a file in stream_dir: the path of absolute URLs, or relative
+ * ones as they are, without query or fragment.  Returns NULL for URLs
+ * that can't be mapped.  Caller frees the result.
+ */
+static char *
+StreamDirPath(const char *url)
+{
+	const char *path = strstr(url, "://");
+	if (path) {
+		path = strchr(path + 3, '/');
+		if (!path) {
+			path = "/";
+		}
+	} else if (strchr(url, ':')) {
+		return NULL; /* javascript:, about: and friends */
+	} else {
+		path = url;
+	}
+
+	path += strspn(path, "/");
+
+	int len = strcspn(path, "?#");
+	char *file = malloc(strlen(stream_dir) + len + 2);
+	sprintf(file, "%s/%.*s", stream_dir, len, path);
+
+	if (strstr(file, "/../")) {
+		free(file);
+		return NULL;
+	}
+
+	return file;
+}
+
+
+/* Timer callback: announce a stream opened by StreamOpenLater. */
+static void
+StreamOpenTimeout(void *data)
+{
+	StreamOpen *o = (StreamOpen *) data;
+	NPError err = NPERR_FILE_NOT_FOUND;
+
+	if (o->path) {
+		err = FileStreamNewURL(o->plugin, o->url, o->path,
+				       StreamGuessMimeType(o->url),
+				       o->notify, o->notifyData);
+	}
+
+	if (err != NPERR_NO_ERROR) {
+		Warning("Error loading '%s': %s\n", o->url,
+			o->path ? "File not found" : "Unsupported URL");
+		if (o->notify) {
+			CallNPP_URLNotifyProc(plugin_funcs.urlnotify,
+					      o->plugin, o->url,
+					      NPRES_NETWORK_ERR,
+					      o->notifyData);
+		}
+	}
+
+	free(o->url);
+	free(o->path);
+	free(o);
+}
+
+
+/*
+ * Serve url from the file at path after delay ms.  Like network streams,
+ * it reaches the plugin only once NPN_GetURL has returned.
+ */
+static NPError
+StreamOpenLater(NPP_t *plugin,
+		const char *url,
+		char *path,
+		Bool notify,
+		void *notifyData,
+		long delay)
+{
+	StreamOpen *o = malloc(sizeof(StreamOpen));
+	o->plugin = plugin;
+	o->url = strdup(url);
+	o->path = path;
+	o->notify = notify;
+	o->notifyData = notifyData;
+
+	MainLoopAddTimer(delay, StreamOpenTimeout, o);
+
+	return NPERR_NO_ERROR;
+}
+
+
+NPError
+StreamNew(NPP_t *plugin, const char *url, Bool notify, void *notifyData)
+{
+	switch (stream_backend) {
+	case STREAM_BACKEND_DIR:
+		return StreamOpenLater(plugin, url, StreamDirPath(url),
+				       notify, notifyData, 0);
+	case STREAM_BACKEND_SYNTH:
+		return StreamOpenLater(plugin, url, strdup(stream_synth_path),
+				       notify, notifyData,
+				       stream_synth_latency);
+	default:
+		break;
+	}
+
+	CURLStream *s = CURLStreamNew(plugin, url, notify, notifyData);
+	return s ? NPERR_NO_ERROR : NPERR_GENERIC_ERROR;
+}
+
+
+NPError
+StreamNewPost(NPP_t *plugin,
+	      const char *url,
+	      Bool notify,
+	      void *notifyData,
+	      const char *buf,
+	      uint32 len,
+	      Bool is_file)
+{
+	if (stream_backend != STREAM_BACKEND_CURL) {
+		return StreamNew(plugin, url, notify, notifyData);
+	}
+
+	CURLStream *s = CURLStreamNewPost(plugin, url, notify, notifyData,
+					  buf, len, is_file);
+	return s ? NPERR_NO_ERROR : NPERR_GENERIC_ERROR;
+}
+
+
+/*
+ * Create the body every synthetic stream reads: stream_synth_size bytes
+ * counting up from 0, modulo 256.  Kept in memory where possible.
+ */
+static Bool
+StreamSynthCreate(void)
+{
+	stream_synth_fd = memfd_create(PROGRAM_NAME, 0);
+	if (stream_synth_fd < 0) {
+		FILE *tmp = tmpfile();
+		stream_synth_fd = tmp ? dup(fileno(tmp)) : -1;
+		if (tmp) {
+			fclose(tmp);
+		}
+	}
+	if (stream_synth_fd < 0) {
+		Warning("Error creating synthetic stream body: %s\n",
+			strerror(errno));
+		return False;
+	}
+
+	char buf[4096];
+	for (int i = 0; i < sizeof(buf); i++) {
+		buf[i] = i;
+	}
+	for (long left = stream_synth_size; left > 0; left -= sizeof(buf)) {
+		if (write(stream_synth_fd, buf, MIN(left, sizeof(buf))) < 0) {
+			Warning("Error creating synthetic stream body: %s\n",
+				strerror(errno));
+			return False;
+		}
+	}
+
+	snprintf(stream_synth_path, sizeof(stream_synth_path),
+		 "/proc/self/fd/%d", stream_synth_fd);
+	return True;
+}
+
+
+/*
+ * Choose the backend for StreamNew and StreamNewPost.  Returns False if
+ * backend isn't valid.
+ */
+Bool
+StreamInit(const char *backend)
+{
+	if (!backend || !strcmp(backend, "curl")) {
+		stream_backend = STREAM_BACKEND_CURL;
+		return True;
+	}
+
+	if (!strncmp(backend, "dir:", 4) && backend[4]) {
+		stream_backend = STREAM_BACKEND_DIR;
+		stream_dir = strdup(backend + 4);
+		return True;
+	}
+
+	if (!strncmp(backend, "synth:", 6)) {
+		char *end;
+		stream_synth_size = strtol(backend + 6, &end, 10);
+		if (*end == ':') {
+			stream_synth_latency = strtol(end + 1, &end, 10);
+		}
+		if (*end || stream_synth_size < 0 || stream_synth_latency < 0) {
+			return False;
+		}
+
+		stream_backend = STREAM_BACKEND_SYNTH;
+		return StreamSynthCreate();
+	}
+
+	return False;
+}
+
+
+void
+StreamShutdown(void)
+{
+	free(stream_dir);
+	stream_dir = NULL;
+
+	if (stream_synth_fd >= 0) {
+		close(stream_synth_fd);
+		stream_synth_fd = -1;
+	}
+}
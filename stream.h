@@ -0,0 +1,33 @@
+/*==========================================================================*\
+ *
+ * stream.h - URL stream backends for flasher.
+ * flasher (C) 2006 Alex Graveley
+ *
+\*==========================================================================*/
+
+#ifndef __STREAM_H__
+#define __STREAM_H__
+
+
+#include "flasher.h"
+
+
+NPError StreamNew(NPP_t *plugin,
+		  const char *url,
+		  Bool notify,
+		  void *notifyData);
+
+NPError StreamNewPost(NPP_t *plugin,
+		      const char *url,
+		      Bool notify,
+		      void *notifyData,
+		      const char *buf,
+		      uint32 len,
+		      Bool is_file);
+
+Bool StreamInit(const char *backend);
+
+void StreamShutdown(void);
+
+
+#endif /* __STREAM_H__ */